@@ -0,0 +1,630 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "bulk_dirty.hpp"
+#include "storage/meta_tile.hpp"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+#ifndef M_PI
+#define M_PI 3.141592653589793238462643
+#endif
+
+// the highest zoom level a bulk dirty request can go to.
+#define MAX_DIRTY_ZOOM (30)
+
+// how many seconds worth of metatiles can build up while no jobs
+// are able to take them.
+#define MAX_BURST (1.0)
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+namespace rendermq
+{
+
+namespace
+{
+
+const int meta_mask = ~(METATILE - 1);
+
+// project to the unit square in spherical mercator, clamping to the 
+// latitudes at which the square ends.
+void project(double lon, double lat, double &x, double &y)
+{
+   lat = std::max(-85.0511287798, std::min(85.0511287798, lat));
+   const double phi = lat * M_PI / 180.0;
+   x = (lon + 180.0) / 360.0;
+   y = (1.0 - std::log(std::tan(phi) + 1.0 / std::cos(phi)) / M_PI) / 2.0;
+   x = std::max(0.0, std::min(1.0, x));
+   y = std::max(0.0, std::min(1.0, y));
+}
+
+int tile_index(double v, int n)
+{
+   return std::max(0, std::min(n - 1, int(std::floor(v * n))));
+}
+
+// which side of the line a-b the point c is on.
+double orient(double ax, double ay, double bx, double by, double cx, double cy)
+{
+   return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+}
+
+// whether the segments a-b and c-d touch, counting touching ends.
+bool segments_cross(double ax, double ay, double bx, double by,
+                    double cx, double cy, double dx, double dy)
+{
+   const double d1 = orient(cx, cy, dx, dy, ax, ay);
+   const double d2 = orient(cx, cy, dx, dy, bx, by);
+   const double d3 = orient(ax, ay, bx, by, cx, cy);
+   const double d4 = orient(ax, ay, bx, by, dx, dy);
+
+   if ((((d1 > 0) && (d2 < 0)) || ((d1 < 0) && (d2 > 0))) &&
+       (((d3 > 0) && (d4 < 0)) || ((d3 < 0) && (d4 > 0))))
+   {
+      return true;
+   }
+
+   // the collinear cases, which are only possible along box edges and
+   // may as well count as covering.
+   return ((d1 == 0) || (d2 == 0) || (d3 == 0) || (d4 == 0)) &&
+      (std::max(ax, bx) >= std::min(cx, dx)) && (std::max(cx, dx) >= std::min(ax, bx)) &&
+      (std::max(ay, by) >= std::min(cy, dy)) && (std::max(cy, dy) >= std::min(ay, by));
+}
+
+bool parse_double(const string &str, double &d)
+{
+   try
+   {
+      d = boost::lexical_cast<double>(str);
+      return true;
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      return false;
+   }
+}
+
+bool parse_numbers(const string &str, vector<double> &numbers)
+{
+   vector<string> parts;
+   boost::split(parts, str, boost::is_any_of(","));
+   BOOST_FOREACH(const string &part, parts)
+   {
+      double d;
+      if (!parse_double(boost::trim_copy(part), d)) { return false; }
+      numbers.push_back(d);
+   }
+   return true;
+}
+
+bool parse_zoom(const string &str, int &min_zoom, int &max_zoom)
+{
+   vector<string> parts;
+   boost::split(parts, str, boost::is_any_of("-"));
+   if ((parts.size() < 1) || (parts.size() > 2)) { return false; }
+   try
+   {
+      min_zoom = boost::lexical_cast<int>(parts[0]);
+      max_zoom = boost::lexical_cast<int>(parts.back());
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      return false;
+   }
+   return (min_zoom >= 0) && (min_zoom <= max_zoom) && (max_zoom <= MAX_DIRTY_ZOOM);
+}
+
+int hex_value(char c)
+{
+   if ((c >= '0') && (c <= '9')) { return c - '0'; }
+   if ((c >= 'a') && (c <= 'f')) { return c - 'a' + 10; }
+   if ((c >= 'A') && (c <= 'F')) { return c - 'A' + 10; }
+   return -1;
+}
+
+string url_decode(const string &str)
+{
+   string out;
+   out.reserve(str.size());
+   for (size_t i = 0; i < str.size(); ++i)
+   {
+      if ((str[i] == '%') && (i + 2 < str.size()) &&
+          (hex_value(str[i+1]) >= 0) && (hex_value(str[i+2]) >= 0))
+      {
+         out.push_back(char(hex_value(str[i+1]) * 16 + hex_value(str[i+2])));
+         i += 2;
+      }
+      else if (str[i] == '+')
+      {
+         out.push_back(' ');
+      }
+      else
+      {
+         out.push_back(str[i]);
+      }
+   }
+   return out;
+}
+
+} // anonymous namespace
+
+void
+parse_query(const string &query, std::map<string, string> &params)
+{
+   vector<string> parts;
+   boost::split(parts, query, boost::is_any_of("&"));
+   BOOST_FOREACH(const string &part, parts)
+   {
+      const string::size_type eq = part.find('=');
+      if (eq == string::npos) { continue; }
+      params[part.substr(0, eq)] = url_decode(part.substr(eq + 1));
+   }
+}
+
+dirty_region::dirty_region(double west, double south, double east, double north,
+                           int min_zoom, int max_zoom)
+   : m_min_zoom(min_zoom), m_max_zoom(max_zoom)
+{
+   // north is at the top, i.e: the smaller y.
+   project(west, north, m_min_x, m_min_y);
+   project(east, south, m_max_x, m_max_y);
+}
+
+dirty_region::dirty_region(const vector<pair<double, double> > &ring,
+                           int min_zoom, int max_zoom)
+   : m_min_zoom(min_zoom), m_max_zoom(max_zoom)
+{
+   m_ring.reserve(ring.size());
+   for (size_t i = 0; i < ring.size(); ++i)
+   {
+      point p;
+      project(ring[i].first, ring[i].second, p.x, p.y);
+      m_ring.push_back(p);
+   }
+   set_bounds();
+}
+
+void
+dirty_region::set_bounds()
+{
+   m_min_x = m_min_y = 1.0;
+   m_max_x = m_max_y = 0.0;
+   BOOST_FOREACH(const point &p, m_ring)
+   {
+      m_min_x = std::min(m_min_x, p.x);
+      m_min_y = std::min(m_min_y, p.y);
+      m_max_x = std::max(m_max_x, p.x);
+      m_max_y = std::max(m_max_y, p.y);
+   }
+}
+
+void
+dirty_region::tile_range(int z, int &x0, int &y0, int &x1, int &y1) const
+{
+   const int n = 1 << z;
+   x0 = tile_index(m_min_x, n);
+   y0 = tile_index(m_min_y, n);
+   x1 = tile_index(m_max_x, n);
+   y1 = tile_index(m_max_y, n);
+}
+
+void
+dirty_region::metatile_range(int z, int &x0, int &y0, int &x1, int &y1) const
+{
+   tile_range(z, x0, y0, x1, y1);
+   x0 &= meta_mask;
+   y0 &= meta_mask;
+   x1 &= meta_mask;
+   y1 &= meta_mask;
+}
+
+bool
+dirty_region::inside(const point &p) const
+{
+   bool in = false;
+   for (size_t i = 0, j = m_ring.size() - 1; i < m_ring.size(); j = i++)
+   {
+      const point &a = m_ring[i], &b = m_ring[j];
+      if (((a.y > p.y) != (b.y > p.y)) &&
+          (p.x < (b.x - a.x) * (p.y - a.y) / (b.y - a.y) + a.x))
+      {
+         in = !in;
+      }
+   }
+   return in;
+}
+
+bool
+dirty_region::covers(int z, int x, int y) const
+{
+   const double n = double(1 << z);
+   const double bx0 = x / n, by0 = y / n;
+   const double bx1 = std::min(x + METATILE, 1 << z) / n;
+   const double by1 = std::min(y + METATILE, 1 << z) / n;
+
+   if ((bx1 < m_min_x) || (bx0 > m_max_x) || (by1 < m_min_y) || (by0 > m_max_y))
+   {
+      return false;
+   }
+
+   // a rectangle is covered by anything that's within its bounds.
+   if (m_ring.empty()) { return true; }
+
+   // the metatile might be entirely within the polygon...
+   point centre;
+   centre.x = (bx0 + bx1) / 2.0;
+   centre.y = (by0 + by1) / 2.0;
+   if (inside(centre)) { return true; }
+
+   for (size_t i = 0, j = m_ring.size() - 1; i < m_ring.size(); j = i++)
+   {
+      const point &a = m_ring[i], &b = m_ring[j];
+
+      // ...or the polygon within the metatile...
+      if ((a.x >= bx0) && (a.x <= bx1) && (a.y >= by0) && (a.y <= by1))
+      {
+         return true;
+      }
+
+      // ...or their edges cross.
+      if (segments_cross(a.x, a.y, b.x, b.y, bx0, by0, bx1, by0) ||
+          segments_cross(a.x, a.y, b.x, b.y, bx1, by0, bx1, by1) ||
+          segments_cross(a.x, a.y, b.x, b.y, bx1, by1, bx0, by1) ||
+          segments_cross(a.x, a.y, b.x, b.y, bx0, by1, bx0, by0))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+metatile_enumerator::metatile_enumerator(const dirty_region &region)
+   : m_region(region)
+{
+   start_zoom(m_region.min_zoom());
+}
+
+void
+metatile_enumerator::start_zoom(int z)
+{
+   m_z = z;
+   if (m_z <= m_region.max_zoom())
+   {
+      m_region.metatile_range(m_z, m_x0, m_y0, m_x1, m_y1);
+      m_x = m_x0;
+      m_y = m_y0;
+   }
+}
+
+bool
+metatile_enumerator::next(int &z, int &x, int &y)
+{
+   while (m_z <= m_region.max_zoom())
+   {
+      if (m_y > m_y1)
+      {
+         start_zoom(m_z + 1);
+         continue;
+      }
+
+      z = m_z;
+      x = m_x;
+      y = m_y;
+
+      m_x += METATILE;
+      if (m_x > m_x1)
+      {
+         m_x = m_x0;
+         m_y += METATILE;
+      }
+
+      if (m_region.covers(z, x, y))
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+uint64_t
+metatile_enumerator::bound() const
+{
+   uint64_t total = 0;
+   for (int z = m_region.min_zoom(); z <= m_region.max_zoom(); ++z)
+   {
+      int x0, y0, x1, y1;
+      m_region.metatile_range(z, x0, y0, x1, y1);
+      total += uint64_t((x1 - x0) / METATILE + 1) * uint64_t((y1 - y0) / METATILE + 1);
+   }
+   return total;
+}
+
+bool 
+parse_dirty_query(const string &query, string &style,
+                  boost::shared_ptr<dirty_region> &region, 
+                  string &error)
+{
+   std::map<string, string> params;
+   parse_query(query, params);
+
+   style = params["style"];
+   const string zoom = params["zoom"], bbox = params["bbox"], poly = params["poly"];
+
+   int min_zoom = 0, max_zoom = 0;
+   if (style.empty())
+   {
+      error = "A style must be given.";
+      return false;
+   }
+   if (!parse_zoom(zoom, min_zoom, max_zoom))
+   {
+      error = (boost::format("A zoom level, or range of levels, between 0 and %1% must be given.") 
+               % MAX_DIRTY_ZOOM).str();
+      return false;
+   }
+
+   vector<double> numbers;
+   if (!bbox.empty() && poly.empty())
+   {
+      if (!parse_numbers(bbox, numbers) || (numbers.size() != 4) || 
+          (numbers[0] > numbers[2]) || (numbers[1] > numbers[3]))
+      {
+         error = "The bbox must be west,south,east,north in degrees.";
+         return false;
+      }
+      region.reset(new dirty_region(numbers[0], numbers[1], numbers[2], numbers[3], 
+                                    min_zoom, max_zoom));
+   }
+   else if (!poly.empty() && bbox.empty())
+   {
+      if (!parse_numbers(poly, numbers) || (numbers.size() % 2 != 0) || (numbers.size() < 6))
+      {
+         error = "The poly must be at least three lon,lat pairs in degrees.";
+         return false;
+      }
+      vector<pair<double, double> > ring;
+      for (size_t i = 0; i < numbers.size(); i += 2)
+      {
+         ring.push_back(make_pair(numbers[i], numbers[i+1]));
+      }
+      region.reset(new dirty_region(ring, min_zoom, max_zoom));
+   }
+   else
+   {
+      error = "Exactly one of bbox or poly must be given.";
+      return false;
+   }
+
+   return true;
+}
+
+bulk_dirty_jobs::job::job(int i, const string &s, const dirty_region &r)
+   : id(i), style(s), tiles(r), bound(tiles.bound()), 
+     released(0), expired(0), queued(0),
+     started(std::time(0)), finished(0), enumerated(false)
+{
+}
+
+bulk_dirty_jobs::bulk_dirty_jobs(double rate, size_t max_jobs)
+   : m_rate(rate), m_max_jobs(max_jobs), m_next_id(1), 
+     m_allowance(0), m_last_release(0)
+{
+}
+
+int
+bulk_dirty_jobs::add(const string &style, const dirty_region &region)
+{
+   const int id = m_next_id;
+   m_next_id = (m_next_id == 0x7fffffff) ? 1 : m_next_id + 1;
+
+   // make room by forgetting the oldest jobs which are done.
+   for (job_list_t::iterator itr = m_jobs.begin(); 
+        (m_jobs.size() >= m_max_jobs) && (itr != m_jobs.end()); )
+   {
+      if (itr->enumerated && itr->retries.empty()) { itr = m_jobs.erase(itr); }
+      else { ++itr; }
+   }
+
+   m_jobs.push_back(job(id, style, region));
+   return id;
+}
+
+bool
+bulk_dirty_jobs::active() const
+{
+   BOOST_FOREACH(const job &j, m_jobs)
+   {
+      if (!j.enumerated || !j.retries.empty()) { return true; }
+   }
+   return false;
+}
+
+void
+bulk_dirty_jobs::release(uint64_t now_usec, 
+                         const boost::function<bool (const string &)> &can_feed,
+                         vector<tile_protocol> &batch)
+{
+   if (m_last_release > 0 && now_usec > m_last_release)
+   {
+      m_allowance += m_rate * double(now_usec - m_last_release) / 1000000.0;
+      m_allowance = std::min(m_allowance, std::max(m_rate * MAX_BURST, 1.0));
+   }
+   m_last_release = now_usec;
+
+   // go round the jobs, taking a metatile from each in turn, so that
+   // one huge job doesn't hold up all the others.
+   bool progress = true;
+   while ((m_allowance >= 1.0) && progress)
+   {
+      progress = false;
+      BOOST_FOREACH(job &j, m_jobs)
+      {
+         if (m_allowance < 1.0) { break; }
+         if ((j.enumerated && j.retries.empty()) || !can_feed(j.style)) { continue; }
+
+         // metatiles which couldn't be expired go again first.
+         int z, x, y;
+         if (!j.retries.empty())
+         {
+            batch.push_back(j.retries.front());
+            j.retries.pop_front();
+            ++j.released;
+            m_allowance -= 1.0;
+            progress = true;
+         }
+         else if (j.tiles.next(z, x, y))
+         {
+            tile_protocol tile(cmdDirty, x, y, z, tile_id(j.id), j.style, fmtPNG);
+            batch.push_back(tile);
+            ++j.released;
+            m_allowance -= 1.0;
+            progress = true;
+         }
+         else
+         {
+            j.enumerated = true;
+            if (j.expired >= j.released) { j.finished = std::time(0); }
+         }
+      }
+   }
+}
+
+int64_t
+bulk_dirty_jobs::tile_id(int job)
+{
+   return -1 - int64_t(job);
+}
+
+int
+bulk_dirty_jobs::job_for_tile(int64_t id)
+{
+   return (id < -1) ? int(-1 - id) : 0;
+}
+
+void
+bulk_dirty_jobs::make_slices(const vector<tile_protocol> &batch, vector<tile_protocol> &slices)
+{
+   // jobs are few, so a linear search for each one's slice is fine.
+   BOOST_FOREACH(const tile_protocol &tile, batch)
+   {
+      vector<tile_protocol>::iterator slice = slices.begin();
+      while ((slice != slices.end()) && (slice->id != tile.id)) { ++slice; }
+      if (slice == slices.end())
+      {
+         slice = slices.insert(slices.end(), tile);
+         slice->set_data("");
+      }
+
+      std::ostringstream line;
+      line << tile.z << " " << tile.x << " " << tile.y << "\n";
+      slice->set_data(slice->data() + line.str());
+   }
+}
+
+void
+bulk_dirty_jobs::slice_tiles(const tile_protocol &slice, vector<tile_protocol> &tiles)
+{
+   std::istringstream lines(slice.data());
+   tile_protocol tile(slice);
+   tile.set_data("");
+   while (lines >> tile.z >> tile.x >> tile.y)
+   {
+      tiles.push_back(tile);
+   }
+}
+
+void
+bulk_dirty_jobs::expired(int id, uint64_t count, uint64_t queued)
+{
+   job *j = find(id);
+   if (j == NULL) { return; }
+
+   j->expired += count;
+   j->queued += queued;
+   if (j->enumerated && j->retries.empty() && (j->expired >= j->released)) 
+   { 
+      j->finished = std::time(0); 
+   }
+}
+
+void
+bulk_dirty_jobs::retry(int id, const vector<tile_protocol> &tiles)
+{
+   job *j = find(id);
+   if (j == NULL) { return; }
+
+   j->retries.insert(j->retries.end(), tiles.begin(), tiles.end());
+   j->released -= std::min(j->released, uint64_t(tiles.size()));
+}
+
+bool
+bulk_dirty_jobs::report(int id, std::ostream &out) const
+{
+   const job *j = find(id);
+   if (j == NULL) { return false; }
+
+   const char *state = (j->finished > 0) ? "done" : 
+      ((j->enumerated && j->retries.empty()) ? "expiring" : "running");
+   const std::time_t elapsed = ((j->finished > 0) ? j->finished : std::time(0)) - j->started;
+   out << boost::format("job=%1% style=%2% state=%3% released=%4% expired=%5% queued=%6% "
+                        "bound=%7% elapsed=%8%\n")
+      % j->id % j->style % state % j->released % j->expired % j->queued % j->bound % elapsed;
+   return true;
+}
+
+bulk_dirty_jobs::job *
+bulk_dirty_jobs::find(int id)
+{
+   BOOST_FOREACH(job &j, m_jobs)
+   {
+      if (j.id == id) { return &j; }
+   }
+   return NULL;
+}
+
+const bulk_dirty_jobs::job *
+bulk_dirty_jobs::find(int id) const
+{
+   BOOST_FOREACH(const job &j, m_jobs)
+   {
+      if (j.id == id) { return &j; }
+   }
+   return NULL;
+}
+
+} // namespace rendermq
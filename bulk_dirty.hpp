@@ -0,0 +1,222 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef BULK_DIRTY_HPP
+#define BULK_DIRTY_HPP
+
+#include "tile_protocol.hpp"
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+
+namespace rendermq
+{
+
+/* an area to be dirtied, either a bounding box or a polygon given in
+ * longitude and latitude, over a range of zoom levels.
+ */
+class dirty_region
+{
+public:
+   // a rectangle covering the given bounds, in degrees.
+   dirty_region(double west, double south, double east, double north,
+                int min_zoom, int max_zoom);
+
+   // a polygon with the given ring of (lon, lat) vertices, in degrees. 
+   // it doesn't need to be closed.
+   dirty_region(const std::vector<std::pair<double, double> > &ring,
+                int min_zoom, int max_zoom);
+
+   int min_zoom() const { return m_min_zoom; }
+   int max_zoom() const { return m_max_zoom; }
+
+   // the range of tile coordinates at the zoom which cover the 
+   // region's bounds, inclusive.
+   void tile_range(int z, int &x0, int &y0, int &x1, int &y1) const;
+
+   // as tile_range(), but aligned to metatiles.
+   void metatile_range(int z, int &x0, int &y0, int &x1, int &y1) const;
+
+   // whether the metatile with the given aligned coordinates covers
+   // any part of the region.
+   bool covers(int z, int x, int y) const;
+
+private:
+   struct point 
+   { 
+      double x, y; 
+   };
+
+   void set_bounds();
+   bool inside(const point &p) const;
+
+   // vertices, projected to the unit square in spherical mercator, 
+   // with x increasing eastwards and y southwards as tiles do. a
+   // rectangle has no vertices, as its bounds are all that's needed.
+   std::vector<point> m_ring;
+   double m_min_x, m_min_y, m_max_x, m_max_y;
+   int m_min_zoom, m_max_zoom;
+};
+
+/* lazily goes through the metatiles covering a region, lowest zoom
+ * first, so that a large area doesn't need a large list in memory.
+ */
+class metatile_enumerator
+{
+public:
+   explicit metatile_enumerator(const dirty_region &region);
+
+   // put the next metatile's aligned coordinates in z, x and y, or 
+   // return false if there are no more.
+   bool next(int &z, int &x, int &y);
+
+   // the number of metatiles covering the bounds of the region, which 
+   // is an upper bound on the number next() will give.
+   uint64_t bound() const;
+
+private:
+   void start_zoom(int z);
+
+   dirty_region m_region;
+   int m_z, m_x, m_y;
+   int m_x0, m_y0, m_x1, m_y1;
+};
+
+/* split a URL query string into its parameters, decoding the values.
+ * parameters without a value are skipped.
+ */
+void parse_query(const std::string &query, std::map<std::string, std::string> &params);
+
+/* parse a bulk dirty query string, such as
+ *
+ *   style=osm&zoom=10-14&bbox=-0.5,51.3,0.3,51.7
+ *
+ * where instead of a bbox a polygon can be given as a comma-separated 
+ * list of lon,lat vertices with poly=, and the zoom can be a single
+ * level. returns false and sets error if the query isn't valid.
+ */
+bool parse_dirty_query(const std::string &query, std::string &style,
+                       boost::shared_ptr<dirty_region> &region, 
+                       std::string &error);
+
+/* asynchronous jobs to dirty all the metatiles in a region. the 
+ * metatiles are handed out at a limited rate, shared between the
+ * jobs which are running, and the progress of each job can be 
+ * reported. this is only touched from the handler's main loop, so
+ * there's no locking.
+ */
+class bulk_dirty_jobs
+{
+public:
+   /* @param rate the maximum number of metatiles per second to hand
+    *    out, over all jobs.
+    * @param max_jobs the number of jobs to keep, after which the 
+    *    oldest finished jobs are forgotten.
+    */
+   bulk_dirty_jobs(double rate, size_t max_jobs);
+
+   // start a job, returning its id, which is always positive.
+   int add(const std::string &style, const dirty_region &region);
+
+   // whether any jobs have metatiles still to hand out.
+   bool active() const;
+
+   /* hand out the metatiles which the rate allows since the last 
+    * call, as dirty requests tagged with their job. jobs for which 
+    * can_feed returns false for the style are skipped over for now.
+    */
+   void release(uint64_t now_usec, 
+                const boost::function<bool (const std::string &)> &can_feed,
+                std::vector<tile_protocol> &batch);
+
+   // the id to give tiles from the job, and the job that a tile with
+   // the given id is from, or zero if none. these are negative so that
+   // everything else treats them as having no client to reply to.
+   static int64_t tile_id(int job);
+   static int job_for_tile(int64_t id);
+
+   /* group released metatiles into one dirty request per job, so that
+    * each job's share of a release is expired in storage as a single
+    * batch. the request is for the first of the metatiles, and lists
+    * all of them in its data.
+    */
+   static void make_slices(const std::vector<tile_protocol> &batch,
+                           std::vector<tile_protocol> &slices);
+
+   // the metatiles which a request made by make_slices() is for.
+   static void slice_tiles(const tile_protocol &slice, 
+                           std::vector<tile_protocol> &tiles);
+
+   // record that a number of metatiles from the job have been expired,
+   // and how many of them were then sent to be re-rendered.
+   void expired(int job, uint64_t count, uint64_t queued);
+
+   // put metatiles from the job which couldn't be expired back, to be
+   // handed out again before any new ones.
+   void retry(int job, const std::vector<tile_protocol> &tiles);
+
+   // write the progress of the job out, or return false if there's
+   // no such job.
+   bool report(int job, std::ostream &out) const;
+
+private:
+   struct job
+   {
+      job(int i, const std::string &s, const dirty_region &r);
+
+      int id;
+      std::string style;
+      metatile_enumerator tiles;
+      std::deque<tile_protocol> retries;
+      uint64_t bound, released, expired, queued;
+      std::time_t started, finished;
+      bool enumerated;
+   };
+
+   typedef std::list<job> job_list_t;
+
+   job *find(int id);
+   const job *find(int id) const;
+
+   const double m_rate;
+   const size_t m_max_jobs;
+   int m_next_id;
+   // metatiles allowed to be handed out, but not yet taken.
+   double m_allowance;
+   uint64_t m_last_release;
+   job_list_t m_jobs;
+};
+
+} // namespace rendermq
+
+#endif // BULK_DIRTY_HPP
@@ -0,0 +1,164 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "storage/bundle_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include "tile_protocol.hpp"
+#include "config.hpp"
+
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <boost/foreach.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::cout;
+using std::endl;
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+/* copies the metatiles stored by disk storage under one directory into
+ * bundles under another, keeping their timestamps so that expired 
+ * metatiles stay expired.
+ */
+namespace 
+{
+
+// read a metatile file, returning false if it isn't one.
+bool read_meta(const fs::path &p, string &data, rendermq::tile_protocol &tile)
+{
+   const uintmax_t size = fs::file_size(p);
+   if (size < sizeof(rendermq::meta_layout))
+   {
+      return false;
+   }
+   data.resize(size);
+   fs::ifstream in(p, std::ios::in | std::ios::binary);
+   if (!in.read(&data[0], size))
+   {
+      return false;
+   }
+
+   // the position of the metatile is in its header, which saves 
+   // having to work it back out from the hashed path.
+   rendermq::meta_layout m;
+   memcpy(&m, data.data(), sizeof(m));
+   if (!m.magic_ok())
+   {
+      return false;
+   }
+   tile.x = m.x;
+   tile.y = m.y;
+   tile.z = m.z;
+   return true;
+}
+
+} // anonymous namespace
+
+int main (int argc, char** argv) 
+{
+   po::options_description desc("Convert To Bundles\n" 
+                                "Version: " VERSION "\n"
+                                "\n"
+                                "Options:");
+   desc.add_options()
+      ("help", "This help message.")
+      ("verbose,v", "Output extra information.")
+      ("tile-dir,t", po::value<string>(), "Directory of the disk storage to convert from.")
+      ("bundle-dir,b", po::value<string>(), "Directory of the bundle storage to convert to.")
+      ("style", po::value<vector<string> >(), "Style names to convert (repeat the argument). Defaults to all of them.")
+      ("sync", "Flush each metatile to disk as it's written. Slower, but an interrupted conversion need not be restarted.")
+      ;
+
+   po::variables_map vm;
+   po::store(po::parse_command_line(argc, argv, desc), vm);
+   po::notify(vm);
+   
+   if (vm.count("help") || (vm.count("tile-dir") == 0) || (vm.count("bundle-dir") == 0)) {
+      cout << desc << endl;
+      return EXIT_SUCCESS;
+   }
+
+   const fs::path tile_dir(vm["tile-dir"].as<string>());
+   const bool verbose = vm.count("verbose") > 0;
+   // each metatile is only written once, so there's nothing to compact.
+   rendermq::bundle_storage storage(vm["bundle-dir"].as<string>(), 0.0, vm.count("sync") > 0);
+
+   vector<string> styles;
+   if (vm.count("style") > 0) {
+      styles = vm["style"].as<vector<string> >();
+   } else {
+      for (fs::directory_iterator itr(tile_dir); itr != fs::directory_iterator(); ++itr) {
+         if (fs::is_directory(itr->status())) {
+            styles.push_back(itr->path().filename().native());
+         }
+      }
+   }
+
+   size_t converted = 0, failed = 0;
+   BOOST_FOREACH(const string &style, styles) {
+      const fs::path style_dir = tile_dir / style;
+      if (!fs::is_directory(style_dir)) {
+         cerr << "Style directory " << style_dir << " does not exist." << endl;
+         ++failed;
+         continue;
+      }
+
+      for (fs::recursive_directory_iterator itr(style_dir); itr != fs::recursive_directory_iterator(); ++itr) {
+         const fs::path &p = itr->path();
+         if (!fs::is_regular_file(itr->status()) || (p.extension() != ".meta")) {
+            continue;
+         }
+
+         rendermq::tile_protocol tile;
+         tile.style = style;
+         string data;
+         if (!read_meta(p, data, tile) || 
+             !storage.put_meta_at(tile, data, fs::last_write_time(p))) {
+            cerr << "Could not convert metatile " << p << "." << endl;
+            ++failed;
+            continue;
+         }
+
+         ++converted;
+         if (verbose) {
+            cout << (boost::format("%1% -> %2%") % p % storage.bundle_path(tile).first) << endl;
+         }
+      }
+   }
+
+   cout << (boost::format("Converted %1% metatiles, %2% failed.") % converted % failed) << endl;
+   return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -83,12 +83,14 @@ BOOST_PYTHON_MODULE(dqueue) {
         .value("cmdRenderPrio", rendermq::cmdRenderPrio)
         .value("cmdRenderBulk", rendermq::cmdRenderBulk)
         .value("cmdStatus", rendermq::cmdStatus)
+        .value("cmdMetatile", rendermq::cmdMetatile)
         ;
 
     enum_<protoFmt>("ProtoFormat")
       .value("fmtPNG", rendermq::fmtPNG)
       .value("fmtJPEG", rendermq::fmtJPEG)
       .value("fmtGIF", rendermq::fmtGIF)
+      .value("fmtWEBP", rendermq::fmtWEBP)
       .value("fmtJSON", rendermq::fmtJSON)
       ;
 
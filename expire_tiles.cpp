@@ -84,6 +84,8 @@ namespace bt = boost::posix_time;
 // bit too much, so lowering to something that should be around
 // 4 sec of work.
 #define LTS_QUEUE_BATCH_SIZE (1024)
+// number of tiles to get and expire in one go for generic storage.
+#define GENERIC_BATCH_SIZE (256)
 
 // global verbosity flag
 bool g_verbose;
@@ -151,7 +153,7 @@ public:
       {
          return lts_special_drain();
       }
-      return true;
+      return generic_drain();
    }
    
    bool operator()(const dqueue::job_t &job) 
@@ -169,16 +171,37 @@ public:
 
    bool generic_expire(const dqueue::job_t &job)
    {
-      shared_ptr<rendermq::tile_storage::handle> handle = m_storage->get(job);
-      // only want to continue the chain and re-render if the tile was present
-      // in storage in the first place...
-      bool is_clean = handle->exists() && !handle->expired();
-      if (is_clean && (job.z >= m_min_z) && (job.z <= m_max_z))
+      // the jobs are batched up so that the storage can get and 
+      // expire them in as few operations as it's able to.
+      m_generic_batch.push_back(job);
+      if (m_generic_batch.size() >= GENERIC_BATCH_SIZE)
       {
-         if (g_verbose) { std::cout << "Expiring " << job << "\n"; }
-         m_storage->expire(job);
+         return generic_drain();
       }
-      return is_clean;
+      return true;
+   }
+
+   bool generic_drain()
+   {
+      vector<shared_ptr<rendermq::tile_storage::handle> > handles;
+      m_storage->get_many(m_generic_batch, handles);
+
+      vector<rendermq::tile_protocol> to_expire;
+      for (size_t i = 0; i < m_generic_batch.size(); ++i)
+      {
+         const dqueue::job_t &job = m_generic_batch[i];
+         // only want to expire the tile if it was present in storage 
+         // in the first place...
+         bool is_clean = handles[i]->exists() && !handles[i]->expired();
+         if (is_clean && (job.z >= m_min_z) && (job.z <= m_max_z))
+         {
+            if (g_verbose) { std::cout << "Expiring " << job << "\n"; }
+            to_expire.push_back(job);
+         }
+      }
+      m_generic_batch.clear();
+
+      return to_expire.empty() || m_storage->expire_many(to_expire);
    }
 
    bool lts_special_expire(const dqueue::job_t &job)
@@ -320,6 +343,7 @@ private:
    scoped_ptr<rendermq::tile_storage> m_storage;
    scoped_ptr<rendermq::lts_storage> m_lts_storage;
    lts_queue_t m_lts_request_queue;
+   vector<rendermq::tile_protocol> m_generic_batch;
    int m_num_complete;
    int m_min_z, m_max_z;
    size_t m_total_tiles;
@@ -29,6 +29,8 @@
 #include <boost/function.hpp>
 #include <boost/variant.hpp>
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
@@ -367,6 +369,51 @@ struct curl_get : public curl_oper
    }
 };
 
+/* waits for something to happen on the transfers in the multi handle,
+ * for no longer than max_wait milliseconds.
+ */
+void wait_for_multi(CURLM *curl_multi, long max_wait)
+{
+   // curl tells us how long it expects to have to wait for something. 
+   // note that this must be called *after* the curl event gathering so 
+   // that curl has had an opportunity to figure out exactly what it is 
+   // that it is waiting for.
+   long timeout = 0;
+   curl_multi_timeout(curl_multi, &timeout);
+   if (timeout != 0) 
+   {
+      // first, pull the interesting file descriptors out of curl
+      fd_set read_fd, write_fd, exc_fd;
+      int n_fd = 0;
+      FD_ZERO(&read_fd);
+      FD_ZERO(&write_fd);
+      FD_ZERO(&exc_fd);
+
+      curl_multi_fdset(curl_multi, &read_fd, &write_fd, &exc_fd, &n_fd);
+
+      if (n_fd > 0)
+      {
+         // if there's timeout information then use that, otherwise
+         // block until something interesting happens...
+         if (timeout < 0)
+         {
+            timeout = std::min(100L, max_wait);
+         }
+         else if (timeout > max_wait)
+         {
+            timeout = max_wait;
+         }
+             
+         // curl gives back the highest descriptor, but select wants
+         // one more than that.
+         struct timeval tv;
+         tv.tv_sec = timeout / 1000;
+         tv.tv_usec = (timeout % 1000) * 1000;
+         select(n_fd + 1, &read_fd, &write_fd, &exc_fd, &tv);
+      }
+   }               
+}
+
 /* template function to abstract the multi-curl stuff across both
  * the single and form types of upload. the second argument is a 
  * functor, used to turn the request type into a representative 
@@ -457,42 +504,8 @@ vector<shared_ptr<response> > do_multi_requests(
          // error code - presumably to drain all the incoming input.
       } while (status == CURLM_CALL_MULTI_PERFORM);
 
-      // wait for something to happen - curl tells us how long it expects
-      // to have to wait for something. note that this is *after* the curl
-      // event gathering loop above so that curl has had an opportunity to
-      // figure out exactly what it is that it is waiting for.
-      long timeout = 0;
-      curl_multi_timeout(curl_multi.get(), &timeout);
-      if (timeout != 0) 
-      {
-         // first, pull the interesting file descriptors out of curl
-         fd_set read_fd, write_fd, exc_fd;
-         int n_fd = 0;
-         FD_ZERO(&read_fd);
-         FD_ZERO(&write_fd);
-         FD_ZERO(&exc_fd);
-
-         curl_multi_fdset(curl_multi.get(), &read_fd, &write_fd, &exc_fd, &n_fd);
-
-         if (n_fd > 0)
-         {
-            // if there's timeout information then use that, otherwise
-            // block until something interesting happens...
-            if (timeout < 0)
-            {
-               timeout = 100;
-            }
-            else if (timeout > 1000)
-            {
-               timeout = 1000;
-            }
-             
-            struct timeval tv;
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-            select(n_fd, &read_fd, &write_fd, &exc_fd, &tv);
-         }
-      }               
+      // wait for something to happen.
+      wait_for_multi(curl_multi.get(), 1000);
 
       // check if some actions completed
       struct CURLMsg *msg = NULL;
@@ -732,6 +745,140 @@ vector<shared_ptr<response> > multiGet(
    return do_multi_requests<string>(urls, mk_req, concurrency, connection);
 }
 
+bool hedgedGet(
+   const string &primary_url,
+   const vector<string> &primary_headers,
+   const string &backup_url,
+   const vector<string> &backup_headers,
+   long hedge_after,
+   hedged_part parts[2],
+   long timeout)
+{
+   using boost::posix_time::ptime;
+   using boost::posix_time::microsec_clock;
+
+   shared_ptr<CURLM> curl_multi(curl_multi_init(), &curl_multi_cleanup);
+   if (!curl_multi)
+   {
+      throw runtime_error("Cannot set up the cURL::multi system.");
+   }
+
+   const string *urls[2] = { &primary_url, &backup_url };
+   const vector<string> *headers[2] = { &primary_headers, &backup_headers };
+   boost::scoped_ptr<curl_get> opers[2];
+   ptime started[2];
+   bool hedged = false;
+   int winner = -1;
+
+   for (int i = 0; i < 2; ++i)
+   {
+      parts[i] = hedged_part();
+   }
+
+   // the primary is sent straight away, and the backup when it's time 
+   // to hedge or when the primary has failed, but only ever once.
+   int to_send = 0;
+   while (winner < 0)
+   {
+      if (to_send >= 0)
+      {
+         hedged_part &part = parts[to_send];
+         opers[to_send].reset(new curl_get(shared_ptr<CURL>(), *urls[to_send], *headers[to_send], 
+                                           false, to_send, timeout));
+         part.sent = true;
+         started[to_send] = microsec_clock::universal_time();
+         hedged = (to_send == 1) && !parts[0].finished;
+         if (curl_multi_add_handle(curl_multi.get(), opers[to_send]->m_curl.get()) != 0)
+         {
+            part.finished = true;
+            part.error = "Error adding easy handle to curl_multi.";
+         }
+         to_send = -1;
+      }
+
+      int running_handles = 0;
+      CURLMcode status;
+      do {
+         status = curl_multi_perform(curl_multi.get(), &running_handles); 
+      } while (status == CURLM_CALL_MULTI_PERFORM);
+
+      struct CURLMsg *msg = NULL;
+      int msg_count = 0;
+      while ((msg = curl_multi_info_read(curl_multi.get(), &msg_count)) != NULL)
+      {
+         if (msg->msg != CURLMSG_DONE) { continue; }
+
+         int i = (msg->easy_handle == opers[0]->m_curl.get()) ? 0 : 1;
+         curl_multi_remove_handle(curl_multi.get(), opers[i]->m_curl.get());
+
+         hedged_part &part = parts[i];
+         part.finished = true;
+         part.elapsed = (microsec_clock::universal_time() - started[i]).total_milliseconds();
+         response_or_error_t maybe_resp = opers[i]->finish(msg->data.result);
+         if (shared_ptr<response> *resp = boost::get<shared_ptr<response> >(&maybe_resp))
+         {
+            part.resp = *resp;
+         }
+         else
+         {
+            part.error = boost::get<string>(maybe_resp);
+         }
+
+         if ((winner < 0) && part.resp && (part.resp->statusCode == 200))
+         {
+            winner = i;
+         }
+      }
+
+      if (winner >= 0)
+      {
+         break;
+      }
+
+      // give up if there's nothing left which might get a 200.
+      bool backup_pending = !backup_url.empty() && !parts[1].sent;
+      if (!backup_pending && parts[0].finished && (!parts[1].sent || parts[1].finished))
+      {
+         break;
+      }
+
+      // work out whether the backup should go now, or how long to wait
+      // before it should.
+      long max_wait = 1000;
+      if (backup_pending)
+      {
+         long waited = (microsec_clock::universal_time() - started[0]).total_milliseconds();
+         if (parts[0].finished || ((hedge_after >= 0) && (waited >= hedge_after)))
+         {
+            to_send = 1;
+            continue;
+         }
+         else if (hedge_after >= 0)
+         {
+            max_wait = std::min(max_wait, hedge_after - waited);
+         }
+      }
+
+      wait_for_multi(curl_multi.get(), max_wait);
+   }
+
+   // abandon whatever is still outstanding.
+   for (int i = 0; i < 2; ++i)
+   {
+      if (parts[i].sent && !parts[i].finished)
+      {
+         curl_multi_remove_handle(curl_multi.get(), opers[i]->m_curl.get());
+         parts[i].elapsed = (microsec_clock::universal_time() - started[i]).total_milliseconds();
+      }
+   }
+
+#ifdef HTTP_DEBUG
+   LOG_FINER(boost::format("<HEDGED GET %1%> <WINNER %2%> <HEDGED %3%>") 
+             % primary_url % winner % hedged);
+#endif
+   return hedged;
+}
+
 // perform HTTP multi-post, returning the responses in the same order as the requests.
 // each request is a pair<string, string> of the URL and the data to post.
 vector<shared_ptr<response> > multiPost(
@@ -118,6 +118,38 @@ std::vector<boost::shared_ptr<response> > multiGet(
    const headers_t &headers = headers_t(),
    const bool &keepHeaders = false);
 
+// the outcome of one of the two requests in a hedged get.
+struct hedged_part
+{
+   hedged_part() : sent(false), finished(false), elapsed(0) {}
+   // whether the request was sent at all, and whether it finished 
+   // before the get returned, rather than being abandoned.
+   bool sent, finished;
+   // the response, if it finished without error, or the error.
+   boost::shared_ptr<response> resp;
+   std::string error;
+   // milliseconds from sending the request until it finished, or 
+   // until it was abandoned.
+   long elapsed;
+};
+
+// perform an HTTP GET of the primary URL and, if that hasn't come back
+// with a 200 within hedge_after milliseconds, of the backup URL too,
+// returning as soon as either has a 200. the other is abandoned. if the
+// primary finishes without a 200 then the backup is sent straight away,
+// and a negative hedge_after means that's the only time it's sent. an
+// empty backup URL means there's no backup. results for each request
+// are put in parts, and the return value is whether the backup was sent
+// while the primary was still outstanding.
+bool hedgedGet(
+   const std::string &primary_url,
+   const headers_t &primary_headers,
+   const std::string &backup_url,
+   const headers_t &backup_headers,
+   long hedge_after,
+   hedged_part parts[2],
+   long timeout = 0L);
+
    // perform HTTP delete, returning the response
    boost::shared_ptr<response> del(const std::string &url,
       curl_ptr connection = curl_ptr(), const headers_t& headers = headers_t(), const bool& keepHeaders = false);
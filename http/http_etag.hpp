@@ -0,0 +1,86 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef HTTP_ETAG_HPP
+#define HTTP_ETAG_HPP
+
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+
+namespace rendermq
+{
+
+/* entity tags are just the tile digest, as 16 hex digits in quotes.
+ * a tile stored compressed and sent with a Content-Encoding is a 
+ * different body from the same tile decompressed, so its tag has a 
+ * -gz suffix.
+ */
+inline std::string format_etag(uint64_t digest, bool gzip = false)
+{
+   char buf[28];
+   std::snprintf(buf, sizeof(buf), "\"%016llx%s\"", (unsigned long long)digest, 
+                 gzip ? "-gz" : "");
+   return std::string(buf);
+}
+
+/* parse the first entity tag out of an If-None-Match header, and 
+ * whether it was for the gzip encoded body. weak tags are accepted, 
+ * since the digest is of the whole tile anyway. returns false if the
+ * header doesn't start with a tag which could have been produced by 
+ * format_etag().
+ */
+inline bool parse_etag(uint64_t &digest, bool &gzip, std::string const& input)
+{
+   std::string::size_type pos = input.find_first_not_of(" \t");
+   if (pos == std::string::npos) { return false; }
+   if (input.compare(pos, 2, "W/") == 0) { pos += 2; }
+   if ((input.size() < pos + 18) || (input[pos] != '"')) { return false; }
+   if (input[pos + 17] == '"') { 
+      gzip = false; 
+   } else if (input.compare(pos + 17, 4, "-gz\"") == 0) {
+      gzip = true;
+   } else {
+      return false;
+   }
+
+   uint64_t value = 0;
+   for (std::string::size_type i = pos + 1; i < pos + 17; ++i) {
+      const char c = input[i];
+      int nibble;
+      if ((c >= '0') && (c <= '9')) { nibble = c - '0'; }
+      else if ((c >= 'a') && (c <= 'f')) { nibble = c - 'a' + 10; }
+      else if ((c >= 'A') && (c <= 'F')) { nibble = c - 'A' + 10; }
+      else { return false; }
+      value = (value << 4) | nibble;
+   }
+
+   digest = value;
+   return true;
+}
+
+}
+
+#endif // HTTP_ETAG_HPP
@@ -0,0 +1,133 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "http_gzip.hpp"
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <vector>
+#include <zlib.h>
+
+// zlib's window bits for a gzip header and trailer, rather than zlib's.
+#define GZIP_WINDOW_BITS (15 + 16)
+
+// size of the chunks in which output is produced.
+#define GZIP_CHUNK (16384)
+
+namespace rendermq
+{
+
+bool is_gzipped(const std::string &data)
+{
+   return (data.size() >= 2) && 
+      ((unsigned char)data[0] == 0x1f) && ((unsigned char)data[1] == 0x8b);
+}
+
+bool accepts_gzip(const std::string &accept_encoding)
+{
+   std::vector<std::string> codings;
+   boost::split(codings, accept_encoding, boost::is_any_of(","));
+   BOOST_FOREACH(const std::string &coding, codings)
+   {
+      std::vector<std::string> params;
+      boost::split(params, coding, boost::is_any_of(";"));
+      const std::string name = boost::to_lower_copy(boost::trim_copy(params[0]));
+      if ((name != "gzip") && (name != "x-gzip") && (name != "*")) { continue; }
+
+      // a quality of zero means it's not acceptable.
+      bool refused = false;
+      for (size_t i = 1; i < params.size(); ++i)
+      {
+         std::string q = boost::trim_copy(params[i]);
+         if (boost::istarts_with(q, "q="))
+         {
+            q = boost::trim_right_copy_if(q.substr(2), boost::is_any_of("0."));
+            refused = q.empty();
+         }
+      }
+      return !refused;
+   }
+   return false;
+}
+
+bool gzip(const std::string &in, std::string &out)
+{
+   z_stream zs;
+   zs.zalloc = Z_NULL;
+   zs.zfree = Z_NULL;
+   zs.opaque = Z_NULL;
+   if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 
+                    8, Z_DEFAULT_STRATEGY) != Z_OK)
+   {
+      return false;
+   }
+
+   out.clear();
+   zs.next_in = (Bytef *)in.data();
+   zs.avail_in = uInt(in.size());
+   char buf[GZIP_CHUNK];
+   int status;
+   do
+   {
+      zs.next_out = (Bytef *)buf;
+      zs.avail_out = sizeof(buf);
+      status = deflate(&zs, Z_FINISH);
+      out.append(buf, sizeof(buf) - zs.avail_out);
+   } while (status == Z_OK);
+
+   deflateEnd(&zs);
+   return status == Z_STREAM_END;
+}
+
+bool gunzip(const std::string &in, std::string &out)
+{
+   z_stream zs;
+   zs.zalloc = Z_NULL;
+   zs.zfree = Z_NULL;
+   zs.opaque = Z_NULL;
+   zs.next_in = Z_NULL;
+   zs.avail_in = 0;
+   if (inflateInit2(&zs, GZIP_WINDOW_BITS) != Z_OK)
+   {
+      return false;
+   }
+
+   out.clear();
+   zs.next_in = (Bytef *)in.data();
+   zs.avail_in = uInt(in.size());
+   char buf[GZIP_CHUNK];
+   int status;
+   do
+   {
+      zs.next_out = (Bytef *)buf;
+      zs.avail_out = sizeof(buf);
+      status = inflate(&zs, Z_NO_FLUSH);
+      out.append(buf, sizeof(buf) - zs.avail_out);
+   } while (status == Z_OK);
+
+   inflateEnd(&zs);
+   return status == Z_STREAM_END;
+}
+
+}
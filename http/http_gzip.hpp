@@ -0,0 +1,53 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef HTTP_GZIP_HPP
+#define HTTP_GZIP_HPP
+
+#include <string>
+
+namespace rendermq
+{
+
+/* whether the data starts with the gzip magic number. JSON can't start
+ * with those bytes, so for JSON tiles this says whether they have been
+ * stored compressed.
+ */
+bool is_gzipped(const std::string &data);
+
+/* whether an Accept-Encoding header allows a gzip encoded response,
+ * i.e: it lists gzip, or *, without a zero quality.
+ */
+bool accepts_gzip(const std::string &accept_encoding);
+
+/* compress or decompress data in gzip format, returning false if it
+ * couldn't be done, e.g: if the input to gunzip() is corrupt.
+ */
+bool gzip(const std::string &in, std::string &out);
+bool gunzip(const std::string &in, std::string &out);
+
+}
+
+#endif // HTTP_GZIP_HPP
@@ -24,7 +24,10 @@
  *-----------------------------------------------------------------------------*/
 
 #include "http_reply.hpp"
+#include "http_etag.hpp"
 #include <sstream>
+#include <cstring>
+#include <boost/format.hpp>
 
 #define SERVER_VERSION "0.8.0"
 #define SERVER_NAME "Mapnik2"
@@ -34,71 +37,114 @@
 namespace rendermq
 {
 
-void send_reply(zmq::socket_t & socket, 
-                std::string const& uuid, 
-                std::string const& id , 
+reply_sink::~reply_sink()
+{
+}
+
+mongrel_reply_sink::mongrel_reply_sink(zmq::socket_t &socket, const std::string &uuid)
+   : m_socket(socket), m_uuid(uuid)
+{
+}
+
+void mongrel_reply_sink::send(int64_t id, std::string const& response)
+{
+   // mongrel2 expects the server uuid and a netstring of the connection
+   // ids to send the response to in front of the response itself.
+   const std::string send_id = (boost::format("%d") % id).str();
+   std::ostringstream http;
+   http << m_uuid << " " << send_id.size() << ":" << send_id << ", " << response;
+   std::string s = http.str();
+   zmq::message_t msg(s.length());
+   std::memcpy(msg.data(),s.c_str(),s.length());
+   m_socket.send(msg);
+}
+
+void send_reply(reply_sink & sink, 
+                int64_t id, 
                 int status, 
                 std::string const& output)
 {
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << status << " " << "OK" << "\r\n";
    http << "Content-Type: text/plain\r\n";
    http << "Content-Length: " << output.length()  << "\r\n";
    http << "Server: " SERVER "\r\n\r\n";
    http << output;
-   std::string s = http.str();
-   zmq::message_t msg(s.length());
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);
+   sink.send(id, http.str());
 }
 
-void send_404(zmq::socket_t & socket,
-              std::string const& uuid, 
-              std::string const& id)
+void send_404(reply_sink & sink,
+              int64_t id)
 {
    std::string output("Sorry - we haven't been able to serve the content you asked for\n");
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 404 << " " << "Not Found" << "\r\n";
    http << "Content-Type: text/plain\r\n";
    http << "Content-Length: " << output.length()  << "\r\n";
    http << "Server: " SERVER "\r\n\r\n";
    http << output;
-   std::string s = http.str();
-   zmq::message_t msg(s.length());
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);
+   sink.send(id, http.str());
+}
+
+void send_400(reply_sink & sink,
+              int64_t id,
+              std::string const& reason)
+{
+   std::string output(reason + "\n");
+   std::ostringstream http;
+   http << "HTTP/1.1" << " " << 400 << " " << "Bad Request" << "\r\n";
+   http << "Content-Type: text/plain\r\n";
+   http << "Content-Length: " << output.length()  << "\r\n";
+   http << "Server: " SERVER "\r\n\r\n";
+   http << output;
+   sink.send(id, http.str());
+}
+
+void send_403(reply_sink & sink,
+              int64_t id,
+              std::string const& reason)
+{
+   std::string output(reason + "\n");
+   std::ostringstream http;
+   http << "HTTP/1.1" << " " << 403 << " " << "Forbidden" << "\r\n";
+   http << "Content-Type: text/plain\r\n";
+   http << "Content-Length: " << output.length()  << "\r\n";
+   http << "Server: " SERVER "\r\n\r\n";
+   http << output;
+   sink.send(id, http.str());
 }
 
-void send_304(zmq::socket_t & socket, 
-              std::string const& uuid, 
-              std::string const& id,
+void send_304(reply_sink & sink, 
+              int64_t id,
               std::time_t date, 
               http_date_formatter const& formatter,
-              const std::string &mime_type)
+              const std::string &mime_type,
+              uint64_t digest,
+              tile_encoding encoding)
 {
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 304 << " " << "Not Modified" << "\r\n";
    http << "Content-Type: " << mime_type << "\r\n";
    http << "Date: ";
    formatter(http,date);
    http << "\r\n";
+   if (digest != 0) {
+      http << "ETag: " << format_etag(digest, encoding == encodingGzip) << "\r\n";
+   }
+   if (encoding != encodingPlain) {
+      http << "Vary: Accept-Encoding\r\n";
+   }
    http << "Server: " SERVER "\r\n\r\n";
-   std::string s = http.str();
-   zmq::message_t msg(s.length());
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);
+   sink.send(id, http.str());
 }
 
-void send_tile(zmq::socket_t & socket, http_date_formatter const& frmt,
-               std::string const& uuid, std::string const& id ,
+void send_tile(reply_sink & sink, http_date_formatter const& frmt,
+               int64_t id ,
                unsigned max_age , std::time_t last_modified, std::time_t expire_time,
-               std::string const& data, const std::string &mime_type)
+               std::string const& data, const std::string &mime_type,
+               uint64_t digest, tile_encoding encoding)
 {
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 200 << " " << "OK" << "\r\n";
    http << "Content-Type: " << mime_type << "\r\n";
    http << "Content-Length: " << data.length()  << "\r\n";
@@ -110,23 +156,27 @@ void send_tile(zmq::socket_t & socket, http_date_formatter const& frmt,
    http << "Expires: " ;
    frmt(http,expire_time);
    http << "\r\n";
+   if (digest != 0) {
+      http << "ETag: " << format_etag(digest, encoding == encodingGzip) << "\r\n";
+   }
+   if (encoding == encodingGzip) {
+      http << "Content-Encoding: gzip\r\n";
+   }
+   if (encoding != encodingPlain) {
+      http << "Vary: Accept-Encoding\r\n";
+   }
    http << "Server: " SERVER "\r\n";
    http << "Access-Control-Allow-Origin: *\r\n\r\n";
    http << data;
-   std::string s = http.str();
-   zmq::message_t msg(s.length()); 
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);    
+   sink.send(id, http.str());
 }
 
-void send_tile(zmq::socket_t & socket, 
-               std::string const& uuid, 
-               std::string const& id ,
+void send_tile(reply_sink & sink, 
+               int64_t id ,
                std::string const& data,
                const std::string &mime_type)
 {
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 200 << " " << "OK" << "\r\n";
    http << "Content-Type: " << mime_type << "\r\n";
    http << "Content-Length: " << data.length()  << "\r\n";
@@ -135,52 +185,52 @@ void send_tile(zmq::socket_t & socket,
    http << "Server: " SERVER "\r\n";
    http << "Access-Control-Allow-Origin: *\r\n\r\n";
    http << data;
-   std::string s = http.str();
-   zmq::message_t msg(s.length()); 
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);    
+   sink.send(id, http.str());
 }
 
-void send_500(zmq::socket_t &socket,
-              const std::string &uuid,
-              const std::string &id) {
+void send_500(reply_sink &sink,
+              int64_t id) {
    std::string output("An unexpected error has occurred. This is a bug, please report it at " SUPPORT_ADDRESS "\n");
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 500 << " " << "Server Error" << "\r\n";
    http << "Content-Type: text/plain\r\n";
    http << "Content-Length: " << output.length()  << "\r\n";
    http << "Server: " SERVER "\r\n\r\n";
    http << output;
-   std::string s = http.str();
-   zmq::message_t msg(s.length());
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);
+   sink.send(id, http.str());
 }
 
-void send_503(zmq::socket_t &socket,
-              const std::string &uuid,
-              const std::string &id) {
+void send_503(reply_sink &sink,
+              int64_t id) {
    std::string output("The service is overloaded and cannot presently complete your request. Please try again later.\n");
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 503 << " " << "Service Overloaded" << "\r\n";
    http << "Content-Type: text/plain\r\n";
    http << "Content-Length: " << output.length()  << "\r\n";
    http << "Server: " SERVER "\r\n\r\n";
    http << output;
-   std::string s = http.str();
-   zmq::message_t msg(s.length());
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);
+   sink.send(id, http.str());
 }
 
-void send_202(zmq::socket_t &socket,
-              const std::string &uuid,
-              const std::string &id) {
+void send_429(reply_sink &sink,
+              int64_t id,
+              unsigned retry_after) {
+   std::string output("You have made too many requests. Please slow down and try again later.\n");
+   std::ostringstream http;
+   http << "HTTP/1.1" << " " << 429 << " " << "Too Many Requests" << "\r\n";
+   http << "Content-Type: text/plain\r\n";
+   http << "Content-Length: " << output.length()  << "\r\n";
+   http << "Retry-After: " << retry_after << "\r\n";
+   http << "Cache-Control: no-cache\r\n";
+   http << "Server: " SERVER "\r\n\r\n";
+   http << output;
+   sink.send(id, http.str());
+}
+
+void send_202(reply_sink &sink,
+              int64_t id) {
    std::string output("The tile you requested is not available at the moment. Please try again later.\n");
    std::ostringstream http;
-   http << uuid << " " << id.size() << ":" << id << ", ";
    http << "HTTP/1.1" << " " << 202 << " " << "Accepted" << "\r\n";
    http << "Content-Type: text/plain\r\n";
    http << "Content-Length: " << output.length()  << "\r\n";
@@ -188,11 +238,32 @@ void send_202(zmq::socket_t &socket,
    http << "Pragma: no-cache\r\n";
    http << "Server: " SERVER "\r\n\r\n";
    http << output;
-   std::string s = http.str();
-   zmq::message_t msg(s.length());
-   std::memcpy(msg.data(),s.c_str(),s.length());
-   socket.send(msg);
+   sink.send(id, http.str());
 }
 
+void send_204(reply_sink &sink,
+              int64_t id,
+              unsigned max_age) {
+   std::ostringstream http;
+   http << "HTTP/1.1" << " " << 204 << " " << "No Content" << "\r\n";
+   http << "Cache-Control: max-age=" << max_age << "\r\n";
+   http << "Server: " SERVER "\r\n\r\n";
+   sink.send(id, http.str());
+}
+
+void send_multipart(reply_sink &sink,
+                    int64_t id,
+                    const std::string &boundary,
+                    const std::string &body) {
+   std::ostringstream http;
+   http << "HTTP/1.1" << " " << 200 << " " << "OK" << "\r\n";
+   http << "Content-Type: multipart/mixed; boundary=" << boundary << "\r\n";
+   http << "Content-Length: " << body.length()  << "\r\n";
+   http << "Cache-Control: no-cache\r\n";
+   http << "Server: " SERVER "\r\n";
+   http << "Access-Control-Allow-Origin: *\r\n\r\n";
+   http << body;
+   sink.send(id, http.str());
+}
 
 }
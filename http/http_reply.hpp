@@ -28,60 +28,111 @@
 
 #include <zmq.hpp>
 #include <string>
+#include <stdint.h>
 
 #include "http_date_formatter.hpp"
 
 namespace rendermq
 {
 
-void send_reply(zmq::socket_t & socket, 
-                std::string const& uuid, 
-                std::string const& id , 
+/* somewhere to send HTTP responses to. the id identifies the request
+ * which is being responded to, and its meaning depends on where the
+ * request came from.
+ */
+class reply_sink
+{
+public:
+   virtual ~reply_sink();
+   virtual void send(int64_t id, std::string const& response) = 0;
+};
+
+/* sends responses back through mongrel2, where the id is mongrel's
+ * connection id. the uuid is only referenced, as the handler doesn't
+ * know it until the first request arrives.
+ */
+class mongrel_reply_sink : public reply_sink
+{
+public:
+   mongrel_reply_sink(zmq::socket_t &socket, std::string const& uuid);
+   void send(int64_t id, std::string const& response);
+
+private:
+   zmq::socket_t &m_socket;
+   std::string const& m_uuid;
+};
+
+void send_reply(reply_sink & sink, 
+                int64_t id, 
                 int status, 
                 std::string const& output);
 
-void send_404(zmq::socket_t & socket,
-              std::string const& uuid, 
-              std::string const& id
-   );
+void send_404(reply_sink & sink,
+              int64_t id);
+
+// send the client a message saying what was wrong with its request.
+void send_400(reply_sink & sink,
+              int64_t id,
+              std::string const& reason);
 
-void send_304(zmq::socket_t & socket, 
-              std::string const& uuid, 
-              std::string const& id,
+// send the client a message saying that it isn't allowed to do what
+// it asked.
+void send_403(reply_sink & sink,
+              int64_t id,
+              std::string const& reason);
+
+// how the data of a tile which is stored compressed is being sent. 
+// responses for those vary with the client's Accept-Encoding.
+enum tile_encoding {
+   encodingPlain,    // not stored compressed, sent as it is
+   encodingGzip,     // sent compressed, with a Content-Encoding
+   encodingGunzipped // decompressed for a client which doesn't accept gzip
+};
+
+// tells the client its copy is still good. if the digest is non-zero
+// it is sent as the ETag for the encoding the client has.
+void send_304(reply_sink & sink, 
+              int64_t id,
               std::time_t date, 
               http_date_formatter const& formatter,
-              const std::string &mime_type);
+              const std::string &mime_type,
+              uint64_t digest = 0,
+              tile_encoding encoding = encodingPlain);
 
 // send the client a message indicating server error. currently used when
 // the worker returns an error to the handler, and there's no fallback.
-void send_500(zmq::socket_t &socket,
-              const std::string &uuid,
-              const std::string &id);
+void send_500(reply_sink &sink,
+              int64_t id);
 
 // when the queue length threshold is greater than the maximum allowed 
 // then return this, "service overloaded" message to inform the client
 // to try again later.
-void send_503(zmq::socket_t &socket,
-              const std::string &uuid,
-              const std::string &id);
+void send_503(reply_sink &sink,
+              int64_t id);
 
+// when a client has made more requests than it's allowed, send this
+// to tell it how many seconds to wait before trying again.
+void send_429(reply_sink &sink,
+              int64_t id,
+              unsigned retry_after);
 
-// sends a tile, along with Last-Modified and cache-related headers.
-void send_tile(zmq::socket_t & socket, 
+// sends a tile, along with Last-Modified and cache-related headers. if
+// the digest is non-zero it is sent as the ETag, which differs between
+// the gzip encoded and decompressed bodies.
+void send_tile(reply_sink & sink, 
                http_date_formatter const& frmt,
-               std::string const& uuid, 
-               std::string const& id ,
+               int64_t id ,
                unsigned max_age , 
                std::time_t last_modified, 
                std::time_t expire_time,
                std::string const& data,
-               const std::string &mime_type);
+               const std::string &mime_type,
+               uint64_t digest = 0,
+               tile_encoding encoding = encodingPlain);
 
 // sends a tile, but omits the Last-Modified and cache-related 
 // headers.
-void send_tile(zmq::socket_t & socket, 
-               std::string const& uuid, 
-               std::string const& id ,
+void send_tile(reply_sink & sink, 
+               int64_t id ,
                std::string const& data,
                const std::string &mime_type);
 
@@ -89,9 +140,22 @@ void send_tile(zmq::socket_t & socket,
 // threshold, and we don't have the tile, send this (but render in
 // the background) so the client knows it's coming, but doesn't keep
 // the connection open.
-void send_202(zmq::socket_t &socket,
-              const std::string &uuid,
-              const std::string &id);
+void send_202(reply_sink &sink,
+              int64_t id);
+
+// when a tile was rendered but there was nothing in it, e.g: outside
+// the coverage of the style, send this. it can be cached for max_age
+// seconds.
+void send_204(reply_sink &sink,
+              int64_t id,
+              unsigned max_age);
+
+// sends several parts, already formatted with the given boundary
+// between them, as one multipart/mixed response.
+void send_multipart(reply_sink &sink,
+                    int64_t id,
+                    const std::string &boundary,
+                    const std::string &body);
 
 }
 
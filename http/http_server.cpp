@@ -0,0 +1,717 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "http_server.hpp"
+#include "../logging/logger.hpp"
+
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+#include <deque>
+#include <sstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::runtime_error;
+
+// maximum size of the request line and headers. anything bigger than
+// this is not going to be a tile request.
+#define MAX_REQUEST_HEAD (8192)
+// maximum number of requests on a connection waiting for a response 
+// before the server stops reading more from it.
+#define MAX_PIPELINED_REQUESTS (64)
+// number of events to take from epoll at once.
+#define MAX_EVENTS (64)
+#define READ_BUFFER_SIZE (16384)
+
+namespace rendermq
+{
+
+namespace
+{
+
+struct pending_response
+{
+   pending_response(int64_t i, bool h, const string &extra)
+      : id(i), head(h), done(false), extra_headers(extra) {}
+
+   int64_t id;
+   // HEAD requests get the headers of the response, but not the body.
+   bool head;
+   bool done;
+   // connection-related headers which the responder doesn't know about.
+   string extra_headers;
+   string response;
+};
+
+void set_nonblocking(int fd)
+{
+   int flags = fcntl(fd, F_GETFL, 0);
+   if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+   {
+      throw runtime_error((boost::format("Unable to make socket non-blocking: %1%") % strerror(errno)).str());
+   }
+}
+
+} // anonymous namespace
+
+struct http_server::connection
+{
+   connection(int f, const string &addr, std::time_t now)
+      : fd(f), remote_addr(addr), out_pos(0), events(0), registered(false), keep_alive(true), read_closed(false), 
+        closed(false), parsing(false), last_active(now) {}
+
+   int fd;
+   string remote_addr;
+   // data read, but not yet parsed into requests.
+   string in;
+   // data ready to be written, and how much of it has been written.
+   string out;
+   size_t out_pos;
+   // responses, in the order the requests were received.
+   std::deque<pending_response> pending;
+   // the events currently registered with epoll.
+   uint32_t events;
+   bool registered;
+   // false once a request has said it doesn't want the connection kept
+   // open, after which no more requests are read.
+   bool keep_alive;
+   bool read_closed;
+   bool closed;
+   // set while requests are being handed out, so that responses sent
+   // straight away don't start parsing again.
+   bool parsing;
+   std::time_t last_active;
+};
+
+bool 
+http_server::request::header(string const& name, string &value) const
+{
+   typedef std::pair<string, string> header_t;
+   BOOST_FOREACH(const header_t &h, headers)
+   {
+      if (boost::iequals(h.first, name))
+      {
+         value = h.second;
+         return true;
+      }
+   }
+   return false;
+}
+
+http_server::http_server(string const& listen, 
+                         request_handler handler,
+                         size_t max_connections, 
+                         std::time_t idle_timeout)
+   : m_handler(handler), m_max_connections(max_connections), 
+     m_idle_timeout(idle_timeout), m_next_idle_check(0),
+     m_listen_fd(-1), m_epoll_fd(-1), m_port(0), m_last_id(0)
+{
+   string::size_type colon = listen.rfind(':');
+   if (colon == string::npos)
+   {
+      throw runtime_error((boost::format("HTTP listen address `%1%' should be of the form host:port.") % listen).str());
+   }
+   const string host = listen.substr(0, colon);
+   const string port = listen.substr(colon + 1);
+
+   struct addrinfo hints, *addrs = NULL;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   int status = getaddrinfo((host.empty() || (host == "*")) ? NULL : host.c_str(), 
+                            port.c_str(), &hints, &addrs);
+   if (status != 0)
+   {
+      throw runtime_error((boost::format("Unable to resolve HTTP listen address `%1%': %2%") 
+                           % listen % gai_strerror(status)).str());
+   }
+
+   for (struct addrinfo *a = addrs; (a != NULL) && (m_listen_fd < 0); a = a->ai_next)
+   {
+      int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd < 0) { continue; }
+
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if ((bind(fd, a->ai_addr, a->ai_addrlen) == 0) && (::listen(fd, SOMAXCONN) == 0))
+      {
+         m_listen_fd = fd;
+      }
+      else
+      {
+         ::close(fd);
+      }
+   }
+   freeaddrinfo(addrs);
+
+   if (m_listen_fd < 0)
+   {
+      throw runtime_error((boost::format("Unable to listen for HTTP on `%1%': %2%") 
+                           % listen % strerror(errno)).str());
+   }
+   set_nonblocking(m_listen_fd);
+
+   struct sockaddr_storage addr;
+   socklen_t addr_len = sizeof(addr);
+   if (getsockname(m_listen_fd, (struct sockaddr *)&addr, &addr_len) == 0)
+   {
+      if (addr.ss_family == AF_INET) 
+      { 
+         m_port = ntohs(((struct sockaddr_in *)&addr)->sin_port); 
+      }
+      else if (addr.ss_family == AF_INET6) 
+      { 
+         m_port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port); 
+      }
+   }
+
+   m_epoll_fd = epoll_create(MAX_EVENTS);
+   if (m_epoll_fd < 0)
+   {
+      ::close(m_listen_fd);
+      throw runtime_error((boost::format("Unable to create epoll instance: %1%") % strerror(errno)).str());
+   }
+
+   struct epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = m_listen_fd;
+   epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev);
+
+   LOG_INFO(boost::format("Listening for HTTP requests on %1% (port %2%)") % listen % m_port);
+}
+
+http_server::~http_server()
+{
+   // copy, as close() removes them from the map.
+   std::vector<connection_ptr> conns;
+   for (boost::unordered_map<int, connection_ptr>::iterator itr = m_connections.begin();
+        itr != m_connections.end(); ++itr)
+   {
+      conns.push_back(itr->second);
+   }
+   BOOST_FOREACH(connection_ptr conn, conns)
+   {
+      close(conn);
+   }
+
+   ::close(m_epoll_fd);
+   ::close(m_listen_fd);
+}
+
+int 
+http_server::fd() const
+{
+   return m_epoll_fd;
+}
+
+int
+http_server::port() const
+{
+   return m_port;
+}
+
+size_t 
+http_server::num_connections() const
+{
+   return m_connections.size();
+}
+
+void 
+http_server::handle_events()
+{
+   struct epoll_event events[MAX_EVENTS];
+   int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, 0);
+
+   for (int i = 0; i < n; ++i)
+   {
+      if (events[i].data.fd == m_listen_fd)
+      {
+         accept_connections();
+         continue;
+      }
+
+      boost::unordered_map<int, connection_ptr>::iterator itr = m_connections.find(events[i].data.fd);
+      if (itr == m_connections.end())
+      {
+         continue;
+      }
+      // hold a reference, as the connection may be closed while it's
+      // being dealt with.
+      connection_ptr conn = itr->second;
+
+      if (events[i].events & EPOLLOUT)
+      {
+         write_responses(conn);
+      }
+      if (!conn->closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      {
+         read_requests(conn);
+      }
+   }
+}
+
+void 
+http_server::send(int64_t id, string const& response)
+{
+   boost::unordered_map<int64_t, connection_ptr>::iterator itr = m_requests.find(id);
+   if (itr == m_requests.end())
+   {
+      // the client went away before the response was ready.
+      return;
+   }
+   connection_ptr conn = itr->second;
+   m_requests.erase(itr);
+
+   BOOST_FOREACH(pending_response &p, conn->pending)
+   {
+      if (p.id == id)
+      {
+         // the status line is the only thing before the first line
+         // break, so connection headers can go straight after it.
+         string::size_type eol = response.find("\r\n");
+         string::size_type end = p.head ? response.find("\r\n\r\n") : string::npos;
+         if ((eol == string::npos) || p.extra_headers.empty())
+         {
+            p.response.assign(response, 0, (end == string::npos) ? string::npos : end + 4);
+         }
+         else
+         {
+            p.response.reserve(response.size() + p.extra_headers.size());
+            p.response.assign(response, 0, eol + 2);
+            p.response.append(p.extra_headers);
+            p.response.append(response, eol + 2, (end == string::npos) ? string::npos : end + 2 - eol);
+         }
+         p.done = true;
+         break;
+      }
+   }
+
+   write_responses(conn);
+
+   // responses going out may have made room for requests which are 
+   // already buffered.
+   if (!conn->closed && !conn->parsing && !conn->in.empty())
+   {
+      parse_requests(conn);
+   }
+}
+
+void 
+http_server::close_idle(std::time_t now)
+{
+   if (now < m_next_idle_check)
+   {
+      return;
+   }
+   m_next_idle_check = now + 1;
+
+   std::vector<connection_ptr> idle;
+   for (boost::unordered_map<int, connection_ptr>::iterator itr = m_connections.begin();
+        itr != m_connections.end(); ++itr)
+   {
+      const connection_ptr &conn = itr->second;
+      if (conn->pending.empty() && (conn->out_pos == conn->out.size()) &&
+          (now - conn->last_active > m_idle_timeout))
+      {
+         idle.push_back(conn);
+      }
+   }
+   BOOST_FOREACH(connection_ptr conn, idle)
+   {
+      close(conn);
+   }
+}
+
+void 
+http_server::accept_connections()
+{
+   while (true)
+   {
+      struct sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      int fd = accept(m_listen_fd, (struct sockaddr *)&addr, &addr_len);
+      if (fd < 0)
+      {
+         if (errno == EINTR) { continue; }
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+         {
+            LOG_WARNING(boost::format("Error accepting HTTP connection: %1%") % strerror(errno));
+         }
+         break;
+      }
+
+      if (m_connections.size() >= m_max_connections)
+      {
+         LOG_WARNING(boost::format("Too many HTTP connections (%1%), dropping new connection.") % m_connections.size());
+         ::close(fd);
+         continue;
+      }
+
+      set_nonblocking(fd);
+      // responses are written whole, so there's nothing to be gained
+      // from waiting for more data.
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      char host[NI_MAXHOST];
+      if (getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host), 
+                      NULL, 0, NI_NUMERICHOST) != 0)
+      {
+         host[0] = '\0';
+      }
+
+      connection_ptr conn(new connection(fd, host, std::time(NULL)));
+      m_connections.insert(std::make_pair(fd, conn));
+      update_events(conn);
+   }
+}
+
+void 
+http_server::read_requests(connection_ptr conn)
+{
+   char buf[READ_BUFFER_SIZE];
+
+   while (!conn->read_closed)
+   {
+      ssize_t n = ::read(conn->fd, buf, sizeof(buf));
+      if (n > 0)
+      {
+         conn->in.append(buf, n);
+         if (size_t(n) < sizeof(buf)) { break; }
+      }
+      else if (n == 0)
+      {
+         conn->read_closed = true;
+      }
+      else if (errno == EINTR)
+      {
+         continue;
+      }
+      else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      {
+         break;
+      }
+      else
+      {
+         close(conn);
+         return;
+      }
+   }
+   conn->last_active = std::time(NULL);
+
+   parse_requests(conn);
+
+   // the client has finished sending, so once everything it asked for
+   // has been sent the connection can go.
+   if (!conn->closed && conn->read_closed && conn->pending.empty() && 
+       (conn->out_pos == conn->out.size()))
+   {
+      close(conn);
+   }
+}
+
+void 
+http_server::parse_requests(connection_ptr conn)
+{
+   conn->parsing = true;
+
+   while (!conn->closed && conn->keep_alive && 
+          (conn->pending.size() < MAX_PIPELINED_REQUESTS))
+   {
+      string::size_type end = conn->in.find("\r\n\r\n");
+      if (end == string::npos)
+      {
+         if (conn->in.size() > MAX_REQUEST_HEAD)
+         {
+            send_error(conn, 400, "Bad Request");
+         }
+         break;
+      }
+      if (end > MAX_REQUEST_HEAD)
+      {
+         send_error(conn, 400, "Bad Request");
+         break;
+      }
+
+      const string head = conn->in.substr(0, end);
+      std::vector<string> lines;
+      boost::split(lines, head, boost::is_any_of("\n"));
+      conn->in.erase(0, end + 4);
+
+      std::vector<string> request_line;
+      boost::trim_right_if(lines[0], boost::is_any_of("\r"));
+      boost::split(request_line, lines[0], boost::is_any_of(" "), boost::token_compress_on);
+      if ((request_line.size() != 3) || 
+          ((request_line[2] != "HTTP/1.1") && (request_line[2] != "HTTP/1.0")))
+      {
+         send_error(conn, 400, "Bad Request");
+         break;
+      }
+
+      request req;
+      req.method = request_line[0];
+      req.path = request_line[1];
+      // strip off any query and, for absolute URIs, the scheme and host.
+      const string::size_type question = req.path.find('?');
+      if (question != string::npos)
+      {
+         req.query = req.path.substr(question + 1);
+         req.path.erase(question);
+      }
+      if (boost::istarts_with(req.path, "http://"))
+      {
+         string::size_type slash = req.path.find('/', 7);
+         req.path = (slash == string::npos) ? string("/") : req.path.substr(slash);
+      }
+
+      bool bad_header = false;
+      for (size_t i = 1; i < lines.size(); ++i)
+      {
+         string::size_type colon = lines[i].find(':');
+         if (colon == string::npos)
+         {
+            bad_header = true;
+            break;
+         }
+         req.headers.push_back(std::make_pair(boost::trim_copy(lines[i].substr(0, colon)),
+                                              boost::trim_copy(lines[i].substr(colon + 1))));
+      }
+      if (bad_header)
+      {
+         send_error(conn, 400, "Bad Request");
+         break;
+      }
+
+      // HTTP/1.1 keeps the connection by default, 1.0 only on request.
+      const bool http_10 = (request_line[2] == "HTTP/1.0");
+      string value;
+      bool keep_alive = !http_10;
+      if (req.header("connection", value))
+      {
+         if (boost::icontains(value, "close")) { keep_alive = false; }
+         else if (boost::icontains(value, "keep-alive")) { keep_alive = true; }
+      }
+
+      // nothing the handler serves takes a request body, and not
+      // reading it would get the framing wrong, so give up.
+      if ((req.header("content-length", value) && (value != "0")) ||
+          req.header("transfer-encoding", value))
+      {
+         send_error(conn, 400, "Bad Request");
+         break;
+      }
+
+      if ((req.method != "GET") && (req.method != "HEAD"))
+      {
+         send_error(conn, 405, "Method Not Allowed");
+         continue;
+      }
+
+      string extra_headers;
+      if (http_10 && keep_alive) { extra_headers = "Connection: keep-alive\r\n"; }
+      else if (!http_10 && !keep_alive) { extra_headers = "Connection: close\r\n"; }
+
+      req.id = next_id();
+      req.remote_addr = conn->remote_addr;
+      conn->keep_alive = keep_alive;
+      conn->pending.push_back(pending_response(req.id, req.method == "HEAD", extra_headers));
+      m_requests.insert(std::make_pair(req.id, conn));
+
+      m_handler(req);
+   }
+
+   conn->parsing = false;
+   if (!conn->closed)
+   {
+      update_events(conn);
+   }
+}
+
+void 
+http_server::send_error(connection_ptr conn, int status, string const& reason)
+{
+   // errors in the request itself are answered in place of the request,
+   // but still have to wait for earlier requests to be responded to.
+   std::ostringstream http;
+   http << "HTTP/1.1 " << status << " " << reason << "\r\n";
+   http << "Content-Type: text/plain\r\n";
+   http << "Content-Length: " << (reason.size() + 1) << "\r\n";
+   if (status == 405) 
+   { 
+      http << "Allow: GET, HEAD\r\n"; 
+   }
+   else 
+   {
+      // after a malformed request, there's no telling where the next 
+      // one starts.
+      http << "Connection: close\r\n";
+      conn->keep_alive = false;
+      conn->in.clear();
+   }
+   http << "\r\n" << reason << "\n";
+
+   pending_response p(0, false, string());
+   p.response = http.str();
+   p.done = true;
+   conn->pending.push_back(p);
+   write_responses(conn);
+}
+
+void 
+http_server::write_responses(connection_ptr conn)
+{
+   while (!conn->pending.empty() && conn->pending.front().done)
+   {
+      if (conn->out_pos == conn->out.size())
+      {
+         conn->out.clear();
+         conn->out_pos = 0;
+      }
+      conn->out.append(conn->pending.front().response);
+      conn->pending.pop_front();
+   }
+
+   while (conn->out_pos < conn->out.size())
+   {
+      ssize_t n = ::send(conn->fd, conn->out.data() + conn->out_pos, 
+                         conn->out.size() - conn->out_pos, MSG_NOSIGNAL);
+      if (n >= 0)
+      {
+         conn->out_pos += n;
+      }
+      else if (errno == EINTR)
+      {
+         continue;
+      }
+      else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      {
+         break;
+      }
+      else
+      {
+         close(conn);
+         return;
+      }
+   }
+   conn->last_active = std::time(NULL);
+
+   if (conn->out_pos == conn->out.size())
+   {
+      conn->out.clear();
+      conn->out_pos = 0;
+
+      if (conn->pending.empty() && (!conn->keep_alive || conn->read_closed))
+      {
+         close(conn);
+         return;
+      }
+   }
+
+   if (!conn->parsing)
+   {
+      update_events(conn);
+   }
+}
+
+void 
+http_server::update_events(connection_ptr conn)
+{
+   // stop reading when the client is sending requests faster than they
+   // can be answered, and only ask about writing when there's a backlog.
+   uint32_t events = 0;
+   if (!conn->read_closed && conn->keep_alive && 
+       (conn->pending.size() < MAX_PIPELINED_REQUESTS) &&
+       (conn->in.size() <= MAX_REQUEST_HEAD))
+   {
+      events |= EPOLLIN;
+   }
+   if (conn->out_pos < conn->out.size())
+   {
+      events |= EPOLLOUT;
+   }
+
+   if (!conn->registered || (events != conn->events))
+   {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.fd = conn->fd;
+      epoll_ctl(m_epoll_fd, conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev);
+      conn->events = events;
+      conn->registered = true;
+   }
+}
+
+void 
+http_server::close(connection_ptr conn)
+{
+   if (conn->closed)
+   {
+      return;
+   }
+   conn->closed = true;
+
+   // the responses to any outstanding requests have nowhere to go.
+   BOOST_FOREACH(const pending_response &p, conn->pending)
+   {
+      m_requests.erase(p.id);
+   }
+   conn->pending.clear();
+
+   epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+   ::close(conn->fd);
+   m_connections.erase(conn->fd);
+}
+
+int64_t 
+http_server::next_id()
+{
+   // ids have to fit in the 32-bit id field of the tile protocol, and
+   // zero or below means "no client".
+   do 
+   {
+      m_last_id = (m_last_id >= 0x7fffffff) ? 1 : (m_last_id + 1);
+   } 
+   while (m_requests.count(m_last_id) > 0);
+
+   return m_last_id;
+}
+
+}
@@ -0,0 +1,146 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef HTTP_SERVER_HPP
+#define HTTP_SERVER_HPP
+
+#include "http_reply.hpp"
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/utility.hpp>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <ctime>
+#include <stdint.h>
+
+namespace rendermq
+{
+
+/* minimal non-blocking HTTP/1.1 server, so that the handler can serve
+ * clients directly rather than through mongrel2. it only understands
+ * GET and HEAD requests without bodies, which is all that the handler
+ * needs, but it does keep-alive and pipelined requests.
+ *
+ * the server doesn't run its own thread. instead, fd() can be added
+ * to the handler's poll items and handle_events() called when it is
+ * readable. requests are passed to the request handler as they are
+ * parsed, and can be responded to at any later time, in any order,
+ * through the reply_sink interface. the server takes care of putting
+ * the responses back in order for each connection.
+ */
+class http_server : public reply_sink, private boost::noncopyable
+{
+public:
+   struct request
+   {
+      // identifies the request when sending the response to it.
+      int64_t id;
+      std::string method;
+      // the path, without any query string.
+      std::string path;
+      // the query string, without the '?', or empty if there wasn't one.
+      std::string query;
+      std::vector<std::pair<std::string, std::string> > headers;
+      // numeric address of the peer which sent the request.
+      std::string remote_addr;
+
+      // case-insensitive lookup of a header's value, returning false
+      // if the header wasn't present.
+      bool header(std::string const& name, std::string &value) const;
+   };
+   typedef boost::function<void (const request &)> request_handler;
+
+   /* start listening on the given address, which is of the form 
+    * "host:port", where the host can be left empty or "*" to listen on
+    * all interfaces. throws if it's unable to listen.
+    *
+    * @param listen address to listen on.
+    * @param handler called for each request received.
+    * @param max_connections new connections are closed straight away
+    *          if there are already this many open.
+    * @param idle_timeout seconds after which a connection with no
+    *          requests outstanding is closed.
+    */
+   http_server(std::string const& listen, 
+               request_handler handler,
+               size_t max_connections, 
+               std::time_t idle_timeout);
+   ~http_server();
+
+   // file descriptor which is readable when there are events to
+   // handle.
+   int fd() const;
+
+   // the port actually being listened on, useful if port 0 was asked
+   // for.
+   int port() const;
+
+   // accept new connections, read and parse requests, and write out
+   // any pending responses. doesn't block.
+   void handle_events();
+
+   // send the response to a request. if the connection has gone away
+   // in the meantime, the response is dropped.
+   void send(int64_t id, std::string const& response);
+
+   // close connections which haven't been active for longer than the
+   // idle timeout. this is cheap to call often, as it only does the 
+   // work about once a second.
+   void close_idle(std::time_t now);
+
+   size_t num_connections() const;
+
+private:
+   struct connection;
+   typedef boost::shared_ptr<connection> connection_ptr;
+
+   void accept_connections();
+   void read_requests(connection_ptr conn);
+   void parse_requests(connection_ptr conn);
+   void send_error(connection_ptr conn, int status, std::string const& reason);
+   void write_responses(connection_ptr conn);
+   void update_events(connection_ptr conn);
+   void close(connection_ptr conn);
+   int64_t next_id();
+
+   request_handler m_handler;
+   size_t m_max_connections;
+   std::time_t m_idle_timeout, m_next_idle_check;
+   int m_listen_fd, m_epoll_fd, m_port;
+   int64_t m_last_id;
+
+   // open connections by file descriptor, and requests which haven't 
+   // been responded to yet by id.
+   boost::unordered_map<int, connection_ptr> m_connections;
+   boost::unordered_map<int64_t, connection_ptr> m_requests;
+};
+
+}
+
+#endif // HTTP_SERVER_HPP
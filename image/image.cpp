@@ -24,6 +24,7 @@
  *-----------------------------------------------------------------------------*/
 
 #include "image.hpp"
+#include "config.hpp"
 #include "../logging/logger.hpp"
 #include <gd.h>
 #include <boost/format.hpp>
@@ -35,6 +36,8 @@
 // the quality setting for JPEG writing if none is specified in
 // the config file.
 #define DEFAULT_JPEG_QUALITY (80)
+// and likewise for lossy WebP writing.
+#define DEFAULT_WEBP_QUALITY (80)
 
 using std::string;
 using std::set;
@@ -200,6 +203,20 @@ string image::save(protoFmt fmt, const bt::ptree &config) const
       bytes = gdImageGifPtr(m_impl->img, &size);
       break;
 
+#ifdef HAVE_GDIMAGEWEBPPTREX
+   case fmtWEBP:
+      // GD's WebP writer only understands true-colour images, so
+      // anything which came in palettized has to be expanded first.
+      if (gdImageTrueColor(m_impl->img) == 0)
+      {
+         gdImagePaletteToTrueColor(m_impl->img);
+      }
+      gdImageSaveAlpha(m_impl->img, 1);
+      bytes = gdImageWebpPtrEx(m_impl->img, &size, 
+                               config.get<int>("webp.quality", DEFAULT_WEBP_QUALITY));
+      break;
+#endif /* HAVE_GDIMAGEWEBPPTREX */
+
    default:
       LOG_ERROR(boost::format("Image writer for type %1% (%2%) unknown.")
                 % fmt % mime_type_for(fmt));
@@ -221,7 +238,7 @@ string image::save(protoFmt fmt, const bt::ptree &config) const
 boost::shared_ptr<image> 
 image::create(string &data, protoFmt fmt)
 {
-   gdImagePtr gd_img;
+   gdImagePtr gd_img = NULL;
 
    switch (fmt)
    {
@@ -237,6 +254,12 @@ image::create(string &data, protoFmt fmt)
       gd_img = gdImageCreateFromGifPtr(data.size(), (void *)data.data());
       break;
 
+#ifdef HAVE_GDIMAGEWEBPPTREX
+   case fmtWEBP:
+      gd_img = gdImageCreateFromWebpPtr(data.size(), (void *)data.data());
+      break;
+#endif /* HAVE_GDIMAGEWEBPPTREX */
+
    default:
       LOG_ERROR(boost::format("Image reader for type %1% (%2%) unknown.")
                 % fmt % mime_type_for(fmt));
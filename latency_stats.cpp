@@ -0,0 +1,169 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "latency_stats.hpp"
+#include "logging/logger.hpp"
+
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <sstream>
+#include <cstring>
+
+using std::string;
+using std::ostream;
+
+namespace rendermq
+{
+
+latency_histogram::latency_histogram()
+   : m_count(0), m_sum(0), m_max(0)
+{
+   std::memset(m_buckets, 0, sizeof(m_buckets));
+}
+
+void 
+latency_histogram::record(uint64_t usec)
+{
+   int bucket = 0;
+   while ((bucket < num_buckets - 1) && ((uint64_t(1) << bucket) <= usec))
+   {
+      ++bucket;
+   }
+
+   ++m_buckets[bucket];
+   ++m_count;
+   m_sum += usec;
+   if (usec > m_max) { m_max = usec; }
+}
+
+uint64_t 
+latency_histogram::quantile(double q) const
+{
+   if (m_count == 0) { return 0; }
+
+   const uint64_t target = uint64_t(q * m_count + 0.5);
+   uint64_t seen = 0;
+   for (int i = 0; i < num_buckets; ++i)
+   {
+      seen += m_buckets[i];
+      if ((seen >= target) && (seen > 0))
+      {
+         // the bucket bound can be well above anything actually seen.
+         uint64_t bound = uint64_t(1) << i;
+         return (bound < m_max) ? bound : m_max;
+      }
+   }
+   return m_max;
+}
+
+latency_stats::latency_stats()
+{
+}
+
+void 
+latency_stats::record(const string &style, const tile_trace &trace)
+{
+   if (trace.empty()) { return; }
+
+   style_stats &stats = m_styles[style];
+   uint64_t first = 0, last = 0;
+
+   for (int i = 0; i < traceNumStages; ++i)
+   {
+      const uint64_t t = trace.at(traceStage(i));
+      if (t == 0) { continue; }
+
+      // if the clock appears to go backwards then something is very
+      // odd with this trace, so don't let it pollute the stats.
+      if (t < last) { return; }
+
+      if (last > 0) { stats.stages[i].record(t - last); }
+      else { first = t; }
+      last = t;
+   }
+
+   if (last > first) { stats.total.record(last - first); }
+}
+
+const char *
+latency_stats::stage_name(traceStage stage)
+{
+   switch (stage)
+   {
+   case traceReceived:       return "received";
+   case traceParsed:         return "parse";
+   case traceStorageEnqueue: return "storage_handoff";
+   case traceStorageDequeue: return "storage_queue";
+   case traceStorageDone:    return "storage_io";
+   case traceQueueSend:      return "queue_send";
+   case traceBrokerReply:    return "render";
+   case traceHttpSend:       return "reply";
+   default:                  return "unknown";
+   }
+}
+
+namespace
+{
+
+void report_line(ostream &out, const string &style, const char *stage, 
+                 const latency_histogram &h)
+{
+   out << boost::format("%1% %2% count=%3% mean=%4% p50=%5% p90=%6% p99=%7% max=%8%\n")
+      % style % stage % h.count() % h.mean() 
+      % h.quantile(0.5) % h.quantile(0.9) % h.quantile(0.99) % h.max();
+}
+
+} // anonymous namespace
+
+void 
+latency_stats::report(ostream &out) const
+{
+   out << "# latencies in microseconds, per style and stage.\n";
+   BOOST_FOREACH(const style_map_t::value_type &entry, m_styles)
+   {
+      const style_stats &stats = entry.second;
+      // the first stage has nothing before it to measure from.
+      for (int i = traceParsed; i < traceNumStages; ++i)
+      {
+         if (stats.stages[i].count() > 0)
+         {
+            report_line(out, entry.first, stage_name(traceStage(i)), stats.stages[i]);
+         }
+      }
+      report_line(out, entry.first, "total", stats.total);
+   }
+}
+
+void 
+latency_stats::log() const
+{
+   if (m_styles.empty()) { return; }
+
+   std::ostringstream ostr;
+   report(ostr);
+   LOG_INFO(boost::format("Request latencies:\n%1%") % ostr.str());
+}
+
+} // namespace rendermq
@@ -0,0 +1,104 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef LATENCY_STATS_HPP
+#define LATENCY_STATS_HPP
+
+#include "tile_trace.hpp"
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <map>
+
+namespace rendermq
+{
+
+/* a histogram of latencies with power-of-two sized buckets, so that
+ * bucket i counts latencies of less than 2^i microseconds. this is
+ * coarse, but it costs nothing to record into and is plenty to tell
+ * a millisecond from a second.
+ */
+class latency_histogram
+{
+public:
+   static const int num_buckets = 32;
+
+   latency_histogram();
+
+   void record(uint64_t usec);
+
+   uint64_t count() const { return m_count; }
+   uint64_t max() const { return m_max; }
+   uint64_t mean() const { return (m_count > 0) ? (m_sum / m_count) : 0; }
+
+   // upper bound, in microseconds, of the bucket which contains the
+   // given fraction (0 < q <= 1) of the recorded latencies.
+   uint64_t quantile(double q) const;
+
+private:
+   uint64_t m_buckets[num_buckets];
+   uint64_t m_count, m_sum, m_max;
+};
+
+/* aggregates the traces of completed requests into per-style,
+ * per-stage latency histograms. this is only touched from the
+ * handler's main loop, so there's no locking.
+ */
+class latency_stats
+{
+public:
+   latency_stats();
+
+   // add the trace from a request for the given style which has
+   // been replied to.
+   void record(const std::string &style, const tile_trace &trace);
+
+   // write out a plain-text table of the histograms, one line per
+   // style and stage.
+   void report(std::ostream &out) const;
+
+   // write the table out to the log at info level.
+   void log() const;
+
+   // the name of the latency measured up to the given stage.
+   static const char *stage_name(traceStage stage);
+
+private:
+   struct style_stats
+   {
+      // per-stage latencies, indexed by the stage at the end of the
+      // interval, and the total latency from first to last stamp.
+      latency_histogram stages[traceNumStages];
+      latency_histogram total;
+   };
+
+   typedef std::map<std::string, style_stats> style_map_t;
+   style_map_t m_styles;
+};
+
+} // namespace rendermq
+
+#endif // LATENCY_STATS_HPP
@@ -0,0 +1,219 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "metatile_cache.hpp"
+
+#include <boost/foreach.hpp>
+
+using std::string;
+using std::vector;
+
+namespace rendermq
+{
+
+bool
+metatile_cache::key::operator<(const key &other) const
+{
+   if (z != other.z) { return z < other.z; }
+   if (x != other.x) { return x < other.x; }
+   if (y != other.y) { return y < other.y; }
+   return style < other.style;
+}
+
+metatile_cache::metatile_cache(size_t max_size, std::time_t ttl)
+   : m_max_size(max_size), m_ttl(ttl), m_hits(0), m_misses(0)
+{
+}
+
+metatile_cache::key
+metatile_cache::make_key(const tile_protocol &tile)
+{
+   const int mask = METATILE - 1;
+   key k;
+   k.style = tile.style;
+   k.x = tile.x & ~mask;
+   k.y = tile.y & ~mask;
+   k.z = tile.z;
+   return k;
+}
+
+bool
+metatile_cache::lookup(tile_protocol &tile)
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+
+   map_t::iterator itr = m_entries.find(make_key(tile));
+   if (itr == m_entries.end())
+   {
+      ++m_misses;
+      return false;
+   }
+
+   // too old to trust, the storage may have changed since.
+   if (std::time(0) - itr->second.inserted >= m_ttl)
+   {
+      erase(itr);
+      ++m_misses;
+      return false;
+   }
+
+   if (!fill(tile, itr->second))
+   {
+      ++m_misses;
+      return false;
+   }
+
+   m_lru.splice(m_lru.begin(), m_lru, itr->second.lru);
+   ++m_hits;
+   return true;
+}
+
+bool
+metatile_cache::fill(tile_protocol &tile, const value &v)
+{
+   const int mask = METATILE - 1;
+   const int offset = (tile.y & mask) * METATILE + (tile.x & mask);
+   BOOST_FOREACH(const format_tiles &f, v.formats)
+   {
+      // empty tiles are left to the storage to decide about.
+      if ((f.fmt == tile.format) && !f.data[offset].empty())
+      {
+         tile.last_modified = v.last_modified;
+         tile.digest = f.digest[offset];
+         // the client already has the data if it's not modified, but
+         // status requests always carry it.
+         if ((tile.status == cmdStatus) || !(tile.conditional() && tile.not_modified()))
+         {
+            tile.set_data(f.data[offset]);
+            tile.data_gzipped = f.gzipped;
+         }
+         return true;
+      }
+   }
+   return false;
+}
+
+bool
+metatile_cache::insert(tile_protocol &tile, const string &buf, std::time_t last_modified)
+{
+   if (m_max_size == 0) { return false; }
+
+   // split the tiles out before taking the lock, as it's by far the
+   // most expensive part.
+   value v;
+   v.last_modified = last_modified;
+   v.inserted = std::time(0);
+
+   vector<meta_digest> digests = make_digests(buf, last_modified);
+   BOOST_FOREACH(const meta_digest &d, digests)
+   {
+      metatile_reader reader(buf, d.fmt);
+      if (!reader.initialized_) { continue; }
+
+      v.formats.push_back(format_tiles());
+      format_tiles &f = v.formats.back();
+      f.fmt = d.fmt;
+      f.digest = d.digest;
+      f.gzipped = reader.header_.gzipped();
+      for (int dy = 0; dy < METATILE; ++dy)
+      {
+         for (int dx = 0; dx < METATILE; ++dx)
+         {
+            std::pair<metatile_reader::iterator_type, metatile_reader::iterator_type> 
+               range = reader.get(dx, dy);
+            f.data[dy * METATILE + dx].assign(range.first, range.second);
+         }
+      }
+   }
+
+   if (v.formats.empty()) { return false; }
+
+   const key k = make_key(tile);
+
+   boost::mutex::scoped_lock lock(m_mutex);
+
+   map_t::iterator itr = m_entries.find(k);
+   if (itr != m_entries.end())
+   {
+      erase(itr);
+   }
+
+   while (m_entries.size() >= m_max_size)
+   {
+      erase(m_entries.find(m_lru.back()));
+   }
+
+   // swap the tiles in, rather than copying them all again.
+   value &slot = m_entries[k];
+   slot.formats.swap(v.formats);
+   slot.last_modified = v.last_modified;
+   slot.inserted = v.inserted;
+   m_lru.push_front(k);
+   slot.lru = m_lru.begin();
+
+   return fill(tile, slot);
+}
+
+void
+metatile_cache::invalidate(const tile_protocol &tile)
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+
+   map_t::iterator itr = m_entries.find(make_key(tile));
+   if (itr != m_entries.end())
+   {
+      erase(itr);
+   }
+}
+
+void
+metatile_cache::erase(map_t::iterator itr)
+{
+   m_lru.erase(itr->second.lru);
+   m_entries.erase(itr);
+}
+
+size_t
+metatile_cache::size() const
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+   return m_entries.size();
+}
+
+uint64_t
+metatile_cache::hits() const
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+   return m_hits;
+}
+
+uint64_t
+metatile_cache::misses() const
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+   return m_misses;
+}
+
+} // namespace rendermq
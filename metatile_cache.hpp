@@ -0,0 +1,130 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef METATILE_CACHE_HPP
+#define METATILE_CACHE_HPP
+
+#include "tile_protocol.hpp"
+#include "storage/meta_tile.hpp"
+
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+namespace rendermq
+{
+
+/* a bounded, least-recently-used cache of whole metatiles, shared
+ * between the storage worker's threads. clients tend to fetch tiles
+ * in clusters, so when one tile is missed the whole metatile it's in
+ * is read and kept here, and requests for its neighbours can then be
+ * answered without going to the storage at all.
+ *
+ * entries are only kept for a limited time, as the storage can be
+ * changed behind the handler's back, e.g: by the workers saving a
+ * fresh render or by another handler's dirty request.
+ */
+class metatile_cache
+{
+public:
+   /* @param max_size the maximum number of metatiles to keep.
+    * @param ttl the number of seconds for which a metatile is kept.
+    */
+   metatile_cache(size_t max_size, std::time_t ttl);
+
+   /* if the metatile containing the tile is cached, and has the
+    * tile's format in it, then fill in the tile's last modified
+    * time, digest and (unless the digest or time show that the
+    * client's copy is current) data and return true.
+    */
+   bool lookup(tile_protocol &tile);
+
+   /* split the metatile buffer, as returned from get_meta(), and
+    * keep it for the metatile containing the tile, with the given
+    * timestamp for all the tiles in it. the tile is then filled in
+    * as lookup() would, returning false if it isn't in the metatile.
+    */
+   bool insert(tile_protocol &tile, const std::string &buf, std::time_t last_modified);
+
+   /* forget the metatile containing the tile, in all formats. */
+   void invalidate(const tile_protocol &tile);
+
+   size_t size() const;
+   uint64_t hits() const;
+   uint64_t misses() const;
+
+private:
+   struct key
+   {
+      std::string style;
+      int x, y, z;
+
+      bool operator<(const key &other) const;
+   };
+
+   struct format_tiles
+   {
+      int fmt;
+      boost::array<std::string, METATILE * METATILE> data;
+      boost::array<uint64_t, METATILE * METATILE> digest;
+      // whether the metatile header flags the tiles as gzip compressed.
+      bool gzipped;
+   };
+
+   typedef std::list<key> lru_list_t;
+
+   struct value
+   {
+      std::vector<format_tiles> formats;
+      std::time_t last_modified;
+      std::time_t inserted;
+      // position in the recency list, so that it can be moved to the
+      // front in constant time.
+      lru_list_t::iterator lru;
+   };
+
+   typedef std::map<key, value> map_t;
+
+   static key make_key(const tile_protocol &tile);
+   static bool fill(tile_protocol &tile, const value &v);
+   void erase(map_t::iterator itr);
+
+   const size_t m_max_size;
+   const std::time_t m_ttl;
+
+   mutable boost::mutex m_mutex;
+   map_t m_entries;
+   // most recently used at the front.
+   lru_list_t m_lru;
+   uint64_t m_hits, m_misses;
+};
+
+} // namespace rendermq
+
+#endif // METATILE_CACHE_HPP
@@ -30,10 +30,186 @@
 // boost
 #include <boost/xpressive/xpressive.hpp>
 #include "logging/logger.hpp"
+// stl
+#include <cctype>
 
 namespace rendermq
 {
 
+namespace
+{
+
+typedef request_scanner::range_t range_t;
+
+// read a netstring's length prefix, up to and including the ':'.
+bool scan_length(const char *&p, const char *end, size_t &length)
+{
+   const char *start = p;
+   length = 0;
+   while ((p != end) && (*p >= '0') && (*p <= '9') && (p - start < 9))
+   {
+      length = length * 10 + (*p - '0');
+      ++p;
+   }
+   if ((p == start) || (p == end) || (*p != ':'))
+   {
+      return false;
+   }
+   ++p;
+   return true;
+}
+
+// read a token terminated by a single space.
+bool scan_token(const char *&p, const char *end, range_t &token)
+{
+   const char *start = p;
+   while ((p != end) && (*p != ' '))
+   {
+      ++p;
+   }
+   if ((p == start) || (p == end))
+   {
+      return false;
+   }
+   token = range_t(start, p);
+   ++p;
+   return true;
+}
+
+inline void skip_space(const char *&p, const char *end)
+{
+   while ((p != end) && ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n')))
+   {
+      ++p;
+   }
+}
+
+// read a JSON string, returning the raw contents between the quotes.
+bool scan_json_string(const char *&p, const char *end, range_t &str)
+{
+   if ((p == end) || (*p != '"'))
+   {
+      return false;
+   }
+   const char *start = ++p;
+   while ((p != end) && (*p != '"'))
+   {
+      // skip over the escaped character, whatever it is.
+      if (*p == '\\') 
+      { 
+         ++p; 
+         if (p == end) { return false; }
+      }
+      ++p;
+   }
+   if (p == end)
+   {
+      return false;
+   }
+   str = range_t(start, p);
+   ++p;
+   return true;
+}
+
+bool iequals(const range_t &r, const char *str)
+{
+   const char *p = r.begin();
+   for (; (p != r.end()) && (*str != '\0'); ++p, ++str)
+   {
+      if (std::tolower(*p) != std::tolower(*str))
+      {
+         return false;
+      }
+   }
+   return (p == r.end()) && (*str == '\0');
+}
+
+} // anonymous namespace
+
+request_scanner::request_scanner()
+   : m_id_number(0)
+{
+}
+
+bool request_scanner::scan(const char *data, size_t size)
+{
+   const char *p = data;
+   const char *end = data + size;
+
+   if (!scan_token(p, end, m_uuid) || 
+       !scan_token(p, end, m_id) ||
+       !scan_token(p, end, m_path))
+   {
+      return false;
+   }
+
+   // the id is a number, and has to fit in the tile id.
+   if (m_id.size() > 9)
+   {
+      return false;
+   }
+   m_id_number = 0;
+   for (const char *c = m_id.begin(); c != m_id.end(); ++c)
+   {
+      if ((*c < '0') || (*c > '9')) 
+      {
+         return false;
+      }
+      m_id_number = m_id_number * 10 + (*c - '0');
+   }
+
+   // headers netstring, which should be a JSON object.
+   size_t length = 0;
+   if (!scan_length(p, end, length) || 
+       (size_t(end - p) < length + 1) ||
+       (length < 2) || 
+       (p[0] != '{') || (p[length - 1] != '}') || 
+       (p[length] != ','))
+   {
+      return false;
+   }
+   m_headers = range_t(p + 1, p + length - 1);
+   p += length + 1;
+
+   // body netstring, which must be empty.
+   if (!scan_length(p, end, length) || (length != 0) ||
+       (p == end) || (*p != ',') || (p + 1 != end))
+   {
+      return false;
+   }
+
+   return true;
+}
+
+bool request_scanner::header(const char *name, range_t &value) const
+{
+   const char *p = m_headers.begin();
+   const char *end = m_headers.end();
+
+   while (true)
+   {
+      range_t key, val;
+
+      skip_space(p, end);
+      if (!scan_json_string(p, end, key)) { return false; }
+      skip_space(p, end);
+      if ((p == end) || (*p != ':')) { return false; }
+      ++p;
+      skip_space(p, end);
+      if (!scan_json_string(p, end, val)) { return false; }
+
+      if (iequals(key, name))
+      {
+         value = val;
+         return true;
+      }
+
+      skip_space(p, end);
+      if ((p == end) || (*p != ',')) { return false; }
+      ++p;
+   }
+}
+
 struct request_parser::pimpl {
    boost::xpressive::sregex rex_;
    keys_and_values<std::string::iterator> kv_grammar_;
@@ -47,6 +223,24 @@ request_parser::request_parser()
 request_parser::~request_parser() {
 }
 
+bool request_parser::operator() (mongrel_request & request, request_scanner const& scanned) const
+{
+   request.set_uuid(std::string(scanned.uuid().begin(), scanned.uuid().end()));
+   request.set_id(std::string(scanned.id().begin(), scanned.id().end()));
+   request.set_path(std::string(scanned.path().begin(), scanned.path().end()));
+
+   std::string headers(scanned.headers().begin(), scanned.headers().end());
+   std::string::iterator begin = headers.begin();
+   std::string::iterator end = headers.end();
+
+   bool result = qi::phrase_parse(begin, end, impl->kv_grammar_, qi::space, request.headers());
+   if (!result)
+   {
+      LOG_ERROR(boost::format("Failed to parse headers: %1%") % headers);
+   }
+   return result;
+}
+
 bool request_parser::operator() (mongrel_request & request, std::string const& input) const
 {
    using namespace boost::xpressive;
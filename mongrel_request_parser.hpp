@@ -31,11 +31,59 @@
 // boost
 #include <boost/scoped_ptr.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/range/iterator_range.hpp>
 // stl
 #include <string>
 
 namespace rendermq {
 
+/* cheap scan of a mongrel2 request message, which is of the form
+ *
+ *   UUID ID PATH LEN:{HEADERS},LEN:BODY,
+ *
+ * this finds the framing and picks out the uuid, id and path without
+ * copying anything, and leaves the headers as unparsed JSON which can
+ * be searched for just the headers that are needed. the handler only
+ * ever looks at a couple of them, so building the whole header map
+ * for every request is a waste - use request_parser on the scanned
+ * request if that's really needed.
+ *
+ * the ranges all point into the buffer which was scanned, which must
+ * outlive any use of them.
+ */
+class request_scanner
+{
+public:
+   typedef boost::iterator_range<const char *> range_t;
+
+   request_scanner();
+
+   // scan the message in the buffer, returning true if the framing
+   // is OK. as with the full parser, requests with a body (e.g: 
+   // mongrel2's JSON disconnect messages) are not accepted.
+   bool scan(const char *data, size_t size);
+
+   const range_t &uuid() const { return m_uuid; }
+   const range_t &id() const { return m_id; }
+   const range_t &path() const { return m_path; }
+
+   // the JSON headers, without the enclosing braces.
+   const range_t &headers() const { return m_headers; }
+
+   // the id as a number. scan() fails if the id doesn't fit.
+   int id_number() const { return m_id_number; }
+
+   // search the headers for one with the given name (compared case-
+   // insensitively) and put its raw value, i.e: without unescaping,
+   // in value. returns false if there's no such header, or if the
+   // JSON is malformed before the header is found.
+   bool header(const char *name, range_t &value) const;
+
+private:
+   range_t m_uuid, m_id, m_path, m_headers;
+   int m_id_number;
+};
+
 class request_parser : boost::noncopyable
 {
 public:
@@ -43,6 +91,9 @@ public:
    ~request_parser();
    bool operator() (mongrel_request & request, std::string const& input) const;
 
+   // fully parse a request which has already been scanned.
+   bool operator() (mongrel_request & request, request_scanner const& scanned) const;
+
 private:
    struct pimpl;
    boost::scoped_ptr<pimpl> impl;
@@ -0,0 +1,149 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "negative_cache.hpp"
+#include "storage/meta_tile.hpp"
+
+#include <boost/format.hpp>
+#include <cstring>
+
+using std::string;
+
+namespace rendermq
+{
+
+// ordered so that all the formats of a tile are next to each other, 
+// which makes invalidating them all easy.
+bool
+negative_cache::key::operator<(const key &other) const
+{
+   if (style != other.style) { return style < other.style; }
+   if (z != other.z) { return z < other.z; }
+   if (x != other.x) { return x < other.x; }
+   if (y != other.y) { return y < other.y; }
+   return format < other.format;
+}
+
+negative_cache::negative_cache(size_t max_size, std::time_t miss_ttl, std::time_t fail_ttl)
+   : m_max_size(max_size), m_miss_ttl(miss_ttl), m_fail_ttl(fail_ttl)
+{
+   std::memset(m_hits, 0, sizeof(m_hits));
+}
+
+negative_cache::key
+negative_cache::make_key(const tile_protocol &tile)
+{
+   key k;
+   k.style = tile.style;
+   k.z = tile.z;
+   k.x = tile.x;
+   k.y = tile.y;
+   k.format = tile.format;
+   return k;
+}
+
+negativeKind
+negative_cache::lookup(const tile_protocol &tile, std::time_t now)
+{
+   if (m_entries.empty()) { return negativeNone; }
+
+   map_t::iterator itr = m_entries.find(make_key(tile));
+   if (itr == m_entries.end()) { return negativeNone; }
+
+   if (now >= itr->second.expires)
+   {
+      erase(itr);
+      return negativeNone;
+   }
+
+   ++m_hits[itr->second.kind];
+   return itr->second.kind;
+}
+
+void
+negative_cache::insert(const tile_protocol &tile, negativeKind kind, std::time_t now)
+{
+   if ((m_max_size == 0) || (kind == negativeNone)) { return; }
+
+   const key k = make_key(tile);
+   map_t::iterator itr = m_entries.find(k);
+   if (itr != m_entries.end())
+   {
+      erase(itr);
+   }
+
+   // entries all have short lives, so throwing out the oldest is
+   // nearly as good as throwing out the least recently used.
+   while (m_entries.size() >= m_max_size)
+   {
+      erase(m_entries.find(m_order.back()));
+   }
+
+   m_order.push_front(k);
+   value &v = m_entries[k];
+   v.kind = kind;
+   v.expires = now + ((kind == negativeMissing) ? m_miss_ttl : m_fail_ttl);
+   v.order = m_order.begin();
+}
+
+void
+negative_cache::invalidate(const tile_protocol &tile)
+{
+   if (m_entries.empty()) { return; }
+
+   // each column of the metatile is a run of neighbouring keys.
+   key k = make_key(tile);
+   const int mx = tile.x & ~(METATILE - 1), my = tile.y & ~(METATILE - 1);
+   for (k.x = mx; k.x < mx + METATILE; ++k.x)
+   {
+      k.y = my;
+      k.format = 0;
+      map_t::iterator itr = m_entries.lower_bound(k);
+      while ((itr != m_entries.end()) && (itr->first.style == k.style) &&
+             (itr->first.z == k.z) && (itr->first.x == k.x) && (itr->first.y < my + METATILE))
+      {
+         map_t::iterator next = itr;
+         ++next;
+         erase(itr);
+         itr = next;
+      }
+   }
+}
+
+void
+negative_cache::erase(map_t::iterator itr)
+{
+   m_order.erase(itr->second.order);
+   m_entries.erase(itr);
+}
+
+void
+negative_cache::report(std::ostream &out) const
+{
+   out << boost::format("# negative cache size=%1% missing=%2% failed=%3% empty=%4%\n")
+      % m_entries.size() % m_hits[negativeMissing] % m_hits[negativeFailed] % m_hits[negativeEmpty];
+}
+
+} // namespace rendermq
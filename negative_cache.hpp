@@ -0,0 +1,127 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef NEGATIVE_CACHE_HPP
+#define NEGATIVE_CACHE_HPP
+
+#include "tile_protocol.hpp"
+
+#include <stdint.h>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <list>
+#include <map>
+
+namespace rendermq
+{
+
+/* what is known about a tile which couldn't be served.
+ */
+enum negativeKind {
+   negativeNone = 0, // nothing known, carry on as normal
+   negativeMissing,  // the storage didn't have it
+   negativeFailed,   // the render failed, so it can't be produced
+   negativeEmpty,    // the render succeeded, but produced nothing
+   negativeNumKinds
+};
+
+/* a bounded cache of tiles which recently couldn't be served, so that
+ * repeated requests for coverage holes and the like don't each cost a
+ * storage lookup and a render.
+ *
+ * storage misses are kept for a short time, so that the storage isn't
+ * asked again while the tile is being rendered. failed and empty
+ * renders are kept longer, and are answered without either the 
+ * storage or a render. entries are dropped when the tile is dirtied
+ * or turns up with data.
+ *
+ * this is only touched from the handler's main loop, so there's no
+ * locking.
+ */
+class negative_cache
+{
+public:
+   /* @param max_size the maximum number of tiles to keep, or zero
+    *    to disable the cache.
+    * @param miss_ttl seconds for which storage misses are kept.
+    * @param fail_ttl seconds for which failed or empty renders are
+    *    kept.
+    */
+   negative_cache(size_t max_size, std::time_t miss_ttl, std::time_t fail_ttl);
+
+   bool enabled() const { return m_max_size > 0; }
+   std::time_t fail_ttl() const { return m_fail_ttl; }
+
+   // what is known about the tile, if anything.
+   negativeKind lookup(const tile_protocol &tile, std::time_t now);
+
+   void insert(const tile_protocol &tile, negativeKind kind, std::time_t now);
+
+   // forget all the tiles in the tile's metatile, in all formats, as 
+   // they're all rendered together.
+   void invalidate(const tile_protocol &tile);
+
+   size_t size() const { return m_entries.size(); }
+   uint64_t hits(negativeKind kind) const { return m_hits[kind]; }
+
+   // write out a plain-text summary line.
+   void report(std::ostream &out) const;
+
+private:
+   struct key
+   {
+      std::string style;
+      int z, x, y, format;
+
+      bool operator<(const key &other) const;
+   };
+
+   typedef std::list<key> order_list_t;
+
+   struct value
+   {
+      negativeKind kind;
+      std::time_t expires;
+      // position in the insertion order, oldest at the back.
+      order_list_t::iterator order;
+   };
+
+   typedef std::map<key, value> map_t;
+
+   static key make_key(const tile_protocol &tile);
+   void erase(map_t::iterator itr);
+
+   const size_t m_max_size;
+   const std::time_t m_miss_ttl, m_fail_ttl;
+
+   map_t m_entries;
+   order_list_t m_order;
+   uint64_t m_hits[negativeNumKinds];
+};
+
+} // namespace rendermq
+
+#endif // NEGATIVE_CACHE_HPP
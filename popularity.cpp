@@ -0,0 +1,230 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "popularity.hpp"
+#include "storage/meta_tile.hpp"
+
+#include <boost/functional/hash.hpp>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+using std::vector;
+
+namespace rendermq
+{
+
+namespace
+{
+
+// different multipliers to get an independent-ish hash for each row
+// from the one hash of the key.
+const uint64_t row_seeds[] = {
+   0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 
+   0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL 
+};
+
+size_t hash_key(const std::string &style, int z, int x, int y)
+{
+   size_t seed = 0;
+   boost::hash_combine(seed, style);
+   boost::hash_combine(seed, z);
+   boost::hash_combine(seed, x);
+   boost::hash_combine(seed, y);
+   return seed;
+}
+
+} // anonymous namespace
+
+const int32_t popularity_sketch::max_priority;
+
+bool
+popularity_sketch::key::operator<(const key &other) const
+{
+   if (z != other.z) { return z < other.z; }
+   if (x != other.x) { return x < other.x; }
+   if (y != other.y) { return y < other.y; }
+   return style < other.style;
+}
+
+popularity_sketch::popularity_sketch(size_t width, std::time_t half_life, size_t max_top)
+   : m_width(width), m_half_life(half_life), m_max_top(max_top),
+     m_next_decay(std::time(0) + half_life),
+     m_counters(depth * width, 0)
+{
+}
+
+popularity_sketch::key
+popularity_sketch::make_key(const tile_protocol &tile)
+{
+   key k;
+   k.style = tile.style;
+   k.z = tile.z;
+   k.x = tile.x & ~(METATILE - 1);
+   k.y = tile.y & ~(METATILE - 1);
+   return k;
+}
+
+size_t
+popularity_sketch::index(int row, size_t hash) const
+{
+   uint64_t h = (uint64_t(hash) + row) * row_seeds[row];
+   h ^= h >> 29;
+   return row * m_width + size_t(h % m_width);
+}
+
+uint32_t
+popularity_sketch::estimate(size_t hash) const
+{
+   uint32_t count = std::numeric_limits<uint32_t>::max();
+   for (int row = 0; row < depth; ++row)
+   {
+      count = std::min(count, m_counters[index(row, hash)]);
+   }
+   return count;
+}
+
+uint32_t
+popularity_sketch::estimate(const tile_protocol &tile) const
+{
+   if (m_width == 0) { return 0; }
+   const key k = make_key(tile);
+   return estimate(hash_key(k.style, k.z, k.x, k.y));
+}
+
+void
+popularity_sketch::record(const tile_protocol &tile, std::time_t now)
+{
+   if (m_width == 0) { return; }
+
+   decay(now);
+
+   const key k = make_key(tile);
+   const size_t hash = hash_key(k.style, k.z, k.x, k.y);
+
+   // conservative update: only the counters at the minimum need to go
+   // up for the estimate to go up, and leaving the others alone makes
+   // collisions hurt much less.
+   const uint32_t count = estimate(hash);
+   if (count == std::numeric_limits<uint32_t>::max()) { return; }
+   for (int row = 0; row < depth; ++row)
+   {
+      uint32_t &c = m_counters[index(row, hash)];
+      if (c == count) { ++c; }
+   }
+   const uint32_t updated = count + 1;
+
+   top_map_t::iterator itr = m_top.find(k);
+   if (itr != m_top.end())
+   {
+      m_by_count.erase(itr->second);
+      itr->second = m_by_count.insert(std::make_pair(updated, k));
+   }
+   else if (m_top.size() < m_max_top)
+   {
+      m_top.insert(std::make_pair(k, m_by_count.insert(std::make_pair(updated, k))));
+   }
+   else if ((m_max_top > 0) && (updated > m_by_count.begin()->first))
+   {
+      // replace the least popular.
+      m_top.erase(m_by_count.begin()->second);
+      m_by_count.erase(m_by_count.begin());
+      m_top.insert(std::make_pair(k, m_by_count.insert(std::make_pair(updated, k))));
+   }
+}
+
+void
+popularity_sketch::decay(std::time_t now)
+{
+   if ((m_half_life <= 0) || (now < m_next_decay)) { return; }
+
+   // if several half-lives have gone by, do them all at once.
+   int halvings = 1 + int((now - m_next_decay) / m_half_life);
+   halvings = std::min(halvings, 32);
+   m_next_decay = now + m_half_life;
+
+   BOOST_FOREACH(uint32_t &c, m_counters)
+   {
+      c = (halvings >= 32) ? 0 : (c >> halvings);
+   }
+
+   // halving keeps the order, so the candidates can be put back in 
+   // order at the end each time.
+   by_count_t halved;
+   BOOST_FOREACH(const by_count_t::value_type &t, m_by_count)
+   {
+      const uint32_t count = (halvings >= 32) ? 0 : (t.first >> halvings);
+      if (count == 0) { m_top.erase(t.second); }
+      else { m_top[t.second] = halved.insert(halved.end(), std::make_pair(count, t.second)); }
+   }
+   m_by_count.swap(halved);
+}
+
+int32_t
+popularity_sketch::priority(const tile_protocol &tile) const
+{
+   const uint32_t count = estimate(tile);
+   if (count == 0) { return 0; }
+
+   // popularity is very skewed, so go by the order of magnitude of the
+   // count, which spreads the popular tiles out over the range.
+   const int32_t p = int32_t(4.0 * std::log(1.0 + count) / std::log(2.0));
+   return std::min(p, max_priority);
+}
+
+void
+popularity_sketch::top(size_t n, vector<entry> &out) const
+{
+   out.clear();
+   out.reserve(std::min(n, m_by_count.size()));
+   for (by_count_t::const_reverse_iterator itr = m_by_count.rbegin(); 
+        (itr != m_by_count.rend()) && (out.size() < n); ++itr)
+   {
+      entry e;
+      e.style = itr->second.style;
+      e.z = itr->second.z;
+      e.x = itr->second.x;
+      e.y = itr->second.y;
+      e.count = itr->first;
+      out.push_back(e);
+   }
+}
+
+void
+popularity_sketch::report(std::ostream &out, size_t n) const
+{
+   vector<entry> entries;
+   top(n, entries);
+
+   out << "# most requested metatiles: style z x y count\n";
+   BOOST_FOREACH(const entry &e, entries)
+   {
+      out << boost::format("%1% %2% %3% %4% %5%\n") % e.style % e.z % e.x % e.y % e.count;
+   }
+}
+
+} // namespace rendermq
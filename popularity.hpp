@@ -0,0 +1,129 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef POPULARITY_HPP
+#define POPULARITY_HPP
+
+#include "tile_protocol.hpp"
+
+#include <stdint.h>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace rendermq
+{
+
+/* approximately how often each metatile has been requested lately,
+ * kept in a count-min sketch so that the memory used is fixed however
+ * many metatiles there are. counts are halved every half-life, so 
+ * that what was popular last week doesn't crowd out what's popular 
+ * now.
+ *
+ * the most popular metatiles are also tracked, so that they can be
+ * listed for pre-warming caches.
+ *
+ * this is only touched from the handler's main loop, so there's no
+ * locking.
+ */
+class popularity_sketch
+{
+public:
+   // a metatile and its estimated count.
+   struct entry
+   {
+      std::string style;
+      int z, x, y;
+      uint32_t count;
+   };
+
+   /* @param width the number of counters in each row of the sketch,
+    *    or zero to disable it. more counters means fewer collisions.
+    * @param half_life seconds after which counts are halved.
+    * @param max_top how many of the most popular metatiles to track.
+    */
+   popularity_sketch(size_t width, std::time_t half_life, size_t max_top);
+
+   bool enabled() const { return m_width > 0; }
+
+   // count a request for the tile.
+   void record(const tile_protocol &tile, std::time_t now);
+
+   // the estimated number of recent requests for the tile's metatile.
+   // this can over-estimate, but never under-estimates.
+   uint32_t estimate(const tile_protocol &tile) const;
+
+   /* a priority for background re-rendering the tile, between zero
+    * for tiles nobody has asked for and max_priority, which is kept
+    * below the default priority of dirty requests so that popular
+    * background renders don't get ahead of those.
+    */
+   int32_t priority(const tile_protocol &tile) const;
+   static const int32_t max_priority = 49;
+
+   // the n most popular metatiles, most popular first.
+   void top(size_t n, std::vector<entry> &out) const;
+
+   // write out the most popular metatiles, one per line.
+   void report(std::ostream &out, size_t n) const;
+
+private:
+   static const int depth = 4;
+
+   struct key
+   {
+      std::string style;
+      int z, x, y;
+
+      bool operator<(const key &other) const;
+   };
+
+   static key make_key(const tile_protocol &tile);
+   size_t index(int row, size_t hash) const;
+   uint32_t estimate(size_t hash) const;
+   void decay(std::time_t now);
+
+   const size_t m_width;
+   const std::time_t m_half_life;
+   const size_t m_max_top;
+   std::time_t m_next_decay;
+
+   // depth rows of width counters each.
+   std::vector<uint32_t> m_counters;
+
+   // candidates for the most popular, ordered by their latest 
+   // estimates so that the least popular can be replaced without a 
+   // scan, and indexed by metatile to find them as they're requested.
+   typedef std::multimap<uint32_t, key> by_count_t;
+   typedef std::map<key, by_count_t::iterator> top_map_t;
+   by_count_t m_by_count;
+   top_map_t m_top;
+};
+
+} // namespace rendermq
+
+#endif // POPULARITY_HPP
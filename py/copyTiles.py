@@ -73,7 +73,8 @@ PROTO_FORMATS = {
     'jpg': dqueue.ProtoFormat.fmtJPEG,
     'jpeg': dqueue.ProtoFormat.fmtJPEG,
     'json': dqueue.ProtoFormat.fmtJSON,
-    'gif': dqueue.ProtoFormat.fmtGIF
+    'gif': dqueue.ProtoFormat.fmtGIF,
+    'webp': dqueue.ProtoFormat.fmtWEBP
 }
 
 if __name__ == "__main__" :
@@ -39,6 +39,7 @@ FORMAT_LOOKUP = {
 	"jpeg":   dqueue.ProtoFormat.fmtJPEG,
 	"jpg":   dqueue.ProtoFormat.fmtJPEG,
 	"gif":    dqueue.ProtoFormat.fmtGIF,
+	"webp":   dqueue.ProtoFormat.fmtWEBP,
 	"json":   dqueue.ProtoFormat.fmtJSON
 }
 
@@ -1,6 +1,7 @@
 import os
 import sys
 import struct
+import zlib
 import dqueue
 import PIL
 from geojson import loads
@@ -11,6 +12,10 @@ import tile as dims
 
 METATILE = dims.METATILE
 META_MAGIC = "META"
+# flags kept in the header's format above the format bits, saying
+# how the tiles in that format are stored. see meta_tile.hpp.
+META_FLAG_GZIP = 0x10000
+META_FLAGS_MASK = ~0xffff
 # NOTE: this is a sanity check value. the per-style max zoom
 # checks are done in the handler.
 MAX_ZOOM=30
@@ -20,6 +25,7 @@ FORMAT_LOOKUP = {
     "png":    dqueue.ProtoFormat.fmtPNG,
     "jpeg":   dqueue.ProtoFormat.fmtJPEG,
     "gif":    dqueue.ProtoFormat.fmtGIF,
+    "webp":   dqueue.ProtoFormat.fmtWEBP,
     "json":   dqueue.ProtoFormat.fmtJSON
 }
 
@@ -27,6 +33,7 @@ FORMAT_REVERSE = {
     dqueue.ProtoFormat.fmtPNG  : "png",
     dqueue.ProtoFormat.fmtJPEG : "jpeg",
     dqueue.ProtoFormat.fmtGIF  : "gif",
+    dqueue.ProtoFormat.fmtWEBP : "webp",
     dqueue.ProtoFormat.fmtJSON : "json"
 }
 
@@ -49,6 +56,15 @@ def xyz_to_meta_offset(x,y,z):
     offset = (y & mask) * METATILE + (x & mask)
     return offset
 
+def gzip_data(data):
+    # wbits of 16 + MAX_WBITS gives a gzip header, which the handler
+    # recognises and can send on as Content-Encoding: gzip.
+    compressor = zlib.compressobj(9, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+    return compressor.compress(data) + compressor.flush()
+
+def gunzip_data(data):
+    return zlib.decompress(str(data), 16 + zlib.MAX_WBITS)
+
 
 
 class metatile_builder:
@@ -86,15 +102,22 @@ class metatile_builder:
                 self.meta_tile += contents[(y, x)]
                 contents[(y, x)] = None
     
-    def write_header(self, format):
-        format_as_int = FORMAT_LOOKUP[format]
+    def write_header(self, format, flags=0):
+        format_as_int = FORMAT_LOOKUP[format] | flags
         self.meta_tile += struct.pack("4s5i", META_MAGIC, METATILE * METATILE, self.tile.x, self.tile.y, self.tile.z, format_as_int)
 
     def offset_header(self):
         self.offset += len(META_MAGIC) + 5 * 4
         self.offset += (2 * 4) * (METATILE * METATILE)
 
-def make_meta(job, tiles, metaData, formats, size):
+def make_meta(job, tiles, metaData, formats, size, compress_json=False):
+    # JSON compresses very well, so it can be stored gzipped, and the
+    # handler will send it on like that to clients which accept it.
+    json_flags = 0
+    if metaData is not None and compress_json:
+        metaData = dict([(k, gzip_data(v)) for k, v in metaData.iteritems()])
+        json_flags = META_FLAG_GZIP
+
     # Make some room for the headers and offsets
     builder = metatile_builder(job, size)
     for f in formats:
@@ -107,7 +130,7 @@ def make_meta(job, tiles, metaData, formats, size):
         builder.write_header(f)
         builder.write_offsets(tiles[f])
     if metaData is not None:
-        builder.write_header('json')
+        builder.write_header('json', json_flags)
         builder.write_offsets(metaData)
 
     # Write out the tiles
@@ -118,20 +141,21 @@ def make_meta(job, tiles, metaData, formats, size):
 
     return builder.meta_tile
 
-def save_meta(storage, job, tiles, metaData, formats, size):
-    meta = make_meta(job, tiles, metaData, formats, size)
-    # Send the meta tile to storage
-    success = storage.put_meta(job, meta)
+def save_meta(storage, job, tiles, metaData, formats, size, compress_json=False):
+    meta = make_meta(job, tiles, metaData, formats, size, compress_json)
+    # Send the meta tile to storage, which says what time it gave it. that
+    # can be earlier than now if the tiles are the same as before.
+    stored = storage.put_meta_stamped(job, meta)
     # Make sure we know about it if the storage doesn't work. The cluster
     # will continue working, as the data can be sent back via the broker,
     # but it's helpful to have something in the logs so we know what's 
     # going on...
-    if not success:
+    if stored is None:
         mq_logging.error("Failed to save meta tile to storage (%d:%d:%d:%s tile-size=%d)" % \
                              (job.z,job.x,job.y,job.style,len(job.data)))
 
-    # Return the meta tile
-    return meta
+    # Return the time it was stored with, or None
+    return stored
 
 def check_xyz(x,y,z):
     bad_coords = ( z < 0 or z > MAX_ZOOM)
@@ -142,12 +166,13 @@ def check_xyz(x,y,z):
         
 class metatile_reader:
     class tileset:
-        def __init__(self, x, y, z, fmt, tiles):
+        def __init__(self, x, y, z, fmt, tiles, gzipped=False):
             self.x = x
             self.y = y
             self.z = z
             self.fmt = fmt
             self.tiles = tiles
+            self.gzipped = gzipped
 
         def unImage(self):
             if len(self.tiles) != METATILE * METATILE:
@@ -171,8 +196,11 @@ class metatile_reader:
                 y = i / 8
                 # not all tiles are necessarily present in a metatile
                 if len(self.tiles[i]) > 0:
+                    data = self.tiles[i]
+                    if self.gzipped:
+                        data = gunzip_data(data)
                     #referenced in row column order
-                    json[(y, x)] = loads(self.tiles[i])
+                    json[(y, x)] = loads(data)
             return json
 
     def __init__(self, data):
@@ -192,7 +220,8 @@ class metatile_reader:
                 off, sz = offset_str.unpack_from(data, offset)
                 offset += offset_str.size
                 tiles.append(buffer(data, off, sz))
-            self.tiles.append(self.tileset(tile_x, tile_y, tile_z, FORMAT_REVERSE[fmt_int], tiles))
+            self.tiles.append(self.tileset(tile_x, tile_y, tile_z, FORMAT_REVERSE[fmt_int & ~META_FLAGS_MASK], tiles,
+                                           (fmt_int & META_FLAG_GZIP) != 0))
 
     def image(self):
         for i, t in enumerate(self.tiles):
@@ -52,6 +52,8 @@ class RenderResult:
     def __init__(self, data, meta):
         self.data = data
         self.meta = meta
+        # the time storage gave the metatile, if it was saved on the way.
+        self.last_modified = None
 
     @classmethod
     def from_image(cls, tile, data, meta=None):
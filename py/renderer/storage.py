@@ -41,6 +41,7 @@ FORMAT_LOOKUP = {
     "png":    dqueue.ProtoFormat.fmtPNG,
     "jpeg":   dqueue.ProtoFormat.fmtJPEG,
     "gif":    dqueue.ProtoFormat.fmtGIF,
+    "webp":   dqueue.ProtoFormat.fmtWEBP,
     "json":   dqueue.ProtoFormat.fmtJSON
 }
 
@@ -92,7 +93,8 @@ class Renderer:
                metaData = None 
                 
            #save the tiles and the meta data to storage
-           save_meta(self.storage, job, metaTile, metaData, imageFormats, tile.dimensions[0])
+           result.last_modified = save_meta(self.storage, job, metaTile, metaData, imageFormats, tile.dimensions[0],
+                                            self.format_args.get('json', {}).get('compress') == 'true')
            
        else:
            # got result from storage, now need to unpack and return
@@ -232,13 +232,22 @@ if __name__ == "__main__" :
                     else: 
                         metaData = None 
                     #save the tiles and the meta data to storage
-                    meta_tile = make_meta(job, metaTile, metaData, imageFormats, tile.dimensions[0])
+                    meta_tile = make_meta(job, metaTile, metaData, imageFormats, tile.dimensions[0],
+                                          format_args.get('json', {}).get('compress') == 'true')
     
                     if job.status!=dqueue.ProtoCommand.cmdDirty and job.status!=dqueue.ProtoCommand.cmdRenderBulk :
                         job.data = meta_tile
                     mq_logging.info("DONE METATILE %s tile-size=%d" % (dumptile(job), len(job.data)))
                     job.status = dqueue.ProtoCommand.cmdDone
-                    job.last_modified = int(time.time())
+                    # storage keeps the old timestamp if the re-render came
+                    # out exactly the same as before, in which case pass that
+                    # on so that clients' copies don't look out of date. the
+                    # renderer says what it was when it saved the metatile.
+                    stored = getattr(result, 'last_modified', None)
+                    if stored is not None and stored > 0:
+                        job.last_modified = stored
+                    else:
+                        job.last_modified = int(time.time())
                 except Exception as detail:
                         mq_logging.error('Exception: %s' % (detail))
                         raise
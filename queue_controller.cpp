@@ -0,0 +1,239 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "queue_controller.hpp"
+#include "logging/logger.hpp"
+
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+
+// the most render latencies to keep for each style between 
+// adjustments, and the fewest worth adjusting on.
+#define MAX_SAMPLES (1024)
+#define MIN_SAMPLES (10)
+
+// thresholds are cut quickly when the target is missed, and raised
+// slowly while there's slack, i.e: the latency is below this fraction
+// of the target.
+#define SCALE_DECREASE (0.5)
+#define SCALE_INCREASE (1.1)
+#define SLACK_FRACTION (0.8)
+
+// limits on how far the thresholds can be scaled.
+#define MIN_SCALE (1.0 / 64.0)
+#define MAX_SCALE (4.0)
+
+using std::string;
+using std::ostream;
+
+namespace rendermq
+{
+
+queue_controller::style_state::style_state()
+   : scale(1.0), next(0)
+{
+   std::memset(decisions, 0, sizeof(decisions));
+}
+
+queue_controller::queue_controller(size_t stale, size_t satisfy, size_t max, 
+                                   uint64_t target_usec, std::time_t adjust_interval)
+   : m_stale(stale), m_satisfy(satisfy), m_max(max),
+     m_target(target_usec), m_adjust_interval(adjust_interval),
+     m_next_adjust(std::time(0) + adjust_interval)
+{
+}
+
+size_t
+queue_controller::scaled(const string &style, size_t threshold) const
+{
+   if ((m_target == 0) || (threshold == 0)) { return threshold; }
+
+   style_map_t::const_iterator itr = m_styles.find(style);
+   if (itr == m_styles.end()) { return threshold; }
+
+   const size_t t = size_t(threshold * itr->second.scale + 0.5);
+   return std::max(t, size_t(1));
+}
+
+size_t
+queue_controller::threshold_stale(const string &style) const
+{
+   return scaled(style, m_stale);
+}
+
+size_t
+queue_controller::threshold_satisfy(const string &style) const
+{
+   return scaled(style, m_satisfy);
+}
+
+size_t
+queue_controller::threshold_max(const string &style) const
+{
+   return scaled(style, m_max);
+}
+
+void 
+queue_controller::record_render(const string &style, uint64_t usec)
+{
+   if (m_target > 0)
+   {
+      style_state &state = m_styles[style];
+      if (state.samples.size() < MAX_SAMPLES)
+      {
+         state.samples.push_back(usec);
+      }
+      else
+      {
+         state.samples[state.next] = usec;
+         state.next = (state.next + 1) % MAX_SAMPLES;
+      }
+   }
+
+   maybe_adjust();
+}
+
+void 
+queue_controller::decided(const string &style, queueDecision decision)
+{
+   ++m_styles[style].decisions[decision];
+
+   maybe_adjust();
+}
+
+void
+queue_controller::maybe_adjust()
+{
+   if ((m_target > 0) && (std::time(0) >= m_next_adjust))
+   {
+      adjust();
+      m_next_adjust = std::time(0) + m_adjust_interval;
+   }
+}
+
+void
+queue_controller::adjust()
+{
+   BOOST_FOREACH(style_map_t::value_type &entry, m_styles)
+   {
+      style_state &state = entry.second;
+      const double old_scale = state.scale;
+
+      if (state.samples.size() >= MIN_SAMPLES)
+      {
+         std::vector<uint64_t>::iterator p95 = 
+            state.samples.begin() + (state.samples.size() * 95) / 100;
+         std::nth_element(state.samples.begin(), p95, state.samples.end());
+
+         if (*p95 > m_target)
+         {
+            state.scale = std::max(state.scale * SCALE_DECREASE, MIN_SCALE);
+         }
+         else if (*p95 < m_target * SLACK_FRACTION)
+         {
+            state.scale = std::min(state.scale * SCALE_INCREASE, MAX_SCALE);
+         }
+      }
+      else if (state.scale < 1.0)
+      {
+         // with hardly any renders to go by, which may well be because
+         // the thresholds have been cut so far that hardly anything is
+         // rendered, drift back towards the configured thresholds.
+         state.scale = std::min(state.scale * SCALE_INCREASE, 1.0);
+      }
+
+      if (state.scale != old_scale)
+      {
+         LOG_FINER(boost::format("Queue thresholds for style %1% scaled by %2%, from %3%.") 
+                   % entry.first % state.scale % old_scale);
+      }
+
+      state.samples.clear();
+      state.next = 0;
+   }
+}
+
+double
+queue_controller::scale(const string &style) const
+{
+   style_map_t::const_iterator itr = m_styles.find(style);
+   return (itr == m_styles.end()) ? 1.0 : itr->second.scale;
+}
+
+uint64_t
+queue_controller::count(const string &style, queueDecision decision) const
+{
+   style_map_t::const_iterator itr = m_styles.find(style);
+   return (itr == m_styles.end()) ? 0 : itr->second.decisions[decision];
+}
+
+const char *
+queue_controller::decision_name(queueDecision decision)
+{
+   switch (decision)
+   {
+   case decisionRender:          return "render";
+   case decisionStale:           return "stale";
+   case decisionStaleBackground: return "stale_background";
+   case decisionSatisfy:         return "satisfy";
+   case decisionReject:          return "reject";
+   case decisionDirty:           return "dirty";
+   default:                      return "unknown";
+   }
+}
+
+void
+queue_controller::report(ostream &out) const
+{
+   out << "# queue thresholds and decision counts, per style.\n";
+   BOOST_FOREACH(const style_map_t::value_type &entry, m_styles)
+   {
+      const string &style = entry.first;
+      out << boost::format("%1% queue scale=%2% threshold_stale=%3% threshold_satisfy=%4% threshold_max=%5%")
+         % style % entry.second.scale % threshold_stale(style) 
+         % threshold_satisfy(style) % threshold_max(style);
+
+      for (int i = 0; i < decisionNumDecisions; ++i)
+      {
+         out << " " << decision_name(queueDecision(i)) << "=" << entry.second.decisions[i];
+      }
+      out << "\n";
+   }
+}
+
+void
+queue_controller::log() const
+{
+   if (m_styles.empty()) { return; }
+
+   std::ostringstream ostr;
+   report(ostr);
+   LOG_INFO(boost::format("Queue decisions:\n%1%") % ostr.str());
+}
+
+} // namespace rendermq
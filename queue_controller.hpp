@@ -0,0 +1,134 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef QUEUE_CONTROLLER_HPP
+#define QUEUE_CONTROLLER_HPP
+
+#include <stdint.h>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace rendermq
+{
+
+/* the things the handler can do with a request, depending on how 
+ * long the render queue is.
+ */
+enum queueDecision {
+   decisionRender = 0,      // render, with the client waiting
+   decisionStale,           // send the stale tile without re-rendering
+   decisionStaleBackground, // send the stale tile and re-render it
+   decisionSatisfy,         // send a 202 and render in the background
+   decisionReject,          // send a 503
+   decisionDirty,           // accept a dirty request
+   decisionNumDecisions
+};
+
+/* per-style queue length thresholds at which the handler starts to
+ * serve stale tiles, to answer with 202s and to answer with 503s.
+ *
+ * the same queue length means very different waits for cheap and
+ * expensive styles, so if a latency target is set then each style's
+ * thresholds are scaled to try and hold the 95th percentile latency
+ * of its rendered requests to the target. when a style's renders are
+ * too slow its thresholds are cut quickly, and they're raised slowly
+ * again when there's slack. with no target the configured thresholds
+ * are used as they are.
+ *
+ * every decision is counted, per style. this is only touched from the
+ * handler's main loop, so there's no locking.
+ */
+class queue_controller
+{
+public:
+   /* @param stale, satisfy, max the configured thresholds, used as 
+    *    they are when there's no target and as the starting point 
+    *    when there is.
+    * @param target_usec the latency target, in microseconds, or zero
+    *    to not adapt the thresholds at all.
+    * @param adjust_interval how often, in seconds, to adjust them.
+    */
+   queue_controller(size_t stale, size_t satisfy, size_t max, 
+                    uint64_t target_usec, std::time_t adjust_interval);
+
+   size_t threshold_stale(const std::string &style) const;
+   size_t threshold_satisfy(const std::string &style) const;
+   size_t threshold_max(const std::string &style) const;
+
+   // record the time a client waited for a tile to be rendered.
+   void record_render(const std::string &style, uint64_t usec);
+
+   // count a decision made for the style.
+   void decided(const std::string &style, queueDecision decision);
+
+   // re-scale the thresholds of each style from the renders seen since
+   // the last adjustment. this is called from record_render() and 
+   // decided() once the adjust interval has passed, so it shouldn't 
+   // normally need calling directly.
+   void adjust();
+
+   // the current scale applied to the style's thresholds.
+   double scale(const std::string &style) const;
+   uint64_t count(const std::string &style, queueDecision decision) const;
+
+   // write out a plain-text table, one line per style.
+   void report(std::ostream &out) const;
+
+   // write the table out to the log at info level.
+   void log() const;
+
+   static const char *decision_name(queueDecision decision);
+
+private:
+   struct style_state
+   {
+      style_state();
+
+      double scale;
+      // render latencies since the last adjustment. if there are too
+      // many then the oldest are overwritten, starting at next.
+      std::vector<uint64_t> samples;
+      size_t next;
+      uint64_t decisions[decisionNumDecisions];
+   };
+
+   size_t scaled(const std::string &style, size_t threshold) const;
+   void maybe_adjust();
+
+   const size_t m_stale, m_satisfy, m_max;
+   const uint64_t m_target;
+   const std::time_t m_adjust_interval;
+   std::time_t m_next_adjust;
+
+   typedef std::map<std::string, style_state> style_map_t;
+   style_map_t m_styles;
+};
+
+} // namespace rendermq
+
+#endif // QUEUE_CONTROLLER_HPP
@@ -0,0 +1,219 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "rate_limiter.hpp"
+
+#include <boost/functional/hash.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+using std::string;
+using boost::optional;
+
+namespace rendermq
+{
+
+namespace
+{
+
+// the longest a client is told to wait, in seconds, which is also 
+// what it's told if the buckets never refill.
+const unsigned max_retry_after = 3600;
+
+// how long, in microseconds, a request may wait for the storage before
+// it's assumed that the answer was lost.
+const uint64_t pending_timeout = 60 * 1000000ULL;
+
+uint64_t hash_client(const string &client)
+{
+   // spread the bits of the string hash out, as it's used both to 
+   // pick a slot and to tell clients apart within a slot.
+   uint64_t h = uint64_t(boost::hash_value(client)) * 0x9e3779b97f4a7c15ULL;
+   h ^= h >> 29;
+   return h;
+}
+
+} // anonymous namespace
+
+const size_t rate_limiter::probe_length;
+
+rate_limiter::rate_limiter(size_t slots, double rate, double burst, double render_cost)
+   : m_rate(rate), m_burst(burst), m_render_cost(render_cost),
+     m_buckets(slots), m_admitted(0), m_rejected(0), m_charged(0), m_evicted(0)
+{
+}
+
+string
+rate_limiter::client_key(const optional<string> &forwarded_for,
+                         const string &remote_addr,
+                         const std::set<string> &trusted_proxies)
+{
+   if (!remote_addr.empty() && (trusted_proxies.count(remote_addr) == 0))
+   {
+      return "addr:" + remote_addr;
+   }
+
+   // proxies append to the header, so going from the right the first
+   // address which wasn't added by a trusted proxy is the client's.
+   string first;
+   if (forwarded_for)
+   {
+      std::vector<string> addrs;
+      boost::split(addrs, *forwarded_for, boost::is_any_of(","));
+      for (std::vector<string>::reverse_iterator itr = addrs.rbegin(); itr != addrs.rend(); ++itr)
+      {
+         string addr = boost::trim_copy(*itr);
+         if (addr.empty())
+         {
+            continue;
+         }
+         if (trusted_proxies.count(addr) == 0)
+         {
+            return "addr:" + addr;
+         }
+         first = addr;
+      }
+   }
+
+   // everything was a trusted proxy, so go by the one furthest out.
+   if (first.empty()) { first = remote_addr; }
+   return first.empty() ? string() : "addr:" + first;
+}
+
+void
+rate_limiter::refill(bucket &b, uint64_t now) const
+{
+   if (now > b.updated)
+   {
+      b.tokens = std::min(m_burst, b.tokens + m_rate * double(now - b.updated) * 1.0e-6);
+      b.updated = now;
+   }
+}
+
+rate_limiter::bucket &
+rate_limiter::find(const string &client, uint64_t now)
+{
+   const uint64_t hash = hash_client(client);
+   const size_t start = size_t(hash % m_buckets.size());
+
+   // either the client's own bucket, or the one which can best be 
+   // given to it: an unused one, or else the one with the most tokens,
+   // which belongs to whichever client has been quietest lately.
+   bucket *victim = NULL;
+   for (size_t i = 0; i < std::min(probe_length, m_buckets.size()); ++i)
+   {
+      bucket &b = m_buckets[(start + i) % m_buckets.size()];
+      if (b.used)
+      {
+         refill(b, now);
+         if (b.hash == hash) { return b; }
+      }
+
+      if ((victim == NULL) || 
+          (victim->used && (!b.used || (b.tokens > victim->tokens))))
+      {
+         victim = &b;
+      }
+   }
+
+   if (victim->used) { ++m_evicted; }
+   victim->hash = hash;
+   victim->tokens = m_burst;
+   victim->updated = now;
+   victim->used = true;
+   return *victim;
+}
+
+bool
+rate_limiter::admit(const string &client, double cost, uint64_t now, unsigned &retry_after)
+{
+   if (m_buckets.empty()) { return true; }
+
+   bucket &b = find(client, now);
+
+   // anything costing more than a full bucket would never get in.
+   cost = std::min(cost, m_burst);
+   if (b.tokens >= cost)
+   {
+      b.tokens -= cost;
+      ++m_admitted;
+      return true;
+   }
+
+   retry_after = max_retry_after;
+   if (m_rate > 0.0)
+   {
+      const double wait = std::ceil((cost - b.tokens) / m_rate);
+      retry_after = unsigned(std::max(1.0, std::min(wait, double(max_retry_after))));
+   }
+   ++m_rejected;
+   return false;
+}
+
+void
+rate_limiter::charge(const string &client, double cost, uint64_t now)
+{
+   if (m_buckets.empty() || (cost <= 0.0)) { return; }
+
+   bucket &b = find(client, now);
+   b.tokens = std::max(-m_burst, b.tokens - cost);
+   ++m_charged;
+}
+
+void
+rate_limiter::pending(int64_t id, uint64_t received, const string &client)
+{
+   if (m_buckets.empty()) { return; }
+
+   while (!m_pending.empty() && 
+          ((m_pending.size() >= m_buckets.size()) ||
+           (m_pending.begin()->first.first + pending_timeout < received)))
+   {
+      m_pending.erase(m_pending.begin());
+   }
+   m_pending[std::make_pair(received, id)] = client;
+}
+
+bool
+rate_limiter::finish(int64_t id, uint64_t received, string &client)
+{
+   pending_map::iterator itr = m_pending.find(std::make_pair(received, id));
+   if (itr == m_pending.end()) { return false; }
+   client.swap(itr->second);
+   m_pending.erase(itr);
+   return true;
+}
+
+void
+rate_limiter::report(std::ostream &out) const
+{
+   out << boost::format("# rate limit slots=%1% admitted=%2% rejected=%3% charged=%4% evicted=%5%\n")
+      % m_buckets.size() % m_admitted % m_rejected % m_charged % m_evicted;
+}
+
+} // namespace rendermq
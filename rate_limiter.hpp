@@ -0,0 +1,145 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RATE_LIMITER_HPP
+#define RATE_LIMITER_HPP
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <boost/optional.hpp>
+
+namespace rendermq
+{
+
+/* per-client token buckets, so that one client asking for a lot of
+ * tiles gets turned away before it fills the render queue for 
+ * everyone else.
+ *
+ * each request takes a token from its client's bucket, and requests
+ * which turn out to need rendering are charged extra. the buckets are
+ * kept in a fixed-size hash table, so the memory used doesn't depend
+ * on how many clients there are. when a table slot is needed for a
+ * new client the most idle of the clients nearby is forgotten, which
+ * is harmless once its bucket has filled back up.
+ *
+ * this is only touched from the handler's main loop, so there's no
+ * locking.
+ */
+class rate_limiter
+{
+public:
+   /* @param slots the number of buckets in the table, or zero to
+    *    disable rate limiting.
+    * @param rate tokens added to each bucket per second.
+    * @param burst the most tokens a bucket can hold.
+    * @param render_cost total tokens charged for a request which 
+    *    needs rendering, including the one taken when it arrived.
+    */
+   rate_limiter(size_t slots, double rate, double burst, double render_cost);
+
+   bool enabled() const { return !m_buckets.empty(); }
+   double render_cost() const { return m_render_cost; }
+
+   /* the key identifying the client a request came from. this is the
+    * address of the peer, unless that's one of the trusted proxies, in
+    * which case it's the rightmost address in X-Forwarded-For which 
+    * isn't a trusted proxy. anything to the left of that could have 
+    * been made up by the client. an empty remote_addr means that the
+    * request came through mongrel2, which adds the peer's address to 
+    * X-Forwarded-For itself, so is trusted too. if there's no address
+    * at all, which can only happen through mongrel2, the key is empty
+    * and the caller has to find some other way to tell clients apart.
+    */
+   static std::string client_key(const boost::optional<std::string> &forwarded_for,
+                                 const std::string &remote_addr,
+                                 const std::set<std::string> &trusted_proxies);
+
+   /* take cost tokens from the client's bucket, returning false if
+    * there aren't enough, in which case nothing is taken and 
+    * retry_after is set to the number of seconds until there will be.
+    *
+    * @param now a monotonic time in microseconds, as tile_trace::now().
+    */
+   bool admit(const std::string &client, double cost, uint64_t now, unsigned &retry_after);
+
+   /* take cost tokens from the client's bucket after the request has
+    * been let in, when it turns out to be more expensive. the bucket
+    * can go into debt, down to minus the burst size.
+    */
+   void charge(const std::string &client, double cost, uint64_t now);
+
+   // remember which client a request sent to the storage came from, 
+   // so that it can be charged for rendering when the answer comes 
+   // back. requests are told apart by the connection id and the time
+   // they were received, as ids are reused by keep-alive connections.
+   // requests which the storage hasn't answered after pending_timeout
+   // are forgotten, as is the oldest when there are too many.
+   void pending(int64_t id, uint64_t received, const std::string &client);
+
+   // forget a request sent to the storage, returning its client if
+   // it was remembered.
+   bool finish(int64_t id, uint64_t received, std::string &client);
+
+   uint64_t admitted() const { return m_admitted; }
+   uint64_t rejected() const { return m_rejected; }
+
+   // write out a plain-text summary line.
+   void report(std::ostream &out) const;
+
+private:
+   // how many slots from the hashed one a client may live in.
+   static const size_t probe_length = 4;
+
+   struct bucket
+   {
+      bucket() : hash(0), tokens(0.0), updated(0), used(false) {}
+
+      uint64_t hash;
+      double tokens;
+      uint64_t updated;
+      bool used;
+   };
+
+   bucket &find(const std::string &client, uint64_t now);
+   void refill(bucket &b, uint64_t now) const;
+
+   const double m_rate, m_burst, m_render_cost;
+   std::vector<bucket> m_buckets;
+
+   // requests waiting for the storage, oldest first. bounded by the
+   // table size.
+   typedef std::map<std::pair<uint64_t, int64_t>, std::string> pending_map;
+   pending_map m_pending;
+
+   uint64_t m_admitted, m_rejected, m_charged, m_evicted;
+};
+
+} // namespace rendermq
+
+#endif // RATE_LIMITER_HPP
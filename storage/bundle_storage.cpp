@@ -0,0 +1,505 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "bundle_storage.hpp"
+#include "disk_storage.hpp"
+#include "meta_tile.hpp"
+#include "null_handle.hpp"
+#include "../logging/logger.hpp"
+
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <boost/static_assert.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+namespace fs = boost::filesystem;
+
+#define BUNDLE_MAGIC "BNDL"
+#define BUNDLE_VERSION (1)
+
+// the largest amount of a metatile copied at once when compacting.
+#define COPY_BUFFER_SIZE (1 << 20)
+
+namespace rendermq 
+{
+
+namespace 
+{
+
+tile_storage *create_bundle_storage(boost::property_tree::ptree const &pt,
+                                    boost::optional<zmq::context_t &> ctx)
+{
+   boost::optional<string> dir = pt.get_optional<string>("tile_dir");
+   double compact_ratio = pt.get<double>("compact_percent", 50.0) / 100.0;
+   bool sync = pt.get<bool>("sync", true);
+   if (dir)
+   {
+      return new bundle_storage(*dir, compact_ratio, sync);
+   }
+   return 0;
+}
+
+const bool registered = register_tile_storage("bundle", create_bundle_storage);
+
+// entries are kept to a size which divides a disk sector, so that each 
+// one is written in a single sector.
+BOOST_STATIC_ASSERT(sizeof(bundle_storage::header) == 64);
+BOOST_STATIC_ASSERT(sizeof(bundle_storage::entry) == 32);
+
+const off_t index_start = sizeof(bundle_storage::header);
+const off_t data_start = index_start + BUNDLE_SIZE * BUNDLE_SIZE * sizeof(bundle_storage::entry);
+
+// closes a file descriptor when it goes out of scope.
+struct fd_closer
+{
+   explicit fd_closer(int f) : fd(f) {}
+   ~fd_closer() { if (fd >= 0) { close(fd); } }
+   int fd;
+};
+
+bool write_fully(int fd, const char *buf, size_t len, off_t offset)
+{
+   size_t pos = 0;
+   while (pos < len)
+   {
+      ssize_t put = pwrite(fd, buf + pos, len - pos, offset + pos);
+      if (put <= 0) { return false; }
+      pos += put;
+   }
+   return true;
+}
+
+bool read_header(int fd, bundle_storage::header &h)
+{
+   return (read_fully(fd, (char *)&h, sizeof(h), 0) == ssize_t(sizeof(h))) && h.magic_ok();
+}
+
+// reads the index entry, returning false if the metatile is missing or
+// the entry is no good. the index isn't trusted at all unless the file 
+// starts with the bundle magic.
+bool read_entry(int fd, int index, bundle_storage::entry &e)
+{
+   bundle_storage::header h;
+   return read_header(fd, h) &&
+      (read_fully(fd, (char *)&e, sizeof(e), index_start + index * sizeof(e)) == ssize_t(sizeof(e))) &&
+      (e.size > 0) && (e.check == e.checksum());
+}
+
+bool write_entry(int fd, int index, bundle_storage::entry &e)
+{
+   e.check = e.checksum();
+   return write_fully(fd, (const char *)&e, sizeof(e), index_start + index * sizeof(e));
+}
+
+// flushes the directory entries of the directory containing path, so 
+// that a file renamed into it stays renamed after a crash.
+bool sync_dir(const string &path)
+{
+   fd_closer dir(open(fs::path(path).parent_path().c_str(), O_RDONLY | O_DIRECTORY));
+   return (dir.fd >= 0) && (fsync(dir.fd) == 0);
+}
+
+} // anonymous namespace
+
+bool
+bundle_storage::header::magic_ok() const
+{
+   return memcmp(magic, BUNDLE_MAGIC, sizeof(magic)) == 0;
+}
+
+uint32_t
+bundle_storage::entry::checksum() const
+{
+   return uint32_t(tile_digest((const char *)this, offsetof(entry, check)));
+}
+
+bundle_storage::bundle_storage(const string &dir, double compact_ratio, bool sync)
+   : m_dir(dir), m_compact_ratio(compact_ratio), m_sync(sync)
+{
+}
+
+bundle_storage::~bundle_storage()
+{
+}
+
+std::pair<string, int>
+bundle_storage::bundle_path(const tile_protocol &tile) const
+{
+   const int mx = tile.x / METATILE, my = tile.y / METATILE;
+   const string path = (boost::format("%1%/%2%/%3%/%4%/%5%.bundle") % m_dir % tile.style % tile.z 
+                        % (mx / BUNDLE_SIZE) % (my / BUNDLE_SIZE)).str();
+   return std::make_pair(path, (my % BUNDLE_SIZE) * BUNDLE_SIZE + (mx % BUNDLE_SIZE));
+}
+
+shared_ptr<tile_storage::handle> 
+bundle_storage::get(const tile_protocol &tile) const
+{
+   std::pair<string, int> bundle = bundle_path(tile);
+   fd_closer file(open(bundle.first.c_str(), O_RDONLY));
+   entry e;
+   if ((file.fd >= 0) && read_entry(file.fd, bundle.second, e))
+   {
+      // the metatile is laid out just as a metatile file on disk is.
+      char header[metaTile::max_headers_size];
+      ssize_t len = read_fully(file.fd, header, std::min(size_t(e.size), sizeof(header)), e.offset);
+      size_t offset = 0, size = 0;
+      bool gzipped = false;
+      if ((len > 0) && 
+          (find_in_meta(bundle.first.c_str(), header, len, tile.format, 
+                        xyz_to_meta_offset(tile.x, tile.y, tile.z), offset, size, &gzipped) == 0) &&
+          (size > 0) && (offset <= e.size) && (size <= e.size - offset))
+      {
+         string data(size, '\0');
+         if (offset + size <= size_t(len))
+         {
+            memcpy(&data[0], header + offset, size);
+         }
+         else if (read_fully(file.fd, &data[0], size, e.offset + offset) != ssize_t(size))
+         {
+            data.clear();
+         }
+         if (!data.empty())
+         {
+            return shared_ptr<tile_storage::handle>(new disk_storage::data_handle(e.timestamp, data, gzipped));
+         }
+      }
+   }
+
+   return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+bool 
+bundle_storage::get_meta(const tile_protocol &tile, string &data) const
+{
+   std::pair<string, int> bundle = bundle_path(tile);
+   fd_closer file(open(bundle.first.c_str(), O_RDONLY));
+   entry e;
+   // as with disk, expired metatiles aren't returned.
+   if ((file.fd < 0) || !read_entry(file.fd, bundle.second, e) || (e.timestamp == 0))
+   {
+      return false;
+   }
+
+   data.resize(e.size);
+   if (read_fully(file.fd, &data[0], e.size, e.offset) != ssize_t(e.size))
+   {
+      LOG_ERROR(boost::format("Short read of metatile %1% from bundle %2%") % bundle.second % bundle.first);
+      return false;
+   }
+   // the digests are for storage's own use, so aren't passed on.
+   data.resize(data.size() - digests_size(data));
+   return true;
+}
+
+bool 
+bundle_storage::put_meta(const tile_protocol &tile, const string &buf) const
+{
+   std::time_t stored;
+   return put_meta_stamped(tile, buf, stored);
+}
+
+bool 
+bundle_storage::put_meta_stamped(const tile_protocol &tile, const string &buf, std::time_t &stored) const
+{
+   if (xyz_to_meta_offset(tile.x, tile.y, tile.z) != 0)
+   {
+#ifdef RENDERMQ_DEBUG
+      LOG_ERROR("Attempt to save tile at non-metatile boundary.");
+#endif
+      return false;
+   }
+
+   return write_locked(tile, true, boost::bind(&bundle_storage::append, this, _1, _2, 
+                                               bundle_path(tile).second, boost::cref(buf),
+                                               std::time(NULL), true, boost::ref(stored)));
+}
+
+bool 
+bundle_storage::put_meta_at(const tile_protocol &tile, const string &buf, std::time_t timestamp) const
+{
+   if (xyz_to_meta_offset(tile.x, tile.y, tile.z) != 0)
+   {
+      return false;
+   }
+
+   std::time_t stored;
+   return write_locked(tile, true, boost::bind(&bundle_storage::append, this, _1, _2, 
+                                               bundle_path(tile).second, boost::cref(buf),
+                                               timestamp, false, boost::ref(stored)));
+}
+
+bool 
+bundle_storage::expire(const tile_protocol &tile) const
+{
+   return write_locked(tile, false, boost::bind(&bundle_storage::expire_locked, this, _1, _2, 
+                                                bundle_path(tile).second));
+}
+
+bool 
+bundle_storage::compact(const tile_protocol &tile) const
+{
+   return write_locked(tile, false, boost::bind(&bundle_storage::compact_locked, this, _1, _2));
+}
+
+bool
+bundle_storage::write_locked(const tile_protocol &tile, bool create, const write_fn &fn) const
+{
+   const string path = bundle_path(tile).first;
+   if (create)
+   {
+      try 
+      {
+         fs::create_directories(fs::path(path).parent_path());
+      }
+      catch (const fs::filesystem_error &e) 
+      {
+         LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
+         return false;
+      }
+   }
+
+   while (true)
+   {
+      fd_closer file(open(path.c_str(), create ? (O_RDWR | O_CREAT) : O_RDWR, 0644));
+      if (file.fd < 0)
+      {
+         if (create || (errno != ENOENT))
+         {
+            LOG_ERROR(boost::format("Can't open bundle %1%: %2%") % path % strerror(errno));
+         }
+         return false;
+      }
+      if (flock(file.fd, LOCK_EX) != 0)
+      {
+         LOG_ERROR(boost::format("Can't lock bundle %1%: %2%") % path % strerror(errno));
+         return false;
+      }
+
+      // the bundle might have been compacted, and so replaced, while
+      // this was waiting for the lock. if so, then start again with the
+      // new one.
+      struct stat st, path_st;
+      if ((fstat(file.fd, &st) != 0) || (stat(path.c_str(), &path_st) != 0))
+      {
+         return false;
+      }
+      if ((st.st_dev != path_st.st_dev) || (st.st_ino != path_st.st_ino))
+      {
+         continue;
+      }
+
+      // a new bundle gets a header and an index of empty entries. 
+      // a full-sized file without the magic isn't a bundle, so is left alone.
+      header existing;
+      if ((st.st_size >= data_start) && !read_header(file.fd, existing))
+      {
+         LOG_ERROR(boost::format("Bundle %1% has the wrong magic, not writing to it.") % path);
+         return false;
+      }
+      if (st.st_size < data_start)
+      {
+         header h;
+         memset(&h, 0, sizeof(h));
+         memcpy(h.magic, BUNDLE_MAGIC, sizeof(h.magic));
+         h.version = BUNDLE_VERSION;
+         h.size = BUNDLE_SIZE;
+         h.z = tile.z;
+         h.x = (tile.x / METATILE) & ~(BUNDLE_SIZE - 1);
+         h.y = (tile.y / METATILE) & ~(BUNDLE_SIZE - 1);
+         if (!write_fully(file.fd, (const char *)&h, sizeof(h), 0) || (ftruncate(file.fd, data_start) != 0))
+         {
+            LOG_ERROR(boost::format("Can't create bundle %1%: %2%") % path % strerror(errno));
+            return false;
+         }
+      }
+
+      return fn(file.fd, path);
+   }
+}
+
+bool
+bundle_storage::append(int fd, const string &path, int index, const string &buf, 
+                       std::time_t timestamp, bool keep_timestamp, std::time_t &stored) const
+{
+   // as with disk, if the tiles are exactly the same as the ones already
+   // stored then keep the time they were first stored.
+   entry old;
+   const bool replacing = read_entry(fd, index, old);
+   vector<meta_digest> digests = make_digests(buf, timestamp);
+   vector<meta_digest> old_digests;
+   if (keep_timestamp && replacing && 
+       read_digests(fd, old.offset, old.size, old_digests) &&
+       same_digests(digests, old_digests) &&
+       (old_digests.front().timestamp > 0)) 
+   {
+      timestamp = old_digests.front().timestamp;
+      BOOST_FOREACH(meta_digest &d, digests) 
+      {
+         d.timestamp = timestamp;
+      }
+   }
+
+   string data(buf, 0, buf.size() - digests_size(buf));
+   data.append(write_digests(digests));
+
+   // the metatile goes at the end, and must be safely there before the
+   // index points to it.
+   struct stat st;
+   if ((fstat(fd, &st) != 0) || !write_fully(fd, data.data(), data.size(), st.st_size) ||
+       (m_sync && (fdatasync(fd) != 0)))
+   {
+      LOG_ERROR(boost::format("Can't write metatile to bundle %1%: %2%") % path % strerror(errno));
+      return false;
+   }
+
+   entry e;
+   memset(&e, 0, sizeof(e));
+   e.offset = st.st_size;
+   e.timestamp = timestamp;
+   e.size = data.size();
+   if (!write_entry(fd, index, e))
+   {
+      LOG_ERROR(boost::format("Can't write index of bundle %1%: %2%") % path % strerror(errno));
+      return false;
+   }
+   stored = timestamp;
+
+   if (replacing)
+   {
+      header h;
+      if (read_header(fd, h))
+      {
+         h.garbage += old.size;
+         write_fully(fd, (const char *)&h, sizeof(h), 0);
+
+         const off_t used = st.st_size + data.size() - data_start;
+         if ((m_compact_ratio > 0.0) && (h.garbage > m_compact_ratio * used))
+         {
+            compact_locked(fd, path);
+         }
+      }
+   }
+
+   return true;
+}
+
+bool
+bundle_storage::expire_locked(int fd, const string &path, int index) const
+{
+   // as with disk, an expired metatile is one with a zero timestamp.
+   entry e;
+   if (!read_entry(fd, index, e))
+   {
+      return false;
+   }
+   e.timestamp = 0;
+   if (!write_entry(fd, index, e))
+   {
+      LOG_ERROR(boost::format("Can't write index of bundle %1%: %2%") % path % strerror(errno));
+      return false;
+   }
+   return true;
+}
+
+bool
+bundle_storage::compact_locked(int fd, const string &path) const
+{
+   header h;
+   vector<entry> index(BUNDLE_SIZE * BUNDLE_SIZE);
+   const size_t index_size = index.size() * sizeof(entry);
+   if (!read_header(fd, h) ||
+       (read_fully(fd, (char *)&index[0], index_size, index_start) != ssize_t(index_size)))
+   {
+      LOG_ERROR(boost::format("Can't read index of bundle %1% to compact it.") % path);
+      return false;
+   }
+
+   // the current metatiles are copied into a new bundle, which then 
+   // replaces this one. writers waiting on this one's lock will notice
+   // that and go to the new one.
+   const string tmp = (fs::path(path).parent_path() / fs::unique_path()).native();
+   fd_closer out(open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644));
+   if (out.fd < 0)
+   {
+      LOG_ERROR(boost::format("Can't create %1% to compact bundle: %2%") % tmp % strerror(errno));
+      return false;
+   }
+
+   bool ok = true;
+   off_t end = data_start;
+   vector<char> copy(COPY_BUFFER_SIZE);
+   for (size_t i = 0; ok && (i < index.size()); ++i)
+   {
+      entry &e = index[i];
+      if ((e.size == 0) || (e.check != e.checksum()))
+      {
+         memset(&e, 0, sizeof(e));
+         continue;
+      }
+      for (size_t pos = 0; ok && (pos < e.size); pos += copy.size())
+      {
+         const size_t len = std::min(copy.size(), size_t(e.size - pos));
+         ok = (read_fully(fd, &copy[0], len, e.offset + pos) == ssize_t(len)) &&
+            write_fully(out.fd, &copy[0], len, end + pos);
+      }
+      e.offset = end;
+      e.check = e.checksum();
+      end += e.size;
+   }
+
+   h.garbage = 0;
+   ok = ok && write_fully(out.fd, (const char *)&h, sizeof(h), 0) &&
+      write_fully(out.fd, (const char *)&index[0], index_size, index_start) &&
+      (ftruncate(out.fd, end) == 0) && 
+      (!m_sync || (fdatasync(out.fd) == 0)) &&
+      (rename(tmp.c_str(), path.c_str()) == 0);
+
+   if (!ok)
+   {
+      LOG_ERROR(boost::format("Can't compact bundle %1%: %2%") % path % strerror(errno));
+      unlink(tmp.c_str());
+   }
+   // the new bundle is in place either way, but until the rename is on
+   // disk a crash could bring back the old one.
+   else if (m_sync && !sync_dir(path))
+   {
+      LOG_ERROR(boost::format("Can't sync directory of compacted bundle %1%: %2%") % path % strerror(errno));
+   }
+   return ok;
+}
+
+} // namespace rendermq
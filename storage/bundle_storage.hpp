@@ -0,0 +1,137 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_BUNDLE_STORAGE_HPP
+#define RENDERMQ_BUNDLE_STORAGE_HPP
+
+#include "tile_storage.hpp"
+#include <string>
+#include <ctime>
+#include <stdint.h>
+
+// how many metatiles along each side of a bundle.
+#define BUNDLE_SIZE 128
+
+namespace rendermq 
+{
+
+/* stores metatiles packed together into bundle files, each of which 
+ * holds a square of BUNDLE_SIZE by BUNDLE_SIZE metatiles of one style
+ * and zoom. this keeps the number of files, and so inodes and 
+ * directory entries, manageable for a whole planet's worth of tiles.
+ *
+ * a bundle starts with a header and an index with a fixed-size entry
+ * for each metatile, giving where its data is and its timestamp. the
+ * metatiles themselves are stored as disk storage stores them, digests
+ * and all, and are only ever appended. a metatile is replaced by 
+ * appending the new one and then pointing its index entry at it, so a
+ * crash part way through leaves either the old or the new metatile.
+ * entries carry a checksum so that a torn write of one is seen as the
+ * metatile being missing.
+ *
+ * writers lock the bundle while they change it. when replaced 
+ * metatiles take up more than compact_ratio of a bundle, it's rewritten
+ * with only the current ones and renamed into place. readers don't 
+ * lock, as data which they might be reading is never overwritten.
+ *
+ * as with disk storage, expired metatiles are given a timestamp of 
+ * zero.
+ */
+class bundle_storage 
+   : public tile_storage
+{
+public:
+   // if sync is set, then metatiles are flushed to disk before the 
+   // index is changed to point to them, and compacted bundles before
+   // they're renamed into place, with the rename itself flushed after.
+   bundle_storage(const std::string &dir, double compact_ratio = 0.5, bool sync = true);
+   ~bundle_storage();
+
+   boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+   bool get_meta(const tile_protocol &tile, std::string &data) const;
+   bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+   bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
+   bool expire(const tile_protocol &tile) const;
+
+   // store a metatile with the given timestamp, e.g: when converting
+   // from another storage, rather than the current time.
+   bool put_meta_at(const tile_protocol &tile, const std::string &buf, std::time_t timestamp) const;
+
+   // rewrite the bundle containing the tile with only the current 
+   // metatiles in it, returning false if that couldn't be done.
+   bool compact(const tile_protocol &tile) const;
+
+   // the path of the bundle containing the tile, and the index of the
+   // tile's metatile within it.
+   std::pair<std::string, int> bundle_path(const tile_protocol &tile) const;
+
+   // on-disk layout of a bundle. all of it is in host byte order.
+   struct header
+   {
+      char magic[4];
+      int32_t version;
+      // metatiles along each side, and the zoom and position in 
+      // metatiles of the top-left one.
+      int32_t size, z, x, y;
+      // bytes taken up by replaced metatiles. this is only a hint for
+      // when to compact, and may be too low after a crash.
+      uint64_t garbage;
+      char reserved[32];
+
+      bool magic_ok() const;
+   };
+
+   struct entry
+   {
+      uint64_t offset;
+      int64_t timestamp;
+      uint32_t size;
+      uint32_t check;
+      uint64_t reserved;
+
+      // checksum of the other fields.
+      uint32_t checksum() const;
+   };
+
+private:
+   typedef boost::function<bool (int, const std::string &)> write_fn;
+
+   // run the function on the fd and path of the bundle containing the
+   // tile, opened for writing and locked. if create is set, the bundle
+   // is created if it doesn't exist yet.
+   bool write_locked(const tile_protocol &tile, bool create, const write_fn &fn) const;
+   bool append(int fd, const std::string &path, int index, const std::string &buf, 
+               std::time_t timestamp, bool keep_timestamp, std::time_t &stored) const;
+   bool expire_locked(int fd, const std::string &path, int index) const;
+   bool compact_locked(int fd, const std::string &path) const;
+
+   const std::string m_dir;
+   const double m_compact_ratio;
+   const bool m_sync;
+};
+
+} // namespace rendermq
+
+#endif // RENDERMQ_BUNDLE_STORAGE_HPP
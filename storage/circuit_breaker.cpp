@@ -0,0 +1,239 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "circuit_breaker.hpp"
+#include "../logging/logger.hpp"
+#include <map>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+
+using boost::shared_ptr;
+using std::string;
+namespace pt = boost::property_tree;
+
+namespace 
+{
+
+// the breakers shared by name between storage objects.
+typedef std::map<string, shared_ptr<rendermq::circuit_breaker> > breaker_map_t;
+boost::mutex registry_mutex;
+breaker_map_t registry;
+
+} // anonymous namespace
+
+namespace rendermq 
+{
+
+circuit_breaker::config::config()
+   : consecutive_failures(5), error_rate(0.5), window(100), min_requests(20),
+     slow_time(5000), open_time(30)
+{
+}
+
+circuit_breaker::config::config(const pt::ptree &conf, const config &defaults)
+   : consecutive_failures(conf.get<unsigned int>("breaker_consecutive_failures", defaults.consecutive_failures)),
+     error_rate(conf.get<double>("breaker_error_percent", defaults.error_rate * 100.0) / 100.0),
+     window(conf.get<size_t>("breaker_window", defaults.window)),
+     min_requests(conf.get<size_t>("breaker_min_requests", defaults.min_requests)),
+     slow_time(conf.get<long>("breaker_slow_time", defaults.slow_time)),
+     open_time(conf.get<int>("breaker_open_time", defaults.open_time))
+{
+}
+
+circuit_breaker::circuit_breaker(const string &name, const config &conf)
+   : m_name(name), m_config(conf), m_state(closed), m_retry_time(0),
+     m_next_outcome(0), m_window_failures(0), m_consecutive(0),
+     m_latency(conf.window), m_requests(0), m_failures(0), m_rejected(0), m_trips(0)
+{
+}
+
+bool
+circuit_breaker::allow(std::time_t now)
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+
+   if (m_state == closed)
+   {
+      return true;
+   }
+
+   // open, or half-open with a probe outstanding. once it's time, a 
+   // probe is let through, and another one if that's never heard of
+   // again.
+   if (now >= m_retry_time)
+   {
+      m_state = half_open;
+      m_retry_time = now + m_config.open_time;
+      return true;
+   }
+
+   ++m_rejected;
+   return false;
+}
+
+bool
+circuit_breaker::available(std::time_t now) const
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+   return (m_state == closed) || (now >= m_retry_time);
+}
+
+void
+circuit_breaker::record(bool success, long msec, std::time_t now)
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+
+   if ((m_config.slow_time > 0) && (msec > m_config.slow_time))
+   {
+      success = false;
+   }
+
+   ++m_requests;
+   if (!success) { ++m_failures; }
+   if (msec >= 0) { m_latency.record(msec); }
+
+   if (m_state == half_open)
+   {
+      // the probe decides which way the breaker goes.
+      if (success) { reset(); } else { trip(now); }
+      return;
+   }
+   else if (m_state == open)
+   {
+      // a request from before the breaker opened, which doesn't 
+      // change anything now.
+      return;
+   }
+
+   // an empty window only leaves the consecutive failure limit.
+   if (m_outcomes.size() < m_config.window)
+   {
+      m_outcomes.push_back(success);
+      if (!success) { ++m_window_failures; }
+   }
+   else if (m_config.window > 0)
+   {
+      if (!m_outcomes[m_next_outcome]) { --m_window_failures; }
+      m_outcomes[m_next_outcome] = success;
+      m_next_outcome = (m_next_outcome + 1) % m_config.window;
+      if (!success) { ++m_window_failures; }
+   }
+   m_consecutive = success ? 0 : (m_consecutive + 1);
+
+   bool too_many_consecutive = 
+      (m_config.consecutive_failures > 0) && (m_consecutive >= m_config.consecutive_failures);
+   bool too_high_rate = 
+      (m_config.error_rate > 0.0) && !m_outcomes.empty() && (m_outcomes.size() >= m_config.min_requests) &&
+      (m_window_failures >= m_config.error_rate * m_outcomes.size());
+
+   if (too_many_consecutive || too_high_rate)
+   {
+      trip(now);
+   }
+}
+
+circuit_breaker::state_t
+circuit_breaker::state() const
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+   return m_state;
+}
+
+void
+circuit_breaker::report(std::ostream &out) const
+{
+   boost::mutex::scoped_lock lock(m_mutex);
+   out << boost::format("# circuit breaker %1% state=%2% requests=%3% failures=%4% "
+                        "rejected=%5% trips=%6% p50=%7%ms p95=%8%ms\n")
+      % m_name % state_name(m_state) % m_requests % m_failures % m_rejected % m_trips
+      % m_latency.quantile(0.5) % m_latency.quantile(0.95);
+}
+
+shared_ptr<circuit_breaker>
+circuit_breaker::named(const string &name, const config &conf)
+{
+   boost::mutex::scoped_lock lock(registry_mutex);
+   breaker_map_t::iterator itr = registry.find(name);
+   if (itr == registry.end())
+   {
+      shared_ptr<circuit_breaker> breaker(new circuit_breaker(name, conf));
+      itr = registry.insert(std::make_pair(name, breaker)).first;
+   }
+   return itr->second;
+}
+
+void
+circuit_breaker::report_all(std::ostream &out)
+{
+   boost::mutex::scoped_lock lock(registry_mutex);
+   BOOST_FOREACH(const breaker_map_t::value_type &entry, registry)
+   {
+      entry.second->report(out);
+   }
+}
+
+const char *
+circuit_breaker::state_name(state_t state)
+{
+   switch (state)
+   {
+   case closed:    return "closed";
+   case open:      return "open";
+   case half_open: return "half-open";
+   }
+   return "unknown";
+}
+
+void
+circuit_breaker::trip(std::time_t now)
+{
+   if (m_state == closed)
+   {
+      LOG_WARNING(boost::format("Circuit breaker %1% opened after %2% failures of the last %3% requests, "
+                                "retrying in %4%s.")
+                  % m_name % m_window_failures % m_outcomes.size() % m_config.open_time);
+      ++m_trips;
+   }
+   else if (m_state == half_open)
+   {
+      LOG_INFO(boost::format("Circuit breaker %1% probe failed, retrying in %2%s.") 
+               % m_name % m_config.open_time);
+   }
+   m_state = open;
+   m_retry_time = now + m_config.open_time;
+}
+
+void
+circuit_breaker::reset()
+{
+   LOG_INFO(boost::format("Circuit breaker %1% closed again.") % m_name);
+   m_state = closed;
+   m_outcomes.clear();
+   m_next_outcome = 0;
+   m_window_failures = 0;
+   m_consecutive = 0;
+}
+
+} // namespace rendermq
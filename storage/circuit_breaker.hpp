@@ -0,0 +1,137 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_CIRCUIT_BREAKER_HPP
+#define RENDERMQ_CIRCUIT_BREAKER_HPP
+
+#include "latency_window.hpp"
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace rendermq 
+{
+
+/* tracks the recent errors and latencies of a backend, and stops 
+ * requests going to it when it's failing, so that they fail fast
+ * rather than each waiting for a timeout.
+ *
+ * the breaker starts closed, letting everything through. too many
+ * failures open it, after which nothing is let through until 
+ * open_time has passed. then it's half-open, and a probe request is
+ * let through at a time. a successful probe closes the breaker and a
+ * failed one opens it again.
+ *
+ * breakers are shared between threads, so they lock internally.
+ */
+class circuit_breaker
+{
+public:
+   enum state_t { closed, open, half_open };
+
+   struct config
+   {
+      config();
+      // read the config from "breaker_" prefixed keys in the tree, 
+      // defaulting to the values in this config.
+      config(const boost::property_tree::ptree &pt, const config &defaults = config());
+
+      // consecutive failures which open the breaker, zero for no limit.
+      unsigned int consecutive_failures;
+      // fraction of failures amongst the most recent 'window' requests 
+      // which opens the breaker, once there have been min_requests.
+      double error_rate;
+      size_t window, min_requests;
+      // milliseconds after which a successful request still counts as a 
+      // failure, zero for no limit. defaults to five seconds.
+      long slow_time;
+      // seconds to stay open before letting a probe through.
+      int open_time;
+   };
+
+   circuit_breaker(const std::string &name, const config &conf);
+
+   // whether a request can go to the backend now. each request which is
+   // let through should have its outcome recorded, although a probe 
+   // which never is will be given up on after open_time.
+   bool allow(std::time_t now);
+
+   // whether allow() would let a request through, without it counting
+   // as the probe if the breaker is half-open.
+   bool available(std::time_t now) const;
+
+   // record the outcome of a request and how long it took, or a
+   // negative time if that isn't known.
+   void record(bool success, long msec, std::time_t now);
+
+   state_t state() const;
+   const std::string &name() const { return m_name; }
+
+   // write out a plain-text summary line.
+   void report(std::ostream &out) const;
+
+   // the breaker with the given name, which is created with the config
+   // if there isn't one already. this lets the storage objects in each
+   // thread share what they know about a backend.
+   static boost::shared_ptr<circuit_breaker> named(const std::string &name, const config &conf);
+
+   // write out a summary line for each of the named breakers.
+   static void report_all(std::ostream &out);
+
+   static const char *state_name(state_t state);
+
+private:
+   void trip(std::time_t now);
+   void reset();
+
+   const std::string m_name;
+   const config m_config;
+
+   mutable boost::mutex m_mutex;
+   state_t m_state;
+
+   // when the breaker can next let a probe through, whilst open or
+   // half-open with a probe outstanding.
+   std::time_t m_retry_time;
+
+   // outcomes of the most recent requests, as a ring buffer, and the
+   // number of those which failed.
+   std::vector<bool> m_outcomes;
+   size_t m_next_outcome, m_window_failures;
+   unsigned int m_consecutive;
+   latency_window m_latency;
+
+   // totals since the breaker was created.
+   uint64_t m_requests, m_failures, m_rejected, m_trips;
+};
+
+} // namespace rendermq
+
+#endif // RENDERMQ_CIRCUIT_BREAKER_HPP
@@ -0,0 +1,263 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "circuit_breaker_storage.hpp"
+#include "null_handle.hpp"
+#include <stdexcept>
+#include <ctime>
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using boost::shared_ptr;
+using std::string;
+using std::vector;
+namespace pt = boost::property_tree;
+
+namespace 
+{
+
+rendermq::tile_storage *create_circuit_breaker_storage(const pt::ptree &conf, 
+                                                       boost::optional<zmq::context_t &> ctx)
+{
+   using rendermq::circuit_breaker;
+   using rendermq::circuit_breaker_storage;
+   using rendermq::tile_storage;
+
+   string storage = conf.get<string>("storage");
+   string name = conf.get<string>("breaker_name", storage);
+
+   // create a new property tree for the sub storage to use.
+   pt::ptree sub_conf = conf.get_child(storage, pt::ptree());
+
+   // the substring that we want to match is the name, plus a dot
+   // as a separator - the rest is the key that the sub storage 
+   // instance will be looking for.
+   storage.append(".");
+
+   BOOST_FOREACH(pt::ptree::value_type entry, conf) 
+   {
+      if (entry.first.compare(0, storage.size(), storage) == 0)
+      {
+         // use semi-colon as a path separator we're not likely to 
+         // see, since that is the comment character for INI files.
+         boost::property_tree::path_of<string>::type p(entry.first, ';');
+         
+         sub_conf.put(entry.first.substr(storage.size()), conf.get<string>(p));
+      }
+   }
+
+   // attempt to create the storage
+   tile_storage *ptr = rendermq::get_tile_storage(sub_conf, ctx);
+
+   if (ptr == NULL)
+   {
+      throw std::runtime_error("Failed to create storage for circuit breaker.");
+   }
+
+   // the breaker is shared with the storage objects in the other 
+   // threads which have the same name.
+   return new circuit_breaker_storage(shared_ptr<tile_storage>(ptr),
+                                      circuit_breaker::named(name, circuit_breaker::config(conf)));
+}
+
+const bool registered = register_tile_storage("circuit_breaker", create_circuit_breaker_storage);
+
+/* times a request to the underlying storage and records its outcome 
+ * with the breaker. if an exception escapes before the outcome has 
+ * been recorded then that counts as a failure.
+ */
+class outcome
+{
+public:
+   outcome(rendermq::circuit_breaker &breaker)
+      : m_breaker(breaker), m_start(boost::posix_time::microsec_clock::universal_time()), 
+        m_recorded(false) {}
+
+   ~outcome() 
+   {
+      if (!m_recorded) { record(false); }
+   }
+
+   void record(bool success)
+   {
+      long msec = (boost::posix_time::microsec_clock::universal_time() - m_start).total_milliseconds();
+      m_breaker.record(success, msec, std::time(NULL));
+      m_recorded = true;
+   }
+
+private:
+   rendermq::circuit_breaker &m_breaker;
+   boost::posix_time::ptime m_start;
+   bool m_recorded;
+};
+
+} // anonymous namespace
+
+namespace rendermq 
+{
+
+circuit_breaker_storage::circuit_breaker_storage(shared_ptr<tile_storage> storage,
+                                                 shared_ptr<circuit_breaker> breaker)
+   : m_storage(storage), m_breaker(breaker)
+{
+}
+
+circuit_breaker_storage::~circuit_breaker_storage()
+{
+}
+
+shared_ptr<tile_storage::handle> 
+circuit_breaker_storage::get(const tile_protocol &tile) const
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return shared_ptr<tile_storage::handle>(new null_handle());
+   }
+
+   outcome o(*m_breaker);
+   shared_ptr<tile_storage::handle> handle = m_storage->get(tile);
+   o.record(!m_storage->last_error());
+   return handle;
+}
+
+shared_ptr<tile_storage::handle> 
+circuit_breaker_storage::probe(const tile_protocol &tile) const
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return shared_ptr<tile_storage::handle>(new null_handle());
+   }
+
+   outcome o(*m_breaker);
+   shared_ptr<tile_storage::handle> handle = m_storage->probe(tile);
+   o.record(!m_storage->last_error());
+   return handle;
+}
+
+bool 
+circuit_breaker_storage::get_meta(const tile_protocol &tile, string &data) const
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return false;
+   }
+
+   // not having the metatile is a perfectly good answer, unless the
+   // storage says that was because of an error.
+   outcome o(*m_breaker);
+   bool ok = m_storage->get_meta(tile, data);
+   o.record(!m_storage->last_error());
+   return ok;
+}
+
+bool 
+circuit_breaker_storage::put_meta(const tile_protocol &tile, const string &buf) const 
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return false;
+   }
+
+   outcome o(*m_breaker);
+   bool ok = m_storage->put_meta(tile, buf);
+   o.record(ok);
+   return ok;
+}
+
+bool 
+circuit_breaker_storage::put_meta_stamped(const tile_protocol &tile, const string &buf, 
+                                          std::time_t &stored) const 
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return false;
+   }
+
+   outcome o(*m_breaker);
+   bool ok = m_storage->put_meta_stamped(tile, buf, stored);
+   o.record(ok);
+   return ok;
+}
+
+bool 
+circuit_breaker_storage::expire(const tile_protocol &tile) const 
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return false;
+   }
+
+   outcome o(*m_breaker);
+   bool ok = m_storage->expire(tile);
+   o.record(ok || !m_storage->last_error());
+   return ok;
+}
+
+void
+circuit_breaker_storage::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      for (size_t i = 0; i < tiles.size(); ++i)
+      {
+         callback(i, shared_ptr<tile_storage::handle>(new null_handle()));
+      }
+      return;
+   }
+
+   outcome o(*m_breaker);
+   m_storage->get_many_async(tiles, callback);
+   o.record(!m_storage->last_error());
+}
+
+bool 
+circuit_breaker_storage::put_meta_many(const vector<tile_protocol> &tiles, const vector<string> &bufs) const 
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return false;
+   }
+
+   outcome o(*m_breaker);
+   bool ok = m_storage->put_meta_many(tiles, bufs);
+   o.record(ok);
+   return ok;
+}
+
+bool 
+circuit_breaker_storage::expire_many(const vector<tile_protocol> &tiles) const 
+{
+   if (!m_breaker->allow(std::time(NULL)))
+   {
+      return false;
+   }
+
+   outcome o(*m_breaker);
+   bool ok = m_storage->expire_many(tiles);
+   o.record(ok || !m_storage->last_error());
+   return ok;
+}
+
+} // namespace rendermq
@@ -0,0 +1,81 @@
+/*------------------------------------------------------------------------------
+ *
+ * Overlay this on another storage provider to stop requests going
+ * to it while it's failing.
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_CIRCUIT_BREAKER_STORAGE_HPP
+#define RENDERMQ_CIRCUIT_BREAKER_STORAGE_HPP
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "tile_storage.hpp"
+#include "circuit_breaker.hpp"
+
+namespace rendermq 
+{
+
+/* wraps an existing storage implementation with a circuit breaker, so
+ * that when the storage is failing or hanging, requests fail straight
+ * away instead of tying up the storage threads.
+ *
+ * exceptions, failed puts, gets and expiries after which the storage
+ * reports last_error(), and requests slower than the breaker's 
+ * slow_time count as failures. expiring a tile which isn't there isn't
+ * a failure. while the breaker is open, 
+ * gets return tiles which don't exist and everything else fails.
+ */
+class circuit_breaker_storage 
+   : public tile_storage
+{
+public:
+
+   circuit_breaker_storage(boost::shared_ptr<tile_storage> storage,
+                           boost::shared_ptr<circuit_breaker> breaker);
+   ~circuit_breaker_storage();
+
+   // pass these on to the underlying storage, if the breaker allows.
+   boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+   bool get_meta(const tile_protocol &, std::string &) const;
+   bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+   bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
+   bool expire(const tile_protocol &tile) const;
+
+   // batches count as a single request to the breaker.
+   void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+   bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+   bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
+   // note that the underlying storage's async reader isn't passed on, as
+   // reads through it would go around the breaker.
+
+private:
+   boost::shared_ptr<tile_storage> m_storage;
+   boost::shared_ptr<circuit_breaker> m_breaker;
+};
+
+}
+
+#endif // RENDERMQ_CIRCUIT_BREAKER_STORAGE_HPP
@@ -215,6 +215,10 @@ compositing_storage::compositing_storage(boost::shared_ptr<tile_storage> under,
    { 
       m_generate_format = protoFmt(m_generate_format | fmtPNG); 
    }
+   if (m_config.get_child_optional("webp"))
+   { 
+      m_generate_format = protoFmt(m_generate_format | fmtWEBP); 
+   }
 
    if (m_generate_format == fmtNone) 
    {
@@ -241,67 +245,16 @@ compositing_storage::get(const tile_protocol &tile) const
       return shared_ptr<tile_storage::handle>(new null_handle());
    }
 
-   // modify the requests to set the format type that is 
-   // configured - this may well be different from the
-   // input type, as it's almost certainly the case that
-   // the under tile is opaque (maybe JPG or PNG) and the
-   // over tile has an alpha channel (GIF or PNG).
-   tile_protocol under_tile(tile); 
-   under_tile.format = m_under_format;
-   if (m_under_style) { under_tile.style = m_under_style.get(); }
-
-   tile_protocol over_tile(tile);  
-   over_tile.format = m_over_format;
-   if (m_over_style) { over_tile.style = m_over_style.get(); }
-
    // try and get the tiles
+   tile_protocol under_tile = make_under_tile(tile);
    shared_ptr<tile_storage::handle> under_handle = m_under_storage->get(under_tile);
    if (under_handle->exists())
    {
+      tile_protocol over_tile = make_over_tile(tile);
       shared_ptr<tile_storage::handle> over_handle = m_over_storage->get(over_tile);
       if (over_handle->exists())
       {
-         // get the maximum last-modified time - this is to be
-         // conservative about the time so that updates to either 
-         // input may be presented to the client. for example, if
-         // one layer is relatively static over some period and 
-         // gets updated, then the last-modified will reflect 
-         // that and clients will not get 304s. for this to work
-         // properly, the timestamps on updated layers must be
-         // the time at which they were available for compositing.
-         // if the time is back-dated (to when they were generated
-         // perhaps) then expiry won't work correctly.
-         std::time_t last_mod = std::max(under_handle->last_modified(),
-                                         over_handle->last_modified());
-
-         // tile is expired if *either* of the input tiles are 
-         // expired. this is also conservative - don't want to be
-         // assuming some stuff is fresh when it potentially isn't.
-         bool expired = under_handle->expired() || over_handle->expired();
-
-         // extract the data from the tiles
-         string under_data, over_data, result_data;
-         bool data_ok = (under_handle->data(under_data) && 
-                         over_handle->data(over_data));
-         if (data_ok) 
-         {
-            data_ok = composite(under_data, m_under_format,
-                                over_data, m_over_format,
-                                result_data, tile.format,
-                                m_config);
-         }
-
-         if (data_ok)
-         {
-            // return a composited tile.
-            return shared_ptr<tile_storage::handle>(new composite_handle(last_mod, expired, result_data));
-         }
-         else
-         {
-            // return a null tile 
-            LOG_ERROR(boost::format("Unable to composite image for tile %1%.") % tile);
-            return shared_ptr<tile_storage::handle>(new null_handle());
-         }
+         return composite_handles(tile, under_handle, over_handle);
       }
       else
       {
@@ -319,6 +272,66 @@ compositing_storage::get(const tile_protocol &tile) const
    }
 }
 
+void
+compositing_storage::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+{
+   // the under tiles are all fetched in one batch, then the over 
+   // tiles for those which exist in another.
+   vector<tile_protocol> under_tiles;
+   vector<size_t> under_positions;
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      if (can_generate_formats(tiles[i].format))
+      {
+         under_tiles.push_back(make_under_tile(tiles[i]));
+         under_positions.push_back(i);
+      }
+      else
+      {
+         LOG_FINER(boost::format("Cannot generate format for tile %1% "
+                                 "when configured formats are %2%.")
+                   % tiles[i] % m_generate_format);
+         callback(i, shared_ptr<tile_storage::handle>(new null_handle()));
+      }
+   }
+
+   vector<shared_ptr<tile_storage::handle> > under_handles;
+   m_under_storage->get_many(under_tiles, under_handles);
+
+   vector<tile_protocol> over_tiles;
+   vector<size_t> over_positions;
+   for (size_t j = 0; j < under_tiles.size(); ++j)
+   {
+      if (under_handles[j]->exists())
+      {
+         over_tiles.push_back(make_over_tile(tiles[under_positions[j]]));
+         over_positions.push_back(j);
+      }
+      else
+      {
+         LOG_FINER(boost::format("Under tile %1% does not exist.") % under_tiles[j]);
+         callback(under_positions[j], under_handles[j]);
+      }
+   }
+
+   vector<shared_ptr<tile_storage::handle> > over_handles;
+   m_over_storage->get_many(over_tiles, over_handles);
+
+   for (size_t k = 0; k < over_tiles.size(); ++k)
+   {
+      size_t j = over_positions[k], i = under_positions[j];
+      if (over_handles[k]->exists())
+      {
+         callback(i, composite_handles(tiles[i], under_handles[j], over_handles[k]));
+      }
+      else
+      {
+         LOG_FINER(boost::format("Over tile %1% does not exist.") % over_tiles[k]);
+         callback(i, over_handles[k]);
+      }
+   }
+}
+
 bool 
 compositing_storage::get_meta(const tile_protocol &tile, std::string &data) const {
    std::string under_data, over_data;
@@ -370,6 +383,105 @@ compositing_storage::expire(const tile_protocol &tile) const
    return under_ok && over_ok;
 }
 
+bool 
+compositing_storage::put_meta_many(const vector<tile_protocol> &, const vector<string> &) const 
+{
+   // can't support this for the same reasons as put_meta.
+   return false;
+}   
+
+bool 
+compositing_storage::expire_many(const vector<tile_protocol> &tiles) const 
+{
+   bool expire_under = m_config.get<bool>("expire_under");
+   bool expire_over  = m_config.get<bool>("expire_over");
+   bool under_ok = !expire_under, over_ok = !expire_over;
+
+   // same conservative ordering as expire(), but a whole batch
+   // at a time.
+   if (expire_under)
+   {
+      under_ok = m_under_storage->expire_many(tiles);
+   }
+   if (expire_over && under_ok)
+   {
+      over_ok = m_over_storage->expire_many(tiles);
+   }
+
+   return under_ok && over_ok;
+}
+
+tile_protocol
+compositing_storage::make_under_tile(const tile_protocol &tile) const
+{
+   // modify the requests to set the format type that is 
+   // configured - this may well be different from the
+   // input type, as it's almost certainly the case that
+   // the under tile is opaque (maybe JPG or PNG) and the
+   // over tile has an alpha channel (GIF or PNG).
+   tile_protocol under_tile(tile); 
+   under_tile.format = m_under_format;
+   if (m_under_style) { under_tile.style = m_under_style.get(); }
+   return under_tile;
+}
+
+tile_protocol
+compositing_storage::make_over_tile(const tile_protocol &tile) const
+{
+   tile_protocol over_tile(tile);  
+   over_tile.format = m_over_format;
+   if (m_over_style) { over_tile.style = m_over_style.get(); }
+   return over_tile;
+}
+
+shared_ptr<tile_storage::handle>
+compositing_storage::composite_handles(const tile_protocol &tile,
+                                       shared_ptr<tile_storage::handle> under_handle,
+                                       shared_ptr<tile_storage::handle> over_handle) const
+{
+   // get the maximum last-modified time - this is to be
+   // conservative about the time so that updates to either 
+   // input may be presented to the client. for example, if
+   // one layer is relatively static over some period and 
+   // gets updated, then the last-modified will reflect 
+   // that and clients will not get 304s. for this to work
+   // properly, the timestamps on updated layers must be
+   // the time at which they were available for compositing.
+   // if the time is back-dated (to when they were generated
+   // perhaps) then expiry won't work correctly.
+   std::time_t last_mod = std::max(under_handle->last_modified(),
+                                   over_handle->last_modified());
+
+   // tile is expired if *either* of the input tiles are 
+   // expired. this is also conservative - don't want to be
+   // assuming some stuff is fresh when it potentially isn't.
+   bool expired = under_handle->expired() || over_handle->expired();
+
+   // extract the data from the tiles
+   string under_data, over_data, result_data;
+   bool data_ok = (under_handle->data(under_data) && 
+                   over_handle->data(over_data));
+   if (data_ok) 
+   {
+      data_ok = composite(under_data, m_under_format,
+                          over_data, m_over_format,
+                          result_data, tile.format,
+                          m_config);
+   }
+
+   if (data_ok)
+   {
+      // return a composited tile.
+      return shared_ptr<tile_storage::handle>(new composite_handle(last_mod, expired, result_data));
+   }
+   else
+   {
+      // return a null tile 
+      LOG_ERROR(boost::format("Unable to composite image for tile %1%.") % tile);
+      return shared_ptr<tile_storage::handle>(new null_handle());
+   }
+}
+
 bool 
 compositing_storage::can_generate_formats(protoFmt formats) const 
 {
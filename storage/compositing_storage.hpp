@@ -67,6 +67,12 @@ public:
    // can expire one, both or neither of the input storages.
    bool expire(const tile_protocol &tile) const;
 
+   // batch versions of the above. the under tiles are fetched in
+   // one batch and the over tiles for those which exist in another.
+   void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+   bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+   bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
 private:
 
    // storage sources for the under (background) and over 
@@ -87,6 +93,17 @@ private:
    // checks if the formats requested are a strict subset
    // of those available.
    bool can_generate_formats(protoFmt formats) const;
+
+   // the requests to make of the under and over storages for
+   // a tile, with the configured formats and styles.
+   tile_protocol make_under_tile(const tile_protocol &tile) const;
+   tile_protocol make_over_tile(const tile_protocol &tile) const;
+
+   // composites two existing input tiles into the output tile.
+   boost::shared_ptr<tile_storage::handle> 
+   composite_handles(const tile_protocol &tile,
+                     boost::shared_ptr<tile_storage::handle> under_handle,
+                     boost::shared_ptr<tile_storage::handle> over_handle) const;
 };
 
 }
@@ -38,6 +38,13 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/format.hpp>
+#include <boost/foreach.hpp>
+// posix
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <climits>
+#include <algorithm>
 
 using std::string;
 using std::time_t;
@@ -55,19 +62,53 @@ tile_storage * create_disk_storage(boost::property_tree::ptree const& pt,
                                    boost::optional<zmq::context_t &> ctx)
 {
     boost::optional<string> tile_cache_dir = pt.get_optional<string>("tile_dir");
+    size_t mapped = pt.get<size_t>("mapped_metatiles", 0);
+    size_t open = pt.get<size_t>("open_metatiles", 0);
     if ( tile_cache_dir )
     {
-        return new disk_storage(*tile_cache_dir);
+        return new disk_storage(*tile_cache_dir, mapped, open);
     }
     return 0;
 }
 
 const bool registered = register_tile_storage("disk",create_disk_storage);
 
+// orders tiles by the path of their metatile.
+struct path_order
+{
+   explicit path_order(const std::vector<pair<string, int> > &m) : metas(m) {}
+   bool operator()(size_t a, size_t b) const { return metas[a].first < metas[b].first; }
+   const std::vector<pair<string, int> > &metas;
+};
+
+// finds each tile's metatile, and the order to visit the tiles in so
+// that tiles in the same metatile come together.
+std::vector<size_t> sort_by_path(const string &dir, const std::vector<tile_protocol> &tiles,
+                                 std::vector<pair<string, int> > &metas)
+{
+   std::vector<size_t> order(tiles.size());
+   metas.clear();
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      metas.push_back(xyz_to_meta(dir, tiles[i].x, tiles[i].y, tiles[i].z, tiles[i].style));
+      order[i] = i;
+   }
+   std::stable_sort(order.begin(), order.end(), path_order(metas));
+   return order;
+}
+
+// closes a file descriptor when it goes out of scope.
+struct fd_closer
+{
+   explicit fd_closer(int f) : fd(f) {}
+   ~fd_closer() { if (fd >= 0) { close(fd); } }
+   int fd;
+};
+
 } // anonymous namespace
 
-disk_storage::handle::handle(std::time_t t, size_t s, const disk_storage &p)
-  : timestamp(t), size(s), parent(p) {
+disk_storage::handle::handle(std::time_t t, size_t s, const disk_storage &p, bool gz)
+  : timestamp(t), size(s), parent(p), gzip(gz) {
   parent.data_locked = true;
 }
 
@@ -99,42 +140,312 @@ disk_storage::handle::data(string &output) const {
   return true;
 }
 
-disk_storage::disk_storage(string const& dir)
-  : dir_(dir), data_locked(false)  {}
+uint64_t
+disk_storage::handle::digest() const {
+  // the data has already been read, so it's cheaper to hash it than to go
+  // back to the file for the stored digest.
+  return tile_digest((const char *)parent.data_cache.data(), size);
+}
+
+bool
+disk_storage::handle::gzipped() const {
+  return gzip;
+}
+
+disk_storage::lazy_handle::lazy_handle(const tile_protocol &tile, std::time_t t, const disk_storage &p, bool gz)
+  : x(tile.x), y(tile.y), z(tile.z), style(tile.style), format(tile.format),
+    timestamp(t), parent(p), gzip(gz) {
+  parent.data_locked = true;
+}
+
+disk_storage::lazy_handle::~lazy_handle() {
+  parent.data_locked = false;
+}
+
+bool 
+disk_storage::lazy_handle::exists() const {
+  return true;
+}
+
+std::time_t 
+disk_storage::lazy_handle::last_modified() const {
+  return timestamp;
+}
+
+bool
+disk_storage::lazy_handle::expired() const {
+  return last_modified() == 0;
+}
+
+bool
+disk_storage::lazy_handle::data(string &output) const {
+  // the metatile might not have this format in it, or might have 
+  // gone away since it was looked at, in which case there's no data.
+  int ret = 0;
+  if (parent.open_) {
+    std::time_t t;
+    ret = parent.read_open(x, y, z, style, format, t);
+  } else {
+    ret = read_from_meta(parent.dir_, x, y, z, style, 
+                         parent.data_cache.c_array(), parent.data_cache.size(), 
+                         format);
+  }
+  if (ret > 0) {
+    output.assign((const char *)parent.data_cache.data(), ret);
+    return true;
+  }
+  return false;
+}
+
+uint64_t
+disk_storage::lazy_handle::digest() const {
+  // use the digest stored at the end of the metatile if there is one, 
+  // otherwise there's nothing for it but to read the data.
+  pair<string, int> foo = xyz_to_meta(parent.dir_, x, y, z, style);
+  std::vector<meta_digest> digests;
+  if (read_digests(foo.first, digests)) {
+    BOOST_FOREACH(const meta_digest &d, digests) {
+      if (d.fmt == format) {
+        return d.digest[foo.second];
+      }
+    }
+    return 0;
+  }
+  return tile_storage::handle::digest();
+}
+
+bool
+disk_storage::lazy_handle::gzipped() const {
+  return gzip;
+}
+
+disk_storage::data_handle::data_handle(std::time_t t, string &data, bool gz)
+  : timestamp(t), gzip(gz) {
+  tile_data.swap(data);
+}
+
+disk_storage::data_handle::~data_handle() {
+}
+
+bool 
+disk_storage::data_handle::exists() const {
+  return true;
+}
+
+std::time_t 
+disk_storage::data_handle::last_modified() const {
+  return timestamp;
+}
+
+bool
+disk_storage::data_handle::expired() const {
+  return last_modified() == 0;
+}
+
+bool
+disk_storage::data_handle::data(string &output) const {
+  output = tile_data;
+  return true;
+}
+
+uint64_t
+disk_storage::data_handle::digest() const {
+  return tile_digest(tile_data.data(), tile_data.size());
+}
+
+bool
+disk_storage::data_handle::gzipped() const {
+  return gzip;
+}
+
+disk_storage::mapped_handle::mapped_handle(std::time_t t, 
+                                           const shared_ptr<const mapped_metatiles::mapping> &m,
+                                           size_t offset, size_t s, bool gz)
+  : timestamp(t), map(m), tile(m->data + offset), size(s), gzip(gz) {
+}
+
+disk_storage::mapped_handle::~mapped_handle() {
+}
+
+bool 
+disk_storage::mapped_handle::exists() const {
+  return true;
+}
+
+std::time_t 
+disk_storage::mapped_handle::last_modified() const {
+  return timestamp;
+}
+
+bool
+disk_storage::mapped_handle::expired() const {
+  return last_modified() == 0;
+}
+
+bool
+disk_storage::mapped_handle::data(string &output) const {
+  output.assign(tile, size);
+  return true;
+}
+
+uint64_t
+disk_storage::mapped_handle::digest() const {
+  return tile_digest(tile, size);
+}
+
+bool
+disk_storage::mapped_handle::gzipped() const {
+  return gzip;
+}
+
+disk_storage::disk_storage(string const& dir, size_t mapped, size_t open)
+  : dir_(dir), data_locked(false), had_error_(false)  {
+  if (mapped > 0) {
+    mappings_.reset(new mapped_metatiles(mapped));
+  } else if (open > 0) {
+    open_.reset(new open_metatiles(open));
+  }
+}
+
+int
+disk_storage::read_open(int x, int y, int z, const string &style, int fmt, std::time_t &t,
+                        bool *gzipped) const {
+  const open_metatiles::metatile *meta = open_->lookup(dir_, x, y, z, style);
+  if (meta == NULL) {
+    return -1;
+  }
+  t = meta->mtime;
+
+  const meta_layout *layout = meta->layout(fmt);
+  if (layout == NULL) {
+    return -3;
+  }
+  const entry &e = layout->index[xyz_to_meta_offset(x, y, z)];
+  if ((e.offset < 0) || (e.size < 0)) {
+    return -5;
+  }
+  if (gzipped) {
+    *gzipped = layout->gzipped();
+  }
+  size_t size = std::min(size_t(e.size), data_cache.size());
+  ssize_t got = read_fully(meta->fd, (char *)data_cache.c_array(), size, e.offset);
+  return (got < 0) ? -7 : got;
+}
 
 disk_storage::~disk_storage() {}
 
+shared_ptr<tile_storage::handle> 
+disk_storage::get_mapped(const tile_protocol &tile) const {
+  char path[PATH_MAX];
+  int index = xyz_to_meta_path(path, sizeof(path), dir_, tile.x, tile.y, tile.z, tile.style);
+  std::time_t t = 0;
+  shared_ptr<const mapped_metatiles::mapping> map;
+  if ((index >= 0) && (map = mappings_->lookup(path, t))) {
+    size_t offset = 0, size = 0;
+    bool gzipped = false;
+    const size_t header_len = std::min(map->size, size_t(metaTile::max_headers_size));
+    if ((find_in_meta(path, map->data, header_len, tile.format, index, offset, size, &gzipped) == 0) &&
+        (size > 0) && (offset <= map->size) && (size <= map->size - offset)) {
+      return shared_ptr<tile_storage::handle>(new mapped_handle(t, map, offset, size, gzipped));
+    }
+  }
+
+  return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
 shared_ptr<tile_storage::handle> 
 disk_storage::get(const tile_protocol &tile) const {
+  had_error_ = false;
+  if (mappings_) {
+    return get_mapped(tile);
+  }
+
   if (data_locked) {
     throw runtime_error("Multiple use of disk_storage::data_cache not allowed.");
   }
 
-  pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
-  try {
-    fs::path p(foo.first);
+  if (open_) {
+    std::time_t t = 0;
+    bool gzipped = false;
+    int ret = read_open(tile.x, tile.y, tile.z, tile.style, tile.format, t, &gzipped);
+    if (ret > 0) {
+      return shared_ptr<tile_storage::handle>(new handle(t, ret, *this, gzipped));
+    }
+    return shared_ptr<tile_storage::handle>(new null_handle());
+  }
 
-    if (fs::exists(p)) {
-      std::time_t t = fs::last_write_time(p);
-      int ret = read_from_meta(dir_, tile.x, tile.y, tile.z, tile.style, 
-                               data_cache.c_array(), data_cache.size(), 
-                               tile.format);
-      
-      if (ret > 0) {
-        return shared_ptr<tile_storage::handle>(new handle(t, ret, *this));
-      }
+  // the metatile's timestamp comes from the same open as the tile, so 
+  // that there's only one lookup of the path.
+  char path[PATH_MAX];
+  int index = xyz_to_meta_path(path, sizeof(path), dir_, tile.x, tile.y, tile.z, tile.style);
+  if (index >= 0) {
+    std::time_t t = 0;
+    bool gzipped = false;
+    int ret = read_from_meta(path, index, tile.format, 
+                             data_cache.c_array(), data_cache.size(), t, &gzipped);
+    if (ret > 0) {
+      return shared_ptr<tile_storage::handle>(new handle(t, ret, *this, gzipped));
     }
+  }
 
-  } catch (const fs::filesystem_error &e) {
-     LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
+  return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
+shared_ptr<tile_storage::handle> 
+disk_storage::probe(const tile_protocol &tile) const {
+  // the tile's already there in the mapping, so there's nothing to 
+  // be saved by leaving it until later.
+  had_error_ = false;
+  if (mappings_) {
+    return get_mapped(tile);
+  }
+
+  if (data_locked) {
+    throw runtime_error("Multiple use of disk_storage::data_cache not allowed.");
+  }
+
+  // the metatile might not have the tile's format in it, in which case
+  // the tile doesn't exist, so the headers have to be looked at even
+  // though the data is left until later.
+  if (open_) {
+    const open_metatiles::metatile *meta = open_->lookup(dir_, tile.x, tile.y, tile.z, tile.style);
+    const meta_layout *m = (meta != NULL) ? meta->layout(tile.format) : NULL;
+    if ((m != NULL) && (m->index[xyz_to_meta_offset(tile.x, tile.y, tile.z)].size > 0)) {
+      return shared_ptr<tile_storage::handle>(new lazy_handle(tile, meta->mtime, *this, m->gzipped()));
+    }
+    return shared_ptr<tile_storage::handle>(new null_handle());
+  }
+
+  char path[PATH_MAX];
+  const int index = xyz_to_meta_path(path, sizeof(path), dir_, tile.x, tile.y, tile.z, tile.style);
+  if (index < 0) {
+    return shared_ptr<tile_storage::handle>(new null_handle());
   }
 
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return shared_ptr<tile_storage::handle>(new null_handle());
+  }
+  struct stat st;
+  char header[metaTile::max_headers_size];
+  size_t offset = 0, size = 0;
+  bool gzipped = false;
+  const bool found = (fstat(fd, &st) == 0) &&
+    (find_in_meta(path, header, std::max(read_fully(fd, header, sizeof(header), 0), ssize_t(0)), 
+                  tile.format, index, offset, size, &gzipped) == 0) &&
+    (size > 0);
+  close(fd);
+
+  if (found) {
+    return shared_ptr<tile_storage::handle>(new lazy_handle(tile, st.st_mtime, *this, gzipped));
+  }
   return shared_ptr<tile_storage::handle>(new null_handle());
 }
 
 bool 
 disk_storage::get_meta(const tile_protocol &tile, std::string &data) const {
   pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
+  had_error_ = false;
   try {
     fs::path p(foo.first);
 
@@ -148,10 +459,13 @@ disk_storage::get_meta(const tile_protocol &tile, std::string &data) const {
       data.resize(size);
       // ooh, evil. cast away the const...
       in.read((char *)data.data(), size);
+      // the digests are for storage's own use, so aren't passed on.
+      data.resize(size - digests_size(data));
       return bool(in);
     }
   } catch (const fs::filesystem_error &e) {
      LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
+     had_error_ = true;
   }
 
   return false;
@@ -159,6 +473,12 @@ disk_storage::get_meta(const tile_protocol &tile, std::string &data) const {
 
 bool 
 disk_storage::put_meta(const tile_protocol &tile, const std::string &buf) const {
+  std::time_t stored;
+  return put_meta_stamped(tile, buf, stored);
+}
+
+bool 
+disk_storage::put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const {
   pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
 
   if (foo.second == 0) {
@@ -169,15 +489,34 @@ disk_storage::put_meta(const tile_protocol &tile, const std::string &buf) const
       // create directory for metatile to go in.
       fs::create_directories(p.parent_path());
 
+      // digests of the tiles are kept at the end of the metatile. if the
+      // tiles are exactly the same as the ones already stored then keep
+      // the time they were first stored, so that copies which clients
+      // already have don't look out of date.
+      time_t timestamp = std::time(NULL);
+      std::vector<meta_digest> digests = make_digests(buf, timestamp);
+      std::vector<meta_digest> old_digests;
+      if (read_digests(p.native(), old_digests) && 
+          same_digests(digests, old_digests) &&
+          (old_digests.front().timestamp > 0)) {
+        timestamp = old_digests.front().timestamp;
+        BOOST_FOREACH(meta_digest &d, digests) {
+          d.timestamp = timestamp;
+        }
+      }
+
       // write first to temporary location
       {
         fs::ofstream out(tmp); 
-        out << buf;
+        out.write(buf.data(), buf.size() - digests_size(buf));
+        out << write_digests(digests);
       }
+      fs::last_write_time(tmp, timestamp);
 
       // now copy that file atomically into position
       fs::rename(tmp, p);
 
+      stored = timestamp;
       return true;
 
     } catch (const fs::filesystem_error &e) {
@@ -192,9 +531,85 @@ disk_storage::put_meta(const tile_protocol &tile, const std::string &buf) const
   return false;    
 }
 
+void
+disk_storage::get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const {
+  had_error_ = false;
+  if (mappings_) {
+    tile_storage::get_many_async(tiles, callback);
+    return;
+  }
+
+  std::vector<pair<string, int> > metas;
+  const std::vector<size_t> order = sort_by_path(dir_, tiles, metas);
+
+  size_t i = 0;
+  while (i < order.size()) {
+    const string &path = metas[order[i]].first;
+    size_t end = i;
+    while ((end < order.size()) && (metas[order[end]].first == path)) { ++end; }
+
+    // all the tiles in this metatile are read from one open of it.
+    fd_closer file(open(path.c_str(), O_RDONLY));
+    struct stat st;
+    char header[metaTile::max_headers_size];
+    size_t header_len = 0;
+    if ((file.fd >= 0) && (fstat(file.fd, &st) == 0)) {
+      header_len = std::max(read_fully(file.fd, header, sizeof(header), 0), ssize_t(0));
+    }
+
+    for (; i < end; ++i) {
+      const size_t n = order[i];
+      shared_ptr<tile_storage::handle> handle;
+      size_t offset = 0, size = 0;
+      bool gzipped = false;
+      if ((header_len > 0) && 
+          (find_in_meta(path.c_str(), header, header_len, tiles[n].format, metas[n].second, offset, size, &gzipped) == 0) &&
+          (size > 0)) {
+        string data(size, '\0');
+        data.resize(std::max(read_fully(file.fd, &data[0], size, offset), ssize_t(0)));
+        if (!data.empty()) {
+          handle.reset(new data_handle(st.st_mtime, data, gzipped));
+        }
+      }
+      if (!handle) {
+        handle.reset(new null_handle());
+      }
+      callback(n, handle);
+    }
+  }
+}
+
+bool
+disk_storage::put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const {
+  if (tiles.size() != bufs.size()) {
+    throw std::invalid_argument("Different numbers of tiles and metatiles to put.");
+  }
+
+  std::vector<pair<string, int> > metas;
+  bool success = true;
+  BOOST_FOREACH(size_t i, sort_by_path(dir_, tiles, metas)) {
+    success &= put_meta(tiles[i], bufs[i]);
+  }
+  return success;
+}
+
+bool
+disk_storage::expire_many(const std::vector<tile_protocol> &tiles) const {
+  std::vector<pair<string, int> > metas;
+  bool success = true;
+  bool error = false;
+  BOOST_FOREACH(size_t i, sort_by_path(dir_, tiles, metas)) {
+    success &= expire(tiles[i]);
+    error |= had_error_;
+  }
+  had_error_ = error;
+  return success;
+}
+
 bool 
 disk_storage::expire(const tile_protocol &tile) const {
   pair<string, int> foo = xyz_to_meta(dir_, tile.x, tile.y, tile.z, tile.style);
+  had_error_ = false;
   try {
     fs::path p(foo.first);
     
@@ -208,10 +623,17 @@ disk_storage::expire(const tile_protocol &tile) const {
 
   } catch (const fs::filesystem_error &e) {
      LOG_ERROR(boost::format("Filesystem error: %1%") % e.what());
+     had_error_ = true;
   }
   
+  // a metatile which was never rendered isn't an error.
   return false;
 }
 
+bool
+disk_storage::last_error() const {
+  return had_error_;
+}
+
 }
 
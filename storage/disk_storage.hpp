@@ -27,9 +27,12 @@
 #define RENDERMQ_DISK_STORAGE_HPP
 
 #include <boost/array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <string>
 #include <ctime>
 #include "tile_storage.hpp"
+#include "mapped_metatiles.hpp"
+#include "open_metatiles.hpp"
 
 namespace rendermq {
 
@@ -39,32 +42,124 @@ public:
 
   class handle : public tile_storage::handle {
   public:
-    handle(std::time_t, size_t, const disk_storage &);
+    handle(std::time_t, size_t, const disk_storage &, bool gzipped);
     virtual ~handle();
     virtual bool exists() const;
     virtual std::time_t last_modified() const;
     virtual bool data(std::string &) const;
     virtual bool expired() const;
+    virtual uint64_t digest() const;
+    virtual bool gzipped() const;
   private:
     std::time_t timestamp;
     size_t size;
     const disk_storage &parent;
+    bool gzip;
   };
   friend class handle;
 
-  disk_storage(std::string const& dir);
+  // handle which has only looked at the metatile's timestamp, and
+  // doesn't read the tile until data() is called.
+  class lazy_handle : public tile_storage::handle {
+  public:
+    lazy_handle(const tile_protocol &, std::time_t, const disk_storage &, bool gzipped);
+    virtual ~lazy_handle();
+    virtual bool exists() const;
+    virtual std::time_t last_modified() const;
+    virtual bool data(std::string &) const;
+    virtual bool expired() const;
+    virtual uint64_t digest() const;
+    virtual bool gzipped() const;
+  private:
+    int x, y, z;
+    std::string style;
+    protoFmt format;
+    std::time_t timestamp;
+    const disk_storage &parent;
+    bool gzip;
+  };
+  friend class lazy_handle;
+
+  // handle which has its own copy of the tile, so that any number of
+  // them can be held at once.
+  class data_handle : public tile_storage::handle {
+  public:
+    // takes the contents of data, leaving it empty.
+    data_handle(std::time_t, std::string &data, bool gzipped);
+    virtual ~data_handle();
+    virtual bool exists() const;
+    virtual std::time_t last_modified() const;
+    virtual bool data(std::string &) const;
+    virtual bool expired() const;
+    virtual uint64_t digest() const;
+    virtual bool gzipped() const;
+  private:
+    std::time_t timestamp;
+    std::string tile_data;
+    bool gzip;
+  };
+
+  // handle which points at the tile in a mapped metatile, keeping it 
+  // mapped for as long as the handle is held. any number of them can
+  // be held at once.
+  class mapped_handle : public tile_storage::handle {
+  public:
+    mapped_handle(std::time_t, const boost::shared_ptr<const mapped_metatiles::mapping> &,
+                  size_t offset, size_t size, bool gzipped);
+    virtual ~mapped_handle();
+    virtual bool exists() const;
+    virtual std::time_t last_modified() const;
+    virtual bool data(std::string &) const;
+    virtual bool expired() const;
+    virtual uint64_t digest() const;
+    virtual bool gzipped() const;
+  private:
+    std::time_t timestamp;
+    boost::shared_ptr<const mapped_metatiles::mapping> map;
+    const char *tile;
+    size_t size;
+    bool gzip;
+  };
+
+  // if mapped_metatiles isn't zero, then tiles are read by mapping up to
+  // that many of the most recently used metatiles into memory. otherwise
+  // if open_metatiles isn't zero, up to that many of them are kept open.
+  disk_storage(std::string const& dir, size_t mapped_metatiles = 0, size_t open_metatiles = 0);
   ~disk_storage();
   boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+  boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
   bool get_meta(const tile_protocol &, std::string &) const;
   bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+  bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
   bool expire(const tile_protocol &tile) const;
 
+  // these go through the tiles in order of metatile path, so that each
+  // metatile is only opened once and directories are visited in turn.
+  void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+  bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+  bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
+  // whether the last get_meta or expiry hit a filesystem error.
+  bool last_error() const;
+
 private:
 
+  // the tile from a mapped metatile, or a null handle.
+  boost::shared_ptr<tile_storage::handle> get_mapped(const tile_protocol &tile) const;
+
+  // reads the tile from an open metatile into data_cache, returning its
+  // size and whether it's compressed as read_from_meta does.
+  int read_open(int x, int y, int z, const std::string &style, int fmt, std::time_t &t,
+                bool *gzipped = NULL) const;
+
   std::string dir_;
 
+  mutable boost::scoped_ptr<mapped_metatiles> mappings_;
+  mutable boost::scoped_ptr<open_metatiles> open_;
+
   mutable bool data_locked;
   mutable tile_data data_cache;
+  mutable bool had_error_;
 };
 
 }
@@ -0,0 +1,480 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "config.hpp"
+#include "disk_uring_storage.hpp"
+#include "meta_tile.hpp"
+#include "null_handle.hpp"
+#include "../logging/logger.hpp"
+
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// default for the most tiles which can be read at once.
+#define DEFAULT_QUEUE_DEPTH (256)
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using boost::shared_ptr;
+
+namespace rendermq {
+
+namespace {
+
+tile_storage * create_disk_uring_storage(boost::property_tree::ptree const& pt,
+                                         boost::optional<zmq::context_t &> ctx)
+{
+   boost::optional<string> tile_cache_dir = pt.get_optional<string>("tile_dir");
+   if (tile_cache_dir)
+   {
+      return new disk_uring_storage(*tile_cache_dir, 
+                                    pt.get<size_t>("queue_depth", DEFAULT_QUEUE_DEPTH));
+   }
+   return 0;
+}
+
+const bool registered = register_tile_storage("disk_uring", create_disk_uring_storage);
+
+} // anonymous namespace
+
+#ifdef HAVE_LIBURING
+
+/* each tile goes through three reads: opening the metatile, reading its
+ * headers and reading the tile. only one of these is with the kernel at
+ * any time, so the ring never has more than queue_depth entries on it.
+ */
+class disk_uring_storage::uring_reader : public tile_storage::async_reader
+{
+public:
+   uring_reader(const string &dir, size_t depth);
+   ~uring_reader();
+   bool ready() const;
+   void submit(tile_protocol *tile);
+   void flush();
+   int fd() const;
+   size_t in_flight() const;
+   void reap(vector<result> &results);
+
+private:
+   enum stage { stageOpen, stageHeader, stageTile };
+
+   struct request
+   {
+      tile_protocol *tile;
+      string path;
+      int index;
+      stage step;
+      int fd;
+      std::time_t timestamp;
+      size_t file_size;
+      // where the tile is in the metatile, and how much has been read.
+      size_t offset, size, pos;
+      bool gzipped;
+      char header[metaTile::max_headers_size];
+      string data;
+   };
+
+   // moves a request on once its last read has finished with res.
+   void advance(request *req, int res, vector<result> &results);
+   void queue_read(request *req, char *buf, size_t len, size_t offset, vector<result> &results);
+   void finish(request *req, tile_storage::handle *handle, vector<result> &results);
+
+   const string m_dir;
+   const size_t m_depth;
+   size_t m_in_flight;
+   struct io_uring m_ring;
+   int m_event_fd;
+};
+
+disk_uring_storage::uring_reader::uring_reader(const string &dir, size_t depth)
+   : m_dir(dir), m_depth(depth), m_in_flight(0), m_event_fd(-1)
+{
+   int ret = io_uring_queue_init(m_depth, &m_ring, 0);
+   if (ret < 0)
+   {
+      throw runtime_error((boost::format("Unable to set up io_uring: %1%") % strerror(-ret)).str());
+   }
+
+   // completions are signalled on an eventfd so that they can be polled
+   // for along with everything else.
+   m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (m_event_fd < 0 || (ret = io_uring_register_eventfd(&m_ring, m_event_fd)) < 0)
+   {
+      const int err = (m_event_fd < 0) ? errno : -ret;
+      if (m_event_fd >= 0) { close(m_event_fd); }
+      io_uring_queue_exit(&m_ring);
+      throw runtime_error((boost::format("Unable to set up eventfd for io_uring: %1%") % strerror(err)).str());
+   }
+}
+
+disk_uring_storage::uring_reader::~uring_reader()
+{
+   // the kernel may still be writing into requests' buffers, so wait for
+   // everything to come back before freeing them. nothing new is queued.
+   flush();
+   while (m_in_flight > 0)
+   {
+      struct io_uring_cqe *cqe = NULL;
+      if (io_uring_wait_cqe(&m_ring, &cqe) < 0) { break; }
+      request *req = static_cast<request *>(io_uring_cqe_get_data(cqe));
+      if ((req->step == stageOpen) && (cqe->res >= 0)) { req->fd = cqe->res; }
+      io_uring_cqe_seen(&m_ring, cqe);
+      if (req->fd >= 0) { close(req->fd); }
+      delete req;
+      --m_in_flight;
+   }
+   io_uring_queue_exit(&m_ring);
+   close(m_event_fd);
+}
+
+bool
+disk_uring_storage::uring_reader::ready() const
+{
+   return m_in_flight < m_depth;
+}
+
+void
+disk_uring_storage::uring_reader::submit(tile_protocol *tile)
+{
+   std::pair<string, int> meta = xyz_to_meta(m_dir, tile->x, tile->y, tile->z, tile->style);
+
+   request *req = new request;
+   req->tile = tile;
+   req->path = meta.first;
+   req->index = meta.second;
+   req->step = stageOpen;
+   req->fd = -1;
+   req->timestamp = 0;
+   req->file_size = 0;
+   req->offset = req->size = req->pos = 0;
+   req->gzipped = false;
+   ++m_in_flight;
+
+   struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+   if (sqe == NULL)
+   {
+      // can't happen, as there's never more than one entry per request.
+      LOG_ERROR(boost::format("No room in io_uring to open %1%.") % req->path);
+      vector<result> ignored;
+      finish(req, new null_handle(), ignored);
+      return;
+   }
+   io_uring_prep_openat(sqe, AT_FDCWD, req->path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+   io_uring_sqe_set_data(sqe, req);
+}
+
+void
+disk_uring_storage::uring_reader::flush()
+{
+   int ret = io_uring_submit(&m_ring);
+   if (ret < 0 && ret != -EAGAIN && ret != -EINTR)
+   {
+      LOG_ERROR(boost::format("Error submitting to io_uring: %1%") % strerror(-ret));
+   }
+}
+
+int
+disk_uring_storage::uring_reader::fd() const
+{
+   return m_event_fd;
+}
+
+size_t
+disk_uring_storage::uring_reader::in_flight() const
+{
+   return m_in_flight;
+}
+
+void
+disk_uring_storage::uring_reader::reap(vector<result> &results)
+{
+   // clear the eventfd before looking at the completions, so that any
+   // arriving after the last one is looked at will wake the poll again.
+   uint64_t count = 0;
+   if (read(m_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+   {
+      LOG_ERROR(boost::format("Error reading io_uring eventfd: %1%") % strerror(errno));
+   }
+
+   struct io_uring_cqe *cqe = NULL;
+   while (io_uring_peek_cqe(&m_ring, &cqe) == 0)
+   {
+      request *req = static_cast<request *>(io_uring_cqe_get_data(cqe));
+      const int res = cqe->res;
+      io_uring_cqe_seen(&m_ring, cqe);
+      advance(req, res, results);
+   }
+
+   // the next reads for the requests which have moved on.
+   flush();
+}
+
+void
+disk_uring_storage::uring_reader::advance(request *req, int res, vector<result> &results)
+{
+   if (res < 0)
+   {
+      // a missing metatile is an ordinary miss, anything else is worth
+      // knowing about.
+      if (!((req->step == stageOpen) && (res == -ENOENT)))
+      {
+         LOG_ERROR(boost::format("Error reading meta file %1%: %2%") % req->path % strerror(-res));
+      }
+      finish(req, new null_handle(), results);
+      return;
+   }
+
+   if (req->step == stageOpen)
+   {
+      // the open will have brought the inode in, so this doesn't block.
+      struct stat st;
+      req->fd = res;
+      if (fstat(req->fd, &st) < 0)
+      {
+         LOG_ERROR(boost::format("Error reading meta file %1%: %2%") % req->path % strerror(errno));
+         finish(req, new null_handle(), results);
+         return;
+      }
+      req->timestamp = st.st_mtime;
+      req->file_size = st.st_size;
+      req->step = stageHeader;
+      queue_read(req, req->header, sizeof(req->header), 0, results);
+   }
+   else if (req->step == stageHeader)
+   {
+      if ((find_in_meta(req->path.c_str(), req->header, res, req->tile->format, req->index, 
+                        req->offset, req->size, &req->gzipped) < 0) || (req->size == 0))
+      {
+         finish(req, new null_handle(), results);
+         return;
+      }
+      // the index can't be trusted not to point past the end of the 
+      // file, and tiles are capped at the size the synchronous reads 
+      // are, so that a corrupt header can't ask for a huge buffer.
+      if ((req->offset > req->file_size) || (req->size > req->file_size - req->offset))
+      {
+         LOG_WARNING(boost::format("Meta file %1% index points past its end") % req->path);
+         finish(req, new null_handle(), results);
+         return;
+      }
+      if (req->size > disk_storage::tile_data::static_size)
+      {
+         LOG_WARNING(boost::format("Truncating tile %1% to fit buffer of %2%") 
+                     % req->size % disk_storage::tile_data::static_size);
+         req->size = disk_storage::tile_data::static_size;
+      }
+      req->data.resize(req->size);
+      req->step = stageTile;
+      queue_read(req, &req->data[0], req->size, req->offset, results);
+   }
+   else
+   {
+      // reads of regular files can come up short, in which case the 
+      // rest is asked for, unless the file ends early.
+      req->pos += res;
+      if ((res > 0) && (req->pos < req->size))
+      {
+         queue_read(req, &req->data[req->pos], req->size - req->pos, req->offset + req->pos, results);
+         return;
+      }
+      req->data.resize(req->pos);
+      if (req->pos == 0)
+      {
+         finish(req, new null_handle(), results);
+         return;
+      }
+      finish(req, new disk_storage::data_handle(req->timestamp, req->data, req->gzipped), results);
+   }
+}
+
+void
+disk_uring_storage::uring_reader::queue_read(request *req, char *buf, size_t len, size_t offset,
+                                             vector<result> &results)
+{
+   struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+   if (sqe == NULL)
+   {
+      LOG_ERROR(boost::format("No room in io_uring to read %1%.") % req->path);
+      finish(req, new null_handle(), results);
+      return;
+   }
+   io_uring_prep_read(sqe, req->fd, buf, len, offset);
+   io_uring_sqe_set_data(sqe, req);
+}
+
+void
+disk_uring_storage::uring_reader::finish(request *req, tile_storage::handle *handle,
+                                         vector<result> &results)
+{
+   shared_ptr<tile_storage::handle> h(handle);
+   if (req->fd >= 0)
+   {
+      close(req->fd);
+   }
+   results.push_back(std::make_pair(req->tile, h));
+   delete req;
+   --m_in_flight;
+}
+
+#endif /* HAVE_LIBURING */
+
+disk_uring_storage::disk_uring_storage(const string &dir, size_t queue_depth)
+   : m_disk(dir), m_dir(dir), m_queue_depth(queue_depth), m_reader_failed(false)
+{
+}
+
+disk_uring_storage::~disk_uring_storage()
+{
+}
+
+shared_ptr<tile_storage::handle>
+disk_uring_storage::get(const tile_protocol &tile) const
+{
+   return m_disk.get(tile);
+}
+
+shared_ptr<tile_storage::handle>
+disk_uring_storage::probe(const tile_protocol &tile) const
+{
+   return m_disk.probe(tile);
+}
+
+bool
+disk_uring_storage::get_meta(const tile_protocol &tile, string &data) const
+{
+   return m_disk.get_meta(tile, data);
+}
+
+bool
+disk_uring_storage::put_meta(const tile_protocol &tile, const string &buf) const
+{
+   return m_disk.put_meta(tile, buf);
+}
+
+bool
+disk_uring_storage::put_meta_stamped(const tile_protocol &tile, const string &buf, std::time_t &stored) const
+{
+   return m_disk.put_meta_stamped(tile, buf, stored);
+}
+
+bool
+disk_uring_storage::expire(const tile_protocol &tile) const
+{
+   return m_disk.expire(tile);
+}
+
+void
+disk_uring_storage::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+{
+   // the reader may already be in use from this thread, e.g: by the
+   // storage worker, in which case it can't be waited on here without
+   // getting that user's tiles back too.
+   async_reader *r = make_reader();
+   if ((r == NULL) || (r->in_flight() > 0))
+   {
+      m_disk.get_many_async(tiles, callback);
+      return;
+   }
+
+   // the reader hands back pointers, so copies are made which can be
+   // matched back up to the position of the original.
+   vector<tile_protocol> copies(tiles);
+   vector<async_reader::result> results;
+   size_t next = 0;
+   while ((next < copies.size()) || (r->in_flight() > 0))
+   {
+      while ((next < copies.size()) && r->ready())
+      {
+         r->submit(&copies[next++]);
+      }
+      r->flush();
+
+      struct pollfd p = { r->fd(), POLLIN, 0 };
+      poll(&p, 1, -1);
+
+      results.clear();
+      r->reap(results);
+      BOOST_FOREACH(const async_reader::result &res, results)
+      {
+         callback(res.first - &copies[0], res.second);
+      }
+   }
+}
+
+bool
+disk_uring_storage::put_meta_many(const vector<tile_protocol> &tiles, const vector<string> &bufs) const
+{
+   return m_disk.put_meta_many(tiles, bufs);
+}
+
+bool
+disk_uring_storage::expire_many(const vector<tile_protocol> &tiles) const
+{
+   return m_disk.expire_many(tiles);
+}
+
+tile_storage::async_reader *
+disk_uring_storage::reader()
+{
+   return make_reader();
+}
+
+tile_storage::async_reader *
+disk_uring_storage::make_reader() const
+{
+   if (!m_reader && !m_reader_failed)
+   {
+#ifdef HAVE_LIBURING
+      try
+      {
+         m_reader.reset(new uring_reader(m_dir, m_queue_depth));
+      }
+      catch (const std::exception &e)
+      {
+         LOG_ERROR(boost::format("%1%, reading tiles by blocking instead.") % e.what());
+         m_reader_failed = true;
+      }
+#else
+      LOG_WARNING("Built without liburing, so disk_uring storage is reading tiles by blocking.");
+      m_reader_failed = true;
+#endif
+   }
+   return m_reader.get();
+}
+
+}
@@ -0,0 +1,85 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_DISK_URING_STORAGE_HPP
+#define RENDERMQ_DISK_URING_STORAGE_HPP
+
+#include <boost/scoped_ptr.hpp>
+#include <string>
+#include "tile_storage.hpp"
+#include "disk_storage.hpp"
+
+namespace rendermq {
+
+/* metatiles on disk, laid out exactly as for disk_storage, but with an
+ * asynchronous reader built on linux's io_uring. the reader opens the
+ * metatile, reads its headers and then the tile as a chain of requests
+ * to the kernel, so one thread can keep many reads waiting on the 
+ * disks at once. everything else, and any tile got through get(), is
+ * done by blocking, the same as disk_storage.
+ *
+ * if it was built without liburing, or the kernel won't set up a ring,
+ * there's no reader and this is just disk_storage under another name.
+ */
+class disk_uring_storage : public tile_storage {
+public:
+  /* @param dir root directory of the metatiles.
+   * @param queue_depth the most tiles which can be read at once.
+   */
+  disk_uring_storage(const std::string &dir, size_t queue_depth);
+  ~disk_uring_storage();
+  boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+  boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
+  bool get_meta(const tile_protocol &, std::string &) const;
+  bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+  bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
+  bool expire(const tile_protocol &tile) const;
+
+  // gets the tiles through the reader, when it isn't already in use,
+  // with as many in flight at once as the queue depth allows.
+  void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+  bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+  bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
+  async_reader *reader();
+
+private:
+  class uring_reader;
+
+  async_reader *make_reader() const;
+
+  disk_storage m_disk;
+  const std::string m_dir;
+  const size_t m_queue_depth;
+
+  // the reader is only set up when it's first asked for, as most 
+  // instances are only used for blocking operations.
+  mutable boost::scoped_ptr<async_reader> m_reader;
+  mutable bool m_reader_failed;
+};
+
+}
+
+#endif // RENDERMQ_DISK_URING_STORAGE_HPP
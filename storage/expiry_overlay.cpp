@@ -31,6 +31,7 @@
 
 using boost::shared_ptr;
 using std::string;
+using std::vector;
 namespace pt = boost::property_tree;
 
 namespace 
@@ -51,12 +52,34 @@ public:
    std::time_t last_modified() const { return m_handle->last_modified(); }
    bool data(std::string &str) const { return m_handle->data(str); }
    bool expired() const { return m_expired; }
+   uint64_t digest() const { return m_handle->digest(); }
+   bool gzipped() const { return m_handle->gzipped(); }
 
 private:
    shared_ptr<rendermq::tile_storage::handle> m_handle;
    bool m_expired;
 };
 
+/* overlays the expiry information on each of a batch of tiles
+ * as it comes back from the underlying storage.
+ */
+struct overlay_expiry
+{
+   overlay_expiry(const vector<rendermq::tile_protocol> &t, const rendermq::expiry_service &e,
+                  const rendermq::tile_storage::get_callback &c)
+      : tiles(t), expiry(e), callback(c) {}
+
+   void operator()(size_t i, shared_ptr<rendermq::tile_storage::handle> handle) const
+   {
+      bool expired = expiry.is_expired(tiles[i]);
+      callback(i, shared_ptr<rendermq::tile_storage::handle>(new overlay_handle(handle, expired)));
+   }
+
+   const vector<rendermq::tile_protocol> &tiles;
+   const rendermq::expiry_service &expiry;
+   const rendermq::tile_storage::get_callback &callback;
+};
+
 rendermq::tile_storage *create_expiry_overlay(const pt::ptree &conf, 
                                               boost::optional<zmq::context_t &> ctx)
 {
@@ -143,10 +166,45 @@ expiry_overlay::put_meta(const tile_protocol &tile, const string &buf) const
    return m_storage->put_meta(tile, buf);
 }
 
+bool 
+expiry_overlay::put_meta_stamped(const tile_protocol &tile, const string &buf, 
+                                 std::time_t &stored) const 
+{
+   m_expiry->set_expired(tile, false);
+   return m_storage->put_meta_stamped(tile, buf, stored);
+}
+
 bool 
 expiry_overlay::expire(const tile_protocol &tile) const 
 {
    return m_expiry->set_expired(tile, true);
 }
 
+void
+expiry_overlay::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+{
+   m_storage->get_many_async(tiles, overlay_expiry(tiles, *m_expiry, callback));
+}
+
+bool 
+expiry_overlay::put_meta_many(const vector<tile_protocol> &tiles, const vector<string> &bufs) const 
+{
+   BOOST_FOREACH(const tile_protocol &tile, tiles)
+   {
+      m_expiry->set_expired(tile, false);
+   }
+   return m_storage->put_meta_many(tiles, bufs);
+}
+
+bool 
+expiry_overlay::expire_many(const vector<tile_protocol> &tiles) const 
+{
+   bool success = true;
+   BOOST_FOREACH(const tile_protocol &tile, tiles)
+   {
+      success &= m_expiry->set_expired(tile, true);
+   }
+   return success;
+}
+
 } // namespace rendermq
@@ -66,10 +66,18 @@ public:
    // put the metatile to the storage and reset the expiry
    // formation for this metatile.
    bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+   bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
 
    // update the expiry service with this information.
    bool expire(const tile_protocol &tile) const;
 
+   // the batch versions of the above. the tiles are fetched from
+   // the underlying storage in one go, with the expiry information
+   // overlaid on each as it arrives.
+   void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+   bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+   bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
 private:
    boost::shared_ptr<tile_storage> m_storage;
    boost::shared_ptr<expiry_service> m_expiry;
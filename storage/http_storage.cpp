@@ -24,6 +24,7 @@
  *-----------------------------------------------------------------------------*/
 #include <cstdarg>
 #include "http_storage.hpp"
+#include "../http/http_gzip.hpp"
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/microsec_time_clock.hpp>
 
@@ -65,7 +66,12 @@ namespace rendermq
       return this->response->statusCode == 200;
    }
 
-   http_storage::http_storage(const bool& persistent, const int& concurrency): persistent(persistent), concurrency(concurrency)
+   bool http_storage::handle::gzipped() const
+   {
+      return this->response->statusCode == 200 && is_gzipped(this->response->body);
+   }
+
+   http_storage::http_storage(const bool& persistent, const int& concurrency): persistent(persistent), concurrency(concurrency), had_error(false)
    {
       //get a persistent connection
       if(persistent)
@@ -76,6 +82,11 @@ namespace rendermq
    {
    }
 
+   bool http_storage::last_error() const
+   {
+      return had_error;
+   }
+
    bool http_storage::put_meta(const tile_protocol &tile, const string &metatile) const
    {
       //put extra stuff in the http header
@@ -176,6 +187,7 @@ namespace rendermq
       vector<string> requests = make_get_requests(tile);
       //place to keep the responses
       vector<shared_ptr<http::response> > responses;
+      had_error = false;
 
 #ifdef RENDERMQ_DEBUG
       LOG_FINER(boost::format("Getting metatile: %1%") % tile);
@@ -213,6 +225,7 @@ namespace rendermq
       catch(const std::runtime_error& e)
       {
          LOG_ERROR(boost::format("Runtime error asynchronously GETTING tile: %1%") % e.what());
+         had_error = true;
          return false;
       }
 
@@ -226,6 +239,7 @@ namespace rendermq
          {
             //should we really log this?
             LOG_FINER(boost::format("Failed to GET tile: %1% (status=%2%, last-mod=%3%)") % *request % (*response)->statusCode % (*response)->timeStamp);
+            had_error |= ((*response)->statusCode >= 500);
             ret = false;
          }
       }
@@ -248,6 +262,7 @@ namespace rendermq
             {
                //should we really log this?
                LOG_FINER(boost::format("Failed to GET tile: %1% (status=%2%, last-mod=%3%)") % *request % response->statusCode % response->timeStamp);
+               had_error |= (response->statusCode >= 500);
                ret = false;
             }
             //keep it
@@ -256,6 +271,7 @@ namespace rendermq
          catch(const std::runtime_error& e)
          {
             LOG_FINER(boost::format("Runtime error synchronously GETTING tile: %1%") % e.what());
+            had_error = true;
             return false;
          }
       }
@@ -271,6 +287,9 @@ namespace rendermq
       //place to keep sizes
       vector<int> sizes(formats.size() * METATILE * METATILE, 0);
       vector<int>::iterator tileSize = sizes.begin();
+      //the tiles were stored without their header, so a format is flagged
+      //as compressed again if its tiles are
+      vector<bool> gzipped(formats.size(), false);
       unsigned int metaSize = 0;
       int dim = get_meta_dimensions(tile.z);
       int size = get_tile_count_in_meta(tile.z);
@@ -295,6 +314,8 @@ namespace rendermq
                   //keep track of the tile size, cast isn't a problem for tiles smaller than 4gig :o)
                   *tileSize = int((*response)->body.length());
                   metaSize += *tileSize;
+                  if(is_gzipped((*response)->body))
+                     gzipped[f] = true;
                   //printf("%d %d %d -> %s\n", tile.z, x + tile.x, y + tile.y, (*response)->body.c_str());
                   //next response
                   response++;
@@ -309,7 +330,7 @@ namespace rendermq
       metatile.clear();
       //put the header there
       pair<int, int> coord = xy_to_meta_xy(tile.x, tile.y);
-      metatile = write_headers(coord.first, coord.second, tile.z, formats, sizes);
+      metatile = write_headers(coord.first, coord.second, tile.z, formats, sizes, gzipped);
       //make space for the tiles so that we don't have to do multiple allocations
       metatile.reserve(metatile.length() + metaSize + 1);
       //put all the tiles in there. can do them all in a row because blank ones have no size
@@ -59,6 +59,9 @@ namespace rendermq
                virtual time_t last_modified() const;
                virtual bool data(string &) const;
                virtual bool expired() const;
+               //single tiles come back without their metatile header, so this
+               //has to look at the body to tell whether they were compressed
+               virtual bool gzipped() const;
             private:
                const shared_ptr<http::response> response;
          };
@@ -74,6 +77,8 @@ namespace rendermq
          virtual bool put_meta(const tile_protocol &tile, const string &metatile) const;
          //expires a tile by setting last modified to invalid (easiest way to expire them)
          virtual bool expire(const tile_protocol &tile) const = 0;
+         //whether the last get or expiry couldn't reach the server or got a server error back
+         virtual bool last_error() const;
 
       protected:
 
@@ -109,6 +114,8 @@ namespace rendermq
          boost::shared_ptr<CURL> connection;
          // the number of outstanding connections to the HTTP storage
          const int concurrency;
+         //set by gets which fail because of the server rather than the tile being missing
+         mutable bool had_error;
    };
 
 }
@@ -0,0 +1,70 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "latency_window.hpp"
+#include <algorithm>
+
+namespace rendermq 
+{
+
+latency_window::latency_window(size_t capacity)
+   : m_capacity(std::max(capacity, size_t(1))), m_next(0)
+{
+   m_samples.reserve(m_capacity);
+}
+
+void
+latency_window::record(long msec)
+{
+   // fill up the window first, then overwrite the oldest sample.
+   if (m_samples.size() < m_capacity)
+   {
+      m_samples.push_back(msec);
+   }
+   else
+   {
+      m_samples[m_next] = msec;
+      m_next = (m_next + 1) % m_capacity;
+   }
+}
+
+long
+latency_window::quantile(double q) const
+{
+   if (m_samples.empty())
+   {
+      return 0;
+   }
+
+   // the window is small, so sorting a copy each time is cheap 
+   // enough and keeps recording trivial.
+   std::vector<long> sorted(m_samples);
+   size_t rank = size_t(q * sorted.size());
+   if (rank >= sorted.size()) { rank = sorted.size() - 1; }
+   std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+   return sorted[rank];
+}
+
+} // namespace rendermq
@@ -0,0 +1,62 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_LATENCY_WINDOW_HPP
+#define RENDERMQ_LATENCY_WINDOW_HPP
+
+#include <vector>
+#include <cstddef>
+
+namespace rendermq 
+{
+
+/* keeps the most recent latency samples, in milliseconds, so that 
+ * percentiles of what a backend has been doing lately can be had. 
+ * unlike the latency_histogram, old samples drop out, so this follows
+ * a host which speeds up or slows down.
+ */
+class latency_window
+{
+public:
+   // keep up to 'capacity' of the most recent samples.
+   explicit latency_window(size_t capacity = 100);
+
+   void record(long msec);
+
+   // the number of samples currently held.
+   size_t size() const { return m_samples.size(); }
+
+   // the latency below which the given fraction (0 < q <= 1) of the
+   // held samples fall, or zero if there aren't any samples yet.
+   long quantile(double q) const;
+
+private:
+   size_t m_capacity, m_next;
+   std::vector<long> m_samples;
+};
+
+} // namespace rendermq
+
+#endif // RENDERMQ_LATENCY_WINDOW_HPP
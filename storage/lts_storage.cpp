@@ -29,6 +29,11 @@
 #define DEFAULT_CONCURRENCY (16) //how many HTTP connections to open to the back-end
 #define DEFAULT_VERSION "0"
 #define DEFAULT_DOWN_RECHECK_TIME (300) // how often to recheck that a down LTS host is still down.
+#define DEFAULT_HEDGE_BUDGET (0) // percentage of extra gets allowed for hedging, zero is off.
+#define DEFAULT_HEDGE_PERCENTILE (95) // percentile of a host's recent latencies after which to hedge.
+#define DEFAULT_HEDGE_WINDOW (100) // number of recent latencies to keep per host.
+#define HEDGE_MIN_SAMPLES (10) // don't hedge until a host has this many latencies to go on.
+#define HEDGE_BURST (10.0) // most hedges which can be saved up.
 
 // 300ms timeout for connect (just the TCP handshake - not the whole HTTP
 // transaction) to help prevent the storage_worker getting bogged down in
@@ -45,8 +50,12 @@
 #include <boost/algorithm/string/classification.hpp> //is_any_of
 #include <boost/algorithm/string/constants.hpp> //token_compress_on
 #include <boost/lexical_cast.hpp> //lexical_cast
+#include <boost/date_time/posix_time/posix_time.hpp> //microsec_clock
+#include <set>
 //#include <boost/algorithm/string.hpp> //str
 
+namespace bt = boost::posix_time;
+
 namespace rendermq
 {
    namespace
@@ -60,6 +69,9 @@ namespace rendermq
          string version = pt.get<string>("version", DEFAULT_VERSION);
          unsigned int concurrency = pt.get<unsigned int>("concurrency", DEFAULT_CONCURRENCY);
          int down_recheck_time = pt.get<unsigned int>("down_recheck_time", DEFAULT_DOWN_RECHECK_TIME);
+         double hedge_budget = pt.get<double>("hedge_budget", DEFAULT_HEDGE_BUDGET) / 100.0;
+         double hedge_percentile = pt.get<double>("hedge_percentile", DEFAULT_HEDGE_PERCENTILE) / 100.0;
+         size_t hedge_window = pt.get<size_t>("hedge_window", DEFAULT_HEDGE_WINDOW);
 
          vecHostInfo vecHosts;
          if(hosts)
@@ -94,7 +106,8 @@ namespace rendermq
          if(vecHosts.size() && config && app_name)
          {
             //make sure that it has hosts to write to
-            lts_storage* storage = new lts_storage(vecHosts, *config, *app_name, version, concurrency, down_recheck_time);
+            lts_storage* storage = new lts_storage(vecHosts, *config, *app_name, version, concurrency, down_recheck_time,
+                                                   hedge_budget, hedge_percentile, hedge_window);
             if(storage->getHostCount())
                return storage;
             else
@@ -108,10 +121,15 @@ namespace rendermq
    } // anonymous namespace
 
 
-   lts_storage::lts_storage(const vecHostInfo& vecHosts, const string& config, const string& app_name, const string& version, const int& concurency, int down_recheck_time):
+   lts_storage::lts_storage(const vecHostInfo& vecHosts, const string& config, const string& app_name, const string& version, const int& concurency, int down_recheck_time,
+                            double hedge_budget, double hedge_percentile, size_t hedge_window):
       http_storage(false, concurency), app_name(app_name), version(version),
-      m_down_recheck_time(down_recheck_time)
+      m_down_recheck_time(down_recheck_time), m_hedge_budget(hedge_budget),
+      m_hedge_percentile(hedge_percentile), m_hedge_window(hedge_window), m_hedge_tokens(0.0)
    {
+      m_host_breaker_config.consecutive_failures = 1;
+      m_host_breaker_config.slow_time = 0;
+      m_host_breaker_config.open_time = m_down_recheck_time;
       this->pHashWrapper = boost::make_shared<hashWrapper>(config, vecHosts);
    }
 
@@ -162,37 +180,28 @@ namespace rendermq
 
    bool lts_storage::is_host_down(const std::pair<string, int> &host) const
    {
-      std::map<std::pair<string, int>, time_t>::iterator itr = m_hosts_down.find(host);
-      if (itr != m_hosts_down.end())
-      {
-         time_t now = time(NULL);
-         if (now > itr->second)
-         {
-            // time has elapsed - remove the record and treat as if it were
-            // not down.
-            m_hosts_down.erase(itr);
-            return false;
-         }
-         else
-         {
-            return true;
-         }
-      }
-      return false;
+      return !breaker_for(host).allow(time(NULL));
    }
 
    void lts_storage::host_is_down(const std::pair<string, int> &host) const
    {
-      time_t recheck_time = time(NULL) + m_down_recheck_time;
-      std::map<std::pair<string, int>, time_t>::iterator itr = m_hosts_down.find(host);
-      if (itr == m_hosts_down.end())
-      {
-         m_hosts_down.insert(make_pair(host, recheck_time));
-      }
-      else
+      breaker_for(host).record(false, 0, time(NULL));
+   }
+
+   void lts_storage::host_answered(const std::pair<string, int> &host, long msec) const
+   {
+      breaker_for(host).record(true, msec, time(NULL));
+   }
+
+   circuit_breaker &lts_storage::breaker_for(const std::pair<string, int> &host) const
+   {
+      breakers_t::iterator itr = m_host_breakers.find(host);
+      if (itr == m_host_breakers.end())
       {
-         itr->second = recheck_time;
+         string name = (boost::format("lts/%1%:%2%") % host.first % host.second).str();
+         itr = m_host_breakers.insert(make_pair(host, circuit_breaker::named(name, m_host_breaker_config))).first;
       }
+      return *itr->second;
    }
 
    shared_ptr<http::response> lts_storage::attempt_get_host(const tile_protocol &tile, int replica) const
@@ -202,7 +211,9 @@ namespace rendermq
 
       // if the host is down, then don't bother trying again - it's just
       // a waste of time and blocks other requests in the queue.
-      if (!is_host_down(hashedHost))
+      if (is_host_down(hashedHost))
+         had_error = true;
+      else
       {
          // try to get the tile
          try
@@ -215,7 +226,9 @@ namespace rendermq
             headers.push_back((boost::format("X-Replica: %1%") % replica).str());
 
             //curl to get the tile data, returns a shared_ptr, forget the last shared pointer we had
+            bt::ptime start = bt::microsec_clock::universal_time();
             response = http::get(url, boost::shared_ptr<CURL>(), headers, false, LTS_CONNECT_TIMEOUT);
+            host_answered(hashedHost, (bt::microsec_clock::universal_time() - start).total_milliseconds());
 
             int status_code = response->statusCode;
             if(status_code != 200)
@@ -228,6 +241,7 @@ namespace rendermq
                if (status_code != 404)
                {
                   LOG_WARNING((boost::format("getting LTS tile returned status code %1%") % status_code).str());
+                  had_error |= (status_code >= 500);
                }
             }
          }//couldn't get to the hosts
@@ -235,26 +249,110 @@ namespace rendermq
          {
             LOG_ERROR(boost::format("Runtime error getting LTS tile %1% from LTS host %2%, marking host as down. Error was: %3%") % tile % hashedHost.first % e.what());
             host_is_down(hashedHost);
+            had_error = true;
          }
       }
 
       return response;
    }
 
-   shared_ptr<tile_storage::handle> lts_storage::get(const tile_protocol &tile) const
+   shared_ptr<http::response> lts_storage::attempt_hedged_get(const tile_protocol &tile) const
    {
-      //for getting the response
-      shared_ptr<http::response> response;
+      std::pair<string, int> hosts[2] = { hashed_host(tile.x, tile.y, tile.z, 0), hashed_host(tile.x, tile.y, tile.z, 1) };
+
+      //if the primary is down then there's nothing to hedge, just go to the secondary
+      if (is_host_down(hosts[0]))
+         return attempt_get_host(tile, 1);
+
+      //each get earns a little of the budget for hedging
+      m_hedge_tokens = std::min(m_hedge_tokens + m_hedge_budget, HEDGE_BURST);
+
+      //hedge once the primary is slower than most of its recent gets, if there's
+      //budget left and somewhere to hedge to. otherwise only fail over to the replica.
+      bool replica_up = breaker_for(hosts[1]).available(time(NULL));
+      latency_window &latency = latency_for(hosts[0]);
+      long hedge_after = -1;
+      if (replica_up && m_hedge_tokens >= 1.0 && latency.size() >= HEDGE_MIN_SAMPLES)
+         hedge_after = latency.quantile(m_hedge_percentile);
+
+      string urls[2];
+      vector<string> headers[2];
+      for (int replica = 0; replica < 2; ++replica)
+      {
+         if (replica == 0 || replica_up)
+            urls[replica] = this->form_url(tile.x, tile.y, tile.z, tile.style, tile.format, replica);
+         headers[replica].push_back((boost::format("X-Replica: %1%") % replica).str());
+      }
 
-      //try to get the primary copy
-      response = attempt_get_host(tile, 0);
+      http::hedged_part parts[2];
+      try
+      {
+         if (http::hedgedGet(urls[0], headers[0], urls[1], headers[1], hedge_after, parts, LTS_CONNECT_TIMEOUT))
+            m_hedge_tokens -= 1.0;
+      }
+      catch(const std::exception &e)
+      {
+         LOG_ERROR(boost::format("Runtime error getting LTS tile %1%: %2%") % tile % e.what());
+         had_error = true;
+         return shared_ptr<http::response>();
+      }
 
-      if (!response) 
+      shared_ptr<http::response> response;
+      for (int replica = 0; replica < 2; ++replica)
       {
-         //try to get the secondary copy
-         response = attempt_get_host(tile, 1);
+         const http::hedged_part &part = parts[replica];
+         if (!part.sent)
+            continue;
+
+         //an abandoned get still took at least this long, so it counts too
+         latency_for(hosts[replica]).record(part.elapsed);
+
+         if (!part.error.empty())
+         {
+            LOG_ERROR(boost::format("Runtime error getting LTS tile %1% from LTS host %2%, marking host as down. Error was: %3%") % tile % hosts[replica].first % part.error);
+            host_is_down(hosts[replica]);
+            had_error = true;
+            continue;
+         }
+
+         //an abandoned get doesn't tell us whether the host is healthy
+         if (part.finished)
+            host_answered(hosts[replica], part.elapsed);
+
+         if (part.resp && part.resp->statusCode == 200)
+         {
+            if (!response)
+               response = part.resp;
+         }
+         //status code 404 (not found) is a perfectly normal runtime condition
+         else if (part.resp && part.resp->statusCode != 404)
+         {
+            LOG_WARNING((boost::format("getting LTS tile returned status code %1%") % part.resp->statusCode).str());
+            had_error |= (part.resp->statusCode >= 500);
+         }
       }
 
+      return response;
+   }
+
+   latency_window &lts_storage::latency_for(const std::pair<string, int> &host) const
+   {
+      latencies_t::iterator itr = m_latencies.find(host);
+      if (itr == m_latencies.end())
+         itr = m_latencies.insert(make_pair(host, latency_window(m_hedge_window))).first;
+      return itr->second;
+   }
+
+   shared_ptr<tile_storage::handle> lts_storage::get(const tile_protocol &tile) const
+   {
+      //try to get the primary copy, and the secondary if that's slow or fails
+      had_error = false;
+      shared_ptr<http::response> response = attempt_hedged_get(tile);
+
+      //it's only an error if neither copy could be got
+      if (response)
+         had_error = false;
+
       if (!response)
       {
          //return a bad response
@@ -267,6 +365,85 @@ namespace rendermq
       return shared_ptr<tile_storage::handle> (new handle(response));
    }
 
+   void lts_storage::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+   {
+      //tiles which haven't been found yet, tried first on the primary and then the secondary
+      vector<size_t> remaining;
+      for (size_t i = 0; i < tiles.size(); ++i)
+         remaining.push_back(i);
+      had_error = false;
+
+      for (int replica = 0; replica < 2 && !remaining.empty(); ++replica)
+      {
+         //ask for all the tiles at once, except those on hosts which are known to be down
+         vector<string> urls;
+         vector<size_t> asked, missing;
+         typedef std::pair<string, int> host_t;
+         std::set<host_t> asked_hosts;
+         BOOST_FOREACH(size_t i, remaining)
+         {
+            const tile_protocol &tile = tiles[i];
+            host_t host = hashed_host(tile.x, tile.y, tile.z, replica);
+            if (asked_hosts.count(host) == 0 && is_host_down(host))
+            {
+               missing.push_back(i);
+               had_error = true;
+            }
+            else
+            {
+               urls.push_back(this->form_url(tile.x, tile.y, tile.z, tile.style, tile.format, replica));
+               asked.push_back(i);
+               asked_hosts.insert(host);
+            }
+         }
+
+         vector<shared_ptr<http::response> > responses;
+         if (!urls.empty())
+         {
+            vector<string> headers;
+            headers.push_back((boost::format("X-Replica: %1%") % replica).str());
+            try
+            {
+               //the hosts all answered, but the time the whole batch took
+               //says nothing about how long each of them took
+               responses = http::multiGet(urls, concurrency, connection, headers);
+               BOOST_FOREACH(const host_t &host, asked_hosts)
+                  host_answered(host, -1);
+            }
+            catch(const std::exception &e)
+            {
+               LOG_ERROR(boost::format("Runtime error getting %1% LTS tiles from replica %2%: %3%") % urls.size() % replica % e.what());
+               had_error = true;
+            }
+         }
+
+         for (size_t j = 0; j < asked.size(); ++j)
+         {
+            if (j < responses.size() && responses[j]->statusCode == 200)
+               callback(asked[j], shared_ptr<tile_storage::handle>(new handle(responses[j])));
+            else
+            {
+               //as for get, a 404 is a perfectly normal runtime condition
+               if (j < responses.size() && responses[j]->statusCode != 404)
+               {
+                  LOG_WARNING((boost::format("getting LTS tile returned status code %1%") % responses[j]->statusCode).str());
+                  had_error |= (responses[j]->statusCode >= 500);
+               }
+               missing.push_back(asked[j]);
+            }
+         }
+         remaining.swap(missing);
+      }
+
+      //errors on the primary don't matter if the replica had everything
+      if (remaining.empty())
+         had_error = false;
+
+      //return a bad response for the rest
+      BOOST_FOREACH(size_t i, remaining)
+         callback(i, shared_ptr<tile_storage::handle>(new handle(shared_ptr<http::response>(new http::response()))));
+   }
+
    bool lts_storage::get_meta(const tile_protocol &tile, string &metatile) const
    {
       //get the requests
@@ -274,6 +451,7 @@ namespace rendermq
       vector<string> requests = make_get_urls(tile, true);
       //place to keep the responses
       vector<shared_ptr<http::response> > responses0;
+      had_error = false;
 
       //try to get the first copy
       bool ret0 = (concurrency < 2 ? get_meta_serial(requests, headers, responses0) : get_meta_parallel(requests, headers, responses0));
@@ -317,6 +495,7 @@ namespace rendermq
          make_metatile(tile, responses0, metatile);
 
       //if we made it here we had enough to make the metatile
+      had_error = false;
       return true;
    }
 
@@ -354,6 +533,48 @@ namespace rendermq
       return ret1 || ret2;
    }
 
+   bool lts_storage::put_meta_many(const vector<tile_protocol> &tiles, const vector<string> &metatiles) const
+   {
+      if (tiles.size() != metatiles.size())
+         throw std::invalid_argument("Different numbers of tiles and metatiles to put.");
+
+      //the requests for all the metatiles are put together, for each copy
+      typedef vector<pair<string, vector<http::part> > > requests_t;
+      requests_t requests, replicaRequests;
+      for (size_t i = 0; i < tiles.size(); ++i)
+      {
+         requests_t tileRequests = make_put_requests(tiles[i], metatiles[i]);
+         vector<string> secondaryUrls = make_replica_urls(tiles[i], metatiles[i]);
+         requests.insert(requests.end(), tileRequests.begin(), tileRequests.end());
+         for (size_t j = 0; j < tileRequests.size() && j < secondaryUrls.size(); ++j)
+            replicaRequests.push_back(make_pair(secondaryUrls[j], tileRequests[j].second));
+      }
+
+      //the urls have moved about, so point the parts back at them
+      requests_t* both[] = { &requests, &replicaRequests };
+      BOOST_FOREACH(requests_t* reqs, both)
+      {
+         for (requests_t::iterator request = reqs->begin(); request != reqs->end(); request++)
+         {
+            request->second.front().fileName = request->first.c_str();
+            request->second.front().position = 0;
+         }
+      }
+
+      //put the first copies and then the second
+      std::time_t now = std::time(0);
+      vector<string> headers = this->make_headers(&now, "X-Replica: 0", (char*)NULL);
+      bool ret1 = (concurrency < 2 ? put_meta_serial(requests, headers) : put_meta_parallel(requests, headers));
+      headers = this->make_headers(&now, "X-Replica: 1", (char*)NULL);
+      bool ret2 = (concurrency < 2 ? put_meta_serial(replicaRequests, headers) : put_meta_parallel(replicaRequests, headers));
+
+      //as for put_meta, it's only a failure if both copies fail
+      if(!ret1 && !ret2)
+         this->expire_many(tiles);
+
+      return ret1 || ret2;
+   }
+
    vector<pair<string, vector<http::part> > > lts_storage::make_put_requests(const tile_protocol &tile, const string &metatile) const
    {
       //the requests
@@ -367,7 +588,7 @@ namespace rendermq
       for(vector<meta_layout*>::const_iterator metaHeader = metaHeaders.begin(); metaHeader != metaHeaders.end(); metaHeader++)
       {
          //get the format
-         protoFmt format = (protoFmt)(*metaHeader)->fmt;
+         protoFmt format = (protoFmt)(*metaHeader)->format();
          //save the mime type
          const char* mime = rendermq::mime_type_for(format).c_str();
          //for each tile
@@ -441,7 +662,7 @@ namespace rendermq
       for(vector<meta_layout*>::const_iterator metaHeader = metaHeaders.begin(); metaHeader != metaHeaders.end(); metaHeader++)
       {
          //get the format
-         protoFmt format = (protoFmt)(*metaHeader)->fmt;
+         protoFmt format = (protoFmt)(*metaHeader)->format();
          //TODO: make this get the secondary server for each tile
          for(int i = 0; i < (*metaHeader)->count; i++)
             //only send this if there is an actual tile here
@@ -462,6 +683,33 @@ namespace rendermq
       return make_headers(&invalid, is_primary ? primary_hdr : replica_hdr, (char*)NULL);
    }
 
+   bool lts_storage::expire_many(const vector<tile_protocol> &tiles) const
+   {
+      //all the urls for each copy go in the one multi-get
+      vector<string> primaryUrls, replicaUrls;
+      BOOST_FOREACH(const tile_protocol &tile, tiles)
+      {
+         vector<string> urls = make_get_urls(tile, true);
+         primaryUrls.insert(primaryUrls.end(), urls.begin(), urls.end());
+         urls = make_get_urls(tile, false);
+         replicaUrls.insert(replicaUrls.end(), urls.begin(), urls.end());
+      }
+
+      had_error = false;
+      try
+      {
+         http::multiGet(primaryUrls, concurrency, connection, expiry_headers(true));
+         http::multiGet(replicaUrls, concurrency, connection, expiry_headers(false));
+      }
+      catch(const std::runtime_error& e)
+      {
+         LOG_ERROR(boost::format("Runtime error while expiring %1% LTS tiles: %2%") % tiles.size() % e.what());
+         had_error = true;
+         return false;
+      }
+      return true;
+   }
+
    bool lts_storage::expire(const tile_protocol &tile) const
    {
       //do a get with time stamp set to invalid
@@ -474,6 +722,7 @@ namespace rendermq
       const vector<string> replicaHeaders = expiry_headers(false);
 
       //parallelize the requests
+      had_error = false;
       try
       {
          //expire primary copy
@@ -484,6 +733,7 @@ namespace rendermq
       catch(const std::runtime_error& e)
       {
          LOG_ERROR(boost::format("Runtime error while expiring LTS tile: %1%") % e.what());
+         had_error = true;
          return false;
       }
       return true;
@@ -29,6 +29,8 @@
 
 #include "http_storage.hpp"
 #include "hashwrapper.hpp"
+#include "latency_window.hpp"
+#include "circuit_breaker.hpp"
 
 namespace rendermq
 {
@@ -37,7 +39,8 @@ namespace rendermq
    {
       public:
 
-         lts_storage(const vecHostInfo& vecHosts,const string& config, const string& app_name, const string& version, const int& concurrency = 1, int down_recheck_time = 300);
+         lts_storage(const vecHostInfo& vecHosts,const string& config, const string& app_name, const string& version, const int& concurrency = 1, int down_recheck_time = 300,
+                     double hedge_budget = 0.0, double hedge_percentile = 0.95, size_t hedge_window = 100);
          virtual ~lts_storage();
          //get a single tile in a single format
          virtual boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
@@ -47,6 +50,12 @@ namespace rendermq
          virtual bool put_meta(const tile_protocol &tile, const string &metatile) const;
          //expires a tile by setting last modified to invalid (easiest way to expire them)
          virtual bool expire(const tile_protocol &tile) const;
+         //get many tiles with one multi-get per replica
+         virtual void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+         //put many metatiles with one multi-post per replica
+         virtual bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &metatiles) const;
+         //expire many metatiles with one multi-get per replica
+         virtual bool expire_many(const std::vector<tile_protocol> &tiles) const;
          //returns the total number of hashable hosts
          virtual unsigned int getHostCount() const {return pHashWrapper->getHostCount();}
 
@@ -73,13 +82,28 @@ namespace rendermq
          // (null) on error.
          boost::shared_ptr<http::response> attempt_get_host(const tile_protocol &tile, int replica) const;
 
+         // attempt a get from the primary, hedged by also trying the replica if
+         // the primary is slow compared to its recent latencies, or failing over
+         // to it if the primary fails. returns the first good response, or an
+         // empty shared pointer if neither had one.
+         boost::shared_ptr<http::response> attempt_hedged_get(const tile_protocol &tile) const;
+
+         // the recent latencies for a host
+         latency_window &latency_for(const std::pair<string, int> &host) const;
+
          // make the host for a particular tile and replica
          std::pair<string, int> hashed_host(int x, int y, int z, unsigned int replica) const;
 
-         // check if a host has been marked down or not
+         // check if a host has been marked down or not. if the host is due to be
+         // rechecked, this lets the request through as the check.
          bool is_host_down(const std::pair<string, int> &host) const;
          // mark a host as down, which will prevent it being checked for some time period
          void host_is_down(const std::pair<string, int> &host) const;
+         // note that a host answered, and how long it took if that's known
+         // (otherwise negative)
+         void host_answered(const std::pair<string, int> &host, long msec) const;
+         // the circuit breaker which keeps track of whether a host is down
+         circuit_breaker &breaker_for(const std::pair<string, int> &host) const;
 
          shared_ptr<hashWrapper> pHashWrapper;
          const string app_name;
@@ -99,8 +123,29 @@ namespace rendermq
             }
          };
 
-         // maps the host into the time it was last checked as down
-         mutable std::map<std::pair<string,int>, time_t, cmp_pair> m_hosts_down;
+         // a host is down as soon as there's an error, and stays down for 
+         // m_down_recheck_time seconds before it's checked again. slow 
+         // answers don't count as errors.
+         circuit_breaker::config m_host_breaker_config;
+
+         // the breakers for each host, which are shared with the other lts
+         // storage objects in the process.
+         typedef std::map<std::pair<string,int>, boost::shared_ptr<circuit_breaker>, cmp_pair> breakers_t;
+         mutable breakers_t m_host_breakers;
+
+         // fraction of extra requests which may be spent on hedging, the 
+         // percentile of a host's recent latencies after which to hedge and
+         // how many of those latencies to keep.
+         const double m_hedge_budget, m_hedge_percentile;
+         const size_t m_hedge_window;
+
+         // hedges which can be sent right now. each get earns a fraction of
+         // one, up to a small burst, and each hedge spends one.
+         mutable double m_hedge_tokens;
+
+         // recent latencies of gets from each host
+         typedef std::map<std::pair<string,int>, latency_window, cmp_pair> latencies_t;
+         mutable latencies_t m_latencies;
    };
 
 }
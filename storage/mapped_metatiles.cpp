@@ -0,0 +1,132 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "mapped_metatiles.hpp"
+#include "../logging/logger.hpp"
+#include <boost/format.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using boost::shared_ptr;
+using std::string;
+
+namespace rendermq 
+{
+
+mapped_metatiles::mapping::mapping(const char *d, size_t s)
+   : data(d), size(s)
+{
+}
+
+mapped_metatiles::mapping::~mapping()
+{
+   munmap((void *)data, size);
+}
+
+mapped_metatiles::mapped_metatiles(size_t max_size)
+   : m_max_size(max_size), m_hits(0), m_misses(0)
+{
+}
+
+shared_ptr<const mapped_metatiles::mapping>
+mapped_metatiles::lookup(const char *path, std::time_t &mtime)
+{
+   struct stat st;
+   if (stat(path, &st) != 0)
+   {
+      return shared_ptr<const mapping>();
+   }
+   mtime = st.st_mtime;
+
+   const string key(path);
+   map_t::iterator itr = m_entries.find(key);
+   if (itr != m_entries.end())
+   {
+      // the same file as was mapped, so only its timestamp can have
+      // changed.
+      if ((itr->second.dev == st.st_dev) && (itr->second.ino == st.st_ino) && 
+          (itr->second.map->size == size_t(st.st_size)))
+      {
+         m_lru.splice(m_lru.begin(), m_lru, itr->second.lru);
+         ++m_hits;
+         return itr->second.map;
+      }
+      erase(itr);
+   }
+   ++m_misses;
+
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+   {
+      return shared_ptr<const mapping>();
+   }
+   // map the file which was opened, in case it was replaced since the
+   // stat above.
+   void *addr = MAP_FAILED;
+   if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+   {
+      addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED)
+      {
+         LOG_ERROR(boost::format("Can't map meta file %1%: %2%") % path % strerror(errno));
+      }
+   }
+   close(fd);
+   if (addr == MAP_FAILED)
+   {
+      return shared_ptr<const mapping>();
+   }
+   mtime = st.st_mtime;
+
+   while (!m_entries.empty() && (m_entries.size() >= m_max_size))
+   {
+      erase(m_entries.find(m_lru.back()));
+   }
+
+   shared_ptr<const mapping> map(new mapping((const char *)addr, st.st_size));
+   if (m_max_size > 0)
+   {
+      value &slot = m_entries[key];
+      slot.map = map;
+      slot.dev = st.st_dev;
+      slot.ino = st.st_ino;
+      m_lru.push_front(key);
+      slot.lru = m_lru.begin();
+   }
+   return map;
+}
+
+void
+mapped_metatiles::erase(map_t::iterator itr)
+{
+   m_lru.erase(itr->second.lru);
+   m_entries.erase(itr);
+}
+
+} // namespace rendermq
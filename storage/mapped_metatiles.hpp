@@ -0,0 +1,104 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_MAPPED_METATILES_HPP
+#define RENDERMQ_MAPPED_METATILES_HPP
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <sys/types.h>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <list>
+#include <map>
+
+namespace rendermq 
+{
+
+/* a bounded, least-recently-used set of metatile files mapped into 
+ * memory, so that tiles can be read straight out of the page cache
+ * without a read into a buffer first.
+ *
+ * the file is stat'ed on each lookup, so that a metatile which has
+ * been replaced (disk storage always renames a new file into place)
+ * is mapped afresh, and one which has been expired gets its new 
+ * timestamp. a mapping stays valid for as long as anything holds on
+ * to it, even after it's dropped from the cache. metatiles must never
+ * be truncated in place, or reading such a mapping would fault.
+ *
+ * this isn't locked, so each thread needs its own.
+ */
+class mapped_metatiles
+{
+public:
+   struct mapping
+      : private boost::noncopyable
+   {
+      mapping(const char *data, size_t size);
+      ~mapping();
+
+      const char *const data;
+      const size_t size;
+   };
+
+   explicit mapped_metatiles(size_t max_size);
+
+   /* the mapping of the metatile at path and its modification time,
+    * or a null mapping if there's no such file or it can't be mapped.
+    */
+   boost::shared_ptr<const mapping> lookup(const char *path, std::time_t &mtime);
+
+   size_t size() const { return m_entries.size(); }
+   uint64_t hits() const { return m_hits; }
+   uint64_t misses() const { return m_misses; }
+
+private:
+   typedef std::list<std::string> lru_list_t;
+
+   struct value
+   {
+      boost::shared_ptr<const mapping> map;
+      dev_t dev;
+      ino_t ino;
+      // position in the recency list, so that it can be moved to the
+      // front in constant time.
+      lru_list_t::iterator lru;
+   };
+
+   typedef std::map<std::string, value> map_t;
+
+   void erase(map_t::iterator itr);
+
+   const size_t m_max_size;
+   map_t m_entries;
+   // most recently used at the front.
+   lru_list_t m_lru;
+   uint64_t m_hits, m_misses;
+};
+
+} // namespace rendermq
+
+#endif // RENDERMQ_MAPPED_METATILES_HPP
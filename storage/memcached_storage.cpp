@@ -25,6 +25,8 @@
 
 #include <sstream>
 #include <cassert>
+#include <map>
+#include <vector>
 #include <boost/make_shared.hpp>
 
 #include <libmemcached/memcached.h>
@@ -66,6 +68,10 @@ tile_storage* create_memcached_storage(boost::property_tree::ptree const& pt,
 
 const bool registered = register_tile_storage("memcached", create_memcached_storage);
 
+// memcached flag for a tile which its metatile header said was gzip
+// compressed, as the header itself isn't stored.
+const uint32_t flag_gzip = 1;
+
 } // anonymous namespace
 
 bool
@@ -77,7 +83,8 @@ memcached_storage::handle::data(string& output) const
 
 memcached_storage::memcached_storage(const std::string& options, int expire_in_minutes) :
    expire_in_seconds(expire_in_minutes * 60),
-   memcache(memcached(options.c_str(), options.size()))
+   memcache(memcached(options.c_str(), options.size())),
+   had_error(false)
 {
    LOG_INFO(boost::format("Initializing memcached storage with expire=[%1% minutes], options=[%2%].") % expire_in_minutes % options);
    if (!memcache) {
@@ -102,6 +109,11 @@ shared_ptr<tile_storage::handle> memcached_storage::get(const tile_protocol& til
    uint32_t flags;
    memcached_return_t error;
    char* value = memcached_get(memcache, key.c_str(), key.size(), &value_length, &flags, &error);
+   had_error = (value == NULL && error != MEMCACHED_NOTFOUND);
+   if (had_error) {
+      LOG_ERROR(boost::format("Can not get tile from memcached (%1%).") % memcached_strerror(memcache, error));
+      return shared_ptr<tile_storage::handle>(new null_handle());
+   }
    if (value == NULL) {
       LOG_DEBUG("memcached_storage::get(): tile not found");
       return shared_ptr<tile_storage::handle>(new null_handle());
@@ -111,7 +123,65 @@ shared_ptr<tile_storage::handle> memcached_storage::get(const tile_protocol& til
    free(value);
 
    LOG_DEBUG("memcached_storage::get(): tile found");
-   return boost::make_shared<handle>(std::make_pair(data.begin(), data.end()));
+   return boost::make_shared<handle>(std::make_pair(data.begin(), data.end()), (flags & flag_gzip) != 0);
+}
+
+/* Ask for all the keys at once and hand back the tiles as memcached
+ * returns them. Anything it doesn't return wasn't there.
+ */
+void memcached_storage::get_many_async(const std::vector<tile_protocol>& tiles, const get_callback& callback) const
+{
+   LOG_DEBUG(boost::format("memcached_storage::get_many_async(%1% tiles)") % tiles.size());
+
+   // the same tile might be asked for more than once.
+   typedef std::map<std::string, std::vector<size_t> > key_map_t;
+   key_map_t positions;
+   for (size_t i = 0; i < tiles.size(); ++i) {
+      positions[key_string(tiles[i])].push_back(i);
+   }
+
+   std::vector<const char*> keys;
+   std::vector<size_t> key_lengths;
+   BOOST_FOREACH(const key_map_t::value_type& entry, positions) {
+      keys.push_back(entry.first.c_str());
+      key_lengths.push_back(entry.first.size());
+   }
+
+   memcached_return_t rc = keys.empty() ? MEMCACHED_SUCCESS :
+      memcached_mget(memcache, &keys[0], &key_lengths[0], keys.size());
+   had_error = (rc != MEMCACHED_SUCCESS);
+   if (had_error) {
+      LOG_ERROR(boost::format("Can not get tiles from memcached (%1%).") % memcached_strerror(memcache, rc));
+   }
+   else {
+      memcached_result_st* result;
+      while ((result = memcached_fetch_result(memcache, NULL, &rc)) != NULL) {
+         const std::string key(memcached_result_key_value(result), memcached_result_key_length(result));
+         const std::string data(memcached_result_value(result), memcached_result_length(result));
+         const bool gzipped = (memcached_result_flags(result) & flag_gzip) != 0;
+         memcached_result_free(result);
+
+         key_map_t::iterator itr = positions.find(key);
+         if (itr != positions.end()) {
+            BOOST_FOREACH(size_t i, itr->second) {
+               callback(i, boost::make_shared<handle>(std::make_pair(data.begin(), data.end()), gzipped));
+            }
+            positions.erase(itr);
+         }
+      }
+
+      // the fetch stops early, without getting to the end, if anything went wrong.
+      if (!keys.empty() && rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND) {
+         LOG_ERROR(boost::format("Can not fetch tiles from memcached (%1%).") % memcached_strerror(memcache, rc));
+         had_error = true;
+      }
+   }
+
+   BOOST_FOREACH(const key_map_t::value_type& entry, positions) {
+      BOOST_FOREACH(size_t i, entry.second) {
+         callback(i, shared_ptr<tile_storage::handle>(new null_handle()));
+      }
+   }
 }
 
 /* Create a string from the tile data that can be used as key for lookup in the memcache.
@@ -129,10 +199,16 @@ std::string memcached_storage::key_string(const tile_protocol& tile) const
    return key.str();
 }
 
+bool memcached_storage::last_error() const
+{
+   return had_error;
+}
+
 // this always returns false, because it is unclear how this should be implemented
 bool memcached_storage::get_meta(const tile_protocol& tile, std::string& data) const
 {
    LOG_DEBUG(boost::format("memcached_storage::get_meta(%1%)") % tile);
+   had_error = false;
 
    return false;
 }
@@ -145,6 +221,7 @@ bool memcached_storage::put_meta(const tile_protocol& tile, const std::string& b
    LOG_DEBUG(boost::format("memcached_storage::put_meta(%1%)") % tile);
 
    metatile_reader reader(buf, tile.format);
+   const uint32_t flags = (reader.initialized_ && reader.header_.gzipped()) ? flag_gzip : 0;
 
    tile_protocol subtile(tile);
    for (int x = 0; x < METATILE; ++x) {
@@ -156,7 +233,7 @@ bool memcached_storage::put_meta(const tile_protocol& tile, const std::string& b
          const std::string key = key_string(subtile);
          const char* value = &*(tile_data.first); // ugh!
          const int size = tile_data.second - tile_data.first;
-         memcached_return_t rc = memcached_set(memcache, key.c_str(), key.size(), value, size, expire_in_seconds, (uint32_t)0);
+         memcached_return_t rc = memcached_set(memcache, key.c_str(), key.size(), value, size, expire_in_seconds, flags);
          if (rc != MEMCACHED_SUCCESS) {
             LOG_ERROR(boost::format("Can not store tile in memcached (%1%).") % key);
             return false;
@@ -175,6 +252,7 @@ bool memcached_storage::expire(const tile_protocol& tile) const
    bool success = true;
    LOG_DEBUG(boost::format("memcached_storage::expire style=%1% z=%2% x=%3% y=%4%") % tile.style % tile.z % tile.x % tile.y);
 
+   had_error = false;
    tile_protocol subtile(tile);
    for (int x = 0; x < METATILE; ++x) {
       subtile.x = tile.x + x;
@@ -184,6 +262,11 @@ bool memcached_storage::expire(const tile_protocol& tile) const
          memcached_return_t rc = memcached_delete(memcache, key.c_str(), key.size(), 0);
          if (rc != MEMCACHED_SUCCESS) {
             success = false;
+            // tiles which were never cached, or have been evicted, are no error.
+            if (rc != MEMCACHED_NOTFOUND && !had_error) {
+               LOG_ERROR(boost::format("Can not expire tile in memcached (%1%).") % memcached_strerror(memcache, rc));
+               had_error = true;
+            }
          }
       }
    }
@@ -47,14 +47,16 @@ public:
    class handle : public tile_storage::handle
    {
    public:
-      handle(const std::pair<metatile_reader::iterator_type, metatile_reader::iterator_type>& p) : tile_data(p.first, p.second) {}
+      handle(const std::pair<metatile_reader::iterator_type, metatile_reader::iterator_type>& p, bool gzipped) : tile_data(p.first, p.second), gzip(gzipped) {}
       virtual ~handle() {}
       virtual bool exists() const { return true; }
       virtual std::time_t last_modified() const { return 0; }
       virtual bool data(std::string &) const;
       virtual bool expired() const { return false; }
+      virtual bool gzipped() const { return gzip; }
    private:
       std::string tile_data;
+      bool gzip;
    };
    friend class handle;
 
@@ -65,9 +67,16 @@ public:
    bool get_meta(const tile_protocol &tile, std::string &data) const;
    bool put_meta(const tile_protocol &tile, const std::string &buf) const;
    bool expire(const tile_protocol &tile) const;
+
+   // gets all the tiles with a single multi-get.
+   void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+
+   // whether the last get or expiry failed for some reason other than the key not being there.
+   bool last_error() const;
 private:
    int expire_in_seconds;
    memcached_st* memcache;
+   mutable bool had_error;
 
    std::string key_string(const tile_protocol &tile) const;
 };
@@ -34,33 +34,76 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <climits> // for PATH_MAX
+#include <cstdio> // for snprintf
 #include "meta_tile.hpp"
 #include "../logging/logger.hpp"
 
 #include <cstring> // for strlen
 #define META_MAGIC "META"
+#define DIGEST_MAGIC "DGST"
 
 namespace rendermq
 {
 
-   std::pair<std::string, int> xyz_to_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style)
+   namespace
    {
-      unsigned hash[5];
-      unsigned mask = METATILE - 1;
-      unsigned offset = (y & mask) * METATILE + (x & mask);
-      x &= ~mask;
-      y &= ~mask;
-      for(unsigned i = 0; i < 5; i++)
+      // the directory hashes for the metatile containing x, y, returning 
+      // the tile's index in the metatile.
+      unsigned meta_hash(int x, int y, unsigned hash[5])
+      {
+         unsigned mask = METATILE - 1;
+         unsigned offset = (y & mask) * METATILE + (x & mask);
+         x &= ~mask;
+         y &= ~mask;
+         for(unsigned i = 0; i < 5; i++)
+         {
+            hash[i] = ((x & 0x0f) << 4) | (y & 0x0f);
+            x >>= 4;
+            y >>= 4;
+         }
+         return offset;
+      }
+   }
+
+   ssize_t read_fully(int fd, char *buf, size_t len, off_t offset)
+   {
+      size_t pos = 0;
+      while(pos < len)
       {
-         hash[i] = ((x & 0x0f) << 4) | (y & 0x0f);
-         x >>= 4;
-         y >>= 4;
+         ssize_t got = pread(fd, buf + pos, len - pos, offset + pos);
+         if(got < 0)
+            return -1;
+         else if(got == 0)
+            break;
+         pos += got;
       }
+      return pos;
+   }
+
+   std::pair<std::string, int> xyz_to_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style)
+   {
+      unsigned hash[5];
+      unsigned offset = meta_hash(x, y, hash);
       std::string path = (boost::format("%s/%s/%d/%u/%u/%u/%u/%u.meta") % tile_dir % style % z % hash[4] % hash[3] % hash[2]
                % hash[1] % hash[0]).str();
       return std::make_pair(path, offset);
    }
 
+   int xyz_to_meta_path(char *path, size_t len, std::string const& tile_dir, int x, int y, int z,
+            std::string const &style)
+   {
+      unsigned hash[5];
+      unsigned offset = meta_hash(x, y, hash);
+      int n = snprintf(path, len, "%s/%s/%d/%u/%u/%u/%u/%u.meta", tile_dir.c_str(), style.c_str(), z, 
+               hash[4], hash[3], hash[2], hash[1], hash[0]);
+      if((n < 0) || (size_t(n) >= len))
+         return -1;
+      return offset;
+   }
+
    int xyz_to_meta_offset(const int& x, const int& y, const int& z)
    {
       unsigned char mask = METATILE - 1;
@@ -105,7 +148,8 @@ namespace rendermq
       return headers;
    }
 
-   std::string write_headers(const int& x, const int& y, const int& z, const std::vector<protoFmt>& formats, const std::vector<int>& sizes)
+   std::string write_headers(const int& x, const int& y, const int& z, const std::vector<protoFmt>& formats, const std::vector<int>& sizes,
+            const std::vector<bool>& gzipped)
    {
       //create a header
       struct meta_layout header;
@@ -137,6 +181,9 @@ namespace rendermq
       {
          //set the format
          header.fmt = *f;
+         const size_t n = f - formats.begin();
+         if(n < gzipped.size() && gzipped[n])
+            header.fmt |= meta_layout::flag_gzip;
          //calculate the offsets and sizes
          for(int i = 0; i < header.count; i++, size++)
          {
@@ -155,99 +202,210 @@ namespace rendermq
       return headers;
    }
 
-   int read_from_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style, unsigned char* buf,
-            size_t sz, int fmt)
+   int find_in_meta(const char *path, const char *header, size_t len, int fmt, int index,
+            size_t &offset, size_t &size, bool *gzipped)
    {
-      char header[4096];
-      std::pair<std::string, int> metatile = xyz_to_meta(tile_dir, x, y, z, style);
-
-      int fd = open(metatile.first.c_str(), O_RDONLY);
-      if(fd < 0)
-         return -1;
-
-      unsigned pos = 0;
-      while(pos < sizeof(header))
-      {
-         size_t len = sizeof(header) - pos;
-         int got = read(fd, header + pos, len);
-         if(got < 0)
-         {
-            close(fd);
-            return -2;
-         }
-         else
-            if(got > 0)
-            {
-               pos += got;
-            }
-            else
-            {
-               break;
-            }
-      }
-
       // search for the correct format metatile header.
       size_t n_header = 0;
-      struct meta_layout *m = NULL;
+      const struct meta_layout *m = NULL;
       do
       {
-         m = (struct meta_layout *)(header + n_header * metaTile::header_size);
-         if(pos < (n_header + 1) * metaTile::header_size)
+         m = (const struct meta_layout *)(header + n_header * metaTile::header_size);
+         if(len < (n_header + 1) * metaTile::header_size)
          {
-            LOG_ERROR(boost::format("Meta file %1% too small to contain header") % metatile.first);
+            LOG_ERROR(boost::format("Meta file %1% too small to contain header") % path);
             return -3;
          }
          if(memcmp(m->magic, META_MAGIC, strlen(META_MAGIC)))
          {
-            LOG_WARNING(boost::format("Meta file %1% header magic mismatch") % metatile.first);
+            LOG_WARNING(boost::format("Meta file %1% header magic mismatch") % path);
             return -4;
          }
          ++n_header;
-      }while(m->fmt != fmt);
+      }while(m->format() != fmt);
 
       // Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
       if(m->count != (METATILE * METATILE))
       {
          LOG_WARNING(boost::format("Meta file %1% header bad count %2% != %3%")
-                     % metatile.first % m->count % (METATILE * METATILE));
+                     % path % m->count % (METATILE * METATILE));
          return -5;
       }
 
-      size_t file_offset = m->index[metatile.second].offset;
-      size_t tile_size = m->index[metatile.second].size;
+      offset = m->index[index].offset;
+      size = m->index[index].size;
+      if(gzipped)
+         *gzipped = m->gzipped();
+      return 0;
+   }
+
+   int read_from_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style, unsigned char* buf,
+            size_t sz, int fmt)
+   {
+      char path[PATH_MAX];
+      int index = xyz_to_meta_path(path, sizeof(path), tile_dir, x, y, z, style);
+      if(index < 0)
+         return -1;
+
+      std::time_t mtime;
+      return read_from_meta(path, index, fmt, buf, sz, mtime);
+   }
+
+   int read_from_meta(const char *path, int index, int fmt, unsigned char* buf, size_t sz, std::time_t &mtime,
+            bool *gzipped)
+   {
+      int fd = open(path, O_RDONLY);
+      if(fd < 0)
+         return -1;
+
+      struct stat st;
+      char header[metaTile::max_headers_size];
+      ssize_t header_len = -1;
+      if(fstat(fd, &st) == 0)
+         header_len = read_fully(fd, header, sizeof(header), 0);
+      if(header_len < 0)
+      {
+         close(fd);
+         return -2;
+      }
+      mtime = st.st_mtime;
 
-      if(lseek(fd, file_offset, SEEK_SET) < 0)
+      size_t file_offset = 0, tile_size = 0;
+      int found = find_in_meta(path, header, header_len, fmt, index, file_offset, tile_size, gzipped);
+      if(found < 0)
       {
-         LOG_ERROR(boost::format("Meta file %1% seek error %2%") % metatile.first % m->count);
-         return -6;
+         close(fd);
+         return found;
       }
+
       if(tile_size > sz)
       {
-         LOG_WARNING(boost::format("Truncating tile %1% to fit buffer of %1%") % tile_size % sz);
+         LOG_WARNING(boost::format("Truncating tile %1% to fit buffer of %2%") % tile_size % sz);
          tile_size = sz;
       }
-      pos = 0;
-      while(pos < tile_size)
+
+      // small tiles near the start of the metatile have already been read
+      // along with the header.
+      ssize_t got = tile_size;
+      if(file_offset + tile_size <= size_t(header_len))
+         memcpy(buf, header + file_offset, tile_size);
+      else
+         got = read_fully(fd, (char *)buf, tile_size, file_offset);
+      close(fd);
+      return (got < 0) ? -7 : got;
+   }
+
+   uint64_t tile_digest(const char *data, size_t size)
+   {
+      // 64-bit FNV-1a. this isn't for security, just to tell whether a
+      // re-rendered tile has come out the same as it was before.
+      uint64_t hash = 14695981039346656037ULL;
+      for(size_t i = 0; i < size; ++i)
       {
-         size_t len = tile_size - pos;
-         int got = read(fd, buf + pos, len);
-         if(got < 0)
+         hash ^= (unsigned char)data[i];
+         hash *= 1099511628211ULL;
+      }
+      return (hash == 0) ? 1 : hash;
+   }
+
+   std::vector<meta_digest> make_digests(const std::string &buf, std::time_t timestamp)
+   {
+      std::vector<meta_digest> digests;
+      const size_t limit = buf.size() - digests_size(buf);
+      std::vector<meta_layout*> headers = read_headers(buf, ~0);
+
+      for(std::vector<meta_layout*>::const_iterator h = headers.begin(); h != headers.end(); ++h)
+      {
+         meta_digest d;
+         memset(&d, 0, sizeof(d));
+         memcpy(d.magic, DIGEST_MAGIC, strlen(DIGEST_MAGIC));
+         d.count = int(headers.size());
+         d.fmt = (*h)->format();
+         d.timestamp = timestamp;
+         const int count = std::min((*h)->count, METATILE * METATILE);
+         for(int i = 0; i < count; ++i)
          {
-            close(fd);
-            return -7;
-         }
-         else
-            if(got > 0)
+            const entry &e = (*h)->index[i];
+            if((e.offset >= 0) && (e.size >= 0) && (size_t(e.offset) + size_t(e.size) <= limit))
             {
-               pos += got;
-            }
-            else
-            {
-               break;
+               d.digest[i] = tile_digest(buf.data() + e.offset, e.size);
             }
+         }
+         digests.push_back(d);
+      }
+
+      return digests;
+   }
+
+   bool same_digests(const std::vector<meta_digest> &a, const std::vector<meta_digest> &b)
+   {
+      if(a.empty() || (a.size() != b.size()))
+         return false;
+
+      for(size_t i = 0; i < a.size(); ++i)
+      {
+         if((a[i].fmt != b[i].fmt) || (a[i].digest != b[i].digest))
+            return false;
+      }
+      return true;
+   }
+
+   size_t digests_size(const std::string &buf)
+   {
+      meta_digest last;
+      if(buf.size() < sizeof(last))
+         return 0;
+
+      memcpy(&last, buf.data() + buf.size() - sizeof(last), sizeof(last));
+      if(!last.magic_ok() || (last.count <= 0) || (size_t(last.count) * sizeof(last) > buf.size()))
+         return 0;
+
+      return size_t(last.count) * sizeof(last);
+   }
+
+   std::string write_digests(const std::vector<meta_digest> &digests)
+   {
+      std::string out;
+      for(std::vector<meta_digest>::const_iterator d = digests.begin(); d != digests.end(); ++d)
+      {
+         out.append((const char *)&(*d), sizeof(meta_digest));
       }
+      return out;
+   }
+
+   bool read_digests(std::string const& path, std::vector<meta_digest> &digests)
+   {
+      int fd = open(path.c_str(), O_RDONLY);
+      if(fd < 0)
+         return false;
+
+      struct stat st;
+      bool ok = (fstat(fd, &st) == 0) && read_digests(fd, 0, st.st_size, digests);
+
       close(fd);
-      return pos;
+      return ok;
+   }
+
+   bool read_digests(int fd, off_t start, size_t size, std::vector<meta_digest> &digests)
+   {
+      meta_digest last;
+      const off_t end = start + size;
+      bool ok = (size >= sizeof(last)) &&
+         (pread(fd, &last, sizeof(last), end - sizeof(last)) == ssize_t(sizeof(last))) &&
+         last.magic_ok() && (last.count > 0) && (size_t(last.count) * sizeof(last) <= size);
+
+      if(ok)
+      {
+         const size_t len = size_t(last.count) * sizeof(last);
+         digests.resize(last.count);
+         ok = (pread(fd, &digests[0], len, end - len) == ssize_t(len));
+         for(size_t i = 0; ok && (i < digests.size()); ++i)
+         {
+            ok = digests[i].magic_ok();
+         }
+      }
+
+      return ok;
    }
 
    metaTile::metaTile(int x, int y, int z, std::string const &style) :
@@ -347,7 +505,7 @@ namespace rendermq
          std::copy(data_ + offset * sizeof(header_), data_ + (offset + 1) * sizeof(header_), reinterpret_cast<char*> (&header_));
 
          // exit when the one that is being searched for is found.
-         if(header_.fmt == fmt)
+         if(header_.format() == fmt)
          {
             initialized_ = header_.magic_ok();
             break;
@@ -30,6 +30,9 @@
 #include <string>
 #include <boost/array.hpp>
 #include <vector>
+#include <ctime>
+#include <stdint.h>
+#include <sys/types.h>
 #include "../tile_utils.hpp"
 
 // how wide and high a metatile is, in tiles
@@ -46,6 +49,11 @@ namespace rendermq
 
    struct meta_layout
    {
+         // flags kept in fmt above the protoFmt bits, saying how the
+         // tiles in that format are stored.
+         static const int flag_gzip = 0x10000;  // each tile is gzip compressed
+         static const int flags_mask = ~0xffff;
+
          char magic[4];
          int count;
          int x, y, z, fmt;
@@ -55,6 +63,32 @@ namespace rendermq
          {
             return ((magic[0] == 'M') && (magic[1] == 'E') && (magic[2] == 'T') && (magic[3] == 'A'));
          }
+
+         // the protoFmt of the tiles, without any flags.
+         int format() const { return fmt & ~flags_mask; }
+         bool gzipped() const { return (fmt & flag_gzip) != 0; }
+   };
+
+   /* optional block appended to the end of a metatile, one per format,
+    * holding a digest of each tile's data. readers which go by the
+    * offsets in the index never look past the tile data, so they don't
+    * see these. every block carries the total count, so that they can
+    * be found by reading backwards from the end of the metatile.
+    */
+   struct meta_digest
+   {
+         char magic[4];
+         int count;
+         int fmt;
+         int reserved;
+         // the time at which the tiles first had this content.
+         int64_t timestamp;
+         boost::array<uint64_t, METATILE * METATILE> digest;
+
+         bool magic_ok() const
+         {
+            return ((magic[0] == 'D') && (magic[1] == 'G') && (magic[2] == 'S') && (magic[3] == 'T'));
+         }
    };
 
    class metaTile
@@ -72,6 +106,9 @@ namespace rendermq
          std::string style_;
          std::string tile[METATILE][METATILE];
       static const int header_size = sizeof(struct meta_layout);
+      // how much of the start of a metatile to read to be sure of
+      // getting the headers for all the formats in it.
+      static const int max_headers_size = 4096;
 
    };
 
@@ -89,15 +126,53 @@ namespace rendermq
    };
 
    std::pair<std::string, int> xyz_to_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style);
+   // writes the metatile path into a caller's buffer instead, returning the
+   // tile's index in the metatile, or -1 if the path doesn't fit.
+   int xyz_to_meta_path(char *path, size_t len, std::string const& tile_dir, int x, int y, int z,
+            std::string const &style);
    std::pair<int, int> xy_to_meta_xy(const int& x, const int& y);
    int xyz_to_meta_offset(const int& x, const int& y, const int& z);
    int get_meta_dimensions(const int& zoom, const int& limit = METATILE);
    int get_tile_count_in_meta(const int& zoom, const int& limit = METATILE);
 
    std::vector<meta_layout*> read_headers(const std::string& buf, const int& formatMask);
-   std::string write_headers(const int& x, const int& y, const int& z, const std::vector<protoFmt>& formats, const std::vector<int>& sizes);
+   // the headers of any formats which are true in gzipped are flagged as
+   // having gzip compressed tiles.
+   std::string write_headers(const int& x, const int& y, const int& z, const std::vector<protoFmt>& formats, const std::vector<int>& sizes,
+            const std::vector<bool>& gzipped = std::vector<bool>());
    int read_from_meta(std::string const& tile_dir, int x, int y, int z, std::string const &style, unsigned char* buf,
             size_t sz, int fmt);
+   // reads the tile at index in the metatile at path with one open, an fstat
+   // for the metatile's modification time and a pread or two. returns the 
+   // size of the tile, or a negative code as above. if gzipped is given,
+   // it's set to whether the metatile header flags the tile as compressed.
+   int read_from_meta(const char *path, int index, int fmt, unsigned char* buf, size_t sz, std::time_t &mtime,
+            bool *gzipped = NULL);
+   // reads as much of len bytes at offset as the file has, returning how
+   // many were read or -1 on error.
+   ssize_t read_fully(int fd, char *buf, size_t len, off_t offset);
+   // finds where a tile is in a metatile, given the start of it as read
+   // from path, which is only used in messages. returns zero if found,
+   // or one of the negative codes returned by read_from_meta.
+   int find_in_meta(const char *path, const char *header, size_t len, int fmt, int index,
+            size_t &offset, size_t &size, bool *gzipped = NULL);
+
+   // a digest of a single tile's data. never zero, so that zero can be used
+   // to mean "unknown".
+   uint64_t tile_digest(const char *data, size_t size);
+   // digests of all the tiles in the given metatile, ignoring any digests
+   // already present at the end of it.
+   std::vector<meta_digest> make_digests(const std::string &buf, std::time_t timestamp);
+   // whether two sets of digests are for exactly the same tiles.
+   bool same_digests(const std::vector<meta_digest> &a, const std::vector<meta_digest> &b);
+   // the number of bytes at the end of the metatile taken up by digests.
+   size_t digests_size(const std::string &buf);
+   std::string write_digests(const std::vector<meta_digest> &digests);
+   // reads the digests from the end of a metatile file, returning false if
+   // there aren't any.
+   bool read_digests(std::string const& path, std::vector<meta_digest> &digests);
+   // the same, for a metatile stored within a larger file.
+   bool read_digests(int fd, off_t start, size_t size, std::vector<meta_digest> &digests);
 
 }
 
@@ -66,6 +66,8 @@ class MercatorTilesController(BaseController):
 		'image/jpeg'
 		>>> get_image_content_type('jpeg')
 		'image/jpeg'
+		>>> get_image_content_type('webp')
+		'image/webp'
 		>>> get_image_content_type('unk')
 		'application/octet-stream'
 		'''
@@ -76,6 +78,8 @@ class MercatorTilesController(BaseController):
 			return 'image/png'
 		elif format == 'jpg' or format == 'jpeg':
 			return 'image/jpeg'
+		elif format == 'webp':
+			return 'image/webp'
 		elif format == 'json':
 			return 'application/json;charset=UTF-8'
 		else:
@@ -0,0 +1,233 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "open_metatiles.hpp"
+#include "../logging/logger.hpp"
+#include <boost/format.hpp>
+#include <boost/thread/mutex.hpp>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using std::string;
+
+// how many lookups each cache makes before adding its counts to the
+// totals, so that the lock isn't taken for every tile.
+#define FLUSH_INTERVAL (1024)
+
+namespace 
+{
+
+// the counts from all the caches.
+boost::mutex totals_mutex;
+uint64_t total_hits = 0, total_misses = 0, total_invalidations = 0;
+
+} // anonymous namespace
+
+namespace rendermq 
+{
+
+const meta_layout *
+open_metatiles::metatile::layout(int fmt) const
+{
+   for (size_t i = 0; i < formats.size(); ++i)
+   {
+      if (formats[i].format() == fmt)
+      {
+         return &formats[i];
+      }
+   }
+   return NULL;
+}
+
+bool
+open_metatiles::key::operator<(const key &other) const
+{
+   if (z != other.z) { return z < other.z; }
+   if (x != other.x) { return x < other.x; }
+   if (y != other.y) { return y < other.y; }
+   return style < other.style;
+}
+
+open_metatiles::open_metatiles(size_t max_size)
+   : m_max_size(max_size), m_hits(0), m_misses(0), m_invalidations(0),
+     m_flushed_hits(0), m_flushed_misses(0), m_flushed_invalidations(0)
+{
+}
+
+open_metatiles::~open_metatiles()
+{
+   while (!m_entries.empty())
+   {
+      erase(m_entries.begin());
+   }
+   flush_counts();
+}
+
+const open_metatiles::metatile *
+open_metatiles::lookup(const string &dir, int x, int y, int z, const string &style)
+{
+   if ((m_hits + m_misses) % FLUSH_INTERVAL == 0)
+   {
+      flush_counts();
+   }
+
+   const int mask = METATILE - 1;
+   key k;
+   k.style = style;
+   k.x = x & ~mask;
+   k.y = y & ~mask;
+   k.z = z;
+
+   map_t::iterator itr = m_entries.find(k);
+   if (itr != m_entries.end())
+   {
+      const metatile &meta = itr->second.meta;
+      struct stat st;
+      if ((fstat(meta.fd, &st) == 0) && (st.st_nlink > 0) && 
+          (st.st_mtime == meta.mtime) && (st.st_size == meta.size))
+      {
+         m_lru.splice(m_lru.begin(), m_lru, itr->second.lru);
+         ++m_hits;
+         return &meta;
+      }
+      // it's been replaced, expired or changed some other way.
+      erase(itr);
+      ++m_invalidations;
+   }
+   ++m_misses;
+
+   char path[PATH_MAX];
+   metatile meta;
+   if ((xyz_to_meta_path(path, sizeof(path), dir, x, y, z, style) < 0) || !open(path, meta))
+   {
+      return NULL;
+   }
+
+   while (!m_entries.empty() && (m_entries.size() >= m_max_size))
+   {
+      erase(m_entries.find(m_lru.back()));
+   }
+
+   value &slot = m_entries[k];
+   slot.meta.formats.swap(meta.formats);
+   slot.meta.fd = meta.fd;
+   slot.meta.dev = meta.dev;
+   slot.meta.ino = meta.ino;
+   slot.meta.mtime = meta.mtime;
+   slot.meta.size = meta.size;
+   m_lru.push_front(k);
+   slot.lru = m_lru.begin();
+   return &slot.meta;
+}
+
+bool
+open_metatiles::open(const char *path, metatile &meta)
+{
+   meta.fd = ::open(path, O_RDONLY);
+   if (meta.fd < 0)
+   {
+      return false;
+   }
+
+   struct stat st;
+   char header[metaTile::max_headers_size];
+   ssize_t len = -1;
+   if (fstat(meta.fd, &st) == 0)
+   {
+      len = read_fully(meta.fd, header, sizeof(header), 0);
+   }
+
+   // keep each format's header, as find_in_meta would find them.
+   for (ssize_t offset = 0; offset + metaTile::header_size <= len; offset += metaTile::header_size)
+   {
+      meta_layout layout;
+      memcpy(&layout, header + offset, sizeof(layout));
+      if (!layout.magic_ok())
+      {
+         break;
+      }
+      if (layout.count != (METATILE * METATILE))
+      {
+         LOG_WARNING(boost::format("Meta file %1% header bad count %2% != %3%")
+                     % path % layout.count % (METATILE * METATILE));
+         break;
+      }
+      meta.formats.push_back(layout);
+   }
+
+   if (meta.formats.empty())
+   {
+      if (len >= 0)
+      {
+         LOG_WARNING(boost::format("Meta file %1% has no usable header") % path);
+      }
+      close(meta.fd);
+      return false;
+   }
+
+   meta.dev = st.st_dev;
+   meta.ino = st.st_ino;
+   meta.mtime = st.st_mtime;
+   meta.size = st.st_size;
+   return true;
+}
+
+void
+open_metatiles::erase(map_t::iterator itr)
+{
+   close(itr->second.meta.fd);
+   m_lru.erase(itr->second.lru);
+   m_entries.erase(itr);
+}
+
+void
+open_metatiles::flush_counts()
+{
+   boost::mutex::scoped_lock lock(totals_mutex);
+   total_hits += m_hits - m_flushed_hits;
+   total_misses += m_misses - m_flushed_misses;
+   total_invalidations += m_invalidations - m_flushed_invalidations;
+   m_flushed_hits = m_hits;
+   m_flushed_misses = m_misses;
+   m_flushed_invalidations = m_invalidations;
+}
+
+void
+open_metatiles::report_all(std::ostream &out)
+{
+   boost::mutex::scoped_lock lock(totals_mutex);
+   const uint64_t lookups = total_hits + total_misses;
+   if (lookups == 0)
+   {
+      return;
+   }
+   out << boost::format("# open metatiles hits=%1% misses=%2% invalidations=%3% hit_ratio=%4$.3f\n")
+      % total_hits % total_misses % total_invalidations % (double(total_hits) / lookups);
+}
+
+} // namespace rendermq
@@ -0,0 +1,127 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef RENDERMQ_OPEN_METATILES_HPP
+#define RENDERMQ_OPEN_METATILES_HPP
+
+#include "meta_tile.hpp"
+#include <sys/types.h>
+#include <stdint.h>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+namespace rendermq 
+{
+
+/* a bounded, least-recently-used set of open metatile files, along
+ * with their parsed headers, so that a tile in a hot metatile can be
+ * read with a single pread, without looking up the path or reading 
+ * the header again.
+ *
+ * each lookup fstats the open file, and opens it afresh if it has a 
+ * new modification time or size, or has been unlinked. as disk storage
+ * replaces metatiles by renaming a new file over the old one, that 
+ * catches re-rendered as well as expired metatiles.
+ *
+ * this isn't locked, so each thread needs its own. the hit and miss 
+ * counts from all of them are added up for report_all().
+ */
+class open_metatiles
+{
+public:
+   struct metatile
+   {
+      int fd;
+      dev_t dev;
+      ino_t ino;
+      std::time_t mtime;
+      off_t size;
+      // the headers of each format in the metatile.
+      std::vector<meta_layout> formats;
+
+      // the header for the given format, or NULL if the metatile 
+      // doesn't have it.
+      const meta_layout *layout(int fmt) const;
+   };
+
+   explicit open_metatiles(size_t max_size);
+   ~open_metatiles();
+
+   /* the open metatile containing the tile, or NULL if there's no such
+    * metatile. this is only valid until the next call.
+    */
+   const metatile *lookup(const std::string &dir, int x, int y, int z, const std::string &style);
+
+   size_t size() const { return m_entries.size(); }
+   uint64_t hits() const { return m_hits; }
+   uint64_t misses() const { return m_misses; }
+   uint64_t invalidations() const { return m_invalidations; }
+
+   // write out a summary line of the counts from all the caches.
+   static void report_all(std::ostream &out);
+
+private:
+   struct key
+   {
+      std::string style;
+      int x, y, z;
+
+      bool operator<(const key &other) const;
+   };
+
+   typedef std::list<key> lru_list_t;
+
+   struct value
+   {
+      metatile meta;
+      // position in the recency list, so that it can be moved to the
+      // front in constant time.
+      lru_list_t::iterator lru;
+   };
+
+   typedef std::map<key, value> map_t;
+
+   // opens the metatile and reads its headers, returning false if 
+   // there isn't one or it's no good.
+   static bool open(const char *path, metatile &meta);
+   void erase(map_t::iterator itr);
+   // add the counts since the last time to the totals for report_all().
+   void flush_counts();
+
+   const size_t m_max_size;
+   map_t m_entries;
+   // most recently used at the front.
+   lru_list_t m_lru;
+   uint64_t m_hits, m_misses, m_invalidations;
+   uint64_t m_flushed_hits, m_flushed_misses, m_flushed_invalidations;
+};
+
+} // namespace rendermq
+
+#endif // RENDERMQ_OPEN_METATILES_HPP
@@ -109,6 +109,22 @@ rendermq::tile_storage *create_per_style_storage(const bt::ptree &pt,
 
 const bool registered = register_tile_storage("per_style", create_per_style_storage);
 
+// maps the positions within a group back to positions in the whole
+// batch before passing the results on.
+struct remap_positions
+{
+   remap_positions(const vector<size_t> &p, const rendermq::tile_storage::get_callback &c)
+      : positions(p), callback(c) {}
+
+   void operator()(size_t i, shared_ptr<rendermq::tile_storage::handle> handle) const
+   {
+      callback(positions[i], handle);
+   }
+
+   const vector<size_t> &positions;
+   const rendermq::tile_storage::get_callback &callback;
+};
+
 } // anonymous namespace
 
 namespace rendermq 
@@ -138,6 +154,20 @@ per_style_storage::get(const tile_protocol &tile) const
    }
 }
 
+shared_ptr<tile_storage::handle> 
+per_style_storage::probe(const tile_protocol &tile) const 
+{
+   map_of_storage_t::const_iterator itr = m_storages.find(tile.style);
+   if (itr == m_storages.end()) 
+   {
+      return m_default_storage->probe(tile);
+   }
+   else
+   {
+      return itr->second->probe(tile);
+   }
+}
+
 bool 
 per_style_storage::get_meta(const tile_protocol &tile, std::string &data) const {
    map_of_storage_t::const_iterator itr = m_storages.find(tile.style);
@@ -165,6 +195,21 @@ per_style_storage::put_meta(const tile_protocol &tile, const std::string &buf) c
    }
 }   
 
+bool 
+per_style_storage::put_meta_stamped(const tile_protocol &tile, const std::string &buf, 
+                                    std::time_t &stored) const 
+{
+   map_of_storage_t::const_iterator itr = m_storages.find(tile.style);
+   if (itr == m_storages.end()) 
+   {
+      return m_default_storage->put_meta_stamped(tile, buf, stored);
+   }
+   else
+   {
+      return itr->second->put_meta_stamped(tile, buf, stored);
+   }
+}   
+
 bool 
 per_style_storage::expire(const tile_protocol &tile) const 
 {
@@ -179,5 +224,90 @@ per_style_storage::expire(const tile_protocol &tile) const
    }
 }
 
+void
+per_style_storage::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+{
+   groups_t groups;
+   group_by_storage(tiles, groups);
+
+   BOOST_FOREACH(const groups_t::value_type &group, groups)
+   {
+      vector<tile_protocol> group_tiles;
+      BOOST_FOREACH(size_t i, group.second) 
+      {
+         group_tiles.push_back(tiles[i]);
+      }
+      group.first->get_many_async(group_tiles, remap_positions(group.second, callback));
+   }
+}
+
+bool 
+per_style_storage::put_meta_many(const vector<tile_protocol> &tiles, const vector<string> &bufs) const 
+{
+   if (tiles.size() != bufs.size())
+   {
+      throw std::invalid_argument("Different numbers of tiles and metatiles to put.");
+   }
+
+   groups_t groups;
+   group_by_storage(tiles, groups);
+
+   bool success = true;
+   BOOST_FOREACH(const groups_t::value_type &group, groups)
+   {
+      vector<tile_protocol> group_tiles;
+      vector<string> group_bufs;
+      BOOST_FOREACH(size_t i, group.second) 
+      {
+         group_tiles.push_back(tiles[i]);
+         group_bufs.push_back(bufs[i]);
+      }
+      success &= group.first->put_meta_many(group_tiles, group_bufs);
+   }
+   return success;
+}   
+
+bool 
+per_style_storage::expire_many(const vector<tile_protocol> &tiles) const 
+{
+   groups_t groups;
+   group_by_storage(tiles, groups);
+
+   bool success = true;
+   BOOST_FOREACH(const groups_t::value_type &group, groups)
+   {
+      vector<tile_protocol> group_tiles;
+      BOOST_FOREACH(size_t i, group.second) 
+      {
+         group_tiles.push_back(tiles[i]);
+      }
+      success &= group.first->expire_many(group_tiles);
+   }
+   return success;
+}
+
+const shared_ptr<tile_storage> &
+per_style_storage::storage_for(const string &style) const
+{
+   map_of_storage_t::const_iterator itr = m_storages.find(style);
+   if (itr == m_storages.end()) 
+   {
+      return m_default_storage;
+   }
+   else
+   {
+      return itr->second;
+   }
+}
+
+void
+per_style_storage::group_by_storage(const vector<tile_protocol> &tiles, groups_t &groups) const
+{
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      groups[storage_for(tiles[i].style)].push_back(i);
+   }
+}
+
 } // namespace rendermq
 
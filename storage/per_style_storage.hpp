@@ -30,6 +30,8 @@
 #include <string>
 #include <ctime>
 #include <list>
+#include <map>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include "tile_storage.hpp"
 
@@ -61,11 +63,28 @@ public:
    // see if the style is mentioned in the map, else use the default,
    // and proxy this request to the appropriate storage object.
    boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
    bool get_meta(const tile_protocol &, std::string &) const;
    bool put_meta(const tile_protocol &tile, const std::string &buf) const;
+   bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
    bool expire(const tile_protocol &tile) const;
 
+   // the batch versions split the tiles up by style and pass each
+   // group on to its storage object in one go.
+   void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+   bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+   bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
 private:
+   // the positions within a batch of tiles which are destined for
+   // each storage object.
+   typedef std::map<boost::shared_ptr<tile_storage>, std::vector<size_t> > groups_t;
+
+   // the storage object for the style, or the default if none match.
+   const boost::shared_ptr<tile_storage> &storage_for(const std::string &style) const;
+
+   // split the batch of tiles up by the storage they'll go to.
+   void group_by_storage(const std::vector<tile_protocol> &tiles, groups_t &groups) const;
 
    // maps style name into a storage object to provide per-style
    // overrides for the storage behaviour.
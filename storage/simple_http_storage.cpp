@@ -26,6 +26,7 @@
 #include "simple_http_storage.hpp"
 #include "null_handle.hpp"
 #include "meta_tile.hpp"
+#include "../http/http_gzip.hpp"
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/microsec_time_clock.hpp>
 
@@ -89,9 +90,15 @@ bool simple_http_storage::handle::data(string &output) const
    return this->response->statusCode == 200;
 }
 
+bool simple_http_storage::handle::gzipped() const
+{
+   return this->response->statusCode == 200 && is_gzipped(this->response->body);
+}
+
 simple_http_storage::simple_http_storage(const string &format)
    : m_format(format),
-     m_connection(http::createPersistentConnection())
+     m_connection(http::createPersistentConnection()),
+     m_error(false)
 {
 }
 
@@ -103,7 +110,9 @@ shared_ptr<tile_storage::handle>
 simple_http_storage::get(const tile_protocol &tile) const 
 {
    string url = make_url(tile.style, tile.z, tile.x, tile.y);
+   m_error = false;
    shared_ptr<http::response> response = http::get(url, m_connection);
+   m_error = (response->statusCode >= 500);
    if (response->statusCode == 200)
    {
       return shared_ptr<tile_storage::handle>(new handle(response));
@@ -128,6 +137,10 @@ simple_http_storage::get_meta(const tile_protocol &tile, string &data) const
    //place to keep sizes
    vector<int> sizes(formats.size() * METATILE * METATILE, 0);
    vector<int>::iterator tileSize = sizes.begin();
+   //the tiles come without their header, so a format is flagged as
+   //compressed again if its tiles are
+   vector<bool> gzipped(formats.size(), false);
+   m_error = false;
    //formats
    for(vector<protoFmt>::const_iterator f = formats.begin(); f != formats.end(); f++)
    {
@@ -142,14 +155,20 @@ simple_http_storage::get_meta(const tile_protocol &tile, string &data) const
                string url = make_url(tile.style, tile.z, x, y);
                shared_ptr<http::response> response = http::get(url, m_connection);
                if(response->statusCode != 200 || response->timeStamp == INVALID_TIMESTAMP)
+               {
+                  m_error = (response->statusCode >= 500);
                   return false;
+               }
 
                data += response->body;
                *tileSize = int(response->body.length()); tileSize++;
+               if(is_gzipped(response->body))
+                  gzipped[f - formats.begin()] = true;
             }
             catch(const std::runtime_error& e)
             {
                LOG_ERROR(boost::format("Runtime error while getting LTS (meta) tile: %1%") % e.what());
+               m_error = true;
                return false;
             }
          }
@@ -157,7 +176,7 @@ simple_http_storage::get_meta(const tile_protocol &tile, string &data) const
    }
    //add the meta headers
    data += '\0';
-   data.insert(0, write_headers(coord.first, coord.second, tile.z, formats, sizes));
+   data.insert(0, write_headers(coord.first, coord.second, tile.z, formats, sizes, gzipped));
    return true;
 }
 
@@ -170,9 +189,16 @@ simple_http_storage::put_meta(const tile_protocol &tile, const string &metatile)
 bool 
 simple_http_storage::expire(const tile_protocol &tile) const 
 {
+   m_error = false;
    return false;
 }
 
+bool
+simple_http_storage::last_error() const
+{
+   return m_error;
+}
+
 string
 simple_http_storage::make_url(const string &style, int z, int x, int y) const
 {
@@ -61,6 +61,9 @@ public:
       virtual time_t last_modified() const;
       virtual bool data(string &) const;
       virtual bool expired() const;
+      //single tiles come back without their metatile header, so this
+      //has to look at the body to tell whether they were compressed
+      virtual bool gzipped() const;
    private:
       const shared_ptr<http::response> response;
    };
@@ -80,11 +83,16 @@ public:
 
    // returns false - source is read-only
    bool expire(const tile_protocol &tile) const;
+
+   // whether the last get failed because of the server, not a missing tile.
+   // expiring is never an error, as the source is read-only.
+   bool last_error() const;
    
 protected:
 
    std::string m_format;
    boost::shared_ptr<CURL> m_connection;
+   mutable bool m_error;
 
    std::string make_url(const std::string &style, int z, int x, int y) const;
 };
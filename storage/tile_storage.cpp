@@ -25,6 +25,9 @@
 
 #include <boost/optional.hpp>
 #include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <stdexcept>
+#include <boost/foreach.hpp>
 #include "tile_storage.hpp"
 #include "../logging/logger.hpp"
 
@@ -33,6 +36,108 @@ namespace rendermq
 
 tile_storage::~tile_storage() {}
 tile_storage::handle::~handle() {}
+tile_storage::async_reader::~async_reader() {}
+
+uint64_t
+tile_storage::handle::digest() const
+{
+   std::string buf;
+   if (data(buf))
+   {
+      return tile_digest(buf.data(), buf.size());
+   }
+   return 0;
+}
+
+bool
+tile_storage::handle::gzipped() const
+{
+   return false;
+}
+
+boost::shared_ptr<tile_storage::handle> 
+tile_storage::probe(const tile_protocol &tile) const
+{
+   return get(tile);
+}
+
+namespace
+{
+
+void store_handle(std::vector<boost::shared_ptr<tile_storage::handle> > &handles,
+                  size_t i, boost::shared_ptr<tile_storage::handle> handle)
+{
+   handles[i] = handle;
+}
+
+} // anonymous namespace
+
+void
+tile_storage::get_many_async(const std::vector<tile_protocol> &tiles, 
+                             const get_callback &callback) const
+{
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      callback(i, get(tiles[i]));
+   }
+}
+
+void
+tile_storage::get_many(const std::vector<tile_protocol> &tiles,
+                       std::vector<boost::shared_ptr<handle> > &handles) const
+{
+   handles.clear();
+   handles.resize(tiles.size());
+   get_many_async(tiles, boost::bind(&store_handle, boost::ref(handles), _1, _2));
+}
+
+bool
+tile_storage::last_error() const
+{
+   return false;
+}
+
+bool
+tile_storage::put_meta_stamped(const tile_protocol &tile, const std::string &buf, 
+                               std::time_t &stored) const
+{
+   stored = std::time(NULL);
+   return put_meta(tile, buf);
+}
+
+bool
+tile_storage::put_meta_many(const std::vector<tile_protocol> &tiles, 
+                            const std::vector<std::string> &bufs) const
+{
+   if (tiles.size() != bufs.size())
+   {
+      throw std::invalid_argument("Different numbers of tiles and metatiles to put.");
+   }
+
+   bool success = true;
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      success &= put_meta(tiles[i], bufs[i]);
+   }
+   return success;
+}
+
+bool
+tile_storage::expire_many(const std::vector<tile_protocol> &tiles) const
+{
+   bool success = true;
+   BOOST_FOREACH(const tile_protocol &tile, tiles)
+   {
+      success &= expire(tile);
+   }
+   return success;
+}
+
+tile_storage::async_reader *
+tile_storage::reader()
+{
+   return NULL;
+}
 
 bool tile_storage_factory::add(std::string const& type, 
                                tile_storage* (*func) (boost::property_tree::ptree const&,
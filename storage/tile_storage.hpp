@@ -32,8 +32,11 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/optional.hpp>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/function.hpp>
 #include <string>
 #include <map>
+#include <vector>
+#include <utility>
 
 namespace rendermq
 {
@@ -68,6 +71,15 @@ struct tile_storage
     // worth serving it to the client.
     virtual bool expired() const = 0;
 
+    // a digest of this tile's data, suitable for use as an entity tag,
+    // or zero if the tile has no data. the default is to hash data(), but
+    // implementations which store digests can do better.
+    virtual uint64_t digest() const;
+
+    // whether data() is gzip compressed, as flagged in the header of 
+    // the metatile the tile came from. the default is that it isn't.
+    virtual bool gzipped() const;
+
     virtual ~handle();
   };
   
@@ -75,6 +87,14 @@ struct tile_storage
    */
   virtual boost::shared_ptr<handle> get(const tile_protocol &tile) const = 0;
 
+  /* gets a handle for which exists(), last_modified() and expired() are
+   * cheap, but data() may have to go back to storage to fetch the tile.
+   * this is for when the data might not be needed at all, for example
+   * when the client already has an up-to-date copy. the default is to
+   * just call get().
+   */
+  virtual boost::shared_ptr<handle> probe(const tile_protocol &tile) const;
+
   /* reads a full, encoded meta tile into the given string. returns whether
    * the copy was successful or not. note that this *may* be less efficient
    * than calling get() if all you need is a single tile.
@@ -85,11 +105,99 @@ struct tile_storage
    */
   virtual bool put_meta(const tile_protocol &tile, const std::string &buf) const = 0;
 
+  /* saves a metatile as put_meta() does, also setting stored to the 
+   * modification time which the storage gave it. storage which keeps
+   * the old time when the tiles haven't changed should override this,
+   * as the default is to give the current time.
+   */
+  virtual bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, 
+                                std::time_t &stored) const;
+
   /* mark a whole meta tile as expired, such that retrieving any tile within
    * this metatile will be present, but have the expired flag set.
    */
   virtual bool expire(const tile_protocol &tile) const = 0;
 
+  /* called back with the position of a tile in the list given to
+   * get_many_async() and the handle for it.
+   */
+  typedef boost::function<void (size_t, boost::shared_ptr<handle>)> get_callback;
+
+  /* gets handles for many tiles, calling back with each as soon as it's
+   * ready, which needn't be in the order the tiles were given. all the
+   * callbacks are made from the calling thread before this returns, but
+   * the first tiles can be dealt with while the rest are still on their
+   * way. the default calls get() for each tile in turn, which storage
+   * that can fetch several tiles in one go should override.
+   */
+  virtual void get_many_async(const std::vector<tile_protocol> &tiles, 
+                              const get_callback &callback) const;
+
+  /* whether the last get(), probe(), get_meta(), get_many_async(), 
+   * expire() or expire_many() went wrong because of an error in the 
+   * storage itself, rather than the tile not being there. storage which
+   * swallows its errors, giving back missing tiles or false instead, 
+   * should override this so that the two can be told apart. the default
+   * is never to have had an error.
+   */
+  virtual bool last_error() const;
+
+  /* gets handles for many tiles, in the same order as the tiles, by
+   * way of get_many_async().
+   */
+  void get_many(const std::vector<tile_protocol> &tiles,
+                std::vector<boost::shared_ptr<handle> > &handles) const;
+
+  /* saves many metatiles, the nth buffer being the metatile for the nth
+   * tile, returning whether they were all saved. the default calls 
+   * put_meta() for each.
+   */
+  virtual bool put_meta_many(const std::vector<tile_protocol> &tiles, 
+                             const std::vector<std::string> &bufs) const;
+
+  /* expires many metatiles, returning whether they all were. the default
+   * calls expire() for each.
+   */
+  virtual bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
+  /* an interface for getting tiles without blocking, so that many can be
+   * in flight at once from a single thread. tiles are submitted, and come
+   * back later along with the same handle that get() would have given
+   * for them. it isn't thread safe, and must only be used by one thread.
+   */
+  struct async_reader
+    : private boost::noncopyable {
+    typedef std::pair<tile_protocol *, boost::shared_ptr<handle> > result;
+
+    // whether there's room to submit another tile.
+    virtual bool ready() const = 0;
+
+    // start getting a tile. the tile isn't owned by the reader, but must
+    // stay alive until it comes back from reap().
+    virtual void submit(tile_protocol *tile) = 0;
+
+    // hand any tiles submitted since the last flush over to the kernel.
+    virtual void flush() = 0;
+
+    // a file descriptor which becomes readable when there are tiles to
+    // be reaped.
+    virtual int fd() const = 0;
+
+    // the number of tiles submitted which haven't been reaped yet.
+    virtual size_t in_flight() const = 0;
+
+    // collect any tiles which have been got, adding them to results.
+    virtual void reap(std::vector<result> &results) = 0;
+
+    virtual ~async_reader();
+  };
+
+  /* gets this storage's asynchronous reader, or NULL if it can only get
+   * tiles by blocking. the reader belongs to the storage. the default is
+   * not to have one.
+   */
+  virtual async_reader *reader();
+
   virtual ~tile_storage();
 };
 
@@ -31,6 +31,7 @@
 using namespace boost::python;
 using rendermq::tile_storage;
 using std::string;
+using std::vector;
 
 namespace {
 
@@ -78,6 +79,55 @@ object storage_get_meta(tile_storage &ts, const rendermq::tile_protocol &tile)
    return obj;
 }
 
+// the time the storage gave the metatile, or None if it couldn't be
+// saved.
+object storage_put_meta_stamped(tile_storage &ts, const rendermq::tile_protocol &tile, const string &buf)
+{
+   object obj;
+   std::time_t stored = 0;
+   if (ts.put_meta_stamped(tile, buf, stored))
+   {
+      obj = object(long(stored));
+   }
+   return obj;
+}
+
+// python lists of tiles and buffers into the vectors which the 
+// batch operations take.
+template<typename T>
+vector<T> from_list(const list &l)
+{
+   vector<T> v;
+   for (int i = 0; i < len(l); ++i) 
+   {
+      v.push_back(extract<T>(l[i]));
+   }
+   return v;
+}
+
+list storage_get_many(tile_storage &ts, const list &tiles)
+{
+   vector<boost::shared_ptr<tile_storage::handle> > handles;
+   ts.get_many(from_list<rendermq::tile_protocol>(tiles), handles);
+
+   list result;
+   for (size_t i = 0; i < handles.size(); ++i) 
+   {
+      result.append(handles[i]);
+   }
+   return result;
+}
+
+bool storage_put_meta_many(tile_storage &ts, const list &tiles, const list &bufs)
+{
+   return ts.put_meta_many(from_list<rendermq::tile_protocol>(tiles), from_list<string>(bufs));
+}
+
+bool storage_expire_many(tile_storage &ts, const list &tiles)
+{
+   return ts.expire_many(from_list<rendermq::tile_protocol>(tiles));
+}
+
 } // anonymous namespace
 
 BOOST_PYTHON_MODULE(tile_storage) {
@@ -88,14 +138,20 @@ BOOST_PYTHON_MODULE(tile_storage) {
     .def("last_modified", &tile_storage::handle::last_modified)
     .def("data", &handle_get_data)
     .def("expired", &tile_storage::handle::expired)
+    .def("digest", &tile_storage::handle::digest)
     ;
 
   class_<tile_storage,
          boost::noncopyable>("TileStorage", no_init)
     .def("get", &tile_storage::get)
+    .def("probe", &tile_storage::probe)
     .def("get_meta", &storage_get_meta)
     .def("put_meta", &tile_storage::put_meta)
+    .def("put_meta_stamped", &storage_put_meta_stamped)
     .def("expire", &tile_storage::expire)
+    .def("get_many", &storage_get_many)
+    .def("put_meta_many", &storage_put_meta_many)
+    .def("expire_many", &storage_expire_many)
     .def("__init__", make_constructor(create_from_factory))
     ;
 }
@@ -100,6 +100,36 @@ rendermq::tile_storage *create_union_storage(const bt::ptree &pt,
 
 const bool registered = register_tile_storage("union", create_union_storage);
 
+/* passes on the tiles which a storage has, and keeps the rest to be
+ * asked of the next one.
+ */
+struct found_or_missing
+{
+   found_or_missing(const vector<rendermq::tile_protocol> &t, const vector<size_t> &p,
+                    const rendermq::tile_storage::get_callback &c,
+                    vector<rendermq::tile_protocol> &mt, vector<size_t> &mp)
+      : tiles(t), positions(p), callback(c), missing_tiles(mt), missing_positions(mp) {}
+
+   void operator()(size_t i, shared_ptr<rendermq::tile_storage::handle> handle) const
+   {
+      if (handle->exists())
+      {
+         callback(positions[i], handle);
+      }
+      else
+      {
+         missing_tiles.push_back(tiles[i]);
+         missing_positions.push_back(positions[i]);
+      }
+   }
+
+   const vector<rendermq::tile_protocol> &tiles;
+   const vector<size_t> &positions;
+   const rendermq::tile_storage::get_callback &callback;
+   vector<rendermq::tile_protocol> &missing_tiles;
+   vector<size_t> &missing_positions;
+};
+
 } // anonymous namespace
 
 namespace rendermq 
@@ -128,6 +158,20 @@ union_storage::get(const tile_protocol &tile) const
    return shared_ptr<tile_storage::handle>(new null_handle());
 }
 
+shared_ptr<tile_storage::handle> 
+union_storage::probe(const tile_protocol &tile) const 
+{
+   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
+   {
+      shared_ptr<tile_storage::handle> handle = storage->probe(tile);
+      if (handle->exists()) 
+      {
+         return handle;
+      }
+   }
+   return shared_ptr<tile_storage::handle>(new null_handle());
+}
+
 bool 
 union_storage::get_meta(const tile_protocol &tile, std::string &data) const {
    BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
@@ -152,6 +196,25 @@ union_storage::put_meta(const tile_protocol &tile, const std::string &buf) const
    return success;
 }   
 
+bool 
+union_storage::put_meta_stamped(const tile_protocol &tile, const std::string &buf, 
+                                std::time_t &stored) const 
+{
+   bool success = true, first = true;
+   stored = std::time(NULL);
+   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
+   {
+      std::time_t t = 0;
+      success &= storage->put_meta_stamped(tile, buf, t);
+      if (first)
+      {
+         stored = t;
+         first = false;
+      }
+   }
+   return success;
+}
+
 bool 
 union_storage::expire(const tile_protocol &tile) const 
 {
@@ -163,5 +226,58 @@ union_storage::expire(const tile_protocol &tile) const
    return success;
 }
 
+void
+union_storage::get_many_async(const vector<tile_protocol> &tiles, const get_callback &callback) const
+{
+   vector<tile_protocol> remaining(tiles);
+   vector<size_t> positions;
+   for (size_t i = 0; i < tiles.size(); ++i) 
+   {
+      positions.push_back(i);
+   }
+
+   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
+   {
+      if (remaining.empty())
+      {
+         break;
+      }
+
+      vector<tile_protocol> missing_tiles;
+      vector<size_t> missing_positions;
+      storage->get_many_async(remaining, found_or_missing(remaining, positions, callback,
+                                                          missing_tiles, missing_positions));
+      remaining.swap(missing_tiles);
+      positions.swap(missing_positions);
+   }
+
+   BOOST_FOREACH(size_t i, positions)
+   {
+      callback(i, shared_ptr<tile_storage::handle>(new null_handle()));
+   }
+}
+
+bool 
+union_storage::put_meta_many(const vector<tile_protocol> &tiles, const vector<string> &bufs) const 
+{
+   bool success = true;
+   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
+   {
+      success &= storage->put_meta_many(tiles, bufs);
+   }
+   return success;
+}   
+
+bool 
+union_storage::expire_many(const vector<tile_protocol> &tiles) const 
+{
+   bool success = true;
+   BOOST_FOREACH(shared_ptr<tile_storage> storage, m_storages) 
+   {
+      success &= storage->expire_many(tiles);
+   }
+   return success;
+}
+
 } // namespace rendermq
 
@@ -61,6 +61,7 @@ public:
    // get the tile from the first storage in the list which
    // claims to have it.
    boost::shared_ptr<tile_storage::handle> get(const tile_protocol &tile) const;
+   boost::shared_ptr<tile_storage::handle> probe(const tile_protocol &tile) const;
 
    // attempt to get the meta tile from the first storage
    // which claims to have it.
@@ -69,9 +70,19 @@ public:
    // put the meta tile to *all* unioned storages.
    bool put_meta(const tile_protocol &tile, const std::string &buf) const;
 
+   // as put_meta, giving the time which the first storage stored, as 
+   // that's the one gets are answered from when it has the tile.
+   bool put_meta_stamped(const tile_protocol &tile, const std::string &buf, std::time_t &stored) const;
+
    // expire the tile from *all* unioned storages.
    bool expire(const tile_protocol &tile) const;
 
+   // the batch versions of the above. each storage is asked for
+   // the tiles which the ones before it didn't have.
+   void get_many_async(const std::vector<tile_protocol> &tiles, const get_callback &callback) const;
+   bool put_meta_many(const std::vector<tile_protocol> &tiles, const std::vector<std::string> &bufs) const;
+   bool expire_many(const std::vector<tile_protocol> &tiles) const;
+
 private:
    
    list_of_storage_t m_storages;
@@ -0,0 +1,185 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "storage_queue.hpp"
+
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <algorithm>
+
+namespace rendermq
+{
+
+storage_queue::storage_queue(size_t max_size, uint64_t deadline)
+   : m_max_size(max_size), m_deadline(deadline), m_size(0)
+{
+}
+
+storage_queue::~storage_queue()
+{
+   for (int c = 0; c < storageNumClasses; ++c)
+   {
+      BOOST_FOREACH(entry &e, m_queues[c])
+      {
+         delete e.tile;
+      }
+   }
+}
+
+storageClass
+storage_queue::classify(const tile_protocol &tile)
+{
+   switch (tile.status)
+   {
+   case cmdStatus:   return storageStatus;
+   case cmdDirty:    return storageDirty;
+   case cmdMetatile: return storageBackground;
+   default:
+      // requests with no client to reply to are background renders.
+      return (tile.id > 0) ? storageInteractive : storageBackground;
+   }
+}
+
+const char *
+storage_queue::class_name(storageClass c)
+{
+   switch (c)
+   {
+   case storageInteractive: return "interactive";
+   case storageBackground:  return "background";
+   case storageDirty:       return "dirty";
+   case storageStatus:      return "status";
+   default:                 return "unknown";
+   }
+}
+
+tile_protocol *
+storage_queue::push(tile_protocol *tile, uint64_t now)
+{
+   const storageClass klass = classify(*tile);
+   tile_protocol *turned_away = NULL;
+
+   if (m_size >= m_max_size)
+   {
+      // make room by dropping the newest of the least urgent requests,
+      // so long as they're less urgent than this one. queued dirty
+      // requests are never dropped.
+      int victim = storageNumClasses - 1;
+      while ((victim > klass) && (m_queues[victim].empty() || (victim == storageDirty))) 
+      { 
+         --victim; 
+      }
+
+      if (victim <= klass)
+      {
+         ++m_stats[klass].full;
+         return tile;
+      }
+
+      turned_away = m_queues[victim].back().tile;
+      m_queues[victim].pop_back();
+      ++m_stats[victim].full;
+      --m_size;
+   }
+
+   entry e;
+   e.tile = tile;
+   e.queued = now;
+   m_queues[klass].push_back(e);
+   ++m_size;
+
+   return turned_away;
+}
+
+tile_protocol *
+storage_queue::pop(uint64_t now)
+{
+   for (int c = 0; c < storageNumClasses; ++c)
+   {
+      if (!m_queues[c].empty())
+      {
+         const entry e = m_queues[c].front();
+         m_queues[c].pop_front();
+         --m_size;
+
+         const uint64_t wait = (now > e.queued) ? (now - e.queued) : 0;
+         stats &s = m_stats[c];
+         ++s.served;
+         s.total_wait += wait;
+         s.max_wait = std::max(s.max_wait, wait);
+         return e.tile;
+      }
+   }
+   return NULL;
+}
+
+tile_protocol *
+storage_queue::front() const
+{
+   for (int c = 0; c < storageNumClasses; ++c)
+   {
+      if (!m_queues[c].empty())
+      {
+         return m_queues[c].front().tile;
+      }
+   }
+   return NULL;
+}
+
+void
+storage_queue::expire(uint64_t now, std::vector<tile_protocol *> &expired)
+{
+   if (m_deadline == 0) { return; }
+
+   // each class is in order of arrival, so the expired ones are all at
+   // the front. dirty requests are kept however long they wait.
+   for (int c = 0; c < storageNumClasses; ++c)
+   {
+      while ((c != storageDirty) && !m_queues[c].empty() && 
+             (m_queues[c].front().queued + m_deadline < now))
+      {
+         expired.push_back(m_queues[c].front().tile);
+         m_queues[c].pop_front();
+         ++m_stats[c].expired;
+         --m_size;
+      }
+   }
+}
+
+void
+storage_queue::report(std::ostream &out) const
+{
+   for (int c = 0; c < storageNumClasses; ++c)
+   {
+      const stats &s = m_stats[c];
+      const double mean_wait = (s.served > 0) ? (double(s.total_wait) / double(s.served)) : 0.0;
+      out << boost::format("# storage queue %1% depth=%2% served=%3% mean_wait_ms=%4$.1f "
+                           "max_wait_ms=%5$.1f full=%6% expired=%7%\n")
+         % class_name(storageClass(c)) % m_queues[c].size() % s.served 
+         % (mean_wait / 1000.0) % (double(s.max_wait) / 1000.0) % s.full % s.expired;
+   }
+}
+
+} // namespace rendermq
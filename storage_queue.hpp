@@ -0,0 +1,122 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef STORAGE_QUEUE_HPP
+#define STORAGE_QUEUE_HPP
+
+#include "tile_protocol.hpp"
+
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+#include <deque>
+
+namespace rendermq
+{
+
+/* the kinds of request the storage worker gets, most urgent first.
+ */
+enum storageClass {
+   storageInteractive = 0, // a client is waiting for the tile
+   storageBackground,      // nobody is waiting, or it's part of a batch
+   storageDirty,           // expiring tiles
+   storageStatus,          // asking after a tile's status
+   storageNumClasses
+};
+
+/* requests waiting for a storage thread to become free. they are 
+ * served most urgent class first and oldest first within a class, and
+ * there's a limit on how many can wait. when it's reached, a new 
+ * request pushes out the newest of a less urgent class, or is turned
+ * away itself if there isn't one. requests which have waited longer 
+ * than the deadline are given up on, as the client has most likely 
+ * given up too.
+ *
+ * dirty requests are the exception: once queued, they're neither 
+ * pushed out nor given up on, as nothing else would ever expire the
+ * tiles if they were. they can still be turned away when they arrive
+ * at a full queue.
+ *
+ * the queue owns the tiles in it, and hands ownership of any that are
+ * given up on back to the caller to fail. it isn't locked itself.
+ */
+class storage_queue
+{
+public:
+   /* @param max_size most requests which can wait, over all classes.
+    * @param deadline microseconds a request may wait, or zero for no
+    *    limit.
+    */
+   storage_queue(size_t max_size, uint64_t deadline);
+   ~storage_queue();
+
+   static storageClass classify(const tile_protocol &tile);
+   static const char *class_name(storageClass c);
+
+   /* queue a request which arrived at now (in microseconds, as from 
+    * tile_trace::now()), returning a request which has been turned 
+    * away to make room - possibly the same one - or NULL.
+    */
+   tile_protocol *push(tile_protocol *tile, uint64_t now);
+
+   // the next request to run, or NULL if there aren't any.
+   tile_protocol *pop(uint64_t now);
+
+   // the request which pop() would return, left on the queue.
+   tile_protocol *front() const;
+
+   // take out requests which have waited past the deadline.
+   void expire(uint64_t now, std::vector<tile_protocol *> &expired);
+
+   size_t size() const { return m_size; }
+   bool empty() const { return m_size == 0; }
+   uint64_t deadline() const { return m_deadline; }
+
+   // write out a plain-text summary line for each class.
+   void report(std::ostream &out) const;
+
+private:
+   struct entry
+   {
+      tile_protocol *tile;
+      uint64_t queued;
+   };
+
+   struct stats
+   {
+      stats() : served(0), full(0), expired(0), total_wait(0), max_wait(0) {}
+      uint64_t served, full, expired, total_wait, max_wait;
+   };
+
+   const size_t m_max_size;
+   const uint64_t m_deadline;
+   size_t m_size;
+   std::deque<entry> m_queues[storageNumClasses];
+   stats m_stats[storageNumClasses];
+};
+
+} // namespace rendermq
+
+#endif // STORAGE_QUEUE_HPP
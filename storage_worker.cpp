@@ -24,14 +24,20 @@
  *-----------------------------------------------------------------------------*/
 
 #include "storage_worker.hpp"
+#include "metatile_cache.hpp"
+#include "bulk_dirty.hpp"
 #include "storage/tile_storage.hpp"
-#include "zstream_pbuf.hpp"
+#include "storage/circuit_breaker.hpp"
+#include "storage/open_metatiles.hpp"
 #include "logging/logger.hpp"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/microsec_time_clock.hpp>
 #include <boost/foreach.hpp>
-#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <algorithm>
+#include <vector>
 
 #include <signal.h> // to ignore child termination signals
 
@@ -45,10 +51,13 @@
 // above.
 #define CHECK_THREAD_DEATH_INTERVAL (5*STORAGE_WORKER_POLL_TIMEOUT)
 
+// poll timeout in microseconds while there are results waiting for 
+// room in the channel back to the handler.
+#define BACKLOG_POLL_TIMEOUT (1000)
+
 namespace pt = boost::property_tree;
 namespace bt = boost::posix_time;
 using boost::shared_ptr;
-using boost::make_shared;
 using std::pair;
 using std::make_pair;
 using std::map;
@@ -58,33 +67,106 @@ using std::string;
 namespace rendermq {
 
 namespace {
+// fill in a tile from the handle got for it by the asynchronous reader,
+// the same as handle_tile does for a plain get.
+void fill_tile(tile_protocol &tile, const tile_storage::handle &handle)
+{
+   if (handle.exists())
+   {
+      if (tile.status != cmdStatus)
+      {
+         tile.status = handle.expired() ? cmdIgnore : cmdDone;
+         tile.digest = handle.digest();
+      }
+      tile.last_modified = handle.last_modified();
+
+      std::string data;
+      handle.data(data);
+      tile.swap_data(data);
+      tile.data_gzipped = handle.gzipped();
+   }
+   else if (tile.status != cmdStatus)
+   {
+      tile.status = cmdNotDone;
+   }
+}
+
 void handle_tile(tile_protocol &tile,
                  shared_ptr<tile_storage> storage,
-                 const map<string, list<string> > &dirty_list) 
+                 const map<string, list<string> > &dirty_list,
+                 metatile_cache *cache) 
 {
    if (tile.status == cmdDirty) 
    {
       // the dirty 'status', or command tells us that the user has
       // said that the tile needs to be re-rendered, so first we must
-      // expire it from the storage.
-      storage->expire(tile);
-      
-      // check to see what other styles need to be dirtied dependent 
-      // on this one.
+      // expire it from the storage, along with whatever other styles
+      // need to be dirtied dependent on this one. these all go to the
+      // storage as a single batch, as do all the metatiles in a slice
+      // of a bulk dirty job.
+      std::vector<tile_protocol> metatiles;
+      if (bulk_dirty_jobs::job_for_tile(tile.id) > 0)
+      {
+         bulk_dirty_jobs::slice_tiles(tile, metatiles);
+      }
+      else
+      {
+         metatiles.push_back(tile);
+      }
+
+      std::vector<tile_protocol> tiles(metatiles);
       map<string, list<string> >::const_iterator itr = dirty_list.find(tile.style);
       if (itr != dirty_list.end()) 
       {
-         BOOST_FOREACH(string style, itr->second) 
+         BOOST_FOREACH(const tile_protocol &metatile, metatiles)
          {
-            tile_protocol dependent_tile(tile);
-            dependent_tile.style = style;
-            storage->expire(dependent_tile);
+            BOOST_FOREACH(string style, itr->second) 
+            {
+               tile_protocol dependent_tile(metatile);
+               dependent_tile.style = style;
+               tiles.push_back(dependent_tile);
+            }
          }
       }
+
+      storage->expire_many(tiles);
+      if (cache) 
+      {
+         BOOST_FOREACH(const tile_protocol &t, tiles) { cache->invalidate(t); }
+      }
    }   
+   else if (tile.status == cmdMetatile)
+   {
+      // the whole metatile is wanted, e.g: for a batch of its tiles, 
+      // along with its last modified time, or zero if it has expired
+      // as for status requests. no data means it isn't there at all.
+      std::string meta;
+      boost::shared_ptr<tile_storage::handle> handle = storage->probe(tile);
+      if (handle->exists() && storage->get_meta(tile, meta))
+      {
+         tile.last_modified = handle->expired() ? 0 : handle->last_modified();
+      }
+      tile.set_data(meta);
+   }
+   else if (cache && cache->lookup(tile))
+   {
+      // the cache only holds tiles which weren't expired when they
+      // were read.
+      if (tile.status != cmdStatus)
+      {
+         tile.status = cmdDone;
+      }
+   }
    else // command is not to dirty the tile
    {
-      boost::shared_ptr<tile_storage::handle> handle = storage->get(tile);
+      // if the client sent If-Modified-Since or If-None-Match then it
+      // quite likely has the tile already, in which case only the 
+      // metadata is needed and reading the tile data can be skipped.
+      // when metatiles are being cached the data comes from the whole
+      // metatile, so again only the metadata is needed.
+      const bool conditional = tile.conditional() && (tile.status != cmdStatus);
+      boost::shared_ptr<tile_storage::handle> handle = 
+         (conditional || cache) ? storage->probe(tile) : storage->get(tile);
       
       if (handle->exists()) 
       {
@@ -103,10 +185,45 @@ void handle_tile(tile_protocol &tile,
             }
          }
          
-         std::string data;
-         handle->data(data);
-         tile.set_data(data);
+         // neighbouring tiles are likely to be asked for soon, so
+         // read the whole metatile in once and keep it. expired ones
+         // are about to be re-rendered, so aren't worth keeping.
+         std::string meta;
+         if (cache && !handle->expired() && storage->get_meta(tile, meta) &&
+             cache->insert(tile, meta, handle->last_modified()))
+         {
+            // the tile has been filled in from the metatile.
+            return;
+         }
+
          tile.last_modified = handle->last_modified();
+         if (tile.status != cmdStatus)
+         {
+            tile.digest = handle->digest();
+         }
+
+         if (!conditional)
+         {
+            std::string data;
+            handle->data(data);
+            tile.swap_data(data);
+            tile.data_gzipped = handle->gzipped();
+         }
+         else if (!tile.not_modified())
+         {
+            // a probed tile may turn out not to have data after all,
+            // e.g: if the format is missing from the metatile.
+            std::string data;
+            if (handle->data(data))
+            {
+               tile.swap_data(data);
+               tile.data_gzipped = handle->gzipped();
+            }
+            else
+            {
+               tile.status = cmdNotDone;
+            }
+         }
       }
       else 
       {
@@ -126,8 +243,9 @@ void
 storage_worker::thread_func(const pt::ptree &conf, 
                             zmq::context_t &ctx,
                             const map<string, list<string> > &dirty_list,
+                            metatile_cache *cache,
                             volatile bool &shutdown_requested,
-                            string resp_ep, string reqs_ep) 
+                            tile_channel &requests, tile_channel &results) 
 {
    boost::shared_ptr<tile_storage> storage(get_tile_storage(conf, ctx));
    // check that storage initialised correctly
@@ -136,14 +254,6 @@ storage_worker::thread_func(const pt::ptree &conf,
       return;
    }
 
-   // create socket and connect anonymously to the storage worker
-   zstream::socket::push socket_out(ctx);
-   zstream::socket::pull socket_in(ctx);
-
-   socket_out.connect(resp_ep);
-   socket_in.connect(reqs_ep);
-   
-
    // event loop
    while (true) 
    {
@@ -153,7 +263,7 @@ storage_worker::thread_func(const pt::ptree &conf,
       }
 
       zmq::pollitem_t items [] = {
-         { socket_in.socket(), 0, ZMQ_POLLIN, 0 }
+         { NULL, requests.fd(), ZMQ_POLLIN, 0 }
       };
       
       try 
@@ -170,17 +280,14 @@ storage_worker::thread_func(const pt::ptree &conf,
       }
 
       if (items[0].revents & ZMQ_POLLIN) {
-         tile_protocol tile;
-
-         try {
-            // read the tile request
-            socket_in >> tile;
-         } 
-         catch (const std::exception &e)
+         // another thread may have been woken for the same request and
+         // got to it first.
+         tile_protocol *request = requests.pop();
+         if (request == NULL) 
          {
-            LOG_ERROR("Error during tile receive. Skipping.");
             continue;
          }
+         tile_protocol &tile = *request;
             
          try
          {
@@ -188,7 +295,7 @@ storage_worker::thread_func(const pt::ptree &conf,
             bt::ptime begin = bt::microsec_clock::local_time();
             
             // do the actual work
-            handle_tile(tile, storage, dirty_list);
+            handle_tile(tile, storage, dirty_list, cache);
             
             // stop the stopwatch and print warning if the process took
             // too long...
@@ -200,38 +307,68 @@ storage_worker::thread_func(const pt::ptree &conf,
          }
          catch (const std::exception &e)
          {
-            // set tile to "not done" status
-            tile.status = cmdNotDone;
+            // set tile to "not done" status, except for metatile reads
+            // which the handler needs to recognise, and which say the
+            // same thing by having no data.
+            if (tile.status == cmdMetatile)
+            {
+               tile.set_data("");
+            }
+            else
+            {
+               tile.status = cmdNotDone;
+            }
             LOG_ERROR(boost::format("Exception during storage activity: %1%, sending "
                                     "'not done' response.") 
                       % e.what());
          }
 
-         // send response back
-         socket_out << tile;
+         // send response back. there's always room, as the storage
+         // worker only hands out as many requests as there are threads.
+         tile.trace.mark(traceStorageDone);
+         if (!results.push(request))
+         {
+            LOG_ERROR(boost::format("No room to send back %1% from storage.") % tile);
+            delete request;
+         }
       }
    }
 }      
   
 storage_worker::storage_worker(zmq::context_t &ctx, 
                                const pt::ptree &c,
-                               const std::string &handler_id,
+                               tile_channel &requests,
+                               tile_channel &results,
                                size_t max_concur,
-                               const map<string, list<string> > &dirty_list) 
-   : m_context(ctx), requests_in(m_context), results_out(m_context), 
-     threads_in(m_context), threads_out(m_context), max_concurrency(max_concur), 
-     cur_concurrency(0), conf(c), m_dirty_list(dirty_list),
-     m_shutdown_requested(false)
+                               const map<string, list<string> > &dirty_list,
+                               size_t metatile_cache_size,
+                               std::time_t metatile_cache_ttl,
+                               size_t max_queued,
+                               uint64_t queue_deadline) 
+   : m_context(ctx), requests_in(requests), results_out(results), 
+     results_backlog(results_out), threads_in(max_concur), threads_out(max_concur), 
+     max_concurrency(max_concur), 
+     cur_concurrency(0), conf(c), m_dirty_list(dirty_list), m_reader(NULL),
+     m_shutdown_requested(false), queued_requests(max_queued, queue_deadline * 1000)
 {
-   requests_in.connect("inproc://storage_request_" + handler_id);
-   results_out.connect("inproc://storage_results_" + handler_id);
-
-   // bind sockets to talk to all the sub-threads which are doing
-   // the work of talking to the storage.
-   const string thread_in_ep =  "inproc://storage_thread_in_" + handler_id;
-   const string thread_out_ep = "inproc://storage_thread_out_" + handler_id;
-   threads_in.bind(thread_in_ep);
-   threads_out.bind(thread_out_ep);
+   if (metatile_cache_size > 0)
+   {
+      m_cache.reset(new metatile_cache(metatile_cache_size, metatile_cache_ttl));
+   }
+   else
+   {
+      // the cache wants whole metatiles, which the reader doesn't do, 
+      // so it's only used when there isn't one.
+      m_async_storage.reset(get_tile_storage(conf, m_context));
+      if (m_async_storage)
+      {
+         m_reader = m_async_storage->reader();
+      }
+      if (m_reader == NULL)
+      {
+         m_async_storage.reset();
+      }
+   }
 
    // don't want to get signals when child threads die, as this interrupts the
    // zeromq poll loop and it's much easier to keep track of this stuff when
@@ -248,8 +385,9 @@ storage_worker::storage_worker(zmq::context_t &ctx,
                             boost::ref(conf), 
                             boost::ref(m_context),
                             boost::cref(m_dirty_list),
+                            m_cache.get(),
                             boost::ref(m_shutdown_requested),
-                            thread_in_ep, thread_out_ep));
+                            boost::ref(threads_out), boost::ref(threads_in)));
       
       threads.push_back(t);
    }
@@ -260,6 +398,26 @@ storage_worker::~storage_worker()
    // notify everyone that we want to shut down
    m_shutdown_requested = true;
 
+   // the reader's tiles belong to this worker, so wait for them to come
+   // back before getting rid of them.
+   while ((m_reader != NULL) && (m_reader->in_flight() > 0))
+   {
+      zmq::pollitem_t item = { NULL, m_reader->fd(), ZMQ_POLLIN, 0 };
+      try 
+      {
+         zmq::poll(&item, 1, STORAGE_WORKER_POLL_TIMEOUT);
+      }
+      catch (const zmq::error_t &) 
+      {
+      }
+      std::vector<tile_storage::async_reader::result> done;
+      m_reader->reap(done);
+      BOOST_FOREACH(const tile_storage::async_reader::result &r, done)
+      {
+         delete r.first;
+      }
+   }
+
    // collect all the threads
    BOOST_FOREACH(shared_ptr<boost::thread> thread, threads)
    {
@@ -273,6 +431,64 @@ storage_worker::~storage_worker()
          LOG_ERROR(boost::format("Error during thread shutdown: %1%") % e.what());
       }
    }
+
+   if (m_cache)
+   {
+      LOG_INFO(boost::format("Metatile cache: %1% hits, %2% misses.") 
+               % m_cache->hits() % m_cache->misses());
+   }
+}
+
+void
+storage_worker::drop(tile_protocol *tile)
+{
+   tile->dropped = true;
+   tile->set_data("");
+   tile->trace.mark(traceStorageDone);
+   results_backlog.push(tile);
+}
+
+bool
+storage_worker::reads_async(const tile_protocol &tile) const
+{
+   // dirty and metatile requests aren't reads of a tile, and conditional
+   // ones only want the tile's metadata, so are cheaper done by probing.
+   return (m_reader != NULL) && (tile.status != cmdDirty) && (tile.status != cmdMetatile) &&
+      !(tile.conditional() && (tile.status != cmdStatus));
+}
+
+void
+storage_worker::reap_async()
+{
+   std::vector<tile_storage::async_reader::result> done;
+   m_reader->reap(done);
+   BOOST_FOREACH(const tile_storage::async_reader::result &r, done)
+   {
+      tile_protocol *tile = r.first;
+      try
+      {
+         fill_tile(*tile, *r.second);
+      }
+      catch (const std::exception &e)
+      {
+         tile->status = cmdNotDone;
+         LOG_ERROR(boost::format("Exception during storage activity: %1%, sending "
+                                 "'not done' response.") % e.what());
+      }
+      tile->trace.mark(traceStorageDone);
+      results_backlog.push(tile);
+   }
+}
+
+void
+storage_worker::report(std::ostream &out) const
+{
+   {
+      boost::mutex::scoped_lock lock(queue_mutex);
+      queued_requests.report(out);
+   }
+   circuit_breaker::report_all(out);
+   open_metatiles::report_all(out);
 }
 
 void 
@@ -284,12 +500,29 @@ storage_worker::operator()() {
 
       while (true) {
          zmq::pollitem_t items [] = {
-            { requests_in.socket(), 0, ZMQ_POLLIN, 0 },
-            { threads_in.socket(),  0, ZMQ_POLLIN, 0 }
+            { NULL, requests_in.fd(), ZMQ_POLLIN, 0 },
+            { NULL, threads_in.fd(),  ZMQ_POLLIN, 0 },
+            { NULL, (m_reader != NULL) ? m_reader->fd() : -1, ZMQ_POLLIN, 0 }
          };
+         const int num_items = (m_reader != NULL) ? 3 : 2;
       
+         // results which couldn't be sent to the handler are retried
+         // every time around.
+         results_backlog.flush();
+
+         // when requests are waiting, wake up in time to drop them if 
+         // they pass their deadline.
+         long timeout = results_backlog.empty() ? STORAGE_WORKER_POLL_TIMEOUT : BACKLOG_POLL_TIMEOUT;
+         {
+            boost::mutex::scoped_lock lock(queue_mutex);
+            if (!queued_requests.empty() && (queued_requests.deadline() > 0)) 
+            {
+               timeout = std::min(timeout, long(queued_requests.deadline()));
+            }
+         }
+
          try {
-            zmq::poll(items, 2, STORAGE_WORKER_POLL_TIMEOUT);
+            zmq::poll(items, num_items, timeout);
          } catch (const zmq::error_t &) {
             // error can be thrown in here due to interrupted system calls. this
             // can be because ctrl-C was pressed, or the process is being run 
@@ -297,42 +530,77 @@ storage_worker::operator()() {
             // ignorable.
             continue;
          }
+
+         boost::mutex::scoped_lock lock(queue_mutex);
+         const uint64_t now = tile_trace::now();
       
-         // new items either get started, or put on the pending queue
-         if (items[0].revents & ZMQ_POLLIN) 
+         // new items go on the queue, which may mean dropping others.
+         tile_protocol *tile = NULL;
+         if ((items[0].revents & ZMQ_POLLIN) && ((tile = requests_in.pop()) != NULL))
          {
-            tile_protocol tile;
-            requests_in >> tile;
-        
-            if (cur_concurrency < max_concurrency) 
-            {
-               threads_out << tile;
-               ++cur_concurrency;
-            } 
-            else 
+            tile->trace.set(traceStorageEnqueue, now);
+            tile_protocol *turned_away = queued_requests.push(tile, now);
+            if (turned_away != NULL)
             {
-               queued_requests.push_back(make_shared<tile_protocol>(tile));
+               drop(turned_away);
             }
          }
 
-         if (items[1].revents & ZMQ_POLLIN) 
+         if ((items[1].revents & ZMQ_POLLIN) && ((tile = threads_in.pop()) != NULL))
          {
-            tile_protocol tile;
-            threads_in >> tile;
-            results_out << tile;
+            // thread becomes idle.
+            results_backlog.push(tile);
+            --cur_concurrency;
+         }
+
+         if ((m_reader != NULL) && (items[2].revents & ZMQ_POLLIN))
+         {
+            reap_async();
+         }
+
+         // give up on anything which has waited too long.
+         std::vector<tile_protocol *> expired;
+         queued_requests.expire(now, expired);
+         BOOST_FOREACH(tile_protocol *t, expired)
+         {
+            drop(t);
+         }
+
+         // hand out the most urgent of the rest to the asynchronous reader,
+         // if it can take them, or to idle threads. if neither can take the
+         // most urgent request, the rest wait behind it.
+         while ((tile = queued_requests.front()) != NULL)
+         {
+            const bool async = reads_async(*tile) && m_reader->ready();
+            if (!async && (cur_concurrency >= max_concurrency))
+            {
+               break;
+            }
 
-            if (!queued_requests.empty()) 
+            // the dequeue time is stamped before the tile is handed
+            // over, as it belongs to the thread afterwards.
+            queued_requests.pop(now);
+            tile->trace.set(traceStorageDequeue, now);
+            if (async)
+            {
+               m_reader->submit(tile);
+            }
+            else if (!threads_out.push(tile))
             {
-               shared_ptr<tile_protocol> tile = queued_requests.front();
-               threads_out << *tile;
-               queued_requests.pop_front();
+               // can't happen, as there's room for max_concurrency.
+               drop(tile);
+               break;
             }
             else
             {
-               // no jobs to do - thread becomes idle.
-               --cur_concurrency;
+               ++cur_concurrency;
             }
          }
+         if (m_reader != NULL)
+         {
+            m_reader->flush();
+         }
+         lock.unlock();
 
          if (bt::microsec_clock::local_time() > next_check_time)
          {
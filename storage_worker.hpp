@@ -28,69 +28,111 @@
 
 #include "zstream.hpp"
 #include "tile_protocol.hpp"
+#include "tile_channel.hpp"
+#include "storage_queue.hpp"
+#include "storage/tile_storage.hpp"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 #include <string>
 #include <list>
+#include <ctime>
 
 namespace rendermq {
 
+class metatile_cache;
+
 /* threaded storage worker. accepts requests for tiles to be looked up
- * in the storage on an inproc set of sockets and spawns threads to
- * handle the blocking storage requests.
+ * in the storage on a tile channel and spawns threads to handle the 
+ * blocking storage requests.
  *
  * it would have been better to use non-blocking I/O or AIO for this,
- * but that's not something that's supported by NFS.
+ * but that's not something that's supported by NFS. storage which 
+ * does have an asynchronous reader, such as disk_uring, has plain tile
+ * reads done by this thread instead, with as many in flight as the 
+ * reader allows, and the threads do everything else.
  *
- * TODO: add queue so that large number of requests doesn't fork-bomb
- * the machine the handler is on.
+ * requests which arrive while all the threads are busy wait in a 
+ * bounded queue, most urgent first. those which can't be queued, or
+ * wait too long, are sent back marked as dropped.
  */
 class storage_worker {
 public:
-   /* constructs a storage worker which listens on 0MQ sockets 
-    * inproc://storage_request_${handler_id} and puts results onto
-    * inproc://storage_results_${handler_id}. 
+   /* constructs a storage worker which takes requests from one 
+    * channel and puts results onto another. the tiles are handed over
+    * along with the ownership of them.
     *
-    * @param ctx the 0MQ context to use for creating sockets.
+    * @param ctx the 0MQ context to use for creating storage drivers.
     * @param c the config for creating storage drivers.
-    * @param handler_id a string used to namespace the inproc
-    *    sockets.
+    * @param requests channel on which tile requests arrive.
+    * @param results channel on which the tiles are sent back.
     * @param max_concur the maximum number of threads to create to
     *    process storage requests.
     * @param dirty_list a map of styles into a list of dependent
     *    styles to expire in addition to any specified in a dirty
     *    request.
+    * @param metatile_cache_size the number of whole metatiles to keep
+    *    in memory, or zero to read each tile from storage as it is
+    *    requested.
+    * @param metatile_cache_ttl the number of seconds for which each
+    *    cached metatile is kept.
+    * @param max_queued the most requests which can wait for a thread.
+    * @param queue_deadline milliseconds after which a waiting request 
+    *    is dropped, or zero to wait as long as it takes.
     */
    storage_worker(zmq::context_t &ctx, 
                   const boost::property_tree::ptree &c,
-                  const std::string &handler_id,
+                  tile_channel &requests,
+                  tile_channel &results,
                   size_t max_concur,
-                  const std::map<std::string, std::list<std::string> > &dirty_list); 
+                  const std::map<std::string, std::list<std::string> > &dirty_list,
+                  size_t metatile_cache_size,
+                  std::time_t metatile_cache_ttl,
+                  size_t max_queued,
+                  uint64_t queue_deadline); 
 
    ~storage_worker();
   
    // main loop
    void operator()();
+
+   // write out the state of the request queue. this can be called from
+   // any thread.
+   void report(std::ostream &out) const;
   
 private:
+   // send a request back without doing it.
+   void drop(tile_protocol *tile);
+
+   // whether a request can be given to the asynchronous reader.
+   bool reads_async(const tile_protocol &tile) const;
+
+   // send back the tiles which the asynchronous reader has finished.
+   void reap_async();
+
    static void thread_func(const boost::property_tree::ptree &conf, 
                            zmq::context_t &ctx,
                            const std::map<std::string, std::list<std::string> > &dirty_list,
+                           metatile_cache *cache,
                            volatile bool &shutdown_requested,
-                           std::string resp_ep, std::string reqs_ep);
+                           tile_channel &requests, tile_channel &results);
   
    // context for zeromq operations
    zmq::context_t &m_context;
 
-   // streams for requests and responses
-   zstream::socket::pull requests_in;
-   zstream::socket::push results_out;
+   // channels for requests and responses, and somewhere for responses
+   // to wait if the handler is slow to take them.
+   tile_channel &requests_in;
+   tile_channel &results_out;
+   tile_channel_backlog results_backlog;
 
-   // stream for responses from sub-threads
-   zstream::socket::pull threads_in;
-   zstream::socket::push threads_out;
+   // channels for requests to, and responses from, the sub-threads. 
+   // no more than max_concurrency requests are handed out at once, so
+   // these never fill up.
+   tile_channel threads_in;
+   tile_channel threads_out;
   
    // maximum number of i/o threads to run. everything else gets queued.
    size_t max_concurrency;
@@ -105,6 +147,14 @@ private:
    // and should be dirtied whenever the keyed style is dirtied.
    std::map<std::string, std::list<std::string> > m_dirty_list;
 
+   // metatiles shared between all the threads, or null if disabled.
+   boost::scoped_ptr<metatile_cache> m_cache;
+
+   // storage used from this thread to read tiles asynchronously, and 
+   // its reader, if it has one. both are null otherwise.
+   boost::scoped_ptr<tile_storage> m_async_storage;
+   tile_storage::async_reader *m_reader;
+
    // signal to threads when they must shut down
    volatile bool m_shutdown_requested;
   
@@ -113,8 +163,9 @@ private:
    thread_list_t threads;
 
    // queue of requests which didn't get processed because of the limit 
-   // on i/o threads.
-   std::list<boost::shared_ptr<tile_protocol> > queued_requests;
+   // on i/o threads, locked so that it can be reported on.
+   storage_queue queued_requests;
+   mutable boost::mutex queue_mutex;
 };
 
 } // namespace rendermq
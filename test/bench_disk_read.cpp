@@ -0,0 +1,175 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* benchmark of reading tiles from metatiles on a warm page cache, to
+ * see how many tiles per second each core can get through when there's
+ * no waiting for the disk, i.e: how much the system calls and copies 
+ * in disk_storage cost, with and without mapping the metatiles or 
+ * keeping them open. each thread reads random tiles from the same set
+ * of metatiles, which are all read once beforehand to warm the cache.
+ *
+ * usage: bench_disk_read [metatiles] [tiles per thread] [threads] [dir]
+ */
+
+#include "test/fake_tile.hpp"
+#include "storage/disk_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <climits>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+using rendermq::disk_storage;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+// fills the directory with metatiles, returning all the tiles in them.
+vector<tile_protocol> make_metatiles(const string &dir, size_t count)
+{
+   disk_storage storage(dir);
+   vector<tile_protocol> tiles;
+   const int z = 18;
+   for (size_t i = 0; i < count; ++i)
+   {
+      const int x = int((i * 7919) % (1 << (z - 3))) * METATILE;
+      const int y = int(i / (1 << (z - 3))) * METATILE;
+      tile_protocol tile(cmdRender, x, y, z, 0, "map", fmtPNG, 0, 0);
+      fake_tile meta(x, y, z, fmtPNG);
+      if (!storage.put_meta(tile, string(meta.ptr, meta.total_size)))
+      {
+         throw std::runtime_error("Can't save meta tile.");
+      }
+      for (int dy = 0; dy < METATILE; ++dy)
+      {
+         for (int dx = 0; dx < METATILE; ++dx)
+         {
+            tiles.push_back(tile_protocol(cmdRender, x + dx, y + dy, z, 0, "map", fmtPNG, 0, 0));
+         }
+      }
+   }
+   return tiles;
+}
+
+typedef boost::shared_ptr<tile_storage::handle> (tile_storage::*read_fn)(const tile_protocol &) const;
+
+void reader(const string &dir, const vector<tile_protocol> &tiles, size_t count, 
+            unsigned int seed, read_fn fn, size_t mapped, size_t open, size_t &found)
+{
+   // each thread has its own storage, as in the storage worker.
+   disk_storage storage(dir, mapped, open);
+   string data;
+   found = 0;
+   for (size_t i = 0; i < count; ++i)
+   {
+      const tile_protocol &tile = tiles[rand_r(&seed) % tiles.size()];
+      boost::shared_ptr<tile_storage::handle> handle = (storage.*fn)(tile);
+      if (handle->exists() && handle->data(data)) { ++found; }
+   }
+}
+
+void bench(const string &name, const string &dir, const vector<tile_protocol> &tiles, 
+           size_t count, size_t num_threads, read_fn fn, size_t mapped = 0, size_t open = 0)
+{
+   vector<size_t> found(num_threads, 0);
+   bt::ptime begin = bt::microsec_clock::local_time();
+   boost::thread_group threads;
+   for (size_t i = 0; i < num_threads; ++i)
+   {
+      threads.create_thread(boost::bind(&reader, boost::cref(dir), boost::cref(tiles), count,
+                                        (unsigned int)(i + 1), fn, mapped, open, boost::ref(found[i])));
+   }
+   threads.join_all();
+   bt::time_duration elapsed = bt::microsec_clock::local_time() - begin;
+
+   size_t total = 0, all_found = 0;
+   for (size_t i = 0; i < num_threads; ++i)
+   {
+      total += count;
+      all_found += found[i];
+   }
+   const double secs = double(elapsed.total_microseconds()) / 1000000.0;
+   cout << boost::format("%1$-24s %2$2d threads %3$9d tiles (%4% found) in %5%, %6$.0f tiles/s, %7$.0f tiles/s/thread") 
+      % name % num_threads % total % all_found % elapsed % (double(total) / secs) 
+      % (double(total) / secs / num_threads) << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   const size_t count = (argc > 1) ? atoi(argv[1]) : 1000;
+   const size_t per_thread = (argc > 2) ? atoi(argv[2]) : 200000;
+   const size_t num_threads = (argc > 3) ? atoi(argv[3]) : boost::thread::hardware_concurrency();
+   const fs::path dir = (argc > 4) ? (fs::path(argv[4]) / fs::unique_path()) :
+      (fs::path("/tmp") / fs::unique_path());
+
+   cout << "== Benchmarking Disk Storage on a Warm Cache ==" << endl << endl;
+
+   fs::create_directories(dir);
+   vector<tile_protocol> tiles = make_metatiles(dir.native(), count);
+
+   // warm the page, dentry and inode caches.
+   {
+      disk_storage storage(dir.native());
+      string data;
+      for (size_t i = 0; i < tiles.size(); i += METATILE * METATILE)
+      {
+         storage.get(tiles[i])->data(data);
+      }
+   }
+
+   // the mapped and open runs keep all the metatiles mapped or open.
+   bench("get", dir.native(), tiles, per_thread, 1, &tile_storage::get);
+   bench("probe then data", dir.native(), tiles, per_thread, 1, &tile_storage::probe);
+   bench("mapped get", dir.native(), tiles, per_thread, 1, &tile_storage::get, count);
+   bench("open get", dir.native(), tiles, per_thread, 1, &tile_storage::get, 0, count);
+   if (num_threads > 1)
+   {
+      bench("get", dir.native(), tiles, per_thread, num_threads, &tile_storage::get);
+      bench("probe then data", dir.native(), tiles, per_thread, num_threads, &tile_storage::probe);
+      bench("mapped get", dir.native(), tiles, per_thread, num_threads, &tile_storage::get, count);
+      bench("open get", dir.native(), tiles, per_thread, num_threads, &tile_storage::get, 0, count);
+   }
+
+   fs::remove_all(dir);
+   return 0;
+}
@@ -0,0 +1,233 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* benchmark of reading tiles from metatiles on a cold cache, comparing
+ * disk_storage on a number of threads, as the storage worker used to do
+ * it, with disk_uring's asynchronous reader on a single thread. one 
+ * tile is read from each metatile, in a random order.
+ *
+ * the page cache for the metatiles is dropped before each run, which
+ * any user can do. the dentry and inode caches can only be dropped by 
+ * root, so it's best run as root, when /proc/sys/vm/drop_caches is used
+ * as well. to be meaningful, the directory should be on the disks to be
+ * measured, and not on a tmpfs.
+ *
+ * usage: bench_disk_uring [metatiles] [threads] [queue depth] [dir]
+ */
+
+#include "test/fake_tile.hpp"
+#include "storage/disk_storage.hpp"
+#include "storage/disk_uring_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+using rendermq::disk_storage;
+using rendermq::disk_uring_storage;
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+// fills the directory with metatiles, returning one tile from each.
+vector<tile_protocol> make_metatiles(const string &dir, size_t count)
+{
+   disk_storage storage(dir);
+   vector<tile_protocol> tiles;
+   const int z = 18;
+   for (size_t i = 0; i < count; ++i)
+   {
+      // spread them out, so that they aren't all in the same directory.
+      const int x = int((i * 7919) % (1 << (z - 3))) * METATILE;
+      const int y = int(i / (1 << (z - 3))) * METATILE;
+      tile_protocol tile(cmdRender, x, y, z, 0, "map", fmtPNG, 0, 0);
+      fake_tile meta(x, y, z, fmtPNG);
+      if (!storage.put_meta(tile, string(meta.ptr, meta.total_size)))
+      {
+         throw std::runtime_error("Can't save meta tile.");
+      }
+      tile.x += rand() % METATILE;
+      tile.y += rand() % METATILE;
+      tiles.push_back(tile);
+   }
+   std::random_shuffle(tiles.begin(), tiles.end());
+   return tiles;
+}
+
+// get rid of as much of the cache as is allowed.
+void drop_caches(const string &dir)
+{
+   sync();
+   std::ofstream drop("/proc/sys/vm/drop_caches");
+   if (drop << "3" << std::flush)
+   {
+      return;
+   }
+
+   for (fs::recursive_directory_iterator itr(dir), end; itr != end; ++itr)
+   {
+      if (fs::is_regular_file(itr->path()))
+      {
+         int fd = open(itr->path().c_str(), O_RDONLY);
+         if (fd >= 0)
+         {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+         }
+      }
+   }
+}
+
+void report(const string &name, size_t count, size_t found, const bt::time_duration &elapsed)
+{
+   const double secs = double(elapsed.total_microseconds()) / 1000000.0;
+   cout << boost::format("%1$-28s %2$8d tiles (%3% found) in %4%, %5$.0f tiles/s") 
+      % name % count % found % elapsed % (double(count) / secs) << endl;
+}
+
+void blocking_reader(const string &dir, const vector<tile_protocol> &tiles, 
+                     size_t &next, boost::mutex &mutex, size_t &found)
+{
+   // each thread has its own storage, as in the storage worker.
+   disk_storage storage(dir);
+   size_t mine = 0;
+   while (true)
+   {
+      size_t i = 0;
+      {
+         boost::mutex::scoped_lock lock(mutex);
+         if (next >= tiles.size()) { break; }
+         i = next++;
+      }
+      string data;
+      boost::shared_ptr<tile_storage::handle> handle = storage.get(tiles[i]);
+      if (handle->exists() && handle->data(data)) { ++mine; }
+   }
+   boost::mutex::scoped_lock lock(mutex);
+   found += mine;
+}
+
+void bench_threads(const string &dir, const vector<tile_protocol> &tiles, size_t num_threads)
+{
+   drop_caches(dir);
+
+   size_t next = 0, found = 0;
+   boost::mutex mutex;
+   bt::ptime begin = bt::microsec_clock::local_time();
+   boost::thread_group threads;
+   for (size_t i = 0; i < num_threads; ++i)
+   {
+      threads.create_thread(boost::bind(&blocking_reader, boost::cref(dir), boost::cref(tiles),
+                                        boost::ref(next), boost::ref(mutex), boost::ref(found)));
+   }
+   threads.join_all();
+   bt::time_duration elapsed = bt::microsec_clock::local_time() - begin;
+
+   report((boost::format("disk, %1% threads") % num_threads).str(), tiles.size(), found, elapsed);
+}
+
+void bench_uring(const string &dir, vector<tile_protocol> &tiles, size_t depth)
+{
+   disk_uring_storage storage(dir, depth);
+   tile_storage::async_reader *reader = storage.reader();
+   if (reader == NULL)
+   {
+      cout << "disk_uring has no asynchronous reader, skipping." << endl;
+      return;
+   }
+
+   drop_caches(dir);
+
+   size_t next = 0, found = 0;
+   std::vector<tile_storage::async_reader::result> results;
+   bt::ptime begin = bt::microsec_clock::local_time();
+   while ((next < tiles.size()) || (reader->in_flight() > 0))
+   {
+      while ((next < tiles.size()) && reader->ready())
+      {
+         reader->submit(&tiles[next++]);
+      }
+      reader->flush();
+
+      struct pollfd p = { reader->fd(), POLLIN, 0 };
+      poll(&p, 1, 1000);
+
+      results.clear();
+      reader->reap(results);
+      BOOST_FOREACH(const tile_storage::async_reader::result &r, results)
+      {
+         string data;
+         if (r.second->exists() && r.second->data(data)) { ++found; }
+      }
+   }
+   bt::time_duration elapsed = bt::microsec_clock::local_time() - begin;
+
+   report((boost::format("disk_uring, depth %1%") % depth).str(), tiles.size(), found, elapsed);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   const size_t count = (argc > 1) ? atoi(argv[1]) : 10000;
+   const size_t num_threads = (argc > 2) ? atoi(argv[2]) : 8;
+   const size_t depth = (argc > 3) ? atoi(argv[3]) : 256;
+   const fs::path dir = (argc > 4) ? (fs::path(argv[4]) / fs::unique_path()) :
+      (fs::path("/tmp") / fs::unique_path());
+
+   cout << "== Benchmarking Disk Storage on a Cold Cache ==" << endl << endl;
+
+   fs::create_directories(dir);
+   vector<tile_protocol> tiles = make_metatiles(dir.native(), count);
+
+   bench_threads(dir.native(), tiles, 1);
+   bench_threads(dir.native(), tiles, num_threads);
+   bench_uring(dir.native(), tiles, depth);
+
+   fs::remove_all(dir);
+   return 0;
+}
@@ -0,0 +1,291 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* HTTP load generator, for comparing the handler behind mongrel2 with
+ * the handler serving HTTP itself (mongrel2.http_listen). run both on
+ * the same box, against the same storage, and point this at each in
+ * turn:
+ *
+ *   bench_http_load 127.0.0.1 6767 100000 32 1   # through mongrel2
+ *   bench_http_load 127.0.0.1 8080 100000 32 1   # built-in server
+ *   bench_http_load 127.0.0.1 8080 100000 32 8   # ... with pipelining
+ *
+ * each connection is kept alive and has up to `depth' requests in 
+ * flight at once. requests are for random tiles at a single zoom
+ * level, so once the tiles are in storage (run it twice) this measures
+ * the request path and not rendering. it prints the request rate and
+ * the latency distribution, measured from writing a request to 
+ * reading the end of its response.
+ *
+ * usage: bench_http_load host port [requests] [connections] [depth]
+ *                        [path template] [zoom]
+ * where the path template takes z, x and y, in that order, in printf
+ * style and defaults to /tiles/1.0.0/osm/%d/%d/%d.png.
+ */
+
+#include "tile_trace.hpp"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <boost/format.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+using rendermq::tile_trace;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+struct options
+{
+   string host, port, path_template;
+   size_t requests, connections, depth;
+   int zoom;
+};
+
+struct results
+{
+   results() : errors(0), not_ok(0) {}
+
+   vector<uint64_t> latencies;
+   size_t errors, not_ok;
+   boost::mutex mutex;
+};
+
+int connect_to(const options &opts)
+{
+   struct addrinfo hints, *addrs = NULL;
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(opts.host.c_str(), opts.port.c_str(), &hints, &addrs) != 0)
+   {
+      return -1;
+   }
+
+   int fd = -1;
+   for (struct addrinfo *a = addrs; (a != NULL) && (fd < 0); a = a->ai_next)
+   {
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if ((fd >= 0) && (connect(fd, a->ai_addr, a->ai_addrlen) != 0))
+      {
+         close(fd);
+         fd = -1;
+      }
+   }
+   freeaddrinfo(addrs);
+
+   if (fd >= 0)
+   {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   }
+   return fd;
+}
+
+/* reads one response from the buffer, topping it up from the socket as
+ * needed. returns the status code, or -1 if the connection failed.
+ */
+int read_response(int fd, string &buf)
+{
+   string::size_type end;
+   while ((end = buf.find("\r\n\r\n")) == string::npos)
+   {
+      char tmp[16384];
+      ssize_t n = read(fd, tmp, sizeof(tmp));
+      if (n <= 0) { return -1; }
+      buf.append(tmp, n);
+   }
+
+   const string head = buf.substr(0, end);
+   int status = -1;
+   if (head.size() > 12) 
+   { 
+      status = atoi(head.c_str() + 9); 
+   }
+
+   size_t length = 0;
+   vector<string> lines;
+   boost::split(lines, head, boost::is_any_of("\n"));
+   for (size_t i = 1; i < lines.size(); ++i)
+   {
+      if (boost::istarts_with(lines[i], "content-length:"))
+      {
+         length = atol(lines[i].c_str() + 15);
+      }
+   }
+
+   const size_t total = end + 4 + length;
+   while (buf.size() < total)
+   {
+      char tmp[16384];
+      ssize_t n = read(fd, tmp, sizeof(tmp));
+      if (n <= 0) { return -1; }
+      buf.append(tmp, n);
+   }
+   buf.erase(0, total);
+   return status;
+}
+
+void run_connection(const options &opts, size_t count, unsigned int seed, results &res)
+{
+   vector<uint64_t> latencies;
+   latencies.reserve(count);
+   size_t errors = 0, not_ok = 0;
+
+   int fd = connect_to(opts);
+   if (fd < 0)
+   {
+      errors = count;
+   }
+   else
+   {
+      const int dim = 1 << opts.zoom;
+      std::deque<uint64_t> in_flight;
+      string buf;
+      size_t sent = 0;
+
+      while ((sent < count) || !in_flight.empty())
+      {
+         // top up the pipeline, all in one write.
+         string requests;
+         while ((sent < count) && (in_flight.size() < opts.depth))
+         {
+            const int x = rand_r(&seed) % dim, y = rand_r(&seed) % dim;
+            char path[1024];
+            snprintf(path, sizeof(path), opts.path_template.c_str(), opts.zoom, x, y);
+            requests += (boost::format("GET %1% HTTP/1.1\r\nHost: %2%\r\n\r\n") % path % opts.host).str();
+            in_flight.push_back(0);
+            ++sent;
+         }
+         if (!requests.empty())
+         {
+            const uint64_t now = tile_trace::now();
+            for (std::deque<uint64_t>::iterator itr = in_flight.begin(); itr != in_flight.end(); ++itr)
+            {
+               if (*itr == 0) { *itr = now; }
+            }
+            if (write(fd, requests.data(), requests.size()) != ssize_t(requests.size()))
+            {
+               errors += count - latencies.size() - not_ok;
+               break;
+            }
+         }
+
+         int status = read_response(fd, buf);
+         if (status < 0)
+         {
+            errors += count - latencies.size() - not_ok;
+            break;
+         }
+         if ((status != 200) && (status != 304)) { ++not_ok; }
+         latencies.push_back(tile_trace::now() - in_flight.front());
+         in_flight.pop_front();
+      }
+      close(fd);
+   }
+
+   boost::mutex::scoped_lock lock(res.mutex);
+   res.latencies.insert(res.latencies.end(), latencies.begin(), latencies.end());
+   res.errors += errors;
+   res.not_ok += not_ok;
+}
+
+uint64_t percentile(const vector<uint64_t> &sorted, double q)
+{
+   if (sorted.empty()) { return 0; }
+   size_t i = std::min(sorted.size() - 1, size_t(q * sorted.size()));
+   return sorted[i];
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   if (argc < 3)
+   {
+      cerr << "usage: " << argv[0] << " host port [requests] [connections] [depth] [path template] [zoom]" << endl;
+      return EXIT_FAILURE;
+   }
+
+   options opts;
+   opts.host = argv[1];
+   opts.port = argv[2];
+   opts.requests = (argc > 3) ? boost::lexical_cast<size_t>(argv[3]) : 100000;
+   opts.connections = (argc > 4) ? boost::lexical_cast<size_t>(argv[4]) : 32;
+   opts.depth = (argc > 5) ? boost::lexical_cast<size_t>(argv[5]) : 1;
+   opts.path_template = (argc > 6) ? argv[6] : "/tiles/1.0.0/osm/%d/%d/%d.png";
+   opts.zoom = (argc > 7) ? boost::lexical_cast<int>(argv[7]) : 12;
+
+   if ((opts.connections == 0) || (opts.depth == 0))
+   {
+      cerr << "connections and depth must be at least 1." << endl;
+      return EXIT_FAILURE;
+   }
+
+   results res;
+   boost::thread_group threads;
+   const uint64_t start = tile_trace::now();
+   for (size_t i = 0; i < opts.connections; ++i)
+   {
+      size_t count = opts.requests / opts.connections + ((i < opts.requests % opts.connections) ? 1 : 0);
+      threads.create_thread(boost::bind(&run_connection, boost::cref(opts), count, 
+                                        (unsigned int)(i + 1), boost::ref(res)));
+   }
+   threads.join_all();
+   const double elapsed = double(tile_trace::now() - start) / 1.0e6;
+
+   std::sort(res.latencies.begin(), res.latencies.end());
+   const size_t done = res.latencies.size();
+
+   cout << boost::format("%1%:%2%  connections=%3% depth=%4%") % opts.host % opts.port % opts.connections % opts.depth << endl;
+   cout << boost::format("requests: %1% ok, %2% non-200/304, %3% failed in %4$.2fs") 
+      % (done - res.not_ok) % res.not_ok % res.errors % elapsed << endl;
+   cout << boost::format("throughput: %1$.0f req/s") % (elapsed > 0 ? done / elapsed : 0.0) << endl;
+   cout << boost::format("latency (us): p50=%1% p90=%2% p99=%3% p99.9=%4% max=%5%")
+      % percentile(res.latencies, 0.5) % percentile(res.latencies, 0.9) 
+      % percentile(res.latencies, 0.99) % percentile(res.latencies, 0.999) 
+      % (res.latencies.empty() ? 0 : res.latencies.back()) << endl;
+
+   return (res.errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,169 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* microbenchmark of one hop between the handler and the storage 
+ * worker: a thread sending tiles to another, which polls for them. 
+ * this compares the inproc zmq sockets with protobuf serialisation, 
+ * which were used for each hop, with the tile channel which replaced
+ * them. it's run with both request-sized tiles, which have no data, 
+ * and result-sized ones carrying a tile image.
+ *
+ * usage: bench_tile_channel [tiles] [data bytes]
+ */
+
+#include "tile_channel.hpp"
+#include "tile_protocol.hpp"
+#include "zstream.hpp"
+#include "zstream_pbuf.hpp"
+#include <zmq.hpp>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using rendermq::tile_protocol;
+using rendermq::tile_channel;
+using rendermq::cmdRender;
+using rendermq::cmdDone;
+using rendermq::fmtPNG;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+
+namespace {
+
+tile_protocol make_tile(size_t data_size)
+{
+   tile_protocol tile(data_size > 0 ? cmdDone : cmdRender, 4093, 2723, 13, 12345, "map", fmtPNG);
+   tile.set_data(string(data_size, 'x'));
+   return tile;
+}
+
+void report(const string &name, size_t count, const bt::time_duration &elapsed)
+{
+   const double per_tile = double(elapsed.total_microseconds()) * 1000.0 / double(count);
+   cout << boost::format("%1$-24s %2$8d tiles in %3%, %4$.0f ns/hop") 
+      % name % count % elapsed % per_tile << endl;
+}
+
+void zmq_sender(zmq::context_t &ctx, const tile_protocol &tile, size_t count)
+{
+   zstream::socket::push out(ctx);
+   out.connect("inproc://bench_tile_channel");
+   for (size_t i = 0; i < count; ++i)
+   {
+      out << tile;
+   }
+}
+
+void bench_zmq(const string &name, const tile_protocol &tile, size_t count)
+{
+   zmq::context_t ctx(1);
+   zstream::socket::pull in(ctx);
+   in.bind("inproc://bench_tile_channel");
+
+   bt::ptime begin = bt::microsec_clock::local_time();
+   boost::thread sender(boost::bind(&zmq_sender, boost::ref(ctx), boost::cref(tile), count));
+   for (size_t i = 0; i < count; ++i)
+   {
+      zmq::pollitem_t items [] = { { in.socket(), 0, ZMQ_POLLIN, 0 } };
+      zmq::poll(items, 1, -1);
+      tile_protocol received;
+      in >> received;
+   }
+   bt::time_duration elapsed = bt::microsec_clock::local_time() - begin;
+   sender.join();
+
+   report(name, count, elapsed);
+}
+
+void channel_sender(tile_channel &channel, vector<tile_protocol *> &tiles, size_t count)
+{
+   for (size_t i = 0; i < count; ++i)
+   {
+      while (!channel.push(tiles[i % tiles.size()]))
+      {
+         boost::this_thread::yield();
+      }
+   }
+}
+
+void bench_channel(const string &name, const tile_protocol &tile, size_t count)
+{
+   tile_channel channel(4096);
+
+   // the tiles are made up front, as in the handler they already exist
+   // and it's only their ownership which moves. nothing changes them,
+   // so a pool of them is sent round and round.
+   vector<tile_protocol *> tiles;
+   for (size_t i = 0; i < 1024; ++i)
+   {
+      tiles.push_back(new tile_protocol(tile));
+   }
+
+   bt::ptime begin = bt::microsec_clock::local_time();
+   boost::thread sender(boost::bind(&channel_sender, boost::ref(channel), boost::ref(tiles), count));
+   for (size_t i = 0; i < count; )
+   {
+      zmq::pollitem_t items [] = { { NULL, channel.fd(), ZMQ_POLLIN, 0 } };
+      zmq::poll(items, 1, -1);
+      if (channel.pop() != NULL) { ++i; }
+   }
+   bt::time_duration elapsed = bt::microsec_clock::local_time() - begin;
+   sender.join();
+
+   report(name, count, elapsed);
+
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      delete tiles[i];
+   }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   const size_t count = (argc > 1) ? atoi(argv[1]) : 100000;
+   const size_t data_size = (argc > 2) ? atoi(argv[2]) : 16384;
+
+   cout << "== Benchmarking Tile Channel ==" << endl << endl;
+
+   const tile_protocol request = make_tile(0);
+   const tile_protocol result = make_tile(data_size);
+
+   bench_zmq("request zmq+protobuf", request, count);
+   bench_channel("request channel", request, count);
+   bench_zmq("result zmq+protobuf", result, count);
+   bench_channel("result channel", result, count);
+
+   return 0;
+}
@@ -0,0 +1,134 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+/* microbenchmark comparing the regex and fast path matchers in the
+ * tile_path_parser on a mix of URLs which looks roughly like what the
+ * handler sees: mostly good tile requests spread over the zoom levels,
+ * with a sprinkling of status / dirty requests and junk.
+ *
+ * usage: bench_tile_path_parser [iterations]
+ */
+
+#include "tile_path_parser.hpp"
+#include "tile_protocol.hpp"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <boost/format.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using rendermq::tile_path_parser;
+using rendermq::tile_protocol;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+namespace bt = boost::posix_time;
+
+namespace {
+
+vector<string> url_mix(size_t count)
+{
+   const char *styles[] = { "map", "hyb", "osm", "sat" };
+   const char *formats[] = { "png", "jpg", "png", "gif", "png", "jpeg", "json" };
+   vector<string> urls;
+
+   srand(1);
+   for (size_t i = 0; i < count; ++i)
+   {
+      const int z = rand() % 19;
+      const int x = rand() % (1 << z);
+      const int y = rand() % (1 << z);
+      string url = (boost::format("/tiles/1.0.0/%1%/%2%/%3%/%4%.%5%")
+                    % styles[rand() % 4] % z % x % y % formats[rand() % 7]).str();
+
+      const int r = rand() % 100;
+      if (r == 0) { url += "/dirty"; }
+      else if (r == 1) { url += "/status"; }
+      else if (r == 2) { url = "/favicon.ico"; }
+      else if (r == 3) { url += ".bak"; }
+
+      urls.push_back(url);
+   }
+   return urls;
+}
+
+template <typename Matcher>
+void run(const string &name, Matcher matcher, const vector<string> &urls, size_t iterations)
+{
+   size_t matched = 0;
+   tile_protocol tile;
+
+   bt::ptime begin = bt::microsec_clock::local_time();
+   for (size_t i = 0; i < iterations; ++i)
+   {
+      for (vector<string>::const_iterator itr = urls.begin(); itr != urls.end(); ++itr)
+      {
+         if (matcher(tile, *itr)) { ++matched; }
+      }
+   }
+   bt::time_duration elapsed = bt::microsec_clock::local_time() - begin;
+
+   const double per_url = double(elapsed.total_microseconds()) * 1000.0 / double(iterations * urls.size());
+   cout << boost::format("%1$-6s %2$8d matched in %3%, %4$.1f ns/url") 
+      % name % matched % elapsed % per_url << endl;
+}
+
+struct regex_matcher
+{
+   tile_path_parser &parser;
+   explicit regex_matcher(tile_path_parser &p) : parser(p) {}
+   bool operator()(tile_protocol &tile, const string &url) { return parser.match_regex(tile, url); }
+};
+
+struct fast_matcher
+{
+   tile_path_parser &parser;
+   explicit fast_matcher(tile_path_parser &p) : parser(p) {}
+   bool operator()(tile_protocol &tile, const string &url) { return parser.match_fast(tile, url); }
+};
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   const size_t iterations = (argc > 1) ? atoi(argv[1]) : 100;
+   const vector<string> urls = url_mix(10000);
+
+   tile_path_parser parser("/tiles/1.0.0/{STYLE}/{Z}/{X}/{Y}.{FORMAT}");
+   if (!parser.fast_path())
+   {
+      cout << "Default template isn't using the fast path!" << endl;
+      return 1;
+   }
+
+   cout << "== Benchmarking Tile Path Parser ==" << endl << endl;
+
+   run("regex", regex_matcher(parser), urls, iterations);
+   run("fast", fast_matcher(parser), urls, iterations);
+
+   return 0;
+}
@@ -0,0 +1,371 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "bulk_dirty.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <boost/format.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+using rendermq::tile_protocol;
+using rendermq::cmdDirty;
+using rendermq::dirty_region;
+using rendermq::metatile_enumerator;
+using rendermq::bulk_dirty_jobs;
+using rendermq::parse_dirty_query;
+
+typedef boost::tuple<int, int, int> zxy_t;
+
+namespace
+{
+std::set<zxy_t> enumerate(const dirty_region &region)
+{
+   std::set<zxy_t> tiles;
+   metatile_enumerator e(region);
+   int z, x, y;
+   while (e.next(z, x, y))
+   {
+      if (!tiles.insert(zxy_t(z, x, y)).second)
+      {
+         throw runtime_error((boost::format("Metatile %1%/%2%/%3% given twice.") % z % x % y).str());
+      }
+   }
+   return tiles;
+}
+
+bool always(const string &) { return true; }
+bool never(const string &) { return false; }
+} // anonymous namespace
+
+void test_bulk_dirty_bbox() 
+{
+   // the whole world at zooms 0 to 4 is 1 + 1 + 1 + 1 + 4 metatiles.
+   std::set<zxy_t> world = enumerate(dirty_region(-180, -85, 180, 85, 0, 4));
+   if (world.size() != 8)
+   {
+      throw runtime_error((boost::format("Expected 8 metatiles for the world, got %1%.") % world.size()).str());
+   }
+
+   // a small box near (0, 0) at zoom 10 is in one of the 4 metatiles
+   // which meet there.
+   std::set<zxy_t> small = enumerate(dirty_region(0.01, 0.01, 0.02, 0.02, 10, 10));
+   if ((small.size() != 1) || (small.count(zxy_t(10, 512, 504)) != 1))
+   {
+      throw runtime_error("Small bbox gave the wrong metatiles.");
+   }
+
+   metatile_enumerator e(dirty_region(-1, -1, 1, 1, 10, 12));
+   const uint64_t bound = e.bound();
+   std::set<zxy_t> tiles = enumerate(dirty_region(-1, -1, 1, 1, 10, 12));
+   if (tiles.size() != bound)
+   {
+      throw runtime_error((boost::format("A bbox should give exactly its bound of %1%, got %2%.") 
+                           % bound % tiles.size()).str());
+   }
+}
+
+void test_bulk_dirty_polygon() 
+{
+   // a thin diagonal triangle covers fewer metatiles than its bounds.
+   vector<pair<double, double> > ring;
+   ring.push_back(make_pair(0.0, 0.0));
+   ring.push_back(make_pair(10.0, 10.0));
+   ring.push_back(make_pair(10.0, 9.5));
+   dirty_region triangle(ring, 12, 12);
+   dirty_region box(0.0, 0.0, 10.0, 10.0, 12, 12);
+
+   std::set<zxy_t> in_triangle = enumerate(triangle), in_box = enumerate(box);
+   if (in_triangle.empty() || (in_triangle.size() >= in_box.size()))
+   {
+      throw runtime_error((boost::format("Triangle gave %1% metatiles, its bounds %2%.") 
+                           % in_triangle.size() % in_box.size()).str());
+   }
+   // everything in the triangle must be in its bounds, and both ends of
+   // the diagonal must be covered.
+   BOOST_FOREACH(const zxy_t &t, in_triangle)
+   {
+      if (in_box.count(t) == 0) { throw runtime_error("Triangle metatile outside bounds."); }
+   }
+   if (!triangle.covers(12, 2048, 2040) || !triangle.covers(12, 2160, 1928))
+   {
+      throw runtime_error("Triangle doesn't cover the metatiles at its ends.");
+   }
+
+   // a polygon entirely inside one metatile still covers it.
+   ring.clear();
+   ring.push_back(make_pair(0.001, 0.001));
+   ring.push_back(make_pair(0.002, 0.001));
+   ring.push_back(make_pair(0.002, 0.002));
+   if (enumerate(dirty_region(ring, 12, 12)).size() != 1)
+   {
+      throw runtime_error("Tiny polygon didn't cover exactly one metatile.");
+   }
+}
+
+void test_bulk_dirty_query() 
+{
+   string style, error;
+   boost::shared_ptr<dirty_region> region;
+
+   if (!parse_dirty_query("style=osm&zoom=10-12&bbox=-1%2C-1%2C1%2C1", style, region, error) ||
+       (style != "osm") || !region || (region->min_zoom() != 10) || (region->max_zoom() != 12))
+   {
+      throw runtime_error("Valid bbox query was rejected: " + error);
+   }
+   if (!parse_dirty_query("zoom=5&style=map&poly=0,0,1,0,1,1", style, region, error) ||
+       (style != "map") || (region->min_zoom() != 5) || (region->max_zoom() != 5))
+   {
+      throw runtime_error("Valid poly query was rejected: " + error);
+   }
+
+   const char *bad[] = {
+      "zoom=10&bbox=0,0,1,1",                 // no style
+      "style=osm&bbox=0,0,1,1",               // no zoom
+      "style=osm&zoom=12-10&bbox=0,0,1,1",    // backwards zoom
+      "style=osm&zoom=10-31&bbox=0,0,1,1",    // too deep
+      "style=osm&zoom=10",                    // no area
+      "style=osm&zoom=10&bbox=1,0,0,1",       // backwards bbox
+      "style=osm&zoom=10&bbox=0,0,1",         // short bbox
+      "style=osm&zoom=10&poly=0,0,1,1",       // not a polygon
+      "style=osm&zoom=10&bbox=0,0,1,1&poly=0,0,1,0,1,1",
+      NULL
+   };
+   for (const char **q = bad; *q != NULL; ++q)
+   {
+      if (parse_dirty_query(*q, style, region, error))
+      {
+         throw runtime_error((boost::format("Invalid query '%1%' was accepted.") % *q).str());
+      }
+   }
+}
+
+void test_bulk_dirty_rate() 
+{
+   bulk_dirty_jobs jobs(100.0, 10);
+   const int a = jobs.add("osm", dirty_region(-180, -85, 180, 85, 6, 8));
+   const int b = jobs.add("map", dirty_region(-180, -85, 180, 85, 6, 8));
+
+   vector<tile_protocol> batch;
+   jobs.release(1000000, &always, batch);
+   if (!batch.empty()) { throw runtime_error("Metatiles released before any time passed."); }
+
+   // half a second at 100 per second is 50, shared between the jobs.
+   jobs.release(1500000, &always, batch);
+   if (batch.size() != 50) 
+   { 
+      throw runtime_error((boost::format("Expected 50 metatiles, got %1%.") % batch.size()).str()); 
+   }
+   size_t from_a = 0;
+   BOOST_FOREACH(const tile_protocol &t, batch)
+   {
+      if (t.status != cmdDirty) { throw runtime_error("Released tile isn't a dirty request."); }
+      const int job = bulk_dirty_jobs::job_for_tile(t.id);
+      if ((job == a) != (t.style == "osm")) { throw runtime_error("Tile tagged with wrong job."); }
+      if (job == a) { ++from_a; }
+   }
+   if (from_a != 25) { throw runtime_error("Jobs didn't share the rate evenly."); }
+
+   // nothing is released for styles which can't be fed, and time spent
+   // waiting doesn't build up into a huge burst.
+   batch.clear();
+   jobs.release(2000000, &never, batch);
+   jobs.release(60000000, &never, batch);
+   if (!batch.empty()) { throw runtime_error("Metatiles released to a style which can't take them."); }
+   jobs.release(60000001, &always, batch);
+   if (batch.size() > 100) { throw runtime_error("Burst after waiting is too large."); }
+
+   if ((bulk_dirty_jobs::job_for_tile(-1) != 0) || (bulk_dirty_jobs::job_for_tile(42) != 0) ||
+       (bulk_dirty_jobs::job_for_tile(bulk_dirty_jobs::tile_id(b)) != b))
+   {
+      throw runtime_error("Tile ids don't map back to jobs.");
+   }
+}
+
+void test_bulk_dirty_slices() 
+{
+   bulk_dirty_jobs jobs(100.0, 10);
+   const int a = jobs.add("osm", dirty_region(-180, -85, 180, 85, 6, 8));
+   const int b = jobs.add("map", dirty_region(-180, -85, 180, 85, 6, 8));
+
+   vector<tile_protocol> batch, slices;
+   jobs.release(1000000, &always, batch);
+   jobs.release(1500000, &always, batch);
+   bulk_dirty_jobs::make_slices(batch, slices);
+   if (slices.size() != 2) 
+   { 
+      throw runtime_error((boost::format("Expected a slice per job, got %1%.") % slices.size()).str()); 
+   }
+
+   // each slice expands back into exactly its job's metatiles.
+   std::set<zxy_t> released, sliced;
+   BOOST_FOREACH(const tile_protocol &t, batch) { released.insert(zxy_t(t.z, t.x, t.y)); }
+   BOOST_FOREACH(const tile_protocol &slice, slices)
+   {
+      const int job = bulk_dirty_jobs::job_for_tile(slice.id);
+      if ((slice.status != cmdDirty) || ((job == a) != (slice.style == "osm")) || 
+          ((job != a) && (job != b)))
+      {
+         throw runtime_error("Slice isn't a dirty request for its job.");
+      }
+
+      vector<tile_protocol> tiles;
+      bulk_dirty_jobs::slice_tiles(slice, tiles);
+      if (tiles.size() != 25) 
+      { 
+         throw runtime_error((boost::format("Expected 25 metatiles in a slice, got %1%.") % tiles.size()).str()); 
+      }
+      BOOST_FOREACH(const tile_protocol &t, tiles)
+      {
+         if ((t.id != slice.id) || (t.style != slice.style) || (t.status != cmdDirty) || 
+             !t.data().empty())
+         {
+            throw runtime_error("Metatile in a slice doesn't match its slice.");
+         }
+         sliced.insert(zxy_t(t.z, t.x, t.y));
+      }
+   }
+   if (sliced != released) { throw runtime_error("Slices don't cover the released metatiles."); }
+}
+
+void test_bulk_dirty_progress() 
+{
+   bulk_dirty_jobs jobs(1000.0, 10);
+   const int id = jobs.add("osm", dirty_region(-180, -85, 180, 85, 0, 4));
+
+   vector<tile_protocol> batch;
+   for (uint64_t t = 1; jobs.active() && (t < 100); ++t)
+   {
+      jobs.release(t * 100000, &always, batch);
+   }
+   if (jobs.active() || (batch.size() != 8))
+   {
+      throw runtime_error((boost::format("Job should have released 8 metatiles, got %1%.") % batch.size()).str());
+   }
+
+   std::ostringstream before;
+   jobs.report(id, before);
+   if (before.str().find("state=expiring") == string::npos)
+   {
+      throw runtime_error("Job isn't waiting for expiry: " + before.str());
+   }
+
+   BOOST_FOREACH(const tile_protocol &t, batch)
+   {
+      jobs.expired(bulk_dirty_jobs::job_for_tile(t.id), 1, 1);
+   }
+
+   std::ostringstream after;
+   jobs.report(id, after);
+   if ((after.str().find("state=done") == string::npos) ||
+       (after.str().find("expired=8 queued=8") == string::npos))
+   {
+      throw runtime_error("Finished job reported wrongly: " + after.str());
+   }
+
+   std::ostringstream unknown;
+   if (jobs.report(id + 1, unknown)) { throw runtime_error("Unknown job was reported."); }
+}
+
+void test_bulk_dirty_retry() 
+{
+   bulk_dirty_jobs jobs(1000.0, 10);
+   const int id = jobs.add("osm", dirty_region(-180, -85, 180, 85, 0, 4));
+
+   vector<tile_protocol> batch;
+   for (uint64_t t = 1; jobs.active() && (t < 100); ++t)
+   {
+      jobs.release(t * 100000, &always, batch);
+   }
+
+   // one metatile is dropped without being expired, so the job isn't 
+   // finished even though all the others have been.
+   const tile_protocol dropped = batch.back();
+   batch.pop_back();
+   BOOST_FOREACH(const tile_protocol &t, batch)
+   {
+      jobs.expired(bulk_dirty_jobs::job_for_tile(t.id), 1, 1);
+   }
+   jobs.retry(id, vector<tile_protocol>(1, dropped));
+
+   std::ostringstream unfinished;
+   jobs.report(id, unfinished);
+   if (!jobs.active() || (unfinished.str().find("state=running released=7 expired=7") == string::npos))
+   {
+      throw runtime_error("Job with a dropped metatile looks finished: " + unfinished.str());
+   }
+
+   // the dropped metatile is handed out again, and once it's expired
+   // the job is done.
+   vector<tile_protocol> again;
+   for (uint64_t t = 100; jobs.active() && (t < 200); ++t)
+   {
+      jobs.release(t * 100000, &always, again);
+   }
+   if ((again.size() != 1) || (again[0].x != dropped.x) || (again[0].y != dropped.y) || 
+       (again[0].z != dropped.z))
+   {
+      throw runtime_error("Dropped metatile wasn't handed out again.");
+   }
+   jobs.expired(id, 1, 1);
+
+   std::ostringstream done;
+   jobs.report(id, done);
+   if (done.str().find("state=done released=8 expired=8") == string::npos)
+   {
+      throw runtime_error("Job didn't finish after the retry: " + done.str());
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Bulk Dirty ==" << endl << endl;
+
+   tests_failed += test::run("test_bulk_dirty_bbox", &test_bulk_dirty_bbox);
+   tests_failed += test::run("test_bulk_dirty_polygon", &test_bulk_dirty_polygon);
+   tests_failed += test::run("test_bulk_dirty_query", &test_bulk_dirty_query);
+   tests_failed += test::run("test_bulk_dirty_rate", &test_bulk_dirty_rate);
+   tests_failed += test::run("test_bulk_dirty_slices", &test_bulk_dirty_slices);
+   tests_failed += test::run("test_bulk_dirty_progress", &test_bulk_dirty_progress);
+   tests_failed += test::run("test_bulk_dirty_retry", &test_bulk_dirty_retry);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
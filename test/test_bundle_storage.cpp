@@ -0,0 +1,396 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "test/fake_tile.hpp"
+#include "storage/tile_storage.hpp"
+#include "storage/bundle_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include <boost/format.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+using boost::shared_ptr;
+using std::runtime_error;
+using std::exception;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using rendermq::bundle_storage;
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+
+namespace fs = boost::filesystem;
+
+namespace 
+{
+/* utility class to create a directory and clean up using
+ * the RAII idiom.
+ */
+class tmp_dir
+{
+public:
+   tmp_dir()
+   {
+      m_dir = fs::path("/tmp") / fs::unique_path();
+      if (!fs::create_directories(m_dir))
+      {
+         throw runtime_error("Cannot create temporary directory for bundle tests.");
+      }
+   }
+
+   ~tmp_dir()
+   {
+      fs::remove_all(m_dir);
+   }
+
+   const fs::path &dir() const
+   {
+      return m_dir;
+   }
+
+private:
+   fs::path m_dir;
+};
+
+// store the fake metatile for the tile, returning its data as passed
+// to storage.
+string put_fake(const bundle_storage &storage, const tile_protocol &tile)
+{
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   return data;
+}
+
+// check that every tile in the metatile is there with the right data.
+void check_tiles(const bundle_storage &storage, tile_protocol tile)
+{
+   const int mx = tile.x, my = tile.y;
+   for (int x = mx; x < mx + METATILE; ++x) 
+   {
+      for (int y = my; y < my + METATILE; ++y) 
+      {
+         tile.x = x;
+         tile.y = y;
+         shared_ptr<tile_storage::handle> handle = storage.get(tile);
+         string data;
+         if (!handle->exists() || !handle->data(data)) 
+         {
+            throw runtime_error((boost::format("Tile %1% should exist!") % tile).str());
+         }
+         if (handle->expired())
+         {
+            throw runtime_error("Tile should not be expired already!");
+         }
+         // fake tiles only keep the first 16 characters of the label.
+         const string expected = (boost::format("%03d|%06d|%06d") % tile.z % x % y).str().substr(0, 16);
+         if (data != expected)
+         {
+            throw runtime_error((boost::format("Expected tile data \"%1%\", but got \"%2%\".") 
+                                 % expected % data).str());
+         }
+      }
+   }
+}
+
+} // anonymous namespace
+
+void test_bundle_round_trip() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   string data = put_fake(storage, tile), data2;
+
+   if (!storage.get_meta(tile, data2)) 
+   {
+      throw runtime_error("Can't load meta tile!");
+   }
+   if (data != data2) 
+   {
+      throw runtime_error("Loaded data is different from saved data!");
+   }
+   check_tiles(storage, tile);
+
+   // a metatile which was never stored, but in the same bundle, 
+   // shouldn't exist.
+   tile.x = 1032;
+   if (storage.get(tile)->exists() || storage.get_meta(tile, data2))
+   {
+      throw runtime_error("Tile which wasn't stored shouldn't exist!");
+   }
+}
+
+void test_bundle_many_metatiles() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+
+   // metatiles in the same bundle, and one in the next bundle along.
+   const int xs[] = { 0, 8, 64, BUNDLE_SIZE * METATILE - 8, BUNDLE_SIZE * METATILE };
+   const size_t num_xs = sizeof(xs) / sizeof(xs[0]);
+   for (size_t i = 0; i < num_xs; ++i)
+   {
+      tile.x = xs[i];
+      tile.y = 2 * METATILE;
+      put_fake(storage, tile);
+   }
+   for (size_t i = 0; i < num_xs; ++i)
+   {
+      tile.x = xs[i];
+      tile.y = 2 * METATILE;
+      check_tiles(storage, tile);
+   }
+
+   tile.x = 0;
+   const string first = storage.bundle_path(tile).first;
+   tile.x = BUNDLE_SIZE * METATILE;
+   if (storage.bundle_path(tile).first == first)
+   {
+      throw runtime_error("Metatiles in different bundles should have different paths.");
+   }
+   if (!fs::exists(first) || !fs::exists(storage.bundle_path(tile).first))
+   {
+      throw runtime_error("Both bundles should exist.");
+   }
+}
+
+void test_bundle_expire() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+
+   // expiring something which isn't there fails, as with disk.
+   if (storage.expire(tile))
+   {
+      throw runtime_error("Shouldn't be able to expire a missing metatile.");
+   }
+
+   put_fake(storage, tile);
+   if (!storage.expire(tile))
+   {
+      throw runtime_error("Can't expire metatile.");
+   }
+
+   tile.x += 3;
+   shared_ptr<tile_storage::handle> handle = storage.get(tile);
+   if (!handle->exists() || !handle->expired())
+   {
+      throw runtime_error("Expired tile should exist and be expired.");
+   }
+   string data;
+   if (storage.get_meta(tile, data))
+   {
+      throw runtime_error("Expired metatile shouldn't be returned by get_meta.");
+   }
+
+   // storing it again makes it current.
+   tile.x -= 3;
+   put_fake(storage, tile);
+   check_tiles(storage, tile);
+}
+
+void test_bundle_compact() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native(), 0.5, false);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   const string path = storage.bundle_path(tile).first;
+
+   put_fake(storage, tile);
+   const uintmax_t one = fs::file_size(path);
+
+   // the first replacement is half of the data, which isn't enough to
+   // compact, but the next one is.
+   put_fake(storage, tile);
+   if (fs::file_size(path) <= one)
+   {
+      throw runtime_error("Replacing a metatile should have appended it.");
+   }
+   put_fake(storage, tile);
+   if (fs::file_size(path) != one)
+   {
+      throw runtime_error((boost::format("Bundle should have been compacted to %1% bytes, but is %2%.") 
+                           % one % fs::file_size(path)).str());
+   }
+   check_tiles(storage, tile);
+
+   // explicit compaction keeps everything current.
+   tile.x += METATILE;
+   put_fake(storage, tile);
+   put_fake(storage, tile);
+   if (!storage.compact(tile))
+   {
+      throw runtime_error("Can't compact bundle.");
+   }
+   check_tiles(storage, tile);
+   tile.x -= METATILE;
+   check_tiles(storage, tile);
+}
+
+void test_bundle_digest() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native(), 0.0, false);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+
+   // stored a while ago...
+   const std::time_t then = std::time(NULL) - 3600;
+   if (!storage.put_meta_at(tile, data, then))
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   if (storage.get(tile)->last_modified() != then)
+   {
+      throw runtime_error("Metatile should have the timestamp it was stored with.");
+   }
+
+   // storing the same tiles again keeps that time...
+   if (!storage.put_meta(tile, data))
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   if (storage.get(tile)->last_modified() != then)
+   {
+      throw runtime_error("Identical metatile should keep the original timestamp.");
+   }
+
+   // but different ones don't. flip a byte of the last tile, which is
+   // before the trailing NUL.
+   data[meta.total_size - 2] ^= 1;
+   if (!storage.put_meta(tile, data))
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   if (storage.get(tile)->last_modified() == then)
+   {
+      throw runtime_error("Changed metatile should have a new timestamp.");
+   }
+}
+
+void test_bundle_torn_entry() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   put_fake(storage, tile);
+
+   // overwrite part of the index entry, as a crash part way through
+   // writing it might.
+   std::pair<string, int> bundle = storage.bundle_path(tile);
+   int fd = open(bundle.first.c_str(), O_WRONLY);
+   if (fd < 0)
+   {
+      throw runtime_error("Can't open bundle.");
+   }
+   const int64_t garbage = 0x1234;
+   const off_t at = sizeof(bundle_storage::header) + bundle.second * sizeof(bundle_storage::entry) + 8;
+   const bool written = pwrite(fd, &garbage, sizeof(garbage), at) == ssize_t(sizeof(garbage));
+   close(fd);
+   if (!written)
+   {
+      throw runtime_error("Can't write to bundle.");
+   }
+
+   string data;
+   if (storage.get(tile)->exists() || storage.get_meta(tile, data))
+   {
+      throw runtime_error("Metatile with a torn index entry should be missing.");
+   }
+
+   // and it can be stored again.
+   put_fake(storage, tile);
+   check_tiles(storage, tile);
+}
+
+void test_bundle_bad_magic() 
+{
+   tmp_dir tmp;
+   bundle_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   const string meta = put_fake(storage, tile);
+
+   // a file which isn't a bundle, but with a good index, as one
+   // copied over it might have.
+   std::pair<string, int> bundle = storage.bundle_path(tile);
+   int fd = open(bundle.first.c_str(), O_WRONLY);
+   if (fd < 0)
+   {
+      throw runtime_error("Can't open bundle.");
+   }
+   const bool written = pwrite(fd, "XXXX", 4, 0) == 4;
+   close(fd);
+   if (!written)
+   {
+      throw runtime_error("Can't write to bundle.");
+   }
+
+   string data;
+   if (storage.get(tile)->exists() || storage.get_meta(tile, data))
+   {
+      throw runtime_error("Metatile in a file with the wrong magic should be missing.");
+   }
+   if (storage.put_meta(tile, meta) || storage.expire(tile))
+   {
+      throw runtime_error("File with the wrong magic shouldn't be written to.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Bundle Storage Functions ==" << endl << endl;
+
+   tests_failed += test::run("test_bundle_round_trip", &test_bundle_round_trip);
+   tests_failed += test::run("test_bundle_many_metatiles", &test_bundle_many_metatiles);
+   tests_failed += test::run("test_bundle_expire", &test_bundle_expire);
+   tests_failed += test::run("test_bundle_compact", &test_bundle_compact);
+   tests_failed += test::run("test_bundle_digest", &test_bundle_digest);
+   tests_failed += test::run("test_bundle_torn_entry", &test_bundle_torn_entry);
+   tests_failed += test::run("test_bundle_bad_magic", &test_bundle_bad_magic);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -27,9 +27,12 @@
 #include "test/fake_tile.hpp"
 #include "storage/tile_storage.hpp"
 #include "storage/disk_storage.hpp"
+#include "storage/meta_tile.hpp"
 #include <stdexcept>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <climits>
 #include <boost/function.hpp>
 #include <boost/format.hpp>
 #define BOOST_FILESYSTEM_VERSION 3
@@ -56,6 +59,9 @@ using rendermq::fmtJSON;
 using rendermq::disk_storage;
 using rendermq::tile_protocol;
 using rendermq::tile_storage;
+using rendermq::tile_digest;
+using rendermq::make_digests;
+using rendermq::same_digests;
 
 namespace fs = boost::filesystem;
 
@@ -194,6 +200,504 @@ void test_disk_round_trip_multiformat()
    }
 }
 
+/* check that a probe gives the same metadata as a full get, and
+ * that the tile data can still be fetched lazily from it.
+ */
+void test_disk_probe() 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+
+   {
+      shared_ptr<tile_storage::handle> handle = storage.probe(tile);
+      if (handle->exists()) 
+      {
+         throw runtime_error("Tile shouldn't exist before it's saved!");
+      }
+   }
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   tile.x = 1027;
+   tile.y = 1029;
+   string full_data, probed_data;
+   std::time_t full_time = 0;
+   {
+      shared_ptr<tile_storage::handle> handle = storage.get(tile);
+      handle->data(full_data);
+      full_time = handle->last_modified();
+   }
+   {
+      shared_ptr<tile_storage::handle> handle = storage.probe(tile);
+      if (!handle->exists()) 
+      {
+         throw runtime_error("Probed tile should exist!");
+      }
+      if (handle->expired())
+      {
+         throw runtime_error("Probed tile should not be expired already!");
+      }
+      if (handle->last_modified() != full_time)
+      {
+         throw runtime_error("Probed tile should have the same timestamp as the full get!");
+      }
+      if (!handle->data(probed_data) || (probed_data != full_data))
+      {
+         throw runtime_error("Probed tile data should be the same as the full get!");
+      }
+   }
+
+   // format isn't in the metatile, so the tile doesn't exist, whether
+   // or not the metatile is kept open.
+   tile.format = fmtJPEG;
+   disk_storage open_storage(tmp.dir().native(), 0, 16);
+   for (int i = 0; i < 2; ++i)
+   {
+      shared_ptr<tile_storage::handle> handle = ((i == 0) ? storage : open_storage).probe(tile);
+      if (handle->exists() || handle->data(probed_data))
+      {
+         throw runtime_error("Probed tile shouldn't exist in a missing format!");
+      }
+   }
+}
+
+/* check that digests are stored with the metatile, and that storing
+ * exactly the same tiles again keeps the original timestamp.
+ */
+void test_disk_digest() 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native());
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size), tile_data;
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   std::time_t first_time = 0;
+   uint64_t first_digest = 0;
+   {
+      shared_ptr<tile_storage::handle> handle = storage.get(tile);
+      handle->data(tile_data);
+      first_time = handle->last_modified();
+      first_digest = handle->digest();
+      if (first_digest != tile_digest(tile_data.data(), tile_data.size()))
+      {
+         throw runtime_error("Digest should be of the tile data!");
+      }
+   }
+   {
+      shared_ptr<tile_storage::handle> handle = storage.probe(tile);
+      if (handle->digest() != first_digest)
+      {
+         throw runtime_error("Probed digest should be the same as the full get!");
+      }
+   }
+
+   // storing the same tiles again, even after expiry, shouldn't make
+   // them look new.
+   if (!same_digests(make_digests(data, 0), make_digests(data, 1)))
+   {
+      throw runtime_error("Digests shouldn't depend on the timestamp!");
+   }
+   storage.expire(tile);
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile again!");
+   }
+   {
+      shared_ptr<tile_storage::handle> handle = storage.get(tile);
+      if (handle->expired() || (handle->last_modified() != first_time))
+      {
+         throw runtime_error("Storing the same tiles should keep the original timestamp!");
+      }
+      if (handle->digest() != first_digest)
+      {
+         throw runtime_error("Storing the same tiles should keep the digest!");
+      }
+   }
+   // and the time kept is what the storage says it stored.
+   storage.expire(tile);
+   std::time_t stored = 0;
+   if (!storage.put_meta_stamped(tile, data, stored) || (stored != first_time))
+   {
+      throw runtime_error("Storing the same tiles should say the original timestamp was kept!");
+   }
+
+   // changing one tile should change its digest.
+   string changed(data);
+   string::size_type pos = changed.find("012|001024|00102");
+   if (pos == string::npos)
+   {
+      throw runtime_error("Couldn't find tile in fake metatile!");
+   }
+   changed[pos] = '9';
+   if (!storage.put_meta(tile, changed)) 
+   {
+      throw runtime_error("Can't save changed meta tile!");
+   }
+   {
+      shared_ptr<tile_storage::handle> handle = storage.probe(tile);
+      if (handle->digest() == first_digest)
+      {
+         throw runtime_error("Changed tile should have a different digest!");
+      }
+   }
+}
+
+/* check that the batch operations give the same results as doing
+ * each tile on its own, whatever order the tiles come in.
+ */
+void test_disk_batch() 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native());
+   std::vector<tile_protocol> metas;
+   std::vector<string> bufs;
+   for (int i = 0; i < 2; ++i)
+   {
+      tile_protocol tile(cmdRender, 1024 + 8 * i, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      metas.push_back(tile);
+      bufs.push_back(string(meta.ptr, meta.total_size));
+   }
+
+   if (!storage.put_meta_many(metas, bufs)) 
+   {
+      throw runtime_error("Can't save meta tiles!");
+   }
+
+   // interleave the tiles from the two metatiles, with some from a
+   // metatile which hasn't been saved.
+   std::vector<tile_protocol> tiles;
+   for (int i = 0; i < 8; ++i) 
+   {
+      for (int j = 0; j < 3; ++j)
+      {
+         tiles.push_back(tile_protocol(cmdRender, 1024 + 8 * j + i, 1024 + i, 12, 0, "osm", fmtPNG, 0, 0));
+      }
+   }
+
+   std::vector<shared_ptr<tile_storage::handle> > handles;
+   storage.get_many(tiles, handles);
+   if (handles.size() != tiles.size()) 
+   {
+      throw runtime_error("Should get a handle for every tile!");
+   }
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      shared_ptr<tile_storage::handle> handle = storage.get(tiles[i]);
+      string data, batch_data;
+      if (handles[i]->exists() != handle->exists()) 
+      {
+         throw runtime_error((boost::format("Batch get of %1% should agree on existence.") % tiles[i]).str());
+      }
+      if (handles[i]->exists() != (tiles[i].x < 1040)) 
+      {
+         throw runtime_error((boost::format("Tile %1% should only exist if it was saved.") % tiles[i]).str());
+      }
+      handle->data(data);
+      handles[i]->data(batch_data);
+      if ((data != batch_data) || (handles[i]->last_modified() != handle->last_modified()) ||
+          (handles[i]->digest() != handle->digest()))
+      {
+         throw runtime_error((boost::format("Batch get of %1% should be the same as a single get.") % tiles[i]).str());
+      }
+   }
+
+   std::vector<tile_protocol> to_expire(1, metas[1]);
+   if (!storage.expire_many(to_expire))
+   {
+      throw runtime_error("Can't expire meta tiles!");
+   }
+   storage.get_many(tiles, handles);
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      if (handles[i]->exists() && (handles[i]->expired() != (tiles[i].x >= 1032))) 
+      {
+         throw runtime_error((boost::format("Only tile %1% in the expired metatile should be expired.") % tiles[i]).str());
+      }
+   }
+
+   bufs.pop_back();
+   try 
+   {
+      storage.put_meta_many(metas, bufs);
+      throw runtime_error("Mismatched tiles and buffers should throw.");
+   }
+   catch (const std::invalid_argument &) 
+   {
+   }
+}
+
+void test_disk_meta_path() 
+{
+   tmp_dir tmp;
+   disk_storage storage(tmp.dir().native());
+
+   // the path written into a buffer should be the same one that the
+   // metatile is stored at.
+   const int coords[][3] = { {0, 0, 0}, {5, 3, 3}, {1234, 5678, 13}, {262143, 262143, 18} };
+   for (size_t i = 0; i < sizeof(coords) / sizeof(coords[0]); ++i)
+   {
+      const int *c = coords[i];
+      std::pair<string, int> meta = rendermq::xyz_to_meta(tmp.dir().native(), c[0], c[1], c[2], "map");
+      char path[PATH_MAX];
+      int index = rendermq::xyz_to_meta_path(path, sizeof(path), tmp.dir().native(), c[0], c[1], c[2], "map");
+      if ((meta.first != path) || (meta.second != index))
+      {
+         throw runtime_error((boost::format("Expected path %1% and index %2%, got %3% and %4%.") 
+                              % meta.first % meta.second % path % index).str());
+      }
+   }
+
+   char small[8];
+   if (rendermq::xyz_to_meta_path(small, sizeof(small), tmp.dir().native(), 0, 0, 0, "map") >= 0)
+   {
+      throw runtime_error("Path shouldn't fit in a tiny buffer.");
+   }
+
+   // the tile's timestamp is the metatile's, from the same read.
+   tile_protocol tile(cmdRender, 8, 16, 5, 0, "map", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   if (!storage.put_meta(tile, string(meta.ptr, meta.total_size))) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   fs::path p(rendermq::xyz_to_meta(tmp.dir().native(), tile.x, tile.y, tile.z, tile.style).first);
+   fs::last_write_time(p, std::time_t(1234567890));
+
+   shared_ptr<tile_storage::handle> handle = storage.get(tile);
+   if (!handle->exists() || (handle->last_modified() != 1234567890))
+   {
+      throw runtime_error("Expected tile to have the metatile's timestamp.");
+   }
+}
+
+void test_disk_mapped() 
+{
+   tmp_dir tmp;
+   disk_storage plain(tmp.dir().native()), mapped(tmp.dir().native(), 2);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+
+   for (int i = 0; i < 3; ++i)
+   {
+      tile.x = 1024 + i * METATILE;
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      if (!plain.put_meta(tile, string(meta.ptr, meta.total_size))) 
+      {
+         throw runtime_error("Can't save meta tile!");
+      }
+   }
+
+   // handles from any number of metatiles, more than are kept mapped,
+   // can be held at once and all read the same as they would from disk.
+   std::vector<shared_ptr<tile_storage::handle> > handles;
+   for (int i = 0; i < 3; ++i)
+   {
+      tile.x = 1024 + i * METATILE + i;
+      handles.push_back(mapped.get(tile));
+      handles.push_back(mapped.probe(tile));
+   }
+   for (size_t i = 0; i < handles.size(); ++i)
+   {
+      tile.x = 1024 + int(i / 2) * METATILE + int(i / 2);
+      string expected, data;
+      if (!plain.get(tile)->data(expected) || !handles[i]->exists() || 
+          !handles[i]->data(data) || (data != expected) ||
+          (handles[i]->digest() != tile_digest(expected.data(), expected.size())))
+      {
+         throw runtime_error((boost::format("Mapped tile %1% differs from the one on disk.") % i).str());
+      }
+   }
+
+   // a held handle keeps the old tile when the metatile is replaced, but 
+   // new ones see the new tile.
+   tile.x = 1031;
+   tile.y = 1031;
+   shared_ptr<tile_storage::handle> old_handle = mapped.get(tile);
+   string before;
+   old_handle->data(before);
+   fake_tile meta(1024, 1024, tile.z, tile.format);
+   string buf(meta.ptr, meta.total_size);
+   // the last tile's data is at the end of the metatile, before a nul.
+   buf[buf.size() - 2] ^= 1;
+   if (!plain.put_meta(tile_protocol(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0), buf)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   string after, again, expected;
+   mapped.get(tile)->data(after);
+   plain.get(tile)->data(expected);
+   old_handle->data(again);
+   if ((again != before) || (after != expected) || (after == before))
+   {
+      throw runtime_error("Replacing a metatile should only change new handles.");
+   }
+
+   // and expiry shows up straight away.
+   if (!mapped.expire(tile) || !mapped.get(tile)->expired()) 
+   {
+      throw runtime_error("Mapped tile should be expired.");
+   }
+
+   tile.z = 13;
+   if (mapped.get(tile)->exists() || mapped.probe(tile)->exists())
+   {
+      throw runtime_error("Missing metatile shouldn't have mapped tiles.");
+   }
+}
+
+void test_disk_open() 
+{
+   tmp_dir tmp;
+   const string dir = tmp.dir().native();
+   disk_storage plain(dir), open(dir, 0, 2);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+
+   for (int i = 0; i < 3; ++i)
+   {
+      tile.x = 1024 + i * METATILE;
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      if (!plain.put_meta(tile, string(meta.ptr, meta.total_size))) 
+      {
+         throw runtime_error("Can't save meta tile!");
+      }
+   }
+
+   // tiles read through open metatiles are the same as from disk.
+   for (int i = 0; i < 3 * METATILE; ++i)
+   {
+      tile.x = 1024 + i;
+      // only one handle from each storage can be held at a time.
+      string expected, data, probed;
+      bool ok = plain.get(tile)->data(expected);
+      ok &= open.get(tile)->data(data);
+      ok &= open.probe(tile)->data(probed);
+      if (!ok || (data != expected) || (probed != expected))
+      {
+         throw runtime_error((boost::format("Tile %1% from open metatile differs from the one on disk.") 
+                              % tile.x).str());
+      }
+   }
+
+   // the most recently used are kept open, and the rest are reopened.
+   rendermq::open_metatiles cache(2);
+   cache.lookup(dir, 1024, 1024, 12, "osm");
+   cache.lookup(dir, 1032, 1024, 12, "osm");
+   cache.lookup(dir, 1025, 1025, 12, "osm");
+   cache.lookup(dir, 1040, 1024, 12, "osm");
+   cache.lookup(dir, 1024, 1024, 12, "osm");
+   if ((cache.size() != 2) || (cache.hits() != 2) || (cache.misses() != 3))
+   {
+      throw runtime_error((boost::format("Expected 2 open, 2 hits and 3 misses, got %1%, %2% and %3%.") 
+                           % cache.size() % cache.hits() % cache.misses()).str());
+   }
+
+   // expiring or replacing the metatile invalidates it.
+   tile.x = 1024;
+   if (!plain.expire(tile))
+   {
+      throw runtime_error("Can't expire meta tile!");
+   }
+   const rendermq::open_metatiles::metatile *meta = cache.lookup(dir, 1024, 1024, 12, "osm");
+   if ((meta == NULL) || (meta->mtime != 0) || (cache.invalidations() != 1))
+   {
+      throw runtime_error("Expired metatile should have been opened again.");
+   }
+   fake_tile fake(tile.x, tile.y, tile.z, tile.format);
+   if (!plain.put_meta(tile, string(fake.ptr, fake.total_size))) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+   meta = cache.lookup(dir, 1024, 1024, 12, "osm");
+   if ((meta == NULL) || (meta->mtime == 0) || (cache.invalidations() != 2))
+   {
+      throw runtime_error("Replaced metatile should have been opened again.");
+   }
+   if (open.get(tile)->expired())
+   {
+      throw runtime_error("Tile from replaced metatile shouldn't be expired.");
+   }
+
+   if (cache.lookup(dir, 1024, 1024, 13, "osm") != NULL)
+   {
+      throw runtime_error("Missing metatile shouldn't be open.");
+   }
+
+   // and expiring it fails, but isn't an error in the storage.
+   tile.z = 13;
+   if (plain.expire(tile) || plain.last_error())
+   {
+      throw runtime_error("Expiring a missing metatile should fail without an error.");
+   }
+}
+
+void test_disk_gzip_flag() 
+{
+   tmp_dir tmp;
+   const string dir = tmp.dir().native();
+   disk_storage plain(dir), mapped(dir, 2), open(dir, 0, 2);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+
+   // the first metatile's header flags its tiles as compressed, the
+   // second's doesn't. the data is the same either way, so it's only
+   // the flag which can tell the handles apart.
+   for (int i = 0; i < 2; ++i)
+   {
+      tile.x = 1024 + i * METATILE;
+      fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+      string buf(meta.ptr, meta.total_size);
+      if (i == 0)
+      {
+         rendermq::meta_layout header;
+         std::memcpy(&header, buf.data(), sizeof(header));
+         header.fmt |= rendermq::meta_layout::flag_gzip;
+         buf.replace(0, sizeof(header), (const char *)&header, sizeof(header));
+      }
+      if (!plain.put_meta(tile, buf)) 
+      {
+         throw runtime_error("Can't save meta tile!");
+      }
+   }
+
+   std::vector<tile_protocol> tiles;
+   for (int i = 0; i < 2; ++i)
+   {
+      tile.x = 1025 + i * METATILE;
+      tiles.push_back(tile);
+   }
+   std::vector<shared_ptr<tile_storage::handle> > handles;
+   plain.get_many(tiles, handles);
+
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      const bool flagged = (i == 0);
+      // only one handle from each storage can be held at a time.
+      bool ok = (handles[i]->gzipped() == flagged);
+      ok &= (plain.get(tiles[i])->gzipped() == flagged);
+      ok &= (plain.probe(tiles[i])->gzipped() == flagged);
+      ok &= (mapped.get(tiles[i])->gzipped() == flagged);
+      ok &= (mapped.probe(tiles[i])->gzipped() == flagged);
+      ok &= (open.get(tiles[i])->gzipped() == flagged);
+      ok &= (open.probe(tiles[i])->gzipped() == flagged);
+      if (!ok)
+      {
+         throw runtime_error((boost::format("Tile %1% should %2%be flagged as gzipped.") 
+                              % tiles[i] % (flagged ? "" : "not ")).str());
+      }
+   }
+}
+
 int main() 
 {
    int tests_failed = 0;
@@ -203,6 +707,13 @@ int main()
    tests_failed += test::run("test_disk_round_trip_empty", &test_disk_round_trip_empty);
    tests_failed += test::run("test_disk_round_trip", &test_disk_round_trip);
    tests_failed += test::run("test_disk_round_trip_multiformat", &test_disk_round_trip_multiformat);
+   tests_failed += test::run("test_disk_probe", &test_disk_probe);
+   tests_failed += test::run("test_disk_digest", &test_disk_digest);
+   tests_failed += test::run("test_disk_batch", &test_disk_batch);
+   tests_failed += test::run("test_disk_meta_path", &test_disk_meta_path);
+   tests_failed += test::run("test_disk_mapped", &test_disk_mapped);
+   tests_failed += test::run("test_disk_open", &test_disk_open);
+   tests_failed += test::run("test_disk_gzip_flag", &test_disk_gzip_flag);
    //tests_failed += test::run("test_", &test_);
 
    cout << " >> Tests failed: " << tests_failed << endl << endl;
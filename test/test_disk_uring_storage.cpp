@@ -0,0 +1,354 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "test/fake_tile.hpp"
+#include "storage/tile_storage.hpp"
+#include "storage/disk_uring_storage.hpp"
+#include "storage/meta_tile.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <vector>
+#include <boost/format.hpp>
+#define BOOST_FILESYSTEM_VERSION 3
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <poll.h>
+
+using boost::shared_ptr;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+using rendermq::fmtJSON;
+using rendermq::disk_uring_storage;
+using rendermq::tile_protocol;
+using rendermq::tile_storage;
+
+namespace fs = boost::filesystem;
+
+typedef tile_storage::async_reader::result result;
+
+namespace 
+{
+/* utility class to create a directory and clean up using
+ * the RAII idiom.
+ */
+class tmp_dir
+{
+public:
+   tmp_dir()
+   {
+      m_dir = fs::path("/tmp") / fs::unique_path();
+      if (!fs::create_directories(m_dir))
+      {
+         throw runtime_error("Cannot create temporary directory for disk tests.");
+      }
+   }
+
+   ~tmp_dir()
+   {
+      fs::remove_all(m_dir);
+   }
+
+   const fs::path &dir() const
+   {
+      return m_dir;
+   }
+
+private:
+   fs::path m_dir;
+};
+
+/* waits for everything submitted to the reader to come back.
+ */
+void reap_all(tile_storage::async_reader &reader, vector<result> &results)
+{
+   reader.flush();
+   while (reader.in_flight() > 0)
+   {
+      struct pollfd p = { reader.fd(), POLLIN, 0 };
+      if (poll(&p, 1, 5000) <= 0)
+      {
+         throw runtime_error("Timed out waiting for the reader.");
+      }
+      reader.reap(results);
+   }
+}
+
+} // anonymous namespace
+
+/* check that every tile read asynchronously is the same as when it's
+ * got by blocking.
+ */
+void test_uring_round_trip() 
+{
+   tmp_dir tmp;
+   disk_uring_storage storage(tmp.dir().native(), 256);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", (rendermq::protoFmt)(fmtPNG | fmtJPEG), 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   // without io_uring support there's no reader, and nothing to test.
+   tile_storage::async_reader *reader = storage.reader();
+   if (reader == NULL) { return; }
+
+   vector<tile_protocol> tiles;
+   for (int fmt = fmtPNG; fmt <= fmtJPEG; fmt <<= 1) {
+      for (int x = 1024; x < 1032; ++x) {
+         for (int y = 1024; y < 1032; ++y) {
+            tiles.push_back(tile_protocol(cmdRender, x, y, 12, 0, "osm", (rendermq::protoFmt)fmt, 0, 0));
+         }
+      }
+   }
+
+   BOOST_FOREACH(tile_protocol &t, tiles)
+   {
+      if (!reader->ready())
+      {
+         throw runtime_error("Reader should have room for all the tiles!");
+      }
+      reader->submit(&t);
+   }
+
+   vector<result> results;
+   reap_all(*reader, results);
+   if (results.size() != tiles.size())
+   {
+      throw runtime_error((boost::format("Expected %1% tiles back, got %2%.") 
+                           % tiles.size() % results.size()).str());
+   }
+
+   BOOST_FOREACH(const result &r, results)
+   {
+      string async_data, blocking_data;
+      shared_ptr<tile_storage::handle> handle = storage.get(*r.first);
+      if (!r.second->exists() || r.second->expired())
+      {
+         throw runtime_error("Tile should exist and not be expired!");
+      }
+      if (!r.second->data(async_data) || !handle->data(blocking_data) || 
+          (async_data != blocking_data))
+      {
+         throw runtime_error((boost::format("Data for %1% should be the same as a blocking get.") 
+                              % *r.first).str());
+      }
+      if ((r.second->last_modified() != handle->last_modified()) ||
+          (r.second->digest() != handle->digest()))
+      {
+         throw runtime_error("Metadata should be the same as a blocking get.");
+      }
+   }
+}
+
+/* check that tiles which aren't there come back as not existing, and
+ * that expired ones come back as expired.
+ */
+void test_uring_missing() 
+{
+   tmp_dir tmp;
+   disk_uring_storage storage(tmp.dir().native(), 16);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   // without io_uring support there's no reader, and nothing to test.
+   tile_storage::async_reader *reader = storage.reader();
+   if (reader == NULL) { return; }
+
+   // no metatile, and no such format in the metatile.
+   tile_protocol no_meta(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   tile_protocol no_format(cmdRender, 1024, 1024, 12, 0, "osm", fmtJSON, 0, 0);
+   reader->submit(&no_meta);
+   reader->submit(&no_format);
+
+   vector<result> results;
+   reap_all(*reader, results);
+   BOOST_FOREACH(const result &r, results)
+   {
+      if (r.second->exists())
+      {
+         throw runtime_error((boost::format("%1% shouldn't exist.") % *r.first).str());
+      }
+   }
+
+   storage.expire(tile);
+   results.clear();
+   reader->submit(&tile);
+   reap_all(*reader, results);
+   if ((results.size() != 1) || !results[0].second->exists() || !results[0].second->expired())
+   {
+      throw runtime_error("Expired tile should exist, but be expired.");
+   }
+}
+
+/* check that a metatile whose index claims a tile runs past the end 
+ * of the file gives a miss, rather than a read of whatever size the 
+ * index says.
+ */
+void test_uring_corrupt_index() 
+{
+   tmp_dir tmp;
+   disk_uring_storage storage(tmp.dir().native(), 16);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   tile_storage::async_reader *reader = storage.reader();
+   if (reader == NULL) { return; }
+
+   // make the tile's index entry claim it's 2GB long.
+   const std::pair<string, int> path = rendermq::xyz_to_meta(tmp.dir().native(), tile.x, tile.y, 
+                                                             tile.z, tile.style);
+   rendermq::meta_layout header;
+   {
+      std::fstream file(path.first.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+      file.read((char *)&header, sizeof(header));
+      header.index[path.second].size = 0x7fffffff;
+      file.seekp(0);
+      file.write((const char *)&header, sizeof(header));
+      if (!file) { throw runtime_error("Can't corrupt the meta tile."); }
+   }
+
+   vector<result> results;
+   reader->submit(&tile);
+   reap_all(*reader, results);
+   if ((results.size() != 1) || results[0].second->exists())
+   {
+      throw runtime_error("Tile with a corrupt index entry shouldn't exist.");
+   }
+}
+
+/* check that the reader doesn't take more tiles than its queue depth.
+ */
+void test_uring_depth() 
+{
+   tmp_dir tmp;
+   disk_uring_storage storage(tmp.dir().native(), 4);
+
+   // without io_uring support there's no reader, and nothing to test.
+   tile_storage::async_reader *reader = storage.reader();
+   if (reader == NULL) { return; }
+
+   vector<tile_protocol> tiles(4, tile_protocol(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0));
+   BOOST_FOREACH(tile_protocol &t, tiles)
+   {
+      reader->submit(&t);
+   }
+   if (reader->ready() || (reader->in_flight() != 4))
+   {
+      throw runtime_error("Reader shouldn't have room for more than its queue depth.");
+   }
+
+   vector<result> results;
+   reap_all(*reader, results);
+   if (!reader->ready() || (results.size() != 4))
+   {
+      throw runtime_error("Reader should have room once its tiles have been reaped.");
+   }
+}
+
+/* check that a batch get with more tiles than the queue depth comes
+ * back complete and the same as blocking gets, in the right places.
+ */
+void test_uring_get_many() 
+{
+   tmp_dir tmp;
+   disk_uring_storage storage(tmp.dir().native(), 4);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(tile.x, tile.y, tile.z, tile.format);
+   string data(meta.ptr, meta.total_size);
+
+   if (!storage.put_meta(tile, data)) 
+   {
+      throw runtime_error("Can't save meta tile!");
+   }
+
+   vector<tile_protocol> tiles;
+   for (int i = 0; i < 8; ++i) 
+   {
+      tiles.push_back(tile_protocol(cmdRender, 1024 + i, 1031 - i, 12, 0, "osm", fmtPNG, 0, 0));
+      tiles.push_back(tile_protocol(cmdRender, i, i, 12, 0, "osm", fmtPNG, 0, 0));
+   }
+
+   vector<shared_ptr<tile_storage::handle> > handles;
+   storage.get_many(tiles, handles);
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      string batch_data, blocking_data;
+      shared_ptr<tile_storage::handle> handle = storage.get(tiles[i]);
+      if (!handles[i] || (handles[i]->exists() != handle->exists()))
+      {
+         throw runtime_error((boost::format("Batch get of %1% should agree on existence.") % tiles[i]).str());
+      }
+      handles[i]->data(batch_data);
+      handle->data(blocking_data);
+      if (batch_data != blocking_data)
+      {
+         throw runtime_error((boost::format("Data for %1% should be the same as a blocking get.") 
+                              % tiles[i]).str());
+      }
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Disk io_uring Storage Functions ==" << endl << endl;
+
+   tests_failed += test::run("test_uring_round_trip", &test_uring_round_trip);
+   tests_failed += test::run("test_uring_missing", &test_uring_missing);
+   tests_failed += test::run("test_uring_corrupt_index", &test_uring_corrupt_index);
+   tests_failed += test::run("test_uring_depth", &test_uring_depth);
+   tests_failed += test::run("test_uring_get_many", &test_uring_get_many);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
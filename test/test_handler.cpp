@@ -55,6 +55,7 @@ using rendermq::cmdStatus;
 using rendermq::fmtPNG;
 using rendermq::fmtJPEG;
 using rendermq::fmtJSON;
+using rendermq::fmtWEBP;
 
 namespace {
 /* little utility class to make things look nicer in the tests below. */
@@ -123,6 +124,7 @@ void test_path_parsing_format() {
    url("/tiles/1.0.0/osm/0/0/0.jpg") .should_give(tile_protocol(cmdRender, 0, 0, 0, 0, "osm", fmtJPEG));
    url("/tiles/1.0.0/osm/0/0/0.jpeg").should_give(tile_protocol(cmdRender, 0, 0, 0, 0, "osm", fmtJPEG));
    url("/tiles/1.0.0/osm/0/0/0.json").should_give(tile_protocol(cmdRender, 0, 0, 0, 0, "osm", fmtJSON));
+   url("/tiles/1.0.0/osm/0/0/0.webp").should_give(tile_protocol(cmdRender, 0, 0, 0, 0, "osm", fmtWEBP));
 }
 
 /* check that the path parsing gives the right command appended to
@@ -0,0 +1,164 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "test/fake_tile.hpp"
+#include "http/http_gzip.hpp"
+#include "http/http_etag.hpp"
+#include "storage/meta_tile.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::fmtPNG;
+using rendermq::meta_layout;
+using rendermq::metatile_reader;
+using rendermq::is_gzipped;
+using rendermq::accepts_gzip;
+
+void test_gzip_round_trip() 
+{
+   string json = "{\"type\":\"FeatureCollection\",\"features\":[";
+   for (int i = 0; i < 100; ++i) 
+   {
+      json += (boost::format("%1%{\"type\":\"Feature\",\"id\":%2%}") % (i ? "," : "") % i).str();
+   }
+   json += "]}";
+
+   string compressed, decompressed;
+   if (!rendermq::gzip(json, compressed) || !is_gzipped(compressed) || is_gzipped(json))
+   {
+      throw runtime_error("Compressed data doesn't look gzipped.");
+   }
+   if (compressed.size() * 5 > json.size())
+   {
+      throw runtime_error((boost::format("JSON only compressed from %1% to %2% bytes.") 
+                           % json.size() % compressed.size()).str());
+   }
+   if (!rendermq::gunzip(compressed, decompressed) || (decompressed != json))
+   {
+      throw runtime_error("Decompressed data isn't the same as the original.");
+   }
+
+   // truncated data isn't accepted.
+   if (rendermq::gunzip(compressed.substr(0, compressed.size() / 2), decompressed))
+   {
+      throw runtime_error("Truncated data was decompressed.");
+   }
+}
+
+void test_gzip_accept_encoding() 
+{
+   const char *accepted[] = { "gzip", "gzip, deflate", "deflate, GZIP;q=0.5", "*", "x-gzip", "br, gzip;q=1.0" };
+   const char *refused[] = { "", "identity", "deflate", "gzip;q=0", "gzip;q=0.000", "gzipped" };
+
+   for (size_t i = 0; i < sizeof(accepted) / sizeof(accepted[0]); ++i) 
+   {
+      if (!accepts_gzip(accepted[i]))
+      {
+         throw runtime_error((boost::format("'%1%' should accept gzip.") % accepted[i]).str());
+      }
+   }
+   for (size_t i = 0; i < sizeof(refused) / sizeof(refused[0]); ++i) 
+   {
+      if (accepts_gzip(refused[i]))
+      {
+         throw runtime_error((boost::format("'%1%' shouldn't accept gzip.") % refused[i]).str());
+      }
+   }
+}
+
+void test_gzip_etag() 
+{
+   const uint64_t digest = 0x0123456789abcdefULL;
+   const string plain = rendermq::format_etag(digest), gz = rendermq::format_etag(digest, true);
+   if (plain == gz)
+   {
+      throw runtime_error("Gzip encoded and decompressed bodies have the same ETag.");
+   }
+
+   uint64_t parsed = 0;
+   bool gzip = true;
+   if (!rendermq::parse_etag(parsed, gzip, plain) || (parsed != digest) || gzip)
+   {
+      throw runtime_error("Couldn't parse back the ETag " + plain + ".");
+   }
+   parsed = 0;
+   if (!rendermq::parse_etag(parsed, gzip, "W/" + gz) || (parsed != digest) || !gzip)
+   {
+      throw runtime_error("Couldn't parse back the ETag " + gz + ".");
+   }
+   if (rendermq::parse_etag(parsed, gzip, "\"0123456789abcdef-br\""))
+   {
+      throw runtime_error("ETag with an unknown suffix was accepted.");
+   }
+}
+
+void test_gzip_metatile_flag() 
+{
+   fake_tile meta(1024, 1024, 12, fmtPNG);
+   string buf(meta.ptr, meta.total_size);
+
+   // set the flag on the format, as the worker does for compressed 
+   // tiles, which mustn't stop the tiles being found.
+   meta_layout header;
+   std::memcpy(&header, buf.data(), sizeof(header));
+   header.fmt |= meta_layout::flag_gzip;
+   buf.replace(0, sizeof(header), (const char *)&header, sizeof(header));
+
+   metatile_reader reader(buf, fmtPNG);
+   if (!reader.initialized_ || !reader.header_.gzipped() || (reader.header_.format() != fmtPNG))
+   {
+      throw runtime_error("Flagged metatile header wasn't read.");
+   }
+   std::pair<metatile_reader::iterator_type, metatile_reader::iterator_type> range = reader.get(1, 2);
+   if (string(range.first, range.second) != string("012|001025|00102"))
+   {
+      throw runtime_error("Wrong tile from flagged metatile: " + string(range.first, range.second));
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing HTTP gzip ==" << endl << endl;
+
+   tests_failed += test::run("test_gzip_round_trip", &test_gzip_round_trip);
+   tests_failed += test::run("test_gzip_accept_encoding", &test_gzip_accept_encoding);
+   tests_failed += test::run("test_gzip_etag", &test_gzip_etag);
+   tests_failed += test::run("test_gzip_metatile_flag", &test_gzip_metatile_flag);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,314 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "http/http_server.hpp"
+#include "test/common.hpp"
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+#include <boost/format.hpp>
+#include <boost/bind.hpp>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using rendermq::http_server;
+
+namespace 
+{
+
+void assert_equal(const string &actual, const string &expected)
+{
+   if (actual != expected)
+   {
+      throw std::runtime_error((boost::format("Expected `%1%' but got `%2%'")
+                                % expected % actual).str());
+   }
+}
+
+void assert_contains(const string &actual, const string &expected)
+{
+   if (actual.find(expected) == string::npos)
+   {
+      throw std::runtime_error((boost::format("Expected to find `%1%' in `%2%'")
+                                % expected % actual).str());
+   }
+}
+
+/* server, plus a record of the requests it has received.
+ */
+struct fixture
+{
+   fixture() : server(":0", boost::bind(&fixture::handle, this, _1), 10, 30) {}
+
+   void handle(const http_server::request &req)
+   {
+      requests.push_back(req);
+   }
+
+   // let the server run until it's got the given number of requests,
+   // or nothing has happened for a while.
+   void run_until(size_t count)
+   {
+      for (int i = 0; (i < 50) && (requests.size() < count); ++i)
+      {
+         struct pollfd p = { server.fd(), POLLIN, 0 };
+         poll(&p, 1, 20);
+         server.handle_events();
+      }
+   }
+
+   http_server server;
+   vector<http_server::request> requests;
+};
+
+int connect_to(int port)
+{
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+   struct sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+   {
+      throw runtime_error((boost::format("Unable to connect to test server: %1%") % strerror(errno)).str());
+   }
+   return fd;
+}
+
+void write_all(int fd, const string &data)
+{
+   if (write(fd, data.data(), data.size()) != ssize_t(data.size()))
+   {
+      throw runtime_error("Unable to write request to test server.");
+   }
+}
+
+// read whatever the server has sent, keeping the server going while
+// waiting. returns when the connection is closed or nothing more has
+// arrived for a little while.
+string read_some(fixture &f, int fd, bool &closed)
+{
+   string data;
+   closed = false;
+   for (int idle = 0; idle < 5; )
+   {
+      f.server.handle_events();
+      struct pollfd p = { fd, POLLIN, 0 };
+      if (poll(&p, 1, 20) > 0)
+      {
+         char buf[4096];
+         ssize_t n = read(fd, buf, sizeof(buf));
+         if (n <= 0) 
+         { 
+            closed = true;
+            break; 
+         }
+         data.append(buf, n);
+         idle = 0;
+      }
+      else
+      {
+         ++idle;
+      }
+   }
+   return data;
+}
+
+string response(const string &body)
+{
+   return (boost::format("HTTP/1.1 200 OK\r\nContent-Length: %1%\r\n\r\n%2%") % body.size() % body).str();
+}
+
+/* pipelined requests answered out of order still have to go back to
+ * the client in the order they were asked for.
+ */
+void test_pipelined_order()
+{
+   fixture f;
+   int fd = connect_to(f.server.port());
+   write_all(fd, 
+             "GET /tiles/1.png HTTP/1.1\r\nHost: x\r\n\r\n"
+             "GET /tiles/2.png?foo=bar HTTP/1.1\r\nHost: x\r\nIf-None-Match: \"abc\"\r\n\r\n"
+             "GET /tiles/3.png HTTP/1.1\r\nHost: x\r\n\r\n");
+   f.run_until(3);
+
+   if (f.requests.size() != 3)
+   {
+      throw runtime_error((boost::format("Expected 3 requests, got %1%.") % f.requests.size()).str());
+   }
+   assert_equal(f.requests[0].path, "/tiles/1.png");
+   assert_equal(f.requests[1].path, "/tiles/2.png");
+   string inm;
+   if (!f.requests[1].header("if-none-match", inm))
+   {
+      throw runtime_error("Expected If-None-Match header on second request.");
+   }
+   assert_equal(inm, "\"abc\"");
+
+   f.server.send(f.requests[2].id, response("three"));
+   f.server.send(f.requests[1].id, response("two"));
+   bool closed;
+   string partial = read_some(f, fd, closed);
+   if (!partial.empty())
+   {
+      throw runtime_error("Responses shouldn't be sent before the first one is ready.");
+   }
+
+   f.server.send(f.requests[0].id, response("one"));
+   string all = read_some(f, fd, closed);
+   assert_equal(all, response("one") + response("two") + response("three"));
+   if (closed)
+   {
+      throw runtime_error("HTTP/1.1 connection should be kept alive.");
+   }
+   close(fd);
+}
+
+/* HEAD gets the headers without the body, and a client asking to close
+ * the connection has it closed after the response.
+ */
+void test_head_and_close()
+{
+   fixture f;
+   int fd = connect_to(f.server.port());
+   write_all(fd, "HEAD /tiles/1.png HTTP/1.1\r\nConnection: close\r\n\r\n");
+   f.run_until(1);
+   if (f.requests.size() != 1)
+   {
+      throw runtime_error("Expected a request.");
+   }
+   assert_equal(f.requests[0].method, "HEAD");
+
+   f.server.send(f.requests[0].id, response("body"));
+   bool closed;
+   string all = read_some(f, fd, closed);
+   assert_equal(all, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 4\r\n\r\n");
+   if (!closed)
+   {
+      throw runtime_error("Connection should have been closed.");
+   }
+   close(fd);
+}
+
+/* HTTP/1.0 only keeps the connection open when asked.
+ */
+void test_http10()
+{
+   fixture f;
+   int fd = connect_to(f.server.port());
+   write_all(fd, "GET /a HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n");
+   f.run_until(1);
+   f.server.send(f.requests.at(0).id, response("a"));
+   bool closed;
+   string all = read_some(f, fd, closed);
+   assert_contains(all, "Connection: keep-alive\r\n");
+   if (closed)
+   {
+      throw runtime_error("Keep-alive HTTP/1.0 connection should be kept open.");
+   }
+
+   write_all(fd, "GET /b HTTP/1.0\r\n\r\n");
+   f.run_until(2);
+   f.server.send(f.requests.at(1).id, response("b"));
+   all = read_some(f, fd, closed);
+   assert_equal(all, response("b"));
+   if (!closed)
+   {
+      throw runtime_error("Plain HTTP/1.0 connection should be closed.");
+   }
+   close(fd);
+}
+
+/* garbage gets a 400 and the connection closed, other methods get a
+ * 405 but the connection stays open.
+ */
+void test_bad_requests()
+{
+   fixture f;
+   int fd = connect_to(f.server.port());
+   write_all(fd, "POST /a HTTP/1.1\r\nContent-Length: 0\r\n\r\n");
+   bool closed;
+   string all = read_some(f, fd, closed);
+   assert_contains(all, "HTTP/1.1 405 ");
+   if (closed || !f.requests.empty())
+   {
+      throw runtime_error("405 shouldn't close the connection or be passed on.");
+   }
+
+   write_all(fd, "this isn't HTTP\r\n\r\n");
+   all = read_some(f, fd, closed);
+   assert_contains(all, "HTTP/1.1 400 ");
+   if (!closed)
+   {
+      throw runtime_error("Connection should be closed after a bad request.");
+   }
+   close(fd);
+
+   // responses to a client which has gone away are just dropped.
+   fd = connect_to(f.server.port());
+   write_all(fd, "GET /gone HTTP/1.1\r\n\r\n");
+   f.run_until(1);
+   close(fd);
+   read_some(f, fd = connect_to(f.server.port()), closed);
+   f.server.send(f.requests.at(0).id, response("gone"));
+   if (f.server.num_connections() != 1)
+   {
+      throw runtime_error((boost::format("Expected 1 connection, got %1%.") % f.server.num_connections()).str());
+   }
+   close(fd);
+}
+
+} // anonymous namespace
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing HTTP Server ==" << endl << endl;
+   
+   tests_failed += test::run("test_pipelined_order", &test_pipelined_order);
+   tests_failed += test::run("test_head_and_close", &test_head_and_close);
+   tests_failed += test::run("test_http10", &test_http10);
+   tests_failed += test::run("test_bad_requests", &test_bad_requests);
+   //tests_failed += test::run("test_", &test_);
+   
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+   
+   return 0;
+}
@@ -0,0 +1,94 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "storage/latency_window.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+using rendermq::latency_window;
+
+void test_latency_window_quantile() 
+{
+   latency_window window(100);
+   if ((window.size() != 0) || (window.quantile(0.95) != 0))
+   {
+      throw runtime_error("An empty window should have no latency.");
+   }
+
+   for (long i = 1; i <= 100; ++i)
+   {
+      window.record(i);
+   }
+
+   long median = window.quantile(0.5), p95 = window.quantile(0.95), max = window.quantile(1.0);
+   if ((median != 51) || (p95 != 96) || (max != 100))
+   {
+      throw runtime_error((boost::format("Expected quantiles of 51, 96 and 100, got %1%, %2% and %3%.") 
+                           % median % p95 % max).str());
+   }
+}
+
+void test_latency_window_forgets() 
+{
+   latency_window window(10);
+
+   // a host which was slow and then speeds up should only be judged
+   // on what it's done lately.
+   for (int i = 0; i < 10; ++i)
+   {
+      window.record(1000);
+   }
+   for (int i = 0; i < 10; ++i)
+   {
+      window.record(5);
+   }
+
+   if ((window.size() != 10) || (window.quantile(1.0) != 5))
+   {
+      throw runtime_error((boost::format("Expected only recent samples to be kept, but maximum is %1%.") 
+                           % window.quantile(1.0)).str());
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Latency Window ==" << endl << endl;
+
+   tests_failed += test::run("test_latency_window_quantile", &test_latency_window_quantile);
+   tests_failed += test::run("test_latency_window_forgets", &test_latency_window_forgets);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,203 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "test/fake_tile.hpp"
+#include "metatile_cache.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+
+using rendermq::cmdRender;
+using rendermq::cmdStatus;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+using rendermq::tile_protocol;
+using rendermq::tile_digest;
+using rendermq::metatile_cache;
+
+namespace
+{
+// the fake tile contents, truncated to 16 characters as fake_tile does.
+string fake_data(int x, int y, int z)
+{
+   return (boost::format("%03d|%06d|%06d") % z % x % y).str().substr(0, 16);
+}
+} // anonymous namespace
+
+void test_metatile_cache_neighbours() 
+{
+   metatile_cache cache(16, 60);
+   tile_protocol tile(cmdRender, 1027, 1029, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(1024, 1024, 12, fmtPNG);
+   string buf(meta.ptr, meta.total_size);
+
+   if (!cache.insert(tile, buf, 1234))
+   {
+      throw runtime_error("Tile wasn't filled in from inserted metatile.");
+   }
+   if (tile.data() != fake_data(1027, 1029, 12))
+   {
+      throw runtime_error((boost::format("Inserted tile has wrong data: %1%.") % tile.data()).str());
+   }
+
+   for (int x = 1024; x < 1032; ++x) {
+      for (int y = 1024; y < 1032; ++y) {
+         tile_protocol neighbour(cmdRender, x, y, 12, 0, "osm", fmtPNG, 0, 0);
+         if (!cache.lookup(neighbour))
+         {
+            throw runtime_error((boost::format("Tile %1% missed the cache.") % neighbour).str());
+         }
+         const string expected = fake_data(x, y, 12);
+         if (neighbour.data() != expected)
+         {
+            throw runtime_error((boost::format("Cached tile %1% has wrong data: %2%.") 
+                                 % neighbour % neighbour.data()).str());
+         }
+         if (neighbour.last_modified != 1234)
+         {
+            throw runtime_error("Cached tile doesn't have the metatile's timestamp.");
+         }
+         if (neighbour.digest != tile_digest(expected.data(), expected.size()))
+         {
+            throw runtime_error("Cached tile has the wrong digest.");
+         }
+      }
+   }
+
+   if ((cache.hits() != 64) || (cache.misses() != 0))
+   {
+      throw runtime_error((boost::format("Expected 64 hits and no misses, got %1% and %2%.") 
+                           % cache.hits() % cache.misses()).str());
+   }
+}
+
+void test_metatile_cache_misses() 
+{
+   metatile_cache cache(16, 60);
+   tile_protocol tile(cmdRender, 1024, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(1024, 1024, 12, fmtPNG);
+   string buf(meta.ptr, meta.total_size);
+   cache.insert(tile, buf, 1234);
+
+   tile_protocol other_format(cmdRender, 1024, 1024, 12, 0, "osm", fmtJPEG, 0, 0);
+   tile_protocol other_style(cmdRender, 1024, 1024, 12, 0, "map", fmtPNG, 0, 0);
+   tile_protocol other_meta(cmdRender, 1032, 1024, 12, 0, "osm", fmtPNG, 0, 0);
+   tile_protocol other_zoom(cmdRender, 1024, 1024, 13, 0, "osm", fmtPNG, 0, 0);
+
+   if (cache.lookup(other_format) || cache.lookup(other_style) || 
+       cache.lookup(other_meta) || cache.lookup(other_zoom))
+   {
+      throw runtime_error("Tile not in the cached metatile was found.");
+   }
+
+   cache.invalidate(tile);
+   if (cache.lookup(tile) || (cache.size() != 0))
+   {
+      throw runtime_error("Tile was found after its metatile was invalidated.");
+   }
+}
+
+void test_metatile_cache_eviction() 
+{
+   metatile_cache cache(2, 60);
+   tile_protocol a(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   tile_protocol b(cmdRender, 8, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   tile_protocol c(cmdRender, 16, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta_a(0, 0, 12, fmtPNG), meta_b(8, 0, 12, fmtPNG), meta_c(16, 0, 12, fmtPNG);
+
+   cache.insert(a, string(meta_a.ptr, meta_a.total_size), 1);
+   cache.insert(b, string(meta_b.ptr, meta_b.total_size), 1);
+   // a is now more recently used than b, so b goes to make room for c.
+   if (!cache.lookup(a)) { throw runtime_error("Expected a to be cached."); }
+   cache.insert(c, string(meta_c.ptr, meta_c.total_size), 1);
+
+   if (cache.size() != 2) { throw runtime_error("Cache grew beyond its bound."); }
+   if (cache.lookup(b)) { throw runtime_error("Least recently used metatile wasn't evicted."); }
+   if (!cache.lookup(a) || !cache.lookup(c)) 
+   { 
+      throw runtime_error("Recently used metatile was evicted."); 
+   }
+}
+
+void test_metatile_cache_ttl() 
+{
+   metatile_cache cache(16, 0);
+   tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(0, 0, 12, fmtPNG);
+   cache.insert(tile, string(meta.ptr, meta.total_size), 1);
+
+   if (cache.lookup(tile)) { throw runtime_error("Metatile older than the TTL was used."); }
+   if (cache.size() != 0) { throw runtime_error("Stale metatile wasn't dropped."); }
+}
+
+void test_metatile_cache_conditional() 
+{
+   metatile_cache cache(16, 60);
+   tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 0);
+   fake_tile meta(0, 0, 12, fmtPNG);
+   cache.insert(tile, string(meta.ptr, meta.total_size), 1234);
+
+   tile_protocol fresh(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 1234);
+   if (!cache.lookup(fresh) || !fresh.data().empty())
+   {
+      throw runtime_error("Data was sent for a tile the client has.");
+   }
+
+   tile_protocol stale(cmdRender, 0, 0, 12, 0, "osm", fmtPNG, 0, 1000);
+   if (!cache.lookup(stale) || stale.data().empty())
+   {
+      throw runtime_error("Data wasn't sent for a tile which has changed.");
+   }
+
+   tile_protocol status(cmdStatus, 0, 0, 12, 0, "osm", fmtPNG, 0, 1234);
+   if (!cache.lookup(status) || status.data().empty())
+   {
+      throw runtime_error("Status request should always get data.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Metatile Cache ==" << endl << endl;
+
+   tests_failed += test::run("test_metatile_cache_neighbours", &test_metatile_cache_neighbours);
+   tests_failed += test::run("test_metatile_cache_misses", &test_metatile_cache_misses);
+   tests_failed += test::run("test_metatile_cache_eviction", &test_metatile_cache_eviction);
+   tests_failed += test::run("test_metatile_cache_ttl", &test_metatile_cache_ttl);
+   tests_failed += test::run("test_metatile_cache_conditional", &test_metatile_cache_conditional);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -32,6 +32,7 @@
 #include <iostream>
 #include <boost/format.hpp>
 #include <cmath>
+#include <cstring>
 
 using std::runtime_error;
 using std::exception;
@@ -54,9 +55,7 @@ void assert_equal(const string &actual, const string &expected)
    }
 }
 
-void test_escape_handling() 
-{
-   const string input = 
+const string escaped_input = 
       "MONGREL2 1208 /layer/search/sic:-541103,541105,581208%5Brgb(162,91,156):255:"
       "rgb(0,0,0):1:120:7%5D/tile 931:{\"PATH\":\"/layer/search/sic:-541103,541105,"
       "581208%5Brgb(162,91,156):255:rgb(0,0,0):1:120:7%5D/tile\",\"x-forwarded-for\""
@@ -72,7 +71,10 @@ void test_escape_handling()
       "541103,541105,581208%5Brgb(162,91,156):255:rgb(0,0,0):1:120:7%5D/tile?s=13&y="
       "3076&x=2411&p=sm\",\"QUERY\":\"s=13&y=3076&x=2411&p=sm\",\"PATTERN\":\"/layer"
       "/search\"},0:,";
-   
+
+void test_escape_handling() 
+{
+   const string &input = escaped_input;
    rendermq::request_parser parser;
    rendermq::mongrel_request req;
 
@@ -103,6 +105,99 @@ void test_escape_handling()
                 "1; s_sess=%20s_cc%3Dtrue%3B%20s_sq%3D%3B");
 }
 
+string range_str(const rendermq::request_scanner::range_t &r)
+{
+   return string(r.begin(), r.end());
+}
+
+void test_scanner()
+{
+   rendermq::request_scanner scanner;
+
+   if (!scanner.scan(escaped_input.data(), escaped_input.size()))
+   {
+      throw std::runtime_error("Expected request to scan OK, but didn't");
+   }
+
+   assert_equal(range_str(scanner.uuid()), "MONGREL2");
+   assert_equal(range_str(scanner.id()), "1208");
+   assert_equal(range_str(scanner.path()), "/layer/search/sic:-541103,541105,581208%5B"
+                "rgb(162,91,156):255:rgb(0,0,0):1:120:7%5D/tile");
+   if (scanner.id_number() != 1208)
+   {
+      throw std::runtime_error("Expected numeric ID to be 1208");
+   }
+
+   rendermq::request_scanner::range_t value;
+   if (!scanner.header("Host", value))
+   {
+      throw std::runtime_error("Expected to find host header, but didn't");
+   }
+   assert_equal(range_str(value), "localhost:8002");
+
+   // values are raw, so still escaped.
+   if (!scanner.header("cookie", value))
+   {
+      throw std::runtime_error("Expected to find cookie header, but didn't");
+   }
+   if (range_str(value).find("psession=\\\"ewSv") == string::npos)
+   {
+      throw std::runtime_error("Expected raw cookie header to still be escaped");
+   }
+
+   if (!scanner.header("PATTERN", value))
+   {
+      throw std::runtime_error("Expected to find the last header, but didn't");
+   }
+   assert_equal(range_str(value), "/layer/search");
+
+   if (scanner.header("if-modified-since", value))
+   {
+      throw std::runtime_error("Found a header which isn't there");
+   }
+
+   // the full parse of the scanned request should be the same as
+   // parsing it from scratch.
+   rendermq::request_parser parser;
+   rendermq::mongrel_request req;
+   if (!parser(req, scanner))
+   {
+      throw std::runtime_error("Expected scanned request to parse OK, but didn't");
+   }
+   assert_equal(req.path(), range_str(scanner.path()));
+   assert_equal(req.query_string(), "s=13&y=3076&x=2411&p=sm");
+}
+
+void test_scanner_bad_framing()
+{
+   rendermq::request_scanner scanner;
+   const char *bad[] = {
+      "",
+      "MONGREL2 12 /tiles/1.png",
+      "MONGREL2 12 /tiles/1.png 3:{},0:,",
+      "MONGREL2 12 /tiles/1.png 2:{}0:,",
+      "MONGREL2 12 /tiles/1.png 2:{},0:",
+      "MONGREL2 12 /tiles/1.png 2:{},0:,junk",
+      "MONGREL2 abc /tiles/1.png 2:{},0:,",
+      "MONGREL2 1234567890 /tiles/1.png 2:{},0:,",
+      "MONGREL2 12 @* 17:{\"METHOD\":\"JSON\"},21:{\"type\":\"disconnect\"},",
+      0
+   };
+   for (const char **p = bad; *p != 0; ++p)
+   {
+      if (scanner.scan(*p, std::strlen(*p)))
+      {
+         throw std::runtime_error((boost::format("Expected `%1%' not to scan, but it did.") % *p).str());
+      }
+   }
+
+   const string good("MONGREL2 12 /tiles/1.png 2:{},0:,");
+   if (!scanner.scan(good.data(), good.size()))
+   {
+      throw std::runtime_error("Expected request with empty headers to scan OK, but didn't");
+   }
+}
+
 } // anonymous namespace
 
 int main() 
@@ -112,6 +207,8 @@ int main()
    cout << "== Testing Mongrel Request Parsing ==" << endl << endl;
    
    tests_failed += test::run("test_escape_handling", &test_escape_handling);
+   tests_failed += test::run("test_scanner", &test_scanner);
+   tests_failed += test::run("test_scanner_bad_framing", &test_scanner_bad_framing);
    //tests_failed += test::run("test_", &test_);
    
    cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -0,0 +1,157 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "negative_cache.hpp"
+#include <stdexcept>
+#include <iostream>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+using rendermq::tile_protocol;
+using rendermq::negative_cache;
+using rendermq::negativeNone;
+using rendermq::negativeMissing;
+using rendermq::negativeFailed;
+using rendermq::negativeEmpty;
+
+void test_negative_cache_ttl() 
+{
+   negative_cache cache(16, 5, 60);
+   tile_protocol missing(cmdRender, 1, 2, 3, 0, "osm", fmtPNG);
+   tile_protocol failed(cmdRender, 4, 5, 6, 0, "osm", fmtPNG);
+
+   cache.insert(missing, negativeMissing, 1000);
+   cache.insert(failed, negativeFailed, 1000);
+
+   if ((cache.lookup(missing, 1004) != negativeMissing) ||
+       (cache.lookup(failed, 1004) != negativeFailed))
+   {
+      throw runtime_error("Entries not found before their TTL.");
+   }
+   if (cache.lookup(missing, 1005) != negativeNone)
+   {
+      throw runtime_error("Storage miss kept past its TTL.");
+   }
+   if (cache.lookup(failed, 1059) != negativeFailed)
+   {
+      throw runtime_error("Failed render not kept for its own TTL.");
+   }
+   if (cache.lookup(failed, 1060) != negativeNone)
+   {
+      throw runtime_error("Failed render kept past its TTL.");
+   }
+   if ((cache.size() != 0) || (cache.hits(negativeFailed) != 2) || (cache.hits(negativeMissing) != 1))
+   {
+      throw runtime_error("Wrong size or hit counts after expiry.");
+   }
+}
+
+void test_negative_cache_invalidate() 
+{
+   negative_cache cache(16, 5, 60);
+   tile_protocol png(cmdRender, 1, 2, 5, 0, "osm", fmtPNG);
+   tile_protocol jpeg(cmdRender, 1, 2, 5, 0, "osm", fmtJPEG);
+   // the whole metatile is rendered again, so its other tiles go too.
+   tile_protocol neighbour(cmdRender, 7, 0, 5, 0, "osm", fmtPNG);
+   tile_protocol other_meta(cmdRender, 8, 2, 5, 0, "osm", fmtPNG);
+   tile_protocol other_zoom(cmdRender, 1, 2, 6, 0, "osm", fmtPNG);
+   tile_protocol other_style(cmdRender, 1, 2, 5, 0, "map", fmtPNG);
+
+   cache.insert(png, negativeEmpty, 1000);
+   cache.insert(jpeg, negativeFailed, 1000);
+   cache.insert(neighbour, negativeFailed, 1000);
+   cache.insert(other_meta, negativeFailed, 1000);
+   cache.insert(other_zoom, negativeFailed, 1000);
+   cache.insert(other_style, negativeFailed, 1000);
+
+   cache.invalidate(png);
+
+   if ((cache.lookup(png, 1001) != negativeNone) || (cache.lookup(jpeg, 1001) != negativeNone) ||
+       (cache.lookup(neighbour, 1001) != negativeNone))
+   {
+      throw runtime_error("Invalidated tile still found.");
+   }
+   if ((cache.lookup(other_meta, 1001) != negativeFailed) || 
+       (cache.lookup(other_zoom, 1001) != negativeFailed) || 
+       (cache.lookup(other_style, 1001) != negativeFailed))
+   {
+      throw runtime_error("Invalidation removed the wrong tiles.");
+   }
+}
+
+void test_negative_cache_bounded() 
+{
+   negative_cache cache(4, 5, 60);
+   for (int x = 0; x < 10; ++x)
+   {
+      cache.insert(tile_protocol(cmdRender, x, 0, 10, 0, "osm", fmtPNG), negativeFailed, 1000);
+   }
+
+   if (cache.size() != 4)
+   {
+      throw runtime_error("Cache grew beyond its bound.");
+   }
+   // the oldest are the ones to go.
+   if ((cache.lookup(tile_protocol(cmdRender, 5, 0, 10, 0, "osm", fmtPNG), 1001) != negativeNone) ||
+       (cache.lookup(tile_protocol(cmdRender, 6, 0, 10, 0, "osm", fmtPNG), 1001) != negativeFailed))
+   {
+      throw runtime_error("Wrong entries evicted.");
+   }
+}
+
+void test_negative_cache_disabled() 
+{
+   negative_cache cache(0, 5, 60);
+   tile_protocol tile(cmdRender, 1, 2, 3, 0, "osm", fmtPNG);
+   cache.insert(tile, negativeFailed, 1000);
+
+   if (cache.enabled() || (cache.lookup(tile, 1000) != negativeNone))
+   {
+      throw runtime_error("Disabled cache remembered a tile.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Negative Cache ==" << endl << endl;
+
+   tests_failed += test::run("test_negative_cache_ttl", &test_negative_cache_ttl);
+   tests_failed += test::run("test_negative_cache_invalidate", &test_negative_cache_invalidate);
+   tests_failed += test::run("test_negative_cache_bounded", &test_negative_cache_bounded);
+   tests_failed += test::run("test_negative_cache_disabled", &test_negative_cache_disabled);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,173 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "popularity.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using rendermq::tile_protocol;
+using rendermq::popularity_sketch;
+
+void test_popularity_counts() 
+{
+   popularity_sketch sketch(1024, 3600, 10);
+   const std::time_t now = std::time(0);
+
+   // every tile in a metatile counts towards it.
+   for (int x = 64; x < 72; ++x)
+   {
+      sketch.record(tile_protocol(cmdRender, x, 32, 10, 0, "osm", fmtPNG), now);
+   }
+   for (int i = 0; i < 3; ++i)
+   {
+      sketch.record(tile_protocol(cmdRender, 72, 32, 10, 0, "osm", fmtPNG), now);
+   }
+
+   const uint32_t hot = sketch.estimate(tile_protocol(cmdRender, 70, 39, 10, 0, "osm", fmtPNG));
+   const uint32_t warm = sketch.estimate(tile_protocol(cmdRender, 72, 32, 10, 0, "osm", fmtPNG));
+   const uint32_t cold = sketch.estimate(tile_protocol(cmdRender, 64, 32, 10, 0, "map", fmtPNG));
+   if ((hot != 8) || (warm != 3) || (cold != 0))
+   {
+      throw runtime_error((boost::format("Expected counts 8, 3, 0, got %1%, %2%, %3%.") 
+                           % hot % warm % cold).str());
+   }
+
+   const int32_t p_hot = sketch.priority(tile_protocol(cmdRender, 64, 32, 10, 0, "osm", fmtPNG));
+   const int32_t p_warm = sketch.priority(tile_protocol(cmdRender, 72, 32, 10, 0, "osm", fmtPNG));
+   const int32_t p_cold = sketch.priority(tile_protocol(cmdRender, 64, 32, 10, 0, "map", fmtPNG));
+   if (!((p_hot > p_warm) && (p_warm > p_cold) && (p_cold == 0)))
+   {
+      throw runtime_error("Priorities don't follow popularity.");
+   }
+}
+
+void test_popularity_never_under() 
+{
+   // a tiny sketch with lots of collisions can over-estimate, but 
+   // never under-estimate.
+   popularity_sketch sketch(16, 3600, 10);
+   const std::time_t now = std::time(0);
+   for (int i = 0; i < 200; ++i)
+   {
+      for (int j = 0; j <= i % 5; ++j)
+      {
+         sketch.record(tile_protocol(cmdRender, i * 8, 0, 12, 0, "osm", fmtPNG), now);
+      }
+   }
+   for (int i = 0; i < 200; ++i)
+   {
+      const uint32_t count = sketch.estimate(tile_protocol(cmdRender, i * 8, 0, 12, 0, "osm", fmtPNG));
+      if (count < uint32_t(i % 5 + 1))
+      {
+         throw runtime_error((boost::format("Metatile %1% under-estimated at %2%.") % i % count).str());
+      }
+   }
+
+   const int32_t p = sketch.priority(tile_protocol(cmdRender, 0, 0, 12, 0, "osm", fmtPNG));
+   if (p > popularity_sketch::max_priority)
+   {
+      throw runtime_error("Priority above the maximum.");
+   }
+}
+
+void test_popularity_top() 
+{
+   popularity_sketch sketch(4096, 3600, 3);
+   const std::time_t now = std::time(0);
+
+   // metatile i is requested i times.
+   for (int i = 1; i <= 10; ++i)
+   {
+      for (int j = 0; j < i; ++j)
+      {
+         sketch.record(tile_protocol(cmdRender, i * 8, 0, 12, 0, "osm", fmtPNG), now);
+      }
+   }
+
+   vector<popularity_sketch::entry> top;
+   sketch.top(10, top);
+   if ((top.size() != 3) || (top[0].x != 80) || (top[1].x != 72) || (top[2].x != 64) ||
+       (top[0].count != 10) || (top[0].style != "osm") || (top[0].z != 12))
+   {
+      std::ostringstream ostr;
+      sketch.report(ostr, 10);
+      throw runtime_error("Wrong top metatiles:\n" + ostr.str());
+   }
+}
+
+void test_popularity_decay() 
+{
+   popularity_sketch sketch(1024, 100, 10);
+   const std::time_t now = std::time(0);
+   tile_protocol tile(cmdRender, 0, 0, 12, 0, "osm", fmtPNG);
+   tile_protocol other(cmdRender, 8, 0, 12, 0, "osm", fmtPNG);
+
+   for (int i = 0; i < 16; ++i) { sketch.record(tile, now); }
+
+   // two half-lives later, the count is a quarter of what it was.
+   sketch.record(other, now + 250);
+   if (sketch.estimate(tile) != 4)
+   {
+      throw runtime_error((boost::format("Expected decayed count of 4, got %1%.") 
+                           % sketch.estimate(tile)).str());
+   }
+
+   // and in the end it's forgotten completely.
+   sketch.record(other, now + 100000);
+   vector<popularity_sketch::entry> top;
+   sketch.top(10, top);
+   if ((sketch.estimate(tile) != 0) || (top.size() != 1))
+   {
+      throw runtime_error("Old popularity wasn't forgotten.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Popularity Sketch ==" << endl << endl;
+
+   tests_failed += test::run("test_popularity_counts", &test_popularity_counts);
+   tests_failed += test::run("test_popularity_never_under", &test_popularity_never_under);
+   tests_failed += test::run("test_popularity_top", &test_popularity_top);
+   tests_failed += test::run("test_popularity_decay", &test_popularity_decay);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,163 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "queue_controller.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+using rendermq::queue_controller;
+using rendermq::decisionRender;
+using rendermq::decisionReject;
+
+#define HOUR (3600)
+
+void test_queue_controller_static() 
+{
+   // without a target, the thresholds are as configured whatever the
+   // latency.
+   queue_controller control(100, 500, 1000, 0, HOUR);
+   for (int i = 0; i < 100; ++i)
+   {
+      control.record_render("osm", 60000000);
+   }
+   control.adjust();
+
+   if ((control.threshold_stale("osm") != 100) || 
+       (control.threshold_satisfy("osm") != 500) ||
+       (control.threshold_max("osm") != 1000))
+   {
+      throw runtime_error("Thresholds changed without a latency target.");
+   }
+}
+
+void test_queue_controller_per_style() 
+{
+   queue_controller control(100, 500, 1000, 1000000, HOUR);
+
+   // slow renders for one style, fast ones for the other.
+   for (int i = 0; i < 100; ++i)
+   {
+      control.record_render("aerial", 5000000);
+      control.record_render("osm", 100000);
+   }
+   control.adjust();
+
+   if (control.threshold_max("aerial") >= 1000)
+   {
+      throw runtime_error((boost::format("Slow style's max threshold wasn't cut: %1%.") 
+                           % control.threshold_max("aerial")).str());
+   }
+   if (control.threshold_max("osm") <= 1000)
+   {
+      throw runtime_error((boost::format("Fast style's max threshold wasn't raised: %1%.") 
+                           % control.threshold_max("osm")).str());
+   }
+   if (!(control.threshold_stale("aerial") <= control.threshold_satisfy("aerial") &&
+         control.threshold_satisfy("aerial") <= control.threshold_max("aerial")))
+   {
+      throw runtime_error("Scaled thresholds are out of order.");
+   }
+   // a style with nothing recorded is left alone.
+   if (control.threshold_max("other") != 1000)
+   {
+      throw runtime_error("Unseen style's threshold was changed.");
+   }
+}
+
+void test_queue_controller_bounds() 
+{
+   queue_controller control(100, 500, 1000, 1000000, HOUR);
+
+   for (int round = 0; round < 100; ++round)
+   {
+      for (int i = 0; i < 100; ++i)
+      {
+         control.record_render("aerial", 50000000);
+      }
+      control.adjust();
+   }
+
+   if (control.threshold_stale("aerial") < 1)
+   {
+      throw runtime_error("Threshold was cut to nothing.");
+   }
+   const double cut = control.scale("aerial");
+
+   // with no renders to go by, the thresholds drift back up, but no
+   // further than configured.
+   for (int round = 0; round < 1000; ++round)
+   {
+      control.adjust();
+   }
+   if (control.scale("aerial") <= cut)
+   {
+      throw runtime_error("Cut threshold didn't recover without renders.");
+   }
+   if (control.threshold_max("aerial") != 1000)
+   {
+      throw runtime_error((boost::format("Threshold recovered past the configured value: %1%.") 
+                           % control.threshold_max("aerial")).str());
+   }
+}
+
+void test_queue_controller_counts() 
+{
+   queue_controller control(100, 500, 1000, 0, HOUR);
+   control.decided("osm", decisionRender);
+   control.decided("osm", decisionRender);
+   control.decided("osm", decisionReject);
+   control.decided("aerial", decisionReject);
+
+   if ((control.count("osm", decisionRender) != 2) ||
+       (control.count("osm", decisionReject) != 1) ||
+       (control.count("aerial", decisionReject) != 1) ||
+       (control.count("aerial", decisionRender) != 0))
+   {
+      throw runtime_error("Decisions weren't counted per style.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Queue Controller ==" << endl << endl;
+
+   tests_failed += test::run("test_queue_controller_static", &test_queue_controller_static);
+   tests_failed += test::run("test_queue_controller_per_style", &test_queue_controller_per_style);
+   tests_failed += test::run("test_queue_controller_bounds", &test_queue_controller_bounds);
+   tests_failed += test::run("test_queue_controller_counts", &test_queue_controller_counts);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,260 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "rate_limiter.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using boost::optional;
+
+using rendermq::rate_limiter;
+
+namespace {
+
+// microseconds in a second, as the limiter is given tile_trace times.
+const uint64_t second = 1000000;
+
+int admit_many(rate_limiter &limiter, const string &client, int n, uint64_t now)
+{
+   int admitted = 0;
+   unsigned retry_after = 0;
+   for (int i = 0; i < n; ++i)
+   {
+      if (limiter.admit(client, 1.0, now, retry_after)) { ++admitted; }
+   }
+   return admitted;
+}
+
+} // anonymous namespace
+
+void test_rate_limit_burst() 
+{
+   rate_limiter limiter(1024, 2.0, 10.0, 5.0);
+   const uint64_t now = 1000 * second;
+
+   // a full bucket lets the burst in and then stops.
+   int admitted = admit_many(limiter, "addr:10.0.0.1", 20, now);
+   if (admitted != 10)
+   {
+      throw runtime_error((boost::format("Expected a burst of 10, got %1%.") % admitted).str());
+   }
+
+   unsigned retry_after = 0;
+   if (limiter.admit("addr:10.0.0.1", 1.0, now, retry_after) || (retry_after != 1))
+   {
+      throw runtime_error((boost::format("Expected to be told to retry after 1s, got %1%s.") 
+                           % retry_after).str());
+   }
+
+   // other clients aren't affected.
+   if (admit_many(limiter, "addr:10.0.0.2", 10, now) != 10)
+   {
+      throw runtime_error("Another client was limited.");
+   }
+
+   // and it refills at the rate.
+   admitted = admit_many(limiter, "addr:10.0.0.1", 20, now + 3 * second);
+   if (admitted != 6)
+   {
+      throw runtime_error((boost::format("Expected 6 after refilling for 3s, got %1%.") % admitted).str());
+   }
+
+   if ((limiter.rejected() != 25) || (limiter.admitted() != 26))
+   {
+      throw runtime_error((boost::format("Expected 26 admitted and 25 rejected, got %1% and %2%.") 
+                           % limiter.admitted() % limiter.rejected()).str());
+   }
+}
+
+void test_rate_limit_render_cost() 
+{
+   rate_limiter limiter(1024, 1.0, 10.0, 5.0);
+   const uint64_t now = 1000 * second;
+   const string client("key:abc");
+
+   // a request which turns out to need rendering is charged the rest
+   // of the render cost when the storage answers.
+   unsigned retry_after = 0;
+   limiter.admit(client, 1.0, now, retry_after);
+   limiter.pending(42, now, client);
+   string pending_client;
+   if (!limiter.finish(42, now, pending_client) || (pending_client != client) ||
+       limiter.finish(42, now, pending_client))
+   {
+      throw runtime_error("Pending request wasn't remembered exactly once.");
+   }
+   limiter.charge(pending_client, limiter.render_cost() - 1.0, now);
+
+   int admitted = admit_many(limiter, client, 10, now);
+   if (admitted != 5)
+   {
+      throw runtime_error((boost::format("Expected 5 after a render, got %1%.") % admitted).str());
+   }
+
+   // debts are capped at a bucket's worth, so that a client can 
+   // always get back in eventually.
+   limiter.charge(client, 1000.0, now);
+   if (admit_many(limiter, client, 1, now + 11 * second) != 1)
+   {
+      throw runtime_error("Client was still limited after paying off its capped debt.");
+   }
+   if (limiter.admit(client, 1.0, now + 11 * second, retry_after) || (retry_after != 1))
+   {
+      throw runtime_error("Client should have been limited again straight away.");
+   }
+}
+
+void test_rate_limit_client_key() 
+{
+   const optional<string> none;
+   // the client made up the first address, and the trusted proxy at 
+   // 10.0.0.1 added the second.
+   const optional<string> forwarded(string(" 203.0.113.7 , 192.0.2.1, 10.0.0.2"));
+   std::set<string> trusted;
+   trusted.insert("10.0.0.1");
+   trusted.insert("10.0.0.2");
+
+   // the header is ignored from anyone who isn't a trusted proxy.
+   string key = rate_limiter::client_key(forwarded, "198.51.100.1", trusted);
+   if (key != "addr:198.51.100.1")
+   {
+      throw runtime_error((boost::format("Expected the peer address, got `%1%'.") % key).str());
+   }
+
+   // from a trusted proxy, it's the rightmost address which isn't 
+   // another trusted proxy.
+   key = rate_limiter::client_key(forwarded, "10.0.0.1", trusted);
+   if (key != "addr:192.0.2.1")
+   {
+      throw runtime_error((boost::format("Expected the forwarded address, got `%1%'.") % key).str());
+   }
+
+   // mongrel2 is trusted, and adds the peer's address itself.
+   key = rate_limiter::client_key(forwarded, "", std::set<string>());
+   if (key != "addr:10.0.0.2")
+   {
+      throw runtime_error((boost::format("Expected the address mongrel2 added, got `%1%'.") % key).str());
+   }
+
+   key = rate_limiter::client_key(none, "10.0.0.1", trusted);
+   if (key != "addr:10.0.0.1")
+   {
+      throw runtime_error((boost::format("Expected the proxy's address, got `%1%'.") % key).str());
+   }
+
+   // with no address at all, all such clients mustn't share a bucket.
+   key = rate_limiter::client_key(none, "", std::set<string>());
+   if (!key.empty())
+   {
+      throw runtime_error((boost::format("Expected no key without an address, got `%1%'.") % key).str());
+   }
+}
+
+void test_rate_limit_pending() 
+{
+   rate_limiter limiter(4, 1.0, 10.0, 5.0);
+   const uint64_t now = 1000 * second;
+   string client;
+
+   // requests on a keep-alive connection share its id, but are still
+   // remembered separately.
+   limiter.pending(7, now, "addr:192.0.2.1");
+   limiter.pending(7, now + 1, "addr:192.0.2.2");
+   if (!limiter.finish(7, now + 1, client) || (client != "addr:192.0.2.2") ||
+       !limiter.finish(7, now, client) || (client != "addr:192.0.2.1"))
+   {
+      throw runtime_error("Requests on the same connection weren't told apart.");
+   }
+
+   // answers which never come back don't stop later requests being 
+   // remembered, as the oldest make way for them.
+   for (int64_t id = 0; id < 10; ++id)
+   {
+      limiter.pending(id, now + id, "addr:192.0.2.3");
+   }
+   if (limiter.finish(0, now, client) || !limiter.finish(9, now + 9, client))
+   {
+      throw runtime_error("Oldest pending requests should have made way for new ones.");
+   }
+
+   // and they're forgotten once they're too old.
+   limiter.pending(10, now + 120 * second, "addr:192.0.2.3");
+   if (limiter.finish(8, now + 8, client) || !limiter.finish(10, now + 120 * second, client))
+   {
+      throw runtime_error("Stale pending requests should have been forgotten.");
+   }
+}
+
+void test_rate_limit_fixed_size() 
+{
+   // many more clients than slots still works, forgetting the idle
+   // ones to make room for new ones.
+   rate_limiter limiter(16, 1.0, 2.0, 5.0);
+   const uint64_t now = 1000 * second;
+   for (int i = 0; i < 1000; ++i)
+   {
+      if (admit_many(limiter, (boost::format("addr:10.0.%1%.%2%") % (i / 256) % (i % 256)).str(), 1, now) != 1)
+      {
+         throw runtime_error("A new client was turned away.");
+      }
+   }
+
+   // a busy client is kept in preference to idle ones.
+   const string busy("addr:192.0.2.1");
+   admit_many(limiter, busy, 2, now);
+   for (int i = 0; i < 1000; ++i)
+   {
+      admit_many(limiter, (boost::format("addr:10.1.%1%.%2%") % (i / 256) % (i % 256)).str(), 1, now);
+      admit_many(limiter, "addr:10.2.0.1", 1, now + second);
+   }
+   if (admit_many(limiter, busy, 1, now) != 0)
+   {
+      throw runtime_error("A busy client's bucket was forgotten.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Rate Limiter ==" << endl << endl;
+
+   tests_failed += test::run("test_rate_limit_burst", &test_rate_limit_burst);
+   tests_failed += test::run("test_rate_limit_render_cost", &test_rate_limit_render_cost);
+   tests_failed += test::run("test_rate_limit_client_key", &test_rate_limit_client_key);
+   tests_failed += test::run("test_rate_limit_pending", &test_rate_limit_pending);
+   tests_failed += test::run("test_rate_limit_fixed_size", &test_rate_limit_fixed_size);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
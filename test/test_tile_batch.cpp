@@ -0,0 +1,291 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "test/fake_tile.hpp"
+#include "tile_batch.hpp"
+#include "storage/meta_tile.hpp"
+#include "http/http_gzip.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include <boost/format.hpp>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using rendermq::cmdMetatile;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+using rendermq::fmtJSON;
+using rendermq::meta_layout;
+using rendermq::tile_protocol;
+using rendermq::tile_batches;
+using rendermq::parse_batch_query;
+using rendermq::http_date_formatter;
+
+namespace
+{
+// the fake tile contents, truncated to 16 characters as fake_tile does.
+string fake_data(int x, int y, int z)
+{
+   return (boost::format("%03d|%06d|%06d") % z % x % y).str().substr(0, 16);
+}
+
+bool contains(const string &haystack, const string &needle)
+{
+   return haystack.find(needle) != string::npos;
+}
+
+// a JSON metatile, stored compressed, in which every tile is the same.
+// the header only says so when flagged is set.
+string gzipped_json_meta(int x, int y, int z, const string &json, bool flagged = true)
+{
+   string compressed;
+   if (!rendermq::gzip(json, compressed)) { throw runtime_error("Couldn't compress JSON."); }
+
+   meta_layout header;
+   std::memset(&header, 0, sizeof(header));
+   std::memcpy(header.magic, "META", 4);
+   header.count = METATILE * METATILE;
+   header.x = x;
+   header.y = y;
+   header.z = z;
+   header.fmt = flagged ? (fmtJSON | meta_layout::flag_gzip) : fmtJSON;
+   for (int i = 0; i < METATILE * METATILE; ++i)
+   {
+      header.index[i].offset = sizeof(header);
+      header.index[i].size = compressed.size();
+   }
+   return string((const char *)&header, sizeof(header)) + compressed;
+}
+} // anonymous namespace
+
+void test_batch_parse_list() 
+{
+   vector<tile_protocol> tiles;
+   string error;
+   if (!parse_batch_query("style=osm&format=jpg&tiles=12/2046/1362,12%2F2047%2F1362", 10, tiles, error))
+   {
+      throw runtime_error("Valid tile list rejected: " + error);
+   }
+   if ((tiles.size() != 2) || (tiles[0].style != "osm") || (tiles[0].format != fmtJPEG) ||
+       (tiles[1].z != 12) || (tiles[1].x != 2047) || (tiles[1].y != 1362))
+   {
+      throw runtime_error("Tile list parsed wrongly.");
+   }
+
+   if (parse_batch_query("style=osm&format=png&tiles=12/2046/1362,12/2047", 10, tiles, error) ||
+       parse_batch_query("style=osm&format=tiff&tiles=12/2046/1362", 10, tiles, error) ||
+       parse_batch_query("format=png&tiles=12/2046/1362", 10, tiles, error) ||
+       parse_batch_query("style=osm&format=png&tiles=1/0/0,1/0/1,1/1/0", 2, tiles, error))
+   {
+      throw runtime_error("Invalid tile list accepted.");
+   }
+}
+
+void test_batch_parse_bbox() 
+{
+   vector<tile_protocol> tiles;
+   string error;
+   // a small area of central London, which at z12 is 2x2 tiles.
+   if (!parse_batch_query("style=osm&format=png&zoom=12&bbox=-0.1,51.48,-0.01,51.52", 10, tiles, error))
+   {
+      throw runtime_error("Valid bbox rejected: " + error);
+   }
+   if ((tiles.size() != 4) || (tiles[0].x != 2046) || (tiles[0].y != 1361) ||
+       (tiles[3].x != 2047) || (tiles[3].y != 1362))
+   {
+      throw runtime_error((boost::format("Bbox gave wrong tiles: %1% tiles, first %2%.") 
+                           % tiles.size() % tiles.front()).str());
+   }
+
+   if (parse_batch_query("style=osm&format=png&zoom=12&bbox=-0.1,51.48,-0.01,51.52", 3, tiles, error) ||
+       parse_batch_query("style=osm&format=png&zoom=10-12&bbox=-0.1,51.48,-0.01,51.52", 10, tiles, error) ||
+       parse_batch_query("style=osm&format=png&zoom=12&bbox=-0.1,51.48,-0.01,51.52&tiles=1/0/0", 10, tiles, error))
+   {
+      throw runtime_error("Invalid bbox accepted.");
+   }
+}
+
+void test_batch_groups_metatiles() 
+{
+   tile_batches batches(4);
+   vector<tile_protocol> tiles, requests;
+   string error;
+   // two tiles in one metatile, one in another.
+   if (!parse_batch_query("style=osm&format=png&tiles=12/1027/1029,12/1030/1025,12/1032/1025", 
+                          10, tiles, error))
+   {
+      throw runtime_error("Valid tile list rejected: " + error);
+   }
+
+   const int id = batches.add(42, tiles, requests);
+   if ((requests.size() != 2) || (requests[0].status != cmdMetatile) || (requests[0].id != id) ||
+       (requests[0].x != 1024) || (requests[0].y != 1024) || (requests[1].x != 1032))
+   {
+      throw runtime_error("Tiles weren't grouped into metatiles.");
+   }
+
+   // the first metatile is found, the second isn't in storage.
+   fake_tile meta(1024, 1024, 12, fmtPNG);
+   tile_protocol reply(requests[0]);
+   reply.set_data(string(meta.ptr, meta.total_size));
+   reply.last_modified = 1234;
+   if (batches.fill(reply))
+   {
+      throw runtime_error("Batch finished before all its metatiles were read.");
+   }
+   if (!batches.fill(requests[1]))
+   {
+      throw runtime_error("Batch didn't finish after all its metatiles were read.");
+   }
+
+   string body;
+   if (batches.take(id, http_date_formatter(), body) != 42)
+   {
+      throw runtime_error("Batch was for the wrong client.");
+   }
+   if (!contains(body, "X-Tile: 12/1027/1029\r\nX-Tile-Status: 200\r\n") ||
+       !contains(body, fake_data(1027, 1029, 12)) ||
+       !contains(body, fake_data(1030, 1025, 12)) ||
+       !contains(body, "X-Tile: 12/1032/1025\r\nX-Tile-Status: 404\r\n") ||
+       !contains(body, "--" + tile_batches::boundary + "--\r\n") ||
+       (body.find("X-Tile: 12/1027/1029") > body.find("X-Tile: 12/1030/1025")))
+   {
+      throw runtime_error("Wrong batch response:\n" + body);
+   }
+   if (batches.size() != 0)
+   {
+      throw runtime_error("Batch wasn't forgotten after being taken.");
+   }
+}
+
+void test_batch_gzip() 
+{
+   const string json = "{\"type\":\"FeatureCollection\",\"features\":[]}";
+   const string meta = gzipped_json_meta(1024, 1024, 12, json);
+
+   // clients which accept gzip get the tiles as they're stored, the 
+   // others get them decompressed.
+   for (int accept = 0; accept < 2; ++accept)
+   {
+      tile_batches batches(1);
+      vector<tile_protocol> tiles(1, tile_protocol(rendermq::cmdRender, 1027, 1029, 12, 0, "osm", fmtJSON));
+      tiles[0].accept_gzip = (accept != 0);
+      vector<tile_protocol> requests;
+      const int id = batches.add(1, tiles, requests);
+
+      tile_protocol reply(requests[0]);
+      reply.set_data(meta);
+      string body;
+      if (!batches.fill(reply) || (batches.take(id, http_date_formatter(), body) != 1))
+      {
+         throw runtime_error("Batch didn't finish.");
+      }
+
+      if (!contains(body, "X-Tile-Status: 200\r\n") ||
+          (contains(body, "Content-Encoding: gzip\r\n") != (accept != 0)) ||
+          (contains(body, json) == (accept != 0)))
+      {
+         throw runtime_error((boost::format("Wrong encoding of batch part when %1%accepting gzip:\n%2%") 
+                              % (accept ? "" : "not ") % body).str());
+      }
+   }
+}
+
+void test_batch_gzip_unflagged() 
+{
+   const string json = "{\"type\":\"FeatureCollection\",\"features\":[]}";
+   const string meta = gzipped_json_meta(1024, 1024, 12, json, false);
+   string compressed;
+   rendermq::gzip(json, compressed);
+
+   // it's the header which says whether the tiles are compressed, so
+   // without the flag the data goes out as it is, whatever it looks like.
+   tile_batches batches(1);
+   vector<tile_protocol> tiles(1, tile_protocol(rendermq::cmdRender, 1027, 1029, 12, 0, "osm", fmtJSON));
+   vector<tile_protocol> requests;
+   const int id = batches.add(1, tiles, requests);
+
+   tile_protocol reply(requests[0]);
+   reply.set_data(meta);
+   string body;
+   if (!batches.fill(reply) || (batches.take(id, http_date_formatter(), body) != 1))
+   {
+      throw runtime_error("Batch didn't finish.");
+   }
+
+   if (!contains(body, "X-Tile-Status: 200\r\n") ||
+       contains(body, "Content-Encoding") ||
+       !contains(body, compressed))
+   {
+      throw runtime_error("Unflagged batch part wasn't sent as it is:\n" + body);
+   }
+}
+
+void test_batch_full() 
+{
+   tile_batches batches(2);
+   vector<tile_protocol> tiles(1, tile_protocol(rendermq::cmdRender, 0, 0, 0, 0, "osm", fmtPNG));
+   vector<tile_protocol> requests;
+
+   const int a = batches.add(1, tiles, requests);
+   const int b = batches.add(2, tiles, requests);
+   if (!batches.full() || (a == b) || (a <= 0) || (b <= 0))
+   {
+      throw runtime_error("Batches should be full, with distinct ids.");
+   }
+
+   // replies for unknown batches are ignored.
+   tile_protocol stray(requests[0]);
+   stray.id = a + b;
+   if (batches.fill(stray) || (batches.size() != 2))
+   {
+      throw runtime_error("Stray reply was accepted.");
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Tile Batches ==" << endl << endl;
+
+   tests_failed += test::run("test_batch_parse_list", &test_batch_parse_list);
+   tests_failed += test::run("test_batch_parse_bbox", &test_batch_parse_bbox);
+   tests_failed += test::run("test_batch_groups_metatiles", &test_batch_groups_metatiles);
+   tests_failed += test::run("test_batch_gzip", &test_batch_gzip);
+   tests_failed += test::run("test_batch_gzip_unflagged", &test_batch_gzip_unflagged);
+   tests_failed += test::run("test_batch_full", &test_batch_full);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
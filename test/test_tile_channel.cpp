@@ -0,0 +1,214 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "test/common.hpp"
+#include "tile_channel.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <poll.h>
+
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::vector;
+
+using rendermq::cmdRender;
+using rendermq::fmtPNG;
+using rendermq::tile_protocol;
+using rendermq::tile_channel;
+using rendermq::tile_channel_backlog;
+
+namespace {
+
+bool readable(const tile_channel &channel, int timeout_ms)
+{
+   struct pollfd item = { channel.fd(), POLLIN, 0 };
+   return (poll(&item, 1, timeout_ms) == 1) && (item.revents & POLLIN);
+}
+
+void producer(tile_channel &channel, int first, int count)
+{
+   for (int i = first; i < first + count; ++i)
+   {
+      tile_protocol *tile = new tile_protocol(cmdRender, i, 0, 20, 0, "osm", fmtPNG);
+      while (!channel.push(tile))
+      {
+         boost::this_thread::yield();
+      }
+   }
+}
+
+void consumer(tile_channel &channel, int count, vector<int> &seen)
+{
+   for (int n = 0; n < count; )
+   {
+      if (!readable(channel, 100)) { continue; }
+      boost::scoped_ptr<tile_protocol> tile(channel.pop());
+      if (tile)
+      {
+         seen.push_back(tile->x);
+         ++n;
+      }
+   }
+}
+
+} // anonymous namespace
+
+void test_channel_order() 
+{
+   tile_channel channel(4);
+   if (readable(channel, 0))
+   {
+      throw runtime_error("Empty channel is readable.");
+   }
+
+   // capacity is rounded up to a power of two.
+   for (int i = 0; i < 4; ++i)
+   {
+      if (!channel.push(new tile_protocol(cmdRender, i, 0, 10, 0, "osm", fmtPNG)))
+      {
+         throw runtime_error((boost::format("Push %1% failed.") % i).str());
+      }
+   }
+   tile_protocol extra(cmdRender, 4, 0, 10, 0, "osm", fmtPNG);
+   if (channel.push(&extra))
+   {
+      throw runtime_error("Push to a full channel succeeded.");
+   }
+
+   for (int i = 0; i < 4; ++i)
+   {
+      if (!readable(channel, 0))
+      {
+         throw runtime_error("Channel with tiles in isn't readable.");
+      }
+      boost::scoped_ptr<tile_protocol> tile(channel.pop());
+      if (!tile || (tile->x != i))
+      {
+         throw runtime_error((boost::format("Expected tile %1% out.") % i).str());
+      }
+   }
+
+   if (readable(channel, 0) || (channel.pop() != NULL))
+   {
+      throw runtime_error("Drained channel still has tiles.");
+   }
+}
+
+void test_channel_backlog() 
+{
+   tile_channel channel(2);
+   tile_channel_backlog backlog(channel);
+
+   for (int i = 0; i < 5; ++i)
+   {
+      backlog.push(new tile_protocol(cmdRender, i, 0, 10, 0, "osm", fmtPNG));
+   }
+   if (backlog.empty())
+   {
+      throw runtime_error("Backlog should be holding tiles for a full channel.");
+   }
+
+   // tiles come out in order as room is made.
+   for (int i = 0; i < 5; ++i)
+   {
+      boost::scoped_ptr<tile_protocol> tile(channel.pop());
+      if (!tile || (tile->x != i))
+      {
+         throw runtime_error((boost::format("Expected tile %1% out of the backlog.") % i).str());
+      }
+      backlog.flush();
+   }
+   if (!backlog.empty())
+   {
+      throw runtime_error("Backlog wasn't emptied.");
+   }
+}
+
+void test_channel_threads() 
+{
+   // lots of tiles through a small channel from several producers to
+   // several consumers, which should each come out exactly once.
+   const int producers = 4, consumers = 3, per_producer = 30000;
+   tile_channel channel(64);
+   vector<vector<int> > seen(consumers);
+
+   boost::thread_group threads;
+   for (int i = 0; i < consumers; ++i)
+   {
+      const int count = (producers * per_producer) / consumers;
+      threads.create_thread(boost::bind(&consumer, boost::ref(channel), count, boost::ref(seen[i])));
+   }
+   for (int i = 0; i < producers; ++i)
+   {
+      threads.create_thread(boost::bind(&producer, boost::ref(channel), i * per_producer, per_producer));
+   }
+   threads.join_all();
+
+   vector<int> counts(producers * per_producer, 0);
+   for (int i = 0; i < consumers; ++i)
+   {
+      // each producer's tiles come out in the order it sent them.
+      vector<int> last(producers, -1);
+      for (size_t j = 0; j < seen[i].size(); ++j)
+      {
+         const int x = seen[i][j];
+         if (x <= last[x / per_producer])
+         {
+            throw runtime_error((boost::format("Tile %1% came out of order.") % x).str());
+         }
+         last[x / per_producer] = x;
+         ++counts[x];
+      }
+   }
+   for (size_t i = 0; i < counts.size(); ++i)
+   {
+      if (counts[i] != 1)
+      {
+         throw runtime_error((boost::format("Tile %1% came out %2% times.") % i % counts[i]).str());
+      }
+   }
+}
+
+int main() 
+{
+   int tests_failed = 0;
+   
+   cout << "== Testing Tile Channel ==" << endl << endl;
+
+   tests_failed += test::run("test_channel_order", &test_channel_order);
+   tests_failed += test::run("test_channel_backlog", &test_channel_backlog);
+   tests_failed += test::run("test_channel_threads", &test_channel_threads);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -0,0 +1,197 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_path_parser.hpp"
+#include "tile_protocol.hpp"
+#include "test/common.hpp"
+#include <stdexcept>
+#include <iostream>
+#include <vector>
+#include <boost/format.hpp>
+
+using rendermq::tile_path_parser;
+using rendermq::tile_protocol;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using rendermq::cmdRender;
+using rendermq::cmdDirty;
+using rendermq::cmdStatus;
+using rendermq::fmtPNG;
+using rendermq::fmtJPEG;
+using rendermq::fmtJSON;
+
+namespace {
+
+const string default_template("/tiles/1.0.0/{STYLE}/{Z}/{X}/{Y}.{FORMAT}");
+
+// a mix of good and bad paths to run through both of the matchers.
+vector<string> test_paths() 
+{
+   vector<string> paths;
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.png");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.jpg");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.jpeg");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.json");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.gif");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.webp");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.tga");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.PNG");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.pngx");
+   paths.push_back("/tiles/1.0.0/map/13/2353/3085.png");
+   paths.push_back("/tiles/1.0.0/map/29/1234567/7654321.png");
+   paths.push_back("/tiles/1.0.0/map/30/1/1.png");
+   paths.push_back("/tiles/1.0.0/map/3/12345678/1.png");
+   paths.push_back("/tiles/1.0.0/map/100/1/1.png");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.png/dirty");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.jpg/status");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.png/killallhumans");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.png/");
+   paths.push_back("/tiles/1.0.0/osm/ 0/ 0/ 0.png");
+   paths.push_back("/tiles/1.0.0/osm_foo/0/0/0.png");
+   paths.push_back("/tiles/1.0.0/osm-foo/0/0/0.png");
+   paths.push_back("/tiles/1.0.0/vx/osm/1/2/3.png");
+   paths.push_back("/tiles/1.0.0/osm/x/0/0.png");
+   paths.push_back("/tiles/1.0.0//0/0/0.png");
+   paths.push_back("/tiles/1.0.0/osm/0/0/.png");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.png?foo=bar");
+   paths.push_back("/tiles/1.0.1/osm/0/0/0.png");
+   paths.push_back("/tiles/1.0.0/osm/0/0/0.png/status/dirty");
+   paths.push_back("/tiles/1.0.0/");
+   paths.push_back("/0/0/0.png");
+   paths.push_back("///0/0/0.png");
+   paths.push_back("");
+   paths.push_back("/tiles/1.0.0/en/osm/1/2/3.png");
+   paths.push_back("/tiles/1.0.0/de-CH/osm/1/2/3.png");
+   paths.push_back("/tiles/1.0.0/a%2Cb/osm/1/2/3.png");
+   paths.push_back("/tiles/1.0.0/a%2Fb/osm/1/2/3.png");
+   paths.push_back("/tiles/1.0.0//osm/1/2/3.png");
+   paths.push_back("/tiles/1.0.0/en/osm/1/2/3.png/dirty");
+   return paths;
+}
+
+void check_same(const string &templ, bool expect_fast)
+{
+   tile_path_parser parser(templ);
+   if (parser.fast_path() != expect_fast)
+   {
+      throw runtime_error((boost::format("Template `%1%' was expected %2%to use the fast path.") 
+                           % templ % (expect_fast ? "" : "not ")).str());
+   }
+   if (!expect_fast) { return; }
+
+   vector<string> paths = test_paths();
+   for (vector<string>::iterator itr = paths.begin(); itr != paths.end(); ++itr)
+   {
+      tile_protocol fast, slow;
+      bool fast_ok = parser.match_fast(fast, *itr);
+      bool slow_ok = parser.match_regex(slow, *itr);
+
+      if (fast_ok != slow_ok) 
+      {
+         throw runtime_error((boost::format("Path `%1%' with template `%2%' %3% by the regex, but %4% by the fast path.")
+                              % *itr % templ % (slow_ok ? "matched" : "not matched") 
+                              % (fast_ok ? "matched" : "not matched")).str());
+      }
+      if (fast_ok && ((fast != slow) || (fast.status != slow.status)))
+      {
+         throw runtime_error((boost::format("Path `%1%' with template `%2%' parsed as %3% by the regex, but %4% by the fast path.")
+                              % *itr % templ % slow % fast).str());
+      }
+   }
+}
+
+/* check that the fast path gives the same answers as the regex for
+ * the default template.
+ */
+void test_fast_path_default() 
+{
+   check_same(default_template, true);
+}
+
+/* check the fast path against the regex for templates with extra
+ * parameters in them.
+ */
+void test_fast_path_additional() 
+{
+   check_same("/tiles/1.0.0/{LANG}/{STYLE}/{Z}/{X}/{Y}.{FORMAT}", true);
+   check_same("/tiles/1.0.0/{ lang }/{STYLE}/{Z}/{X}/{Y}.{FORMAT}", true);
+   check_same("/tiles/{STYLE}/{Z}/{X}/{Y}.png", true);
+}
+
+/* check that templates which would need backtracking, or which are
+ * just odd, aren't handled by the fast path.
+ */
+void test_fast_path_fallback() 
+{
+   // parameters need something to separate them
+   check_same("/tiles/{STYLE}{Z}/{X}/{Y}.{FORMAT}", false);
+   // additional parameters can contain dots
+   check_same("/tiles/{LANG}.{STYLE}/{Z}/{X}/{Y}.{FORMAT}", false);
+   // missing the basic parameters
+   check_same("/tiles/{STYLE}/{Z}/{X}.{FORMAT}", false);
+}
+
+/* check the fast path gives the actual expected results too.
+ */
+void test_fast_path_results()
+{
+   tile_path_parser parser("/tiles/1.0.0/{LANG}/{STYLE}/{Z}/{X}/{Y}.{FORMAT}");
+   tile_protocol tile;
+   if (!parser(tile, "/tiles/1.0.0/a%2Cb/map/13/2353/3085.jpg/dirty"))
+   {
+      throw runtime_error("Expected path to parse, but it didn't.");
+   }
+   tile_protocol expected(cmdDirty, 2353, 3085, 13, 0, "map", fmtJPEG);
+   expected.parameters["lang"] = "a,b";
+   if ((tile != expected) || (tile.status != cmdDirty))
+   {
+      throw runtime_error((boost::format("Expected %1%, but got %2%.") % expected % tile).str());
+   }
+}
+
+} // anonymous namespace
+
+int main() 
+{
+   int tests_failed = 0;
+
+   cout << "== Testing Tile Path Parser ==" << endl << endl;
+
+   tests_failed += test::run("test_fast_path_default", &test_fast_path_default);
+   tests_failed += test::run("test_fast_path_additional", &test_fast_path_additional);
+   tests_failed += test::run("test_fast_path_fallback", &test_fast_path_fallback);
+   tests_failed += test::run("test_fast_path_results", &test_fast_path_results);
+   //tests_failed += test::run("test_", &test_);
+
+   cout << " >> Tests failed: " << tests_failed << endl << endl;
+
+   return 0;
+}
@@ -49,6 +49,7 @@ using std::string;
 using std::numeric_limits;
 using std::time_t;
 using std::list;
+using std::vector;
 
 using rendermq::union_storage;
 using rendermq::null_storage;
@@ -195,6 +196,24 @@ public:
    mutable list<tile_protocol> gets, puts;
 };
 
+// a storage which says it stored every tile at the same time.
+class stamping_storage
+   : public recording_storage
+{
+public:
+   stamping_storage(time_t stamp) : m_stamp(stamp) {}
+
+   bool put_meta_stamped(const tile_protocol &tile, const string &str, time_t &stored) const
+   {
+      puts.push_back(tile);
+      stored = m_stamp;
+      return true;
+   }
+
+private:
+   time_t m_stamp;
+};
+
 class randomized_tester
 {
 public:
@@ -326,6 +345,53 @@ private:
    recording_storage *record;
 };
 
+class test_odd_and_even_batch_pass_thru
+   : public randomized_tester
+{
+public:
+   test_odd_and_even_batch_pass_thru() 
+      : randomized_tester(),
+        record(new recording_storage())
+   {
+      storages.push_back(shared_ptr<tile_storage>(new predicate_tiles_exist(&is_even_tile)));
+      storages.push_back(shared_ptr<tile_storage>(record));
+      storages.push_back(shared_ptr<tile_storage>(new predicate_tiles_exist(&is_odd_tile)));
+   }
+
+   void test(const tile_protocol &t, tile_storage &storage)
+   {
+      batch.push_back(t);
+      if (batch.size() < 64) { return; }
+
+      vector<shared_ptr<tile_storage::handle> > handles;
+      storage.get_many(batch, handles);
+      for (size_t i = 0; i < batch.size(); ++i) 
+      {
+         if (!handles[i] || !handles[i]->exists())
+         {
+            throw runtime_error((boost::format("Tile %1% should exist in a batch get.") % batch[i]).str());
+         }
+      }
+      batch.clear();
+   }
+
+   void finally() 
+   {
+      BOOST_FOREACH(const tile_protocol &t, record->gets)
+      {
+         if (is_even_tile(t)) 
+         {
+            throw runtime_error((boost::format("Tile %1% is an even tile, and should not have been passed on in a batch after the even tile layer in the storage.") % t).str());
+         }
+      }
+   }
+
+private:
+   // see comment in test_odd_and_even_pass_thru
+   recording_storage *record;
+   vector<tile_protocol> batch;
+};
+
 class test_put_puts_to_all
    : public randomized_tester
 {
@@ -410,6 +476,28 @@ private:
    list<tile_protocol> tiles;
 };
 
+// the time given back is what the first storage, which gets are 
+// answered from, stored.
+void test_put_stamped_gives_first_time()
+{
+   stamping_storage *first = new stamping_storage(1000), *second = new stamping_storage(2000);
+   union_storage::list_of_storage_t storages;
+   storages.push_back(shared_ptr<tile_storage>(first));
+   storages.push_back(shared_ptr<tile_storage>(second));
+   union_storage storage(storages);
+
+   tile_protocol tile;
+   time_t stored = 0;
+   if (!storage.put_meta_stamped(tile, "", stored) || (stored != 1000))
+   {
+      throw runtime_error((boost::format("Expected the first storage's time of 1000, got %1%.") % stored).str());
+   }
+   if ((first->puts.size() != 1) || (second->puts.size() != 1))
+   {
+      throw runtime_error("Stamped put should go to all the storages.");
+   }
+}
+
 } // anonymous namespace
 
 int main() 
@@ -434,6 +522,10 @@ int main()
       test_odd_and_even_pass_thru test;
       tests_failed += test::run("test_odd_and_even_pass_thru", boost::ref(test));
    }
+   {
+      test_odd_and_even_batch_pass_thru test;
+      tests_failed += test::run("test_odd_and_even_batch_pass_thru", boost::ref(test));
+   }
    {
       test_put_puts_to_all test;
       tests_failed += test::run("test_put_puts_to_all", boost::ref(test));
@@ -442,6 +534,7 @@ int main()
       test_expire_expires_from_all test;
       tests_failed += test::run("test_expire_expires_from_all", boost::ref(test));
    }
+   tests_failed += test::run("test_put_stamped_gives_first_time", &test_put_stamped_gives_first_time);
    //tests_failed += test::run("test_", &test_);
    
    cout << " >> Tests failed: " << tests_failed << endl << endl;
@@ -0,0 +1,300 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_batch.hpp"
+#include "bulk_dirty.hpp"
+#include "storage/meta_tile.hpp"
+#include "http/http_gzip.hpp"
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <limits>
+#include <sstream>
+#include <set>
+
+// the highest zoom level which a batch can ask for.
+#define MAX_BATCH_ZOOM (30)
+
+using std::string;
+using std::vector;
+using std::map;
+using std::set;
+
+namespace rendermq
+{
+
+namespace
+{
+
+const int meta_mask = ~(METATILE - 1);
+
+bool parse_tile_list(const string &str, const tile_protocol &proto, size_t max_tiles,
+                     vector<tile_protocol> &tiles)
+{
+   vector<string> items;
+   boost::split(items, str, boost::is_any_of(","));
+   BOOST_FOREACH(const string &item, items)
+   {
+      vector<string> zxy;
+      boost::split(zxy, boost::trim_copy(item), boost::is_any_of("/"));
+      if ((zxy.size() != 3) || (tiles.size() >= max_tiles)) { return false; }
+
+      tile_protocol tile(proto);
+      try
+      {
+         tile.z = boost::lexical_cast<int>(zxy[0]);
+         tile.x = boost::lexical_cast<int>(zxy[1]);
+         tile.y = boost::lexical_cast<int>(zxy[2]);
+      }
+      catch (const boost::bad_lexical_cast &)
+      {
+         return false;
+      }
+      tiles.push_back(tile);
+   }
+   return true;
+}
+
+bool parse_tile_bbox(const string &zoom, const string &bbox, const tile_protocol &proto, 
+                     size_t max_tiles, vector<tile_protocol> &tiles)
+{
+   int z;
+   vector<double> numbers;
+   try
+   {
+      z = boost::lexical_cast<int>(zoom);
+      vector<string> parts;
+      boost::split(parts, bbox, boost::is_any_of(","));
+      BOOST_FOREACH(const string &part, parts)
+      {
+         numbers.push_back(boost::lexical_cast<double>(boost::trim_copy(part)));
+      }
+   }
+   catch (const boost::bad_lexical_cast &)
+   {
+      return false;
+   }
+   if ((z < 0) || (z > MAX_BATCH_ZOOM) || (numbers.size() != 4) ||
+       (numbers[0] > numbers[2]) || (numbers[1] > numbers[3]))
+   {
+      return false;
+   }
+
+   int x0, y0, x1, y1;
+   dirty_region(numbers[0], numbers[1], numbers[2], numbers[3], z, z).tile_range(z, x0, y0, x1, y1);
+   if (uint64_t(x1 - x0 + 1) * uint64_t(y1 - y0 + 1) > max_tiles) { return false; }
+
+   tile_protocol tile(proto);
+   tile.z = z;
+   for (tile.y = y0; tile.y <= y1; ++tile.y)
+   {
+      for (tile.x = x0; tile.x <= x1; ++tile.x)
+      {
+         tiles.push_back(tile);
+      }
+   }
+   return true;
+}
+
+} // anonymous namespace
+
+bool 
+parse_batch_query(const string &query, size_t max_tiles,
+                  vector<tile_protocol> &tiles, string &error)
+{
+   map<string, string> params;
+   parse_query(query, params);
+
+   tiles.clear();
+   tile_protocol proto(cmdRender, 0, 0, 0, 0, params["style"], fmtNone);
+   if (proto.style.empty())
+   {
+      error = "A style must be given.";
+      return false;
+   }
+
+   const string &format = params["format"];
+   proto.format = (format == "jpg") ? fmtJPEG : get_format_for(format);
+   if (proto.format == fmtNone)
+   {
+      error = "A format of png, jpg, gif, webp or json must be given.";
+      return false;
+   }
+
+   const string &list = params["tiles"], &zoom = params["zoom"], &bbox = params["bbox"];
+   const string too_many = (boost::format(" At most %1% tiles can be asked for.") % max_tiles).str();
+   if (!list.empty() && zoom.empty() && bbox.empty())
+   {
+      if (!parse_tile_list(list, proto, max_tiles, tiles))
+      {
+         error = "The tiles must be a comma-separated list of z/x/y." + too_many;
+         return false;
+      }
+   }
+   else if (list.empty() && !zoom.empty() && !bbox.empty())
+   {
+      if (!parse_tile_bbox(zoom, bbox, proto, max_tiles, tiles))
+      {
+         error = "The zoom must be a single level and the bbox west,south,east,north "
+            "in degrees." + too_many;
+         return false;
+      }
+   }
+   else
+   {
+      error = "Either a list of tiles, or a zoom and bbox, must be given.";
+      return false;
+   }
+
+   return true;
+}
+
+const string tile_batches::boundary("rendermq-tile-batch-5e1b7c93");
+
+tile_batches::tile_batches(size_t max_batches)
+   : m_max_batches(max_batches), m_next_id(1)
+{
+}
+
+int
+tile_batches::add(int64_t client_id, const vector<tile_protocol> &tiles,
+                  vector<tile_protocol> &requests)
+{
+   const int id = m_next_id;
+   m_next_id = (m_next_id == std::numeric_limits<int32_t>::max()) ? 1 : m_next_id + 1;
+
+   batch &b = m_batches[id];
+   b.client_id = client_id;
+   b.format = tiles.empty() ? fmtNone : tiles.front().format;
+   b.accept_gzip = !tiles.empty() && tiles.front().accept_gzip;
+   b.parts.reserve(tiles.size());
+   b.waiting = 0;
+
+   // all the tiles are the same style, so the zoom and aligned x, y
+   // are enough to tell metatiles apart.
+   set<std::pair<int, std::pair<int, int> > > metatiles;
+   BOOST_FOREACH(const tile_protocol &tile, tiles)
+   {
+      part p;
+      p.z = tile.z;
+      p.x = tile.x;
+      p.y = tile.y;
+      p.found = false;
+      p.gzipped = false;
+      p.last_modified = 0;
+      b.parts.push_back(p);
+
+      tile_protocol request(cmdMetatile, tile.x & meta_mask, tile.y & meta_mask, tile.z, 
+                            id, tile.style, tile.format);
+      if (metatiles.insert(std::make_pair(request.z, std::make_pair(request.x, request.y))).second)
+      {
+         requests.push_back(request);
+         ++b.waiting;
+      }
+   }
+
+   return id;
+}
+
+bool
+tile_batches::fill(const tile_protocol &reply)
+{
+   batch_map_t::iterator itr = m_batches.find(int(reply.id));
+   if ((itr == m_batches.end()) || (itr->second.waiting == 0)) { return false; }
+   batch &b = itr->second;
+
+   if (!reply.data().empty())
+   {
+      metatile_reader reader(reply.data(), b.format);
+      if (reader.initialized_)
+      {
+         BOOST_FOREACH(part &p, b.parts)
+         {
+            if ((p.z != reply.z) || ((p.x & meta_mask) != reply.x) || ((p.y & meta_mask) != reply.y)) 
+            { 
+               continue; 
+            }
+            std::pair<metatile_reader::iterator_type, metatile_reader::iterator_type> 
+               range = reader.get(p.x & (METATILE - 1), p.y & (METATILE - 1));
+            p.data.assign(range.first, range.second);
+            p.found = !p.data.empty();
+            p.gzipped = reader.header_.gzipped();
+            p.last_modified = reply.last_modified;
+         }
+      }
+   }
+
+   return --b.waiting == 0;
+}
+
+int64_t
+tile_batches::take(int id, const http_date_formatter &date_format, string &body)
+{
+   batch_map_t::iterator itr = m_batches.find(id);
+   if (itr == m_batches.end()) { return -1; }
+   const batch &b = itr->second;
+
+   std::ostringstream out;
+   BOOST_FOREACH(const part &p, b.parts)
+   {
+      // tiles which the metatile header flags as compressed are left
+      // that way for clients which accept it, and decompressed for the
+      // others.
+      const bool gzipped = p.found && p.gzipped;
+      string gunzipped;
+      const bool failed = gzipped && !b.accept_gzip && !gunzip(p.data, gunzipped);
+      const string &data = (gzipped && !b.accept_gzip) ? gunzipped : p.data;
+      const bool found = p.found && !failed;
+
+      out << "--" << boundary << "\r\n";
+      out << "X-Tile: " << p.z << "/" << p.x << "/" << p.y << "\r\n";
+      out << "X-Tile-Status: " << (found ? 200 : (failed ? 500 : 404)) << "\r\n";
+      if (found)
+      {
+         out << "Content-Type: " << mime_type_for(b.format) << "\r\n";
+         if (gzipped && b.accept_gzip)
+         {
+            out << "Content-Encoding: gzip\r\n";
+         }
+         if (p.last_modified > 0)
+         {
+            out << "Last-Modified: ";
+            date_format(out, p.last_modified);
+            out << "\r\n";
+         }
+      }
+      out << "Content-Length: " << data.size() << "\r\n\r\n";
+      out << data << "\r\n";
+   }
+   out << "--" << boundary << "--\r\n";
+   body = out.str();
+
+   const int64_t client_id = b.client_id;
+   m_batches.erase(itr);
+   return client_id;
+}
+
+} // namespace rendermq
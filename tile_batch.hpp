@@ -0,0 +1,137 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TILE_BATCH_HPP
+#define TILE_BATCH_HPP
+
+#include "tile_protocol.hpp"
+#include "http/http_date_formatter.hpp"
+
+#include <stdint.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+
+namespace rendermq
+{
+
+/* parse a batch query string, asking for several tiles of the same 
+ * style and format at once, such as
+ *
+ *   style=osm&format=png&tiles=12/2046/1362,12/2047/1362
+ *
+ * where instead of a list of z/x/y tiles, all the tiles covering a 
+ * bbox of west,south,east,north in degrees at a single zoom level 
+ * can be given with zoom= and bbox=. the tiles are put in tiles, in 
+ * the order they were asked for, as normal render requests. returns 
+ * false and sets error if the query isn't valid, or asks for more 
+ * than max_tiles tiles.
+ */
+bool parse_batch_query(const std::string &query, size_t max_tiles,
+                       std::vector<tile_protocol> &tiles,
+                       std::string &error);
+
+/* batches of tiles which are being read from storage so that they 
+ * can be sent back to the client together in one multipart response.
+ * the tiles are grouped by metatile, and each metatile is read whole
+ * just once, however many of its tiles were asked for.
+ *
+ * this is only touched from the handler's main loop, so there's no
+ * locking.
+ */
+class tile_batches
+{
+public:
+   // boundary between the parts of a batch response.
+   static const std::string boundary;
+
+   /* @param max_batches the number of batches which can be waiting 
+    *    for storage at once.
+    */
+   explicit tile_batches(size_t max_batches);
+
+   bool full() const { return m_batches.size() >= m_max_batches; }
+   size_t size() const { return m_batches.size(); }
+
+   /* start a batch of tiles for the client. one cmdMetatile storage
+    * request is added to requests for each distinct metatile, with
+    * the batch id in place of the client id. returns the batch id, 
+    * which is always positive. the tiles' accept_gzip says whether
+    * compressed JSON tiles can be sent as they are.
+    */
+   int add(int64_t client_id, const std::vector<tile_protocol> &tiles,
+           std::vector<tile_protocol> &requests);
+
+   /* fill in the tiles of a batch from the reply to one of its 
+    * requests, which has the whole metatile as its data, or none if
+    * it wasn't in storage, and its last modified time, or zero if 
+    * it has expired. returns true if that was the last reply the 
+    * batch was waiting for.
+    */
+   bool fill(const tile_protocol &reply);
+
+   /* forget a finished batch, writing out the multipart body of its
+    * response and returning the client id it's for. each part has
+    * the tile's z/x/y in an X-Tile header, and an X-Tile-Status of 
+    * 200 if the tile was found, or 404 if it wasn't. tiles which had
+    * expired have no Last-Modified, and JSON tiles which are stored
+    * compressed have a Content-Encoding of gzip if the client accepts
+    * it, or are decompressed otherwise. a tile which can't be 
+    * decompressed has an X-Tile-Status of 500.
+    */
+   int64_t take(int batch, const http_date_formatter &date_format,
+                std::string &body);
+
+private:
+   struct part
+   {
+      int z, x, y;
+      bool found;
+      // whether the metatile header flags the data as gzip compressed.
+      bool gzipped;
+      std::time_t last_modified;
+      std::string data;
+   };
+
+   struct batch
+   {
+      int64_t client_id;
+      protoFmt format;
+      bool accept_gzip;
+      std::vector<part> parts;
+      size_t waiting;
+   };
+
+   typedef std::map<int, batch> batch_map_t;
+   batch_map_t m_batches;
+   const size_t m_max_batches;
+   int m_next_id;
+};
+
+} // namespace rendermq
+
+#endif // TILE_BATCH_HPP
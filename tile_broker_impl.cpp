@@ -155,6 +155,7 @@ void send_tile_to_listeners(rendermq::task_queue &queue,
             string_const_range range = reader.get(tile_for_handler.x, tile_for_handler.y);
             // TODO: add error handling when range is zero?
             tile_for_handler.set_data(string(range.first,range.second));
+            tile_for_handler.data_gzipped = reader.initialized_ && reader.header_.gzipped();
          }
          frontend_rep.to(itr->second) << tile_for_handler;
       }
@@ -0,0 +1,229 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#include "tile_channel.hpp"
+
+#include <boost/foreach.hpp>
+#include <boost/format.hpp>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <sched.h>
+
+namespace rendermq
+{
+
+namespace
+{
+
+size_t round_up_pow2(size_t n)
+{
+   size_t p = 2;
+   while (p < n) { p <<= 1; }
+   return p;
+}
+
+// loads and stores of the positions and sequence numbers, with the 
+// barriers needed so that the tile pointer in a cell is only read 
+// after its sequence says it has been written.
+inline size_t load_acquire(const volatile size_t &v)
+{
+   const size_t x = v;
+   __sync_synchronize();
+   return x;
+}
+
+inline void store_release(volatile size_t &v, size_t x)
+{
+   __sync_synchronize();
+   v = x;
+}
+
+} // anonymous namespace
+
+tile_channel::tile_channel(size_t capacity)
+   : m_cells(round_up_pow2(capacity)), m_mask(m_cells.size() - 1)
+{
+   // each cell's sequence is the position at which it can next be 
+   // pushed to, and one more than that when it can be popped from.
+   for (size_t i = 0; i < m_cells.size(); ++i)
+   {
+      m_cells[i].sequence = i;
+      m_cells[i].tile = NULL;
+   }
+   m_push_pos.value = 0;
+   m_pop_pos.value = 0;
+
+   // semaphore mode, so that each read takes one tile's worth of 
+   // wakeup rather than all of them.
+   m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+   if (m_event_fd < 0)
+   {
+      throw std::runtime_error((boost::format("Unable to create eventfd for tile channel: %1%") 
+                                % strerror(errno)).str());
+   }
+}
+
+tile_channel::~tile_channel()
+{
+   tile_protocol *tile = NULL;
+   while ((tile = try_pop()) != NULL)
+   {
+      delete tile;
+   }
+   close(m_event_fd);
+}
+
+bool
+tile_channel::try_push(tile_protocol *tile)
+{
+   cell *c = NULL;
+   size_t pos = m_push_pos.value;
+   while (true)
+   {
+      c = &m_cells[pos & m_mask];
+      const intptr_t diff = intptr_t(load_acquire(c->sequence)) - intptr_t(pos);
+      if (diff == 0)
+      {
+         // the cell is free, try and claim it.
+         if (__sync_bool_compare_and_swap(&m_push_pos.value, pos, pos + 1)) { break; }
+         pos = m_push_pos.value;
+      }
+      else if (diff < 0)
+      {
+         // the cell still holds a tile from the last time around.
+         return false;
+      }
+      else
+      {
+         // another producer got this one first.
+         pos = m_push_pos.value;
+      }
+   }
+
+   c->tile = tile;
+   store_release(c->sequence, pos + 1);
+   return true;
+}
+
+tile_protocol *
+tile_channel::try_pop()
+{
+   cell *c = NULL;
+   size_t pos = m_pop_pos.value;
+   while (true)
+   {
+      c = &m_cells[pos & m_mask];
+      const intptr_t diff = intptr_t(load_acquire(c->sequence)) - intptr_t(pos + 1);
+      if (diff == 0)
+      {
+         if (__sync_bool_compare_and_swap(&m_pop_pos.value, pos, pos + 1)) { break; }
+         pos = m_pop_pos.value;
+      }
+      else if (diff < 0)
+      {
+         // nothing has been pushed here yet.
+         return NULL;
+      }
+      else
+      {
+         pos = m_pop_pos.value;
+      }
+   }
+
+   tile_protocol *tile = c->tile;
+   c->tile = NULL;
+   store_release(c->sequence, pos + m_mask + 1);
+   return tile;
+}
+
+bool
+tile_channel::push(tile_protocol *tile)
+{
+   if (!try_push(tile)) { return false; }
+
+   // the tile is in the channel before the wakeup is sent, so anyone
+   // woken by it will find a tile.
+   const uint64_t one = 1;
+   while ((write(m_event_fd, &one, sizeof(one)) < 0) && (errno == EINTR)) {}
+   return true;
+}
+
+tile_protocol *
+tile_channel::pop()
+{
+   uint64_t count = 0;
+   ssize_t n = 0;
+   while (((n = read(m_event_fd, &count, sizeof(count))) < 0) && (errno == EINTR)) {}
+   if (n != ssize_t(sizeof(count))) { return NULL; }
+
+   // there's a tile for each wakeup, but a producer which claimed an
+   // earlier cell than the one which woke us might not have finished
+   // filling it in yet, so it may take a moment to turn up.
+   tile_protocol *tile = NULL;
+   while ((tile = try_pop()) == NULL)
+   {
+      sched_yield();
+   }
+   return tile;
+}
+
+tile_channel_backlog::tile_channel_backlog(tile_channel &channel)
+   : m_channel(channel)
+{
+}
+
+tile_channel_backlog::~tile_channel_backlog()
+{
+   BOOST_FOREACH(tile_protocol *tile, m_waiting)
+   {
+      delete tile;
+   }
+}
+
+void
+tile_channel_backlog::push(tile_protocol *tile)
+{
+   flush();
+   if (!m_waiting.empty() || !m_channel.push(tile))
+   {
+      m_waiting.push_back(tile);
+   }
+}
+
+void
+tile_channel_backlog::flush()
+{
+   while (!m_waiting.empty() && m_channel.push(m_waiting.front()))
+   {
+      m_waiting.pop_front();
+   }
+}
+
+} // namespace rendermq
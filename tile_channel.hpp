@@ -0,0 +1,121 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TILE_CHANNEL_HPP
+#define TILE_CHANNEL_HPP
+
+#include "tile_protocol.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <vector>
+#include <list>
+#include <cstddef>
+
+namespace rendermq
+{
+
+/* a bounded queue of tiles between threads in the same process, which
+ * hands over ownership of heap-allocated tiles rather than serialising
+ * them through inproc sockets. any number of threads may push and pop
+ * at once without locking.
+ *
+ * the file descriptor becomes readable when there are tiles waiting,
+ * so it can go in a zmq::poll set alongside sockets. each tile pushed 
+ * makes it readable once, so with several consumers polling it each
+ * tile wakes just one of them.
+ */
+class tile_channel : private boost::noncopyable
+{
+public:
+   // the capacity is rounded up to a power of two.
+   explicit tile_channel(size_t capacity);
+
+   // deletes any tiles which were never popped.
+   ~tile_channel();
+
+   // fd to poll for ZMQ_POLLIN.
+   int fd() const { return m_event_fd; }
+
+   /* hand a tile over to the channel, returning false if it's full, in
+    * which case the caller still owns the tile.
+    */
+   bool push(tile_protocol *tile);
+
+   /* take a tile from the channel, which the caller then owns, or NULL
+    * if there wasn't one, e.g: because another consumer got it first.
+    * this doesn't block, so should be called when the fd is readable.
+    */
+   tile_protocol *pop();
+
+private:
+   struct cell
+   {
+      volatile size_t sequence;
+      tile_protocol *tile;
+   };
+
+   // keeps the positions written by producers and consumers on 
+   // separate cache lines.
+   struct position
+   {
+      volatile size_t value;
+      char pad[64 - sizeof(size_t)];
+   };
+
+   bool try_push(tile_protocol *tile);
+   tile_protocol *try_pop();
+
+   std::vector<cell> m_cells;
+   const size_t m_mask;
+   position m_push_pos, m_pop_pos;
+   int m_event_fd;
+};
+
+/* tiles waiting for room in a channel, for a producer which can 
+ * neither drop them nor wait. tiles are kept in order, so nothing
+ * overtakes what's already waiting. only to be used from one thread.
+ */
+class tile_channel_backlog : private boost::noncopyable
+{
+public:
+   explicit tile_channel_backlog(tile_channel &channel);
+   ~tile_channel_backlog();
+
+   // hand the tile over to the channel, or keep it until there's room.
+   void push(tile_protocol *tile);
+
+   // push as many of the waiting tiles as there's room for.
+   void flush();
+
+   bool empty() const { return m_waiting.empty(); }
+
+private:
+   tile_channel &m_channel;
+   std::list<tile_protocol *> m_waiting;
+};
+
+} // namespace rendermq
+
+#endif // TILE_CHANNEL_HPP
@@ -28,6 +28,9 @@
 #include "mongrel_request.hpp"
 #include "storage/meta_tile.hpp"
 #include "http/http_reply.hpp"
+#include "http/http_date_parser.hpp"
+#include "http/http_etag.hpp"
+#include "http/http_gzip.hpp"
 #include "dqueue/distributed_queue.hpp"
 #include "zstream.hpp"
 #include "zstream_pbuf.hpp"
@@ -47,6 +50,8 @@
 #include <boost/foreach.hpp>
 #include <boost/optional.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
 // stl
 #include <iostream>
@@ -67,11 +72,61 @@ using std::list;
 using std::runtime_error;
 namespace pt = boost::property_tree;
 
+// defaults for the options in the mongrel2 section of the config.
+#define DEFAULT_QUEUE_THRESHOLD_STALE (100)
+#define DEFAULT_QUEUE_THRESHOLD_SATISFY (500)
+#define DEFAULT_QUEUE_THRESHOLD_MAX (1000)
+#define DEFAULT_IO_MAX_CONCURRENCY (64)
+#define DEFAULT_LATENCY_LOG_INTERVAL (300)
+#define DEFAULT_HTTP_MAX_CONNECTIONS (10000)
+#define DEFAULT_HTTP_IDLE_TIMEOUT (30)
+#define DEFAULT_METATILE_CACHE_SIZE (0)
+#define DEFAULT_METATILE_CACHE_TTL (60)
+#define DEFAULT_LATENCY_TARGET (0)
+#define DEFAULT_LATENCY_ADJUST_INTERVAL (10)
+#define DEFAULT_NEGATIVE_CACHE_SIZE (0)
+#define DEFAULT_NEGATIVE_CACHE_MISS_TTL (5)
+#define DEFAULT_NEGATIVE_CACHE_FAIL_TTL (60)
+#define DEFAULT_BULK_DIRTY_RATE (50)
+#define DEFAULT_BULK_DIRTY_MAX_METATILES (1000000)
+#define DEFAULT_POPULARITY_WIDTH (0)
+#define DEFAULT_POPULARITY_HALF_LIFE (3600)
+#define DEFAULT_POPULARITY_TOP (1000)
+#define DEFAULT_BATCH_MAX_TILES (64)
+#define DEFAULT_RATE_LIMIT_SLOTS (0)
+#define DEFAULT_RATE_LIMIT_RATE (20)
+#define DEFAULT_RATE_LIMIT_BURST (200)
+#define DEFAULT_RATE_LIMIT_RENDER_COST (10)
+#define DEFAULT_STORAGE_QUEUE_SIZE (10000)
+#define DEFAULT_STORAGE_QUEUE_DEADLINE (0)
+
 // unless otherwise specified, the maximum zoom for any tile
 // layer. this can be overridden on a per-style basis in the
 // config file.
 #define DEFAULT_MAX_ZOOM (18)
 
+// poll loop timeout in microseconds when there's periodic work (such
+// as logging the latency stats) to be done by the main loop.
+#define HANDLER_POLL_TIMEOUT (1000000)
+
+// poll loop timeout in microseconds while bulk dirty jobs are feeding
+// the storage, so that they go at a steady pace rather than in bursts.
+#define BULK_DIRTY_POLL_TIMEOUT (100000)
+
+// how many bulk dirty jobs to keep track of, including finished ones.
+#define MAX_BULK_DIRTY_JOBS (100)
+
+// how many batches of tiles can be waiting for the storage at once.
+#define MAX_TILE_BATCHES (1000)
+
+// the number of tiles which can be waiting in each direction between 
+// the handler and the storage worker.
+#define STORAGE_CHANNEL_CAPACITY (4096)
+
+// poll timeout in microseconds while there are requests waiting for
+// room in the channel to the storage worker.
+#define STORAGE_BACKLOG_POLL_TIMEOUT (1000)
+
 namespace {
 
 inline bool old_tile(rendermq::tile_protocol const& tile, std::time_t delta)
@@ -83,12 +138,14 @@ const string mime_json("application/json;charset=UTF-8");
 const string mime_png("image/png");
 const string mime_jpg("image/jpeg");
 const string mime_gif("image/gif");
+const string mime_webp("image/webp");
 
 const string &mime_type_for(rendermq::protoFmt fmt) {
    switch (fmt) {
    case rendermq::fmtPNG:  return mime_png;
    case rendermq::fmtJPEG: return mime_jpg;
    case rendermq::fmtGIF: return mime_gif;
+   case rendermq::fmtWEBP: return mime_webp;
    case rendermq::fmtJSON: return mime_json;
    default:
       throw runtime_error("Ambiguous format in mime_type_for()");
@@ -122,6 +179,10 @@ rendermq::protoFmt parse_formats(const string &str)
       {
          fmts |= rendermq::fmtGIF;
       }
+      else if (fmt_name == "webp")
+      {
+         fmts |= rendermq::fmtWEBP;
+      }
       else if (fmt_name == "json")
       {
          fmts |= rendermq::fmtJSON;
@@ -153,58 +214,133 @@ namespace po = boost::program_options;
 
 namespace rendermq {
 
+tile_handler_config::tile_handler_config(const pt::ptree &conf)
+   : in_endpoint(conf.get<string>("mongrel2.in_endpoint", "ipc:///tmp/mongrel_send")),
+     out_endpoint(conf.get<string>("mongrel2.out_endpoint", "ipc:///tmp/mongrel_recv")),
+     max_age(conf.get<std::time_t>("mongrel2.max_age", 60*60*24)),
+     queue_threshold_stale(conf.get<size_t>("mongrel2.queue_threshold_stale", DEFAULT_QUEUE_THRESHOLD_STALE)),
+     queue_threshold_satisfy(conf.get<size_t>("mongrel2.queue_threshold_satisfy", DEFAULT_QUEUE_THRESHOLD_SATISFY)),
+     queue_threshold_max(conf.get<size_t>("mongrel2.queue_threshold_max", DEFAULT_QUEUE_THRESHOLD_MAX)),
+     stale_render_background(conf.get<bool>("mongrel2.stale_render_background", false)),
+     max_io_concurrency(conf.get<size_t>("mongrel2.max_io_concurrency", DEFAULT_IO_MAX_CONCURRENCY)),
+     tile_path_template(conf.get<string>("mongrel2.tile_path_template", "/tiles/1.0.0/{STYLE}/{Z}/{X}/{Y}.{FORMAT}")),
+     latency_status_path(conf.get<string>("mongrel2.latency_status_path", "")),
+     latency_log_interval(conf.get<std::time_t>("mongrel2.latency_log_interval", DEFAULT_LATENCY_LOG_INTERVAL)),
+     http_listen(conf.get<string>("mongrel2.http_listen", "")),
+     http_max_connections(conf.get<size_t>("mongrel2.http_max_connections", DEFAULT_HTTP_MAX_CONNECTIONS)),
+     http_idle_timeout(conf.get<std::time_t>("mongrel2.http_idle_timeout", DEFAULT_HTTP_IDLE_TIMEOUT)),
+     metatile_cache_size(conf.get<size_t>("mongrel2.metatile_cache_size", DEFAULT_METATILE_CACHE_SIZE)),
+     metatile_cache_ttl(conf.get<std::time_t>("mongrel2.metatile_cache_ttl", DEFAULT_METATILE_CACHE_TTL)),
+     latency_target(conf.get<uint64_t>("mongrel2.latency_target", DEFAULT_LATENCY_TARGET)),
+     latency_adjust_interval(conf.get<std::time_t>("mongrel2.latency_adjust_interval", DEFAULT_LATENCY_ADJUST_INTERVAL)),
+     negative_cache_size(conf.get<size_t>("mongrel2.negative_cache_size", DEFAULT_NEGATIVE_CACHE_SIZE)),
+     negative_cache_miss_ttl(conf.get<std::time_t>("mongrel2.negative_cache_miss_ttl", DEFAULT_NEGATIVE_CACHE_MISS_TTL)),
+     negative_cache_fail_ttl(conf.get<std::time_t>("mongrel2.negative_cache_fail_ttl", DEFAULT_NEGATIVE_CACHE_FAIL_TTL)),
+     bulk_dirty_path(conf.get<string>("mongrel2.bulk_dirty_path", "")),
+     bulk_dirty_key(conf.get<string>("mongrel2.bulk_dirty_key", "")),
+     bulk_dirty_rate(conf.get<double>("mongrel2.bulk_dirty_rate", DEFAULT_BULK_DIRTY_RATE)),
+     bulk_dirty_max_metatiles(conf.get<uint64_t>("mongrel2.bulk_dirty_max_metatiles", DEFAULT_BULK_DIRTY_MAX_METATILES)),
+     popularity_width(conf.get<size_t>("mongrel2.popularity_width", DEFAULT_POPULARITY_WIDTH)),
+     popularity_half_life(conf.get<std::time_t>("mongrel2.popularity_half_life", DEFAULT_POPULARITY_HALF_LIFE)),
+     popularity_top(conf.get<size_t>("mongrel2.popularity_top", DEFAULT_POPULARITY_TOP)),
+     popularity_status_path(conf.get<string>("mongrel2.popularity_status_path", "")),
+     batch_path(conf.get<string>("mongrel2.batch_path", "")),
+     batch_max_tiles(conf.get<size_t>("mongrel2.batch_max_tiles", DEFAULT_BATCH_MAX_TILES)),
+     rate_limit_slots(conf.get<size_t>("mongrel2.rate_limit_slots", DEFAULT_RATE_LIMIT_SLOTS)),
+     rate_limit_rate(conf.get<double>("mongrel2.rate_limit_rate", DEFAULT_RATE_LIMIT_RATE)),
+     rate_limit_burst(conf.get<double>("mongrel2.rate_limit_burst", DEFAULT_RATE_LIMIT_BURST)),
+     rate_limit_render_cost(conf.get<double>("mongrel2.rate_limit_render_cost", DEFAULT_RATE_LIMIT_RENDER_COST)),
+     storage_queue_size(conf.get<size_t>("mongrel2.storage_queue_size", DEFAULT_STORAGE_QUEUE_SIZE)),
+     storage_queue_deadline(conf.get<uint64_t>("mongrel2.storage_queue_deadline", DEFAULT_STORAGE_QUEUE_DEADLINE))
+{
+   const string proxies = conf.get<string>("mongrel2.rate_limit_trusted_proxies", "");
+   if (!proxies.empty()) {
+      boost::split(rate_limit_trusted_proxies, proxies, boost::is_any_of(", "), boost::token_compress_on);
+      rate_limit_trusted_proxies.erase("");
+   }
+}
+
 tile_handler::tile_handler(const string &handler_id, 
-                           const string &in_ep, 
-                           const string &out_ep,
-                           std::time_t max_age,
-                           size_t queue_threshold_stale,
-                           size_t queue_threshold_satisfy,
-                           size_t queue_threshold_max,
-                           bool stale_render_background,
-                           size_t max_io_threads,
                            const string &dqueue_config,
-                           const std::string& tile_path_template,
                            const pt::ptree &storage_conf,
                            const style_rules &rules,
-                           const map<string, list<string> > &dirty_list)
+                           const map<string, list<string> > &dirty_list,
+                           const tile_handler_config &config)
    : m_context(1), 
      m_socket_req(m_context, ZMQ_PULL), 
      m_socket_rep(m_context, ZMQ_PUB),
      m_str_handler_id(handler_id),
-     m_max_age(max_age), 
-     m_queue_threshold_stale(queue_threshold_stale),
-     m_queue_threshold_satisfy(queue_threshold_satisfy),
-     m_queue_threshold_max(queue_threshold_max),
-     m_stale_render_background(stale_render_background),
+     m_max_age(config.max_age), 
+     m_queue_control(config.queue_threshold_stale, config.queue_threshold_satisfy, 
+                     config.queue_threshold_max, config.latency_target * 1000, 
+                     config.latency_adjust_interval),
+     m_stale_render_background(config.stale_render_background),
      m_style_rules(rules),
      m_queue_runner(dqueue_config, m_context),
      m_storage_conf(storage_conf),
-     m_socket_storage_request(m_context),
-     m_socket_storage_results(m_context),
-     m_path_parse(tile_path_template)
+     m_storage_requests(STORAGE_CHANNEL_CAPACITY),
+     m_storage_results(STORAGE_CHANNEL_CAPACITY),
+     m_storage_backlog(m_storage_requests),
+     m_path_parse(config.tile_path_template),
+     m_mongrel_reply(m_socket_rep, m_str_mongrel_id),
+     m_reply(&m_mongrel_reply),
+     m_latency_status_path(config.latency_status_path),
+     m_latency_log_interval(config.latency_log_interval),
+     m_next_latency_log(std::time(0) + config.latency_log_interval),
+     m_negative(config.negative_cache_size, config.negative_cache_miss_ttl, 
+                config.negative_cache_fail_ttl),
+     m_dirty_list(dirty_list),
+     m_bulk_dirty(config.bulk_dirty_rate, MAX_BULK_DIRTY_JOBS),
+     m_bulk_dirty_path(config.bulk_dirty_key.empty() ? string() : config.bulk_dirty_path),
+     m_bulk_dirty_key(config.bulk_dirty_key),
+     m_bulk_dirty_max_metatiles(config.bulk_dirty_max_metatiles),
+     m_popularity(config.popularity_width, config.popularity_half_life, config.popularity_top),
+     m_popularity_top(config.popularity_top),
+     m_popularity_status_path(config.popularity_status_path),
+     m_batches(MAX_TILE_BATCHES),
+     m_batch_path(config.batch_path),
+     m_batch_max_tiles(config.batch_max_tiles),
+     m_rate_limit(config.rate_limit_slots, config.rate_limit_rate, config.rate_limit_burst, 
+                  config.rate_limit_render_cost),
+     m_trusted_proxies(config.rate_limit_trusted_proxies)
 {
    LOG_INFO(boost::format("Init tile handler with ID: %1%") % m_str_handler_id);
 
-   // connect the out socket to mongrel, so we've somewhere
-   // for requests to go if we happen to receive some the 
-   // instant we start up.
-   m_socket_rep.setsockopt(ZMQ_IDENTITY, m_str_handler_id.data(), m_str_handler_id.length());        
-   m_socket_rep.connect(out_ep.c_str());
+   if (!config.bulk_dirty_path.empty() && config.bulk_dirty_key.empty()) {
+      LOG_WARNING("Bulk dirty jobs are disabled, as no bulk_dirty_key is set.");
+   }
+
+   if (config.http_listen.empty()) {
+      // connect the out socket to mongrel, so we've somewhere
+      // for requests to go if we happen to receive some the 
+      // instant we start up.
+      m_socket_rep.setsockopt(ZMQ_IDENTITY, m_str_handler_id.data(), m_str_handler_id.length());        
+      m_socket_rep.connect(config.out_endpoint.c_str());
+   }
 
    // setup the queue runner
    m_queue_runner.default_handler(
       dqueue::runner::handler_function_t(
-         boost::bind(&tile_handler::reply_with_tile, this, _1)));
+         boost::bind(&tile_handler::handle_response_from_queue, this, _1)));
 
-   // connect input socket to mongrel server
-   m_socket_req.connect(in_ep.c_str());
+   if (config.http_listen.empty()) {
+      // connect input socket to mongrel server
+      m_socket_req.connect(config.in_endpoint.c_str());
+
+   } else {
+      // serve HTTP directly, and send the responses there too.
+      m_http_server.reset(
+         new http_server(config.http_listen, 
+                         boost::bind(&tile_handler::handle_request_from_http, this, _1),
+                         config.http_max_connections, config.http_idle_timeout));
+      m_reply = m_http_server.get();
+   }
       
-   // push and pull sockets for storage handling.
-   m_socket_storage_request.bind("inproc://storage_request_" + m_str_handler_id);
-   m_socket_storage_results.bind("inproc://storage_results_" + m_str_handler_id);
-   
    // start storage worker thread
-   m_ptr_storage_instance.reset(new storage_worker(m_context, storage_conf, m_str_handler_id, max_io_threads, dirty_list));
+   m_ptr_storage_instance.reset(new storage_worker(m_context, storage_conf, m_storage_requests, m_storage_results,
+                                                   config.max_io_concurrency, dirty_list,
+                                                   config.metatile_cache_size, config.metatile_cache_ttl,
+                                                   config.storage_queue_size, config.storage_queue_deadline));
    m_ptr_storage_thread.reset(new boost::thread(boost::ref(*m_ptr_storage_instance)));
 }
 
@@ -216,29 +352,62 @@ tile_handler::operator()() {
          //  Always poll for mongrel frontend activity
          { m_socket_req,  0, ZMQ_POLLIN, 0 }, 
          // always poll for storage component activity
-         { m_socket_storage_results.socket(), 0, ZMQ_POLLIN, 0 },
+         { NULL, m_storage_results.fd(), ZMQ_POLLIN, 0 },
          //  Poll tile
          { NULL, 0, ZMQ_POLLIN, 0 },
          { NULL, 0, ZMQ_POLLIN, 0 },
       };
     
+      // when serving HTTP directly, requests come from the server 
+      // rather than mongrel.
+      if (m_http_server) {
+         items[0].socket = NULL;
+         items[0].fd = m_http_server->fd();
+      }
+
       // for the moment assume there's only one pollitem for the distributed queue
       assert(m_queue_runner.num_pollitems() == 2);
       m_queue_runner.fill_pollitems(&items[2]);
     
+      // requests which couldn't be sent to the storage worker are 
+      // retried every time around.
+      m_storage_backlog.flush();
+
       // poll
       try {
-         zmq::poll(&items[0], 4, -1);
+         const bool periodic = (m_latency_log_interval > 0) || m_http_server;
+         zmq::poll(&items[0], 4, 
+                   !m_storage_backlog.empty() ? STORAGE_BACKLOG_POLL_TIMEOUT :
+                   m_bulk_dirty.active() ? BULK_DIRTY_POLL_TIMEOUT : 
+                   (periodic ? HANDLER_POLL_TIMEOUT : -1));
       } catch (const zmq::error_t &) {
          // ignore and loop...
          continue;
       }
+
+      if (m_http_server) {
+         m_http_server->close_idle(std::time(0));
+      }
+
+      if (m_bulk_dirty.active()) {
+         release_bulk_dirty();
+      }
+
+      if ((m_latency_log_interval > 0) && (std::time(0) >= m_next_latency_log)) {
+         m_latency.log();
+         m_queue_control.log();
+         m_next_latency_log = std::time(0) + m_latency_log_interval;
+      }
     
-      // handle request from mongrel
+      // handle request from mongrel, or the HTTP server
       if (items[0].revents & ZMQ_POLLIN) {
          // this will either send a request to the storage component, or 
          // return an error to the user. either way, it shouldn't take long.
-         handle_request_from_mongrel();
+         if (m_http_server) {
+            m_http_server->handle_events();
+         } else {
+            handle_request_from_mongrel();
+         }
       }
                 
       // handle response from the storage component
@@ -249,15 +418,60 @@ tile_handler::operator()() {
       } 
                 
       // handle response from broker
-      else {
+      else if ((items[2].revents | items[3].revents) & ZMQ_POLLIN) {
          m_queue_runner.handle_pollitems(&items[2]);
       }
    }
 }
 
+void
+tile_handler::handle_response_from_queue(const tile_protocol &tile) {
+   tile_trace trace(tile.trace);
+   trace.mark(traceBrokerReply);
+   // tiles coming back from the broker are cut from the worker's metatile,
+   // and any digest is from whatever was in storage when the request went
+   // out, so work out the digest of what actually came back.
+   tile_protocol reply(tile);
+   reply.digest = reply.data().empty() ? 0 : tile_digest(reply.data().data(), reply.data().size());
+
+   // a tile which can't be rendered, or renders as nothing, will be 
+   // the same the next time it's asked for, so remember that for a
+   // while. otherwise it's not missing any more.
+   if (m_negative.enabled() && (reply.id >= 0)) {
+      if (reply.status == cmdNotDone) {
+         m_negative.insert(reply, negativeFailed, std::time(0));
+         send_404(*m_reply, reply.id);
+         record_latency(reply.style, trace);
+         return;
+
+      } else if (((reply.status == cmdDone) || (reply.status == cmdIgnore)) &&
+                 reply.data().empty() && !reply.not_modified()) {
+         m_negative.insert(reply, negativeEmpty, std::time(0));
+         send_204(*m_reply, reply.id, m_negative.fail_ttl());
+         record_latency(reply.style, trace);
+         return;
+      }
+
+      m_negative.invalidate(reply);
+   }
+
+   // this is how long the client has been kept waiting for the render,
+   // which is what the queue thresholds are there to control.
+   const uint64_t received = trace.at(traceReceived), replied = trace.at(traceBrokerReply);
+   if ((received > 0) && (replied > received)) {
+      m_queue_control.record_render(tile.style, replied - received);
+   }
+   reply_with_tile(reply, trace);
+}
+
+void
+tile_handler::record_latency(const string &style, tile_trace trace) {
+   trace.mark(traceHttpSend);
+   m_latency.record(style, trace);
+}
+
 void 
-tile_handler::reply_with_tile(const tile_protocol &tile) {
-   string send_id = (boost::format("%d") % tile.id).str();         
+tile_handler::reply_with_tile(const tile_protocol &tile, const tile_trace &trace) {
    std::time_t current_time = std::time(0);
 
    if (tile.id < 0) {
@@ -265,9 +479,9 @@ tile_handler::reply_with_tile(const tile_protocol &tile) {
       return;
    }
 
-   /* tile is done, has data & is OK */
+   /* tile is done, has data (or the client has it already) & is OK */
    if ((tile.status == cmdDone || tile.status == cmdIgnore) &&
-       (tile.data().size() > 0)) {
+       (tile.not_modified() || (tile.data().size() > 0))) {
       // always assume that the tile is good for another max_age seconds.
       std::time_t expire_time = current_time + m_max_age;
       // what's the expected mime type returned?
@@ -275,28 +489,58 @@ tile_handler::reply_with_tile(const tile_protocol &tile) {
                 
       /* tile modified data is younger than last modified header, 
          or last modified header doesn't exist */
-      if ((tile.request_last_modified == 0) || 
-          (tile.last_modified < tile.request_last_modified)) {
-         send_tile(m_socket_rep, m_date_format, m_str_mongrel_id, send_id, 
-                   m_max_age, tile.last_modified, expire_time, tile.data(), 
-                   mime_type);
+      if (!tile.not_modified()) {
+         // tiles may be stored compressed, as flagged in their metatile
+         // header, in which case they're sent that way to any client
+         // which accepts it.
+         if (tile.data_gzipped) {
+            string data;
+            if (tile.accept_gzip) {
+               send_tile(*m_reply, m_date_format, tile.id, 
+                         m_max_age, tile.last_modified, expire_time, tile.data(), 
+                         mime_type, tile.digest, encodingGzip);
+
+            } else if (gunzip(tile.data(), data)) {
+               send_tile(*m_reply, m_date_format, tile.id, 
+                         m_max_age, tile.last_modified, expire_time, data, 
+                         mime_type, tile.digest, encodingGunzipped);
+
+            } else {
+               send_500(*m_reply, tile.id);
+               LOG_ERROR(boost::format("Couldn't decompress JSON tile %1%.") % tile);
+            }
+            
+         } else {
+            send_tile(*m_reply, m_date_format, tile.id, 
+                      m_max_age, tile.last_modified, expire_time, tile.data(), 
+                      mime_type, tile.digest);
+         }
                         
+      } else if (tile.request_digest != 0) {
+         // not modified, and the client has the body for this tag.
+         send_304(*m_reply, tile.id, current_time, m_date_format, mime_type, tile.digest, 
+                  tile.request_etag_gzip ? encodingGzip : encodingPlain);
+
       } else {
-         // not modified
-         send_304(m_socket_rep, m_str_mongrel_id, send_id,
-                  current_time, m_date_format, mime_type);
+         // not modified by date. without the data it isn't known which
+         // encoding a JSON tile would have been sent in, so its tag 
+         // would be a guess.
+         send_304(*m_reply, tile.id, current_time, m_date_format, mime_type, 
+                  (tile.format == fmtJSON) ? 0 : tile.digest);
       }
    } else {
       // something bad happened, return a server error status
-      send_500(m_socket_rep, m_str_mongrel_id, send_id);
+      send_500(*m_reply, tile.id);
       // log this out too...
       LOG_ERROR(boost::format("tile received from broker is %1% and has status "
                               "!= done/ignore or zero size.") % tile);
    }
+   record_latency(tile.style, trace);
 }
 
 void 
 tile_handler::handle_request_from_mongrel() {
+   const uint64_t received = tile_trace::now();
    int64_t more;
    size_t more_size = sizeof (more);
    zmq::message_t msg;
@@ -309,51 +553,232 @@ tile_handler::handle_request_from_mongrel() {
       if (!more) break;
    }               
         
-   // process last message
-   string txt((char*)msg.data(),msg.size());
-   mongrel_request request;                
+   // process last message. the handler only needs a few bits of the
+   // request, so just scan the message in place rather than parsing
+   // all the headers.
+   request_scanner request;
         
-   if (m_request_parse(request, txt)) {
-      tile_protocol tile;
-      if (m_path_parse(tile, request.path()) && 
-          m_style_rules.rewrite_and_check(tile)) {
-         // need to store the ID of the client in with the tile request so
-         // that when/if the data comes back we know where to tell mongrel
-         // to send it to.
-         tile.id = boost::lexical_cast<int>(request.id());
-
-         // need to store the id of the mongrel server too? we really 
-         // should, in case multiple mongrel servers are being used. but
-         // for the moment, just assume it's true.
-         if (m_str_mongrel_id.empty()) {
-            m_str_mongrel_id = request.uuid();
+   if (request.scan(static_cast<const char *>(msg.data()), msg.size())) {
+      // need to store the id of the mongrel server too? we really 
+      // should, in case multiple mongrel servers are being used. but
+      // for the moment, just assume it's true.
+      if (m_str_mongrel_id.empty()) {
+         m_str_mongrel_id.assign(request.uuid().begin(), request.uuid().end());
 #ifdef RENDERMQ_DEBUG
-         } else {
-            assert(m_str_mongrel_id == request.uuid());
+      } else {
+         assert(m_str_mongrel_id == string(request.uuid().begin(), request.uuid().end()));
 #endif
+      }
+
+      optional<string> if_modified_since, if_none_match, accept_encoding, forwarded_for,
+         authorization;
+      request_scanner::range_t value;
+      if (request.header("if-modified-since", value)) {
+         if_modified_since = string(value.begin(), value.end());
+      }
+      if (request.header("if-none-match", value)) {
+         if_none_match = string(value.begin(), value.end());
+      }
+      if (request.header("accept-encoding", value)) {
+         accept_encoding = string(value.begin(), value.end());
+      }
+      if (request.header("x-forwarded-for", value)) {
+         forwarded_for = string(value.begin(), value.end());
+      }
+      if (request.header("authorization", value)) {
+         authorization = string(value.begin(), value.end());
+      }
+
+      string query;
+      if (request.header("query", value)) {
+         query.assign(value.begin(), value.end());
+      }
+
+      // mongrel2 puts the peer's address in X-Forwarded-For itself. 
+      // if it's missing, or repeated so that it comes as a list, then
+      // the best that can be done is to limit each connection.
+      string client;
+      if (m_rate_limit.enabled()) {
+         client = rate_limiter::client_key(forwarded_for, "", m_trusted_proxies);
+         if (client.empty()) {
+            client = (boost::format("conn:%1%") % request.id_number()).str();
          }
+      }
 
-         // send request to storage, see if the tile has already been
-         // cached.
-         m_socket_storage_request << tile;
-                        
-      } else {
-         std::string path = request.path();
-         // sanitize URL before logging it
-         std::replace_if(path.begin(), path.end(), !(boost::is_alnum() || boost::is_any_of("/.,|")), '_');
-         LOG_WARNING(boost::format("Can not parse tile URL '%1%'. Sending 404...") % path);
-         send_404(m_socket_rep, request.uuid(), request.id());
+      handle_request(received, string(request.path().begin(), request.path().end()), query,
+                     request.id_number(), client, if_modified_since, if_none_match, 
+                     accept_encoding, authorization);
+   }
+}
+
+void
+tile_handler::handle_request_from_http(const http_server::request &request) {
+   const uint64_t received = tile_trace::now();
+   optional<string> if_modified_since, if_none_match, accept_encoding, forwarded_for,
+      authorization;
+   string value;
+   if (request.header("if-modified-since", value)) {
+      if_modified_since = value;
+   }
+   if (request.header("if-none-match", value)) {
+      if_none_match = value;
+   }
+   if (request.header("accept-encoding", value)) {
+      accept_encoding = value;
+   }
+   if (request.header("x-forwarded-for", value)) {
+      forwarded_for = value;
+   }
+   if (request.header("authorization", value)) {
+      authorization = value;
+   }
+
+   string client;
+   if (m_rate_limit.enabled()) {
+      client = rate_limiter::client_key(forwarded_for, request.remote_addr, m_trusted_proxies);
+   }
+
+   handle_request(received, request.path, request.query, request.id, client,
+                  if_modified_since, if_none_match, accept_encoding, authorization);
+}
+
+void
+tile_handler::handle_request(uint64_t received, const string &path, 
+                             const string &query, int64_t id,
+                             const string &client,
+                             const optional<string> &if_modified_since,
+                             const optional<string> &if_none_match,
+                             const optional<string> &accept_encoding,
+                             const optional<string> &authorization) {
+   tile_protocol tile;
+   unsigned retry_after = 0;
+
+   if (!m_latency_status_path.empty() && 
+       (path == m_latency_status_path)) {
+      std::ostringstream ostr;
+      m_latency.report(ostr);
+      m_queue_control.report(ostr);
+      m_negative.report(ostr);
+      m_rate_limit.report(ostr);
+      m_ptr_storage_instance->report(ostr);
+      send_reply(*m_reply, id, 200, ostr.str());
+
+   } else if (!m_popularity_status_path.empty() && 
+              (path == m_popularity_status_path)) {
+      std::ostringstream ostr;
+      m_popularity.report(ostr, m_popularity_top);
+      send_reply(*m_reply, id, 200, ostr.str());
+
+   } else if (m_rate_limit.enabled() && 
+              !m_rate_limit.admit(client, 1.0, received, retry_after)) {
+      // this client has been asking for too much, so turn it away
+      // before it costs a storage lookup or a render.
+      send_429(*m_reply, id, retry_after);
+
+   } else if (!m_bulk_dirty_path.empty() && 
+       ((path == m_bulk_dirty_path) || boost::starts_with(path, m_bulk_dirty_path + "/"))) {
+      handle_bulk_dirty(path, query, id, authorization);
+
+   } else if (!m_batch_path.empty() && (path == m_batch_path)) {
+      handle_batch(query, id, client, accept_encoding && accepts_gzip(*accept_encoding));
+
+   } else if (m_path_parse(tile, path) && 
+              m_style_rules.rewrite_and_check(tile)) {
+      tile.trace.set(traceReceived, received);
+      tile.trace.mark(traceParsed);
+
+      // need to store the ID of the client in with the tile request so
+      // that when/if the data comes back we know where to send it to.
+      tile.id = id;
+
+      // pass on the client's cached copy time, if it has one, so that
+      // a 304 can be sent rather than the whole tile.
+      if (if_modified_since) {
+         std::time_t ims_time;
+         if (parse_http_date(ims_time, *if_modified_since)) {
+            tile.request_last_modified = ims_time;
+         }
       }
+      if (accept_encoding) {
+         tile.accept_gzip = accepts_gzip(*accept_encoding);
+      }
+      if (if_none_match) {
+         // a tag for the gzip encoded body doesn't match what a client
+         // which no longer accepts gzip would be sent.
+         uint64_t digest;
+         bool gzip_etag;
+         if (parse_etag(digest, gzip_etag, *if_none_match) && 
+             (tile.accept_gzip || !gzip_etag)) {
+            tile.request_digest = digest;
+            tile.request_etag_gzip = gzip_etag;
+         }
+      }
+
+      // tiles which recently couldn't be served can be answered, or
+      // sent for rendering, without asking the storage again.
+      if (tile.status == cmdDirty) {
+         invalidate_negative(tile);
+
+      } else if (tile.status != cmdStatus) {
+         m_popularity.record(tile, std::time(0));
+
+         const negativeKind known = m_negative.lookup(tile, std::time(0));
+         if (known == negativeFailed) {
+            send_404(*m_reply, id);
+            record_latency(tile.style, tile.trace);
+            return;
+
+         } else if (known == negativeEmpty) {
+            send_204(*m_reply, id, m_negative.fail_ttl());
+            record_latency(tile.style, tile.trace);
+            return;
+
+         } else if (known == negativeMissing) {
+            m_rate_limit.charge(client, m_rate_limit.render_cost() - 1.0, received);
+            tile.status = cmdNotDone;
+            handle_missing_tile(tile);
+            return;
+         }
+      }
+
+      // send request to storage, see if the tile has already been
+      // cached.
+      m_rate_limit.pending(id, received, client);
+      send_to_storage(tile);
+                        
+   } else {
+      std::string clean_path = path;
+      // sanitize URL before logging it
+      std::replace_if(clean_path.begin(), clean_path.end(), !(boost::is_alnum() || boost::is_any_of("/.,|")), '_');
+      LOG_WARNING(boost::format("Can not parse tile URL '%1%'. Sending 404...") % clean_path);
+      send_404(*m_reply, id);
    }
 }
 
 void 
 tile_handler::handle_response_from_storage() {
-   tile_protocol tile;
-   m_socket_storage_results >> tile;
+   boost::scoped_ptr<tile_protocol> result(m_storage_results.pop());
+   if (!result) {
+      return;
+   }
+   tile_protocol &tile = *result;
+
+   // requests which turn out to need rendering cost their client more
+   // than those which can be answered from storage.
+   string client;
+   if ((tile.status != cmdMetatile) && (bulk_dirty_jobs::job_for_tile(tile.id) == 0) &&
+       m_rate_limit.finish(tile.id, tile.trace.at(traceReceived), client) && !tile.dropped &&
+       ((tile.status == cmdNotDone) || (tile.status == cmdDirty))) {
+      m_rate_limit.charge(client, m_rate_limit.render_cost() - 1.0, tile_trace::now());
+   }
   
-   if (tile.status == cmdStatus) {
-      string send_id = (boost::format("%d") % tile.id).str(); 
+   if (tile.dropped) {
+      handle_dropped_by_storage(tile);
+
+   } else if (tile.status == cmdMetatile) {
+      handle_batch_metatile(tile);
+
+   } else if (tile.status == cmdStatus) {
       // request was for status, so the tile metadata will tell us what
       // the response should be.
       if (tile.last_modified > 0) 
@@ -361,33 +786,59 @@ tile_handler::handle_response_from_storage() {
          // tile is present, and has a last-modified time
          std::stringstream txt;
          txt << "Tile last modified: " << std::asctime(std::gmtime(&tile.last_modified));
-         send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, txt.str());
+         send_reply(*m_reply, tile.id, 200, txt.str());
          
       } 
       else if (tile.data().size() > 0) 
       {
          // tile is present, but has been expired.
-         send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, "Tile marked as dirty.");
+         send_reply(*m_reply, tile.id, 200, "Tile marked as dirty.");
          
       } 
       else 
       {
          // tile isn't present.
-         send_404(m_socket_rep, m_str_mongrel_id, send_id);
+         send_404(*m_reply, tile.id);
       }
+      record_latency(tile.style, tile.trace);
+
+   } else if (bulk_dirty_jobs::job_for_tile(tile.id) > 0) {
+      // a slice of metatiles from a bulk dirty job has been expired, so
+      // queue them for re-rendering unless the queue is already too 
+      // long. if it is, they'll get rendered when next asked for anyway.
+      // if the storage couldn't expire them they go back to the job.
+      vector<tile_protocol> metatiles;
+      bulk_dirty_jobs::slice_tiles(tile, metatiles);
+      if (tile.status != cmdDirty) {
+         m_bulk_dirty.retry(bulk_dirty_jobs::job_for_tile(tile.id), metatiles);
+         return;
+      }
+      uint64_t queued = 0;
+      BOOST_FOREACH(tile_protocol &metatile, metatiles) {
+         if (m_queue_runner.queue_length() < m_queue_control.threshold_max(metatile.style)) {
+            metatile.status = cmdRenderBulk;
+            metatile.id = -1;
+            send_to_queue(metatile);
+            ++queued;
+         }
+      }
+      m_bulk_dirty.expired(bulk_dirty_jobs::job_for_tile(tile.id), metatiles.size(), queued);
 
    } else if (tile.status == cmdDirty) {
-      string send_id = (boost::format("%d") % tile.id).str(); 
 
-      if (m_queue_runner.queue_length() >= m_queue_threshold_max)
+      if (m_queue_runner.queue_length() >= m_queue_control.threshold_max(tile.style))
       {
          // send a 503 - queue is too long to send anything to.
-         send_503(m_socket_rep, m_str_mongrel_id, send_id);
+         m_queue_control.decided(tile.style, decisionReject);
+         send_503(*m_reply, tile.id);
+         record_latency(tile.style, tile.trace);
       }
       else
       {
+         m_queue_control.decided(tile.style, decisionDirty);
          string txt("Tile submitted for rendering...");
-         send_reply(m_socket_rep, m_str_mongrel_id, send_id, 200, txt);
+         send_reply(*m_reply, tile.id, 200, txt);
+         record_latency(tile.style, tile.trace);
 
          tile.status = cmdRenderBulk;
          tile.set_data("");
@@ -395,41 +846,21 @@ tile_handler::handle_response_from_storage() {
          send_to_queue(tile);
       }
    } else if (tile.status == cmdNotDone) {
-      // tile isn't available - have to render it, if there are resources
-      // available to do it.
-      if (m_queue_runner.queue_length() >= m_queue_threshold_max) 
-      {
-         // send 503 (service unavailable) to indicate overload.
-         string send_id = (boost::format("%d") % tile.id).str(); 
-         send_503(m_socket_rep, m_str_mongrel_id, send_id);
-
-      } 
-      else if (m_queue_runner.queue_length() >= m_queue_threshold_satisfy)
-      {
-         // render the tile in the background and tell the client that
-         // it's not ready yet.
-         string send_id = (boost::format("%d") % tile.id).str(); 
-         send_202(m_socket_rep, m_str_mongrel_id, send_id);
-
-         tile.status = cmdRenderBulk;
-         tile.set_data("");
-         tile.id = -1;
-         send_to_queue(tile);
-
-      } 
-      else 
-      {
-         // render the tile (and have the client wait for the response)
-         tile.status = cmdRender;
-         send_to_queue(tile);
-      } 
+      // remember that the storage doesn't have it, so that other 
+      // requests for it don't have to ask again while it's rendered.
+      m_negative.insert(tile, negativeMissing, std::time(0));
+      handle_missing_tile(tile);
 
    } else {
       // check if tile is fresh
-      if ((tile.status == cmdDone) ||
-          (m_queue_runner.queue_length() >= m_queue_threshold_stale))
+      if (tile.status == cmdDone)
+      {
+         reply_with_tile(tile, tile.trace);
+      }
+      else if (m_queue_runner.queue_length() >= m_queue_control.threshold_stale(tile.style))
       {
-         reply_with_tile(tile);
+         m_queue_control.decided(tile.style, decisionStale);
+         reply_with_tile(tile, tile.trace);
       }
       else
       {
@@ -438,12 +869,13 @@ tile_handler::handle_response_from_storage() {
          // that up-to-date data isn't always what's being served.
          if (m_stale_render_background)
          {
-            reply_with_tile(tile);
+            reply_with_tile(tile, tile.trace);
             // don't background render when the queue is very long. this
             // prevents queue overload when a very large area has been
             // expired.
-            if (m_queue_runner.queue_length() < m_queue_threshold_stale)
+            if (m_queue_runner.queue_length() < m_queue_control.threshold_stale(tile.style))
             {
+               m_queue_control.decided(tile.style, decisionStaleBackground);
                tile.status = cmdRenderBulk;
                tile.set_data("");
                tile.id = -1;
@@ -453,6 +885,7 @@ tile_handler::handle_response_from_storage() {
          else 
          {
             // otherwise render the tile and wait for the result.
+            m_queue_control.decided(tile.style, decisionRender);
             tile.status = cmdRender;
             send_to_queue(tile);
          }            
@@ -460,6 +893,217 @@ tile_handler::handle_response_from_storage() {
    }       
 }
 
+void
+tile_handler::handle_dropped_by_storage(tile_protocol &tile) {
+   if (tile.status == cmdMetatile) {
+      // the batch is sent back without these tiles, rather than 
+      // waiting any longer for them.
+      handle_batch_metatile(tile);
+
+   } else if (bulk_dirty_jobs::job_for_tile(tile.id) > 0) {
+      // the slice was turned away by a full queue without being 
+      // expired, so its metatiles go back to the job to try again.
+      vector<tile_protocol> metatiles;
+      bulk_dirty_jobs::slice_tiles(tile, metatiles);
+      m_bulk_dirty.retry(bulk_dirty_jobs::job_for_tile(tile.id), metatiles);
+
+   } else if (tile.id > 0) {
+      send_503(*m_reply, tile.id);
+      record_latency(tile.style, tile.trace);
+   }
+}
+
+void
+tile_handler::invalidate_negative(const tile_protocol &tile) {
+   m_negative.invalidate(tile);
+
+   // styles which depend on this one are being dirtied too.
+   map<string, list<string> >::const_iterator itr = m_dirty_list.find(tile.style);
+   if (itr != m_dirty_list.end()) {
+      BOOST_FOREACH(const string &style, itr->second) {
+         tile_protocol dependent_tile(tile);
+         dependent_tile.style = style;
+         m_negative.invalidate(dependent_tile);
+      }
+   }
+}
+
+void
+tile_handler::handle_bulk_dirty(const string &path, const string &query, int64_t id,
+                                const optional<string> &authorization) {
+   std::ostringstream ostr;
+
+   if (!authorization || (*authorization != "Bearer " + m_bulk_dirty_key)) {
+      send_403(*m_reply, id, "A valid bulk dirty key must be given.");
+
+   } else if (path == m_bulk_dirty_path) {
+      string style, error;
+      shared_ptr<dirty_region> region;
+      int max_zoom = 0;
+
+      if (!parse_dirty_query(query, style, region, error)) {
+         send_400(*m_reply, id, error);
+
+      } else if (!m_style_rules.rewrite_and_check_style(style, max_zoom)) {
+         send_400(*m_reply, id, "Unknown style " + style + ".");
+
+      } else if (region->max_zoom() > max_zoom) {
+         send_400(*m_reply, id, (boost::format("The style only goes up to zoom %1%.") % max_zoom).str());
+
+      } else if (metatile_enumerator(*region).bound() > m_bulk_dirty_max_metatiles) {
+         send_400(*m_reply, id, (boost::format("The region covers more than %1% metatiles.") 
+                                 % m_bulk_dirty_max_metatiles).str());
+
+      } else {
+         const int job = m_bulk_dirty.add(style, *region);
+         LOG_INFO(boost::format("Started bulk dirty job %1% for style %2%: %3%") % job % style % query);
+         m_bulk_dirty.report(job, ostr);
+         send_reply(*m_reply, id, 200, ostr.str());
+      }
+
+   } else {
+      // the rest of the path is the job id.
+      int job = 0;
+      try {
+         job = boost::lexical_cast<int>(path.substr(m_bulk_dirty_path.size() + 1));
+      } catch (const boost::bad_lexical_cast &) {
+      }
+
+      if ((job > 0) && m_bulk_dirty.report(job, ostr)) {
+         send_reply(*m_reply, id, 200, ostr.str());
+      } else {
+         send_404(*m_reply, id);
+      }
+   }
+}
+
+namespace {
+// whether the queue is short enough to take more bulk work for the
+// style, for which the point at which clients start getting 202s is
+// a reasonable limit.
+bool can_feed_bulk_dirty(const dqueue::runner &queue, const queue_controller &control,
+                         const string &style) {
+   return queue.queue_length() < control.threshold_satisfy(style);
+}
+} // anonymous namespace
+
+void
+tile_handler::release_bulk_dirty() {
+   vector<tile_protocol> batch;
+   m_bulk_dirty.release(tile_trace::now(), 
+                        boost::bind(&can_feed_bulk_dirty, boost::cref(m_queue_runner),
+                                    boost::cref(m_queue_control), _1),
+                        batch);
+
+   BOOST_FOREACH(const tile_protocol &tile, batch) {
+      invalidate_negative(tile);
+   }
+
+   // the storage worker expires each job's slice of metatiles, and 
+   // their dependent styles, in one go and sends it back to be queued
+   // for rendering.
+   vector<tile_protocol> slices;
+   bulk_dirty_jobs::make_slices(batch, slices);
+   BOOST_FOREACH(tile_protocol &slice, slices) {
+      send_to_storage(slice);
+   }
+}
+
+void
+tile_handler::handle_batch(const string &query, int64_t id, const string &client,
+                           bool accept_gzip) {
+   vector<tile_protocol> tiles;
+   string error;
+
+   if (!parse_batch_query(query, m_batch_max_tiles, tiles, error)) {
+      send_400(*m_reply, id, error);
+      return;
+   }
+
+   // a batch costs its client as much as asking for each tile.
+   m_rate_limit.charge(client, double(tiles.size()) - 1.0, tile_trace::now());
+
+   BOOST_FOREACH(tile_protocol &tile, tiles) {
+      if (!m_style_rules.rewrite_and_check(tile)) {
+         send_400(*m_reply, id, (boost::format("Tile %1%/%2%/%3% isn't available in that style "
+                                               "and format.") % tile.z % tile.x % tile.y).str());
+         return;
+      }
+      tile.accept_gzip = accept_gzip;
+      m_popularity.record(tile, std::time(0));
+   }
+
+   if (m_batches.full()) {
+      send_503(*m_reply, id);
+      return;
+   }
+
+   // each metatile is read from storage just once, whichever of its
+   // tiles were asked for.
+   vector<tile_protocol> requests;
+   m_batches.add(id, tiles, requests);
+   BOOST_FOREACH(tile_protocol &request, requests) {
+      send_to_storage(request);
+   }
+}
+
+void
+tile_handler::handle_batch_metatile(tile_protocol &tile) {
+   // a metatile which is missing or expired is re-rendered in the 
+   // background if there's room in the queue, so that it'll be there
+   // the next time the client asks.
+   if (!tile.dropped && ((tile.data().empty()) || (tile.last_modified == 0)) &&
+       (m_queue_runner.queue_length() < m_queue_control.threshold_satisfy(tile.style))) {
+      tile_protocol render(tile);
+      render.status = cmdRenderBulk;
+      render.set_data("");
+      render.id = -1;
+      send_to_queue(render);
+   }
+
+   const int batch = int(tile.id);
+   if (m_batches.fill(tile)) {
+      string body;
+      const int64_t id = m_batches.take(batch, m_date_format, body);
+      send_multipart(*m_reply, id, tile_batches::boundary, body);
+   }
+}
+
+void
+tile_handler::handle_missing_tile(tile_protocol &tile) {
+   // tile isn't available - have to render it, if there are resources
+   // available to do it.
+   if (m_queue_runner.queue_length() >= m_queue_control.threshold_max(tile.style)) 
+   {
+      // send 503 (service unavailable) to indicate overload.
+      m_queue_control.decided(tile.style, decisionReject);
+      send_503(*m_reply, tile.id);
+      record_latency(tile.style, tile.trace);
+
+   } 
+   else if (m_queue_runner.queue_length() >= m_queue_control.threshold_satisfy(tile.style))
+   {
+      // render the tile in the background and tell the client that
+      // it's not ready yet.
+      m_queue_control.decided(tile.style, decisionSatisfy);
+      send_202(*m_reply, tile.id);
+      record_latency(tile.style, tile.trace);
+
+      tile.status = cmdRenderBulk;
+      tile.set_data("");
+      tile.id = -1;
+      send_to_queue(tile);
+
+   } 
+   else 
+   {
+      // render the tile (and have the client wait for the response)
+      m_queue_control.decided(tile.style, decisionRender);
+      tile.status = cmdRender;
+      send_to_queue(tile);
+   }
+}
+
 style_rules::style_rules(const pt::ptree &conf)
 {
    // see if there are any style rewrite rules
@@ -525,6 +1169,22 @@ style_rules::style_rules(const pt::ptree &conf)
    }
 }
 
+bool
+style_rules::rewrite_and_check_style(string &style, int &max_zoom) const
+{
+   map<string, string>::const_iterator rewrite_itr = m_rewrites.find(style);
+   if (rewrite_itr != m_rewrites.end())
+   {
+      style = rewrite_itr->second;
+   }
+
+   map<string, int>::const_iterator zoom_itr = m_zoom_limits.find(style);
+   max_zoom = (zoom_itr != m_zoom_limits.end()) ? zoom_itr->second : DEFAULT_MAX_ZOOM;
+
+   // as for tiles, no formats section means all styles are allowed.
+   return m_formats.empty() || (m_formats.count(style) > 0);
+}
+
 bool
 style_rules::rewrite_and_check(tile_protocol &tile) const
 {
@@ -578,6 +1238,10 @@ tile_handler::send_to_queue(rendermq::tile_protocol &tile)
 
    tile.priority = tile.get_priority(); // base priority from command
    tile.priority += m_storage_conf.get(pt::path(tile.style + ".priority", '/'), 0); // plus optional style priority
+   if (tile.status == cmdRenderBulk) {
+      tile.priority += m_popularity.priority(tile); // plus popularity for background renders
+   }
+   tile.trace.mark(traceQueueSend);
 
    try
    {
@@ -601,11 +1265,19 @@ tile_handler::send_to_queue(rendermq::tile_protocol &tile)
    // it, then send an error back to the client.
    if (error && tile.id > 0)
    {
-      string send_id = (boost::format("%d") % tile.id).str(); 
-      send_404(m_socket_rep, m_str_mongrel_id, send_id);
+      send_404(*m_reply, tile.id);
    }
 }
 
+void
+tile_handler::send_to_storage(const tile_protocol &tile)
+{
+   // requests don't carry any tile data, so they're cheap to copy. 
+   // the storage worker owns the copy from here on, and hands it back
+   // with the result in it.
+   m_storage_backlog.push(new tile_protocol(tile));
+}
+
 } // namespace rendermq
 
 
@@ -33,14 +33,26 @@
 #include "tile_path_parser.hpp"
 #include "mongrel_request_parser.hpp"
 #include "http/http_date_formatter.hpp"
+#include "http/http_reply.hpp"
+#include "http/http_server.hpp"
+#include "latency_stats.hpp"
+#include "queue_controller.hpp"
+#include "negative_cache.hpp"
+#include "bulk_dirty.hpp"
+#include "popularity.hpp"
+#include "rate_limiter.hpp"
+#include "tile_batch.hpp"
 
 // boost
 #include <boost/thread/thread.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/optional.hpp>
 #include <boost/property_tree/ptree.hpp>
 
 // stl
 #include <ctime>
+#include <set>
 
 namespace rendermq {
 
@@ -68,6 +80,11 @@ public:
    // formats.
    bool rewrite_and_check(tile_protocol &tile) const;
 
+   // rewrite the style name according to the rewrite rules and return
+   // whether the result is a known style, setting max_zoom to its 
+   // zoom limit.
+   bool rewrite_and_check_style(std::string &style, int &max_zoom) const;
+
 private:
    // map of from-style to to-style names.
    std::map<std::string, std::string> m_rewrites;
@@ -84,6 +101,108 @@ private:
    std::map<std::string, int> m_zoom_limits;
 };
 
+/* the handler's options, read from the mongrel2 section of its config
+ * file. anything not in the file gets a default.
+ */
+struct tile_handler_config
+{
+   explicit tile_handler_config(const boost::property_tree::ptree &);
+
+   // incoming and outgoing endpoints of mongrel2.
+   std::string in_endpoint, out_endpoint;
+
+   // age, in seconds, to put in the HTTP expiry headers.
+   std::time_t max_age;
+
+   // queue lengths at which to return stale tiles rather than render
+   // them, to render in the background and send a 202, and to return 
+   // an error rather than try to render tiles.
+   size_t queue_threshold_stale, queue_threshold_satisfy, queue_threshold_max;
+
+   // if true, return stale tiles immediately, even if the queue length
+   // is low, and render the tile in the background.
+   bool stale_render_background;
+
+   // maximum number of concurrent storage requests to run. others are
+   // queued.
+   size_t max_io_concurrency;
+
+   // template of the URLs which tiles are asked for at.
+   std::string tile_path_template;
+
+   // URL path at which the per-stage latency statistics are served, or
+   // empty to disable, and how often, in seconds, to write them to the
+   // log, or zero to disable.
+   std::string latency_status_path;
+   std::time_t latency_log_interval;
+
+   // address to serve HTTP on directly, instead of connecting to 
+   // mongrel2, or empty to use mongrel2. the maximum number of HTTP 
+   // connections to have open at once, and seconds after which an idle
+   // one is closed.
+   std::string http_listen;
+   size_t http_max_connections;
+   std::time_t http_idle_timeout;
+
+   // number of whole metatiles for the storage worker to keep in 
+   // memory, or zero to disable, and seconds for which one is used.
+   size_t metatile_cache_size;
+   std::time_t metatile_cache_ttl;
+
+   // the 95th percentile latency, in ms, of rendered requests which the
+   // queue thresholds are adjusted per style to hold, or zero to use 
+   // them as they are, and how often, in seconds, to adjust them.
+   uint64_t latency_target;
+   std::time_t latency_adjust_interval;
+
+   // number of tiles which couldn't be served to remember, or zero to
+   // disable, and seconds for which to remember that a tile wasn't in
+   // storage, or couldn't be rendered or was empty.
+   size_t negative_cache_size;
+   std::time_t negative_cache_miss_ttl, negative_cache_fail_ttl;
+
+   // URL path at which jobs to dirty whole areas are started, or empty
+   // to disable them, the key which clients must give to use it, 
+   // without which it's disabled, the maximum number of metatiles per
+   // second to dirty, over all bulk dirty jobs, and the most metatiles
+   // a single job may cover.
+   std::string bulk_dirty_path;
+   std::string bulk_dirty_key;
+   double bulk_dirty_rate;
+   uint64_t bulk_dirty_max_metatiles;
+
+   // number of counters in each row of the sketch of metatile 
+   // popularity, or zero to disable it, seconds after which counts are
+   // halved, number of the most popular metatiles to keep track of, 
+   // and URL path at which they're listed, or empty to disable it.
+   size_t popularity_width;
+   std::time_t popularity_half_life;
+   size_t popularity_top;
+   std::string popularity_status_path;
+
+   // URL path at which several tiles can be asked for in one request,
+   // or empty to disable it, and the maximum number of tiles in one.
+   std::string batch_path;
+   size_t batch_max_tiles;
+
+   // number of per-client token buckets, or zero to disable rate 
+   // limiting, requests per second each client may make, how many it
+   // may make at once after being idle, and what a request which needs
+   // rendering costs, counted in ordinary requests.
+   size_t rate_limit_slots;
+   double rate_limit_rate, rate_limit_burst, rate_limit_render_cost;
+
+   // addresses of the proxies in front of the handler, which are 
+   // trusted to add the addresses of their peers to X-Forwarded-For.
+   std::set<std::string> rate_limit_trusted_proxies;
+
+   // most requests which can wait for a storage thread, and 
+   // milliseconds after which they're given up on, or zero to wait as
+   // long as it takes.
+   size_t storage_queue_size;
+   uint64_t storage_queue_deadline;
+};
+
 /* handler main loop object.
  *
  * mongrel2 only provides HTTP protocol support, it delegates most of
@@ -101,6 +220,10 @@ private:
  * than routing the messages. this is by design, so that the handler
  * is able to spend as much time as possible in its event loop,
  * reducing the latency for messages to be appropriately routed.
+ *
+ * alternatively, the handler can serve HTTP itself, in which case
+ * mongrel2 isn't used at all, saving the extra hops between it and
+ * the handler.
  */
 class tile_handler {
 public:
@@ -109,19 +232,6 @@ public:
     * requests.
     *
     * @param handler_id zeromq identity of this handler.
-    * @param in_ep incoming endpoint from mongrel2.
-    * @param out_ep outgoing endpoing to mongrel2.
-    * @param max_age age, in seconds, to put in the HTTP expiry
-    *          headers.
-    * @param queue_threshold_stale queue length at which to return
-    *          stale tiles rather than render them. 
-    * @param queue_threshold_max queue length at which to return an
-    *          error rather than try to render tiles. 
-    * @param stale_render_background if true, return stale tiles
-    *          immediately, even if the queue length is low, and
-    *          render the tile in the background.
-    * @param max_io_threads maximum number of concurrent storage
-    *          requests to run. others are queued.
     * @param dqueue_config file name of distributed queue config.
     * @param storage_conf storage configuration - already parsed as a
     *          property tree.
@@ -129,21 +239,14 @@ public:
     * @param dirty_list a map of styles into a list of dependent
     *          styles to expire in addition to any specified in a 
     *          dirty request.
+    * @param config the rest of the handler's options.
     */
    tile_handler(const std::string &handler_id, 
-                const std::string &in_ep, 
-                const std::string &out_ep,
-                std::time_t max_age,
-                size_t queue_threshold_stale, 
-                size_t queue_threshold_satisfy, 
-                size_t queue_threshold_max,
-                bool stale_render_background,
-                size_t max_io_threads,
                 const std::string &dqueue_config,
-                const std::string& tile_path_template,
                 const boost::property_tree::ptree &storage_conf,
                 const style_rules &rules,
-                const std::map<std::string, std::list<std::string> > &dirty_list);
+                const std::map<std::string, std::list<std::string> > &dirty_list,
+                const tile_handler_config &config);
    
    /* run the event loop for the handler.
     */
@@ -154,22 +257,91 @@ private:
     * status of the tile. this is also called when a message from the
     * rendering queue is detected.
     */
-   void reply_with_tile(const rendermq::tile_protocol &tile);
+   void reply_with_tile(const rendermq::tile_protocol &tile,
+                        const rendermq::tile_trace &trace);
+
+   /* called when a rendered tile comes back from the queue.
+    */
+   void handle_response_from_queue(const rendermq::tile_protocol &tile);
    
    /* called when a message from mongrel is detected. reads and parses
     * the request message and routes it appropriately.
     */
    void handle_request_from_mongrel();
+
+   /* called by the built-in HTTP server for each request.
+    */
+   void handle_request_from_http(const http_server::request &request);
+
+   /* routes a request, wherever it came from. the id is what the 
+    * response gets sent to, the client is the rate limiter's key for
+    * whoever sent it, and the conditional, Accept-Encoding and 
+    * Authorization headers are passed if the client sent them.
+    */
+   void handle_request(uint64_t received, const std::string &path, 
+                       const std::string &query, int64_t id,
+                       const std::string &client,
+                       const boost::optional<std::string> &if_modified_since,
+                       const boost::optional<std::string> &if_none_match,
+                       const boost::optional<std::string> &accept_encoding,
+                       const boost::optional<std::string> &authorization);
    
    /* called when a message from the storage object is detected.
     */
    void handle_response_from_storage();
 
+   /* called for a request which the storage worker gave up on without
+    * looking in the storage, as it was too busy.
+    */
+   void handle_dropped_by_storage(rendermq::tile_protocol &tile);
+
+   /* called for a tile which isn't in storage, to render it or send
+    * an error back, depending on how busy the queue is.
+    */
+   void handle_missing_tile(rendermq::tile_protocol &tile);
+
+   /* forget anything in the negative cache about the metatile of a 
+    * tile which is being dirtied, and those of styles which depend on
+    * it.
+    */
+   void invalidate_negative(const rendermq::tile_protocol &tile);
+
+   /* start a bulk dirty job from the query, or report on the job whose
+    * id follows the bulk dirty path, if the request carries the key.
+    */
+   void handle_bulk_dirty(const std::string &path, const std::string &query, int64_t id,
+                          const boost::optional<std::string> &authorization);
+
+   /* send the storage worker as many metatiles from the bulk dirty 
+    * jobs as the rate allows.
+    */
+   void release_bulk_dirty();
+
+   /* start reading a batch of tiles from the query, which are sent
+    * back together when they've all been read.
+    */
+   void handle_batch(const std::string &query, int64_t id, const std::string &client,
+                     bool accept_gzip);
+
+   /* called with a whole metatile read from storage for a batch, 
+    * sending the batch back if it was the last one.
+    */
+   void handle_batch_metatile(rendermq::tile_protocol &tile);
+
    /* send a tile to the queue. if there's an error then print a 
     * message and, if there is a connection id associated with the
     * tile, send an error response back to the client.
     */
    void send_to_queue(rendermq::tile_protocol &tile);
+
+   /* send a copy of a tile request to the storage worker.
+    */
+   void send_to_storage(const rendermq::tile_protocol &tile);
+
+   /* stamp the trace as having been replied to and add it to the 
+    * latency statistics.
+    */
+   void record_latency(const std::string &style, tile_trace trace);
    
    // zeromq socket context used in the handler
    zmq::context_t m_context;
@@ -187,9 +359,9 @@ private:
    // cache-related HTTP headers.
    std::time_t m_max_age;
 
-   // the queue length at which to return stale tiles and errors to the
-   // client, respectively.
-   size_t m_queue_threshold_stale, m_queue_threshold_satisfy, m_queue_threshold_max;
+   // the per-style queue lengths at which to return stale tiles, 202s
+   // and 503s to the client, and counts of which was done.
+   rendermq::queue_controller m_queue_control;
 
    // if true, return tiles to the client even if they're stale (marked as
    // expired). this reduces the amount of time clients are waiting for
@@ -204,13 +376,12 @@ private:
  
    const boost::property_tree::ptree& m_storage_conf;
  
-   // sockets for sending requests and receiving results from the storage
-   // worker thread, respectively.
-   zstream::socket::push m_socket_storage_request;
-   zstream::socket::pull m_socket_storage_results;
-
-   // mongrel2 format request parser
-   rendermq::request_parser m_request_parse;
+   // channels for sending requests to and receiving results from the
+   // storage worker thread, respectively, and requests waiting for room
+   // in the channel.
+   rendermq::tile_channel m_storage_requests;
+   rendermq::tile_channel m_storage_results;
+   rendermq::tile_channel_backlog m_storage_backlog;
 
    // function object to parse URLs into tile protocol objects
    rendermq::tile_path_parser m_path_parse;
@@ -221,12 +392,58 @@ private:
    // mongrel2 server ID that we're connected to.
    std::string m_str_mongrel_id;
 
+   // where responses go: either back through mongrel2 or, if the 
+   // handler is serving HTTP itself, to the built-in server.
+   rendermq::mongrel_reply_sink m_mongrel_reply;
+   boost::scoped_ptr<rendermq::http_server> m_http_server;
+   rendermq::reply_sink *m_reply;
+
    // pointers to the instance of the storage worker and the thread that
    // it is running on. this is separate from the main thread of the tile
    // handler so that it can run blocking file / HTTP operations without
    // affecting the main thread's ability to continue handling tiles.
    boost::shared_ptr<rendermq::storage_worker> m_ptr_storage_instance;
    boost::shared_ptr<boost::thread> m_ptr_storage_thread;
+
+   // per-style, per-stage latency statistics, where they're served
+   // from and how often they get logged.
+   rendermq::latency_stats m_latency;
+   const std::string m_latency_status_path;
+   const std::time_t m_latency_log_interval;
+   std::time_t m_next_latency_log;
+
+   // tiles which recently couldn't be served.
+   rendermq::negative_cache m_negative;
+
+   // map of style names into a list of style names which are dependent
+   // and are dirtied whenever the keyed style is dirtied.
+   const std::map<std::string, std::list<std::string> > m_dirty_list;
+
+   // jobs to dirty whole areas at once, the URL path at which they
+   // are started, or empty if they're disabled, the key which must be
+   // given to start them and the most metatiles a job may cover.
+   rendermq::bulk_dirty_jobs m_bulk_dirty;
+   const std::string m_bulk_dirty_path;
+   const std::string m_bulk_dirty_key;
+   const uint64_t m_bulk_dirty_max_metatiles;
+
+   // how often each metatile has been asked for lately, used to put
+   // popular tiles first when re-rendering in the background.
+   rendermq::popularity_sketch m_popularity;
+   const size_t m_popularity_top;
+   const std::string m_popularity_status_path;
+
+   // batches of tiles being read from storage, the URL path at which
+   // they're asked for, or empty if they're disabled, and the most 
+   // tiles which can be asked for at once.
+   rendermq::tile_batches m_batches;
+   const std::string m_batch_path;
+   const size_t m_batch_max_tiles;
+
+   // per-client token buckets, and the proxies which are trusted to 
+   // say which client a request came from.
+   rendermq::rate_limiter m_rate_limit;
+   const std::set<std::string> m_trusted_proxies;
 };
 
 } // namespace rendermq
@@ -43,11 +43,6 @@
 // for gethostname
 #include <unistd.h>
 
-#define DEFAULT_QUEUE_THRESHOLD_STALE (100)
-#define DEFAULT_QUEUE_THRESHOLD_SATISFY (500)
-#define DEFAULT_QUEUE_THRESHOLD_MAX (1000)
-#define DEFAULT_IO_MAX_CONCURRENCY (64)
-
 namespace po = boost::program_options;
 namespace pt = boost::property_tree;
 using std::map;
@@ -273,19 +268,11 @@ int main( int argc, char** argv)
 
    rendermq::tile_handler handler(
       uuid,
-      conf.get<string>("mongrel2.in_endpoint","ipc:///tmp/mongrel_send"),
-      conf.get<string>("mongrel2.out_endpoint","ipc:///tmp/mongrel_recv"),
-      conf.get<std::time_t>("mongrel2.max_age",60*60*24),
-      conf.get<size_t>("mongrel2.queue_threshold_stale", DEFAULT_QUEUE_THRESHOLD_STALE),
-      conf.get<size_t>("mongrel2.queue_threshold_satisfy", DEFAULT_QUEUE_THRESHOLD_SATISFY),
-      conf.get<size_t>("mongrel2.queue_threshold_max", DEFAULT_QUEUE_THRESHOLD_MAX),                    
-      conf.get<bool>("mongrel2.stale_render_background", false),
-      conf.get<size_t>("mongrel2.max_io_concurrency", DEFAULT_IO_MAX_CONCURRENCY),
       dqueue_config,
-      conf.get<std::string>("mongrel2.tile_path_template", "/tiles/1.0.0/{STYLE}/{Z}/{X}/{Y}.{FORMAT}"),
       conf.get_child("tiles"),
       style_rules,
-      dirty_deps);
+      dirty_deps,
+      rendermq::tile_handler_config(conf));
 
    handler();
     
@@ -56,6 +56,7 @@ struct formats_ : qi::symbols<char, protoFmt> {
       ("jpg", fmtJPEG)
       ("jpeg", fmtJPEG) // why not, let's have both spellings...
       ("gif", fmtGIF)
+      ("webp", fmtWEBP)
       ("json", fmtJSON)
       ;
   }
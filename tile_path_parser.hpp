@@ -29,8 +29,11 @@
 #include <algorithm>
 #include <iostream>
 #include <map>
+#include <set>
 #include <string>
+#include <cstring>
 #include <boost/xpressive/xpressive.hpp>
+#include <boost/algorithm/string/trim.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/utility.hpp>
 #include <boost/foreach.hpp>
@@ -52,6 +55,16 @@ namespace rendermq {
  * the tile_path_parser object is intialized.
  * Later we match the URL path for each incoming request against this
  * regular expression to parse out its parameters.
+ *
+ * Because running the regex and then lexical_cast on its captures for
+ * every request is fairly expensive, the template is also compiled into
+ * a list of literal and parameter segments which can be matched by a
+ * single scan along the path. This only works if no backtracking is
+ * ever needed, i.e: every parameter is followed by the end of the
+ * template or by literal text which can't be part of the parameter.
+ * Templates which don't fit that (adjacent parameters, a parameter
+ * followed by a character it might contain, repeated parameters, etc...)
+ * use the regex instead.
  */
 class tile_path_parser : boost::noncopyable {
 
@@ -79,7 +92,7 @@ class tile_path_parser : boost::noncopyable {
             params["z"]      = "(?P<z>[12]?[0-9])"; // zoom level
             params["x"]      = "(?P<x>[0-9]{1,7})"; // x coordinate with 1 to 7 digits
             params["y"]      = "(?P<y>[0-9]{1,7})"; // x coordinate with 1 to 7 digits
-            params["format"] = "(?P<format>(png|jpg|jpeg|gif|json))"; // map image format
+            params["format"] = "(?P<format>(png|jpg|jpeg|gif|webp|json))"; // map image format
       }
 
       template<typename Out>
@@ -107,6 +120,191 @@ class tile_path_parser : boost::noncopyable {
    // List of additional parameters generated from this path above the basic parameters STYLE, Z, X, and Y
    std::vector<std::string> additional_params;
 
+   /**
+    * One piece of the compiled template: either literal text which has
+    * to match exactly, or one of the parameters.
+    */
+   struct segment {
+      enum kind_t { literal, style, z, x, y, format, additional };
+
+      kind_t kind;
+      std::string text; // the literal text, or the additional parameter name
+
+      segment(kind_t k, const std::string& t) : kind(k), text(t) {}
+   };
+
+   // The compiled template, only used if use_fast_path is true.
+   std::vector<segment> segments;
+   bool use_fast_path;
+
+   // Where each segment matched in the path currently being parsed, so
+   // that nothing is written into the results unless the whole path
+   // matches.
+   std::vector<std::pair<const char*, const char*> > captures;
+
+   static inline bool is_alnum(char c) {
+      return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+   }
+
+   /**
+    * Whether the character can be part of the given kind of parameter.
+    * This must agree with the patterns in url_pattern_formatter.
+    */
+   static inline bool in_class(segment::kind_t kind, char c) {
+      switch (kind) {
+      case segment::style:
+         return is_alnum(c) || c == '_';
+      case segment::z:
+      case segment::x:
+      case segment::y:
+         return c >= '0' && c <= '9';
+      case segment::format:
+         return c >= 'a' && c <= 'z';
+      case segment::additional:
+         return is_alnum(c) || c == '-' || c == '_' || c == '.' || c == '%' || c == ',' || c == '|';
+      default:
+         return false;
+      }
+   }
+
+   static inline bool equals(const char* begin, const char* end, const char* str) {
+      const size_t len = std::strlen(str);
+      return size_t(end - begin) == len && std::memcmp(begin, str, len) == 0;
+   }
+
+   static inline protoFmt format_for(const char* begin, const char* end) {
+      if (equals(begin, end, "png")) {
+         return fmtPNG;
+      } else if (equals(begin, end, "jpg") || equals(begin, end, "jpeg")) {
+         return fmtJPEG;
+      } else if (equals(begin, end, "json")) {
+         return fmtJSON;
+      } else if (equals(begin, end, "gif")) {
+         return fmtGIF;
+      } else if (equals(begin, end, "webp")) {
+         return fmtWEBP;
+      }
+      return fmtNone;
+   }
+
+   // Only called on runs of at most 7 digits, so this can't overflow.
+   static inline int to_int(const char* begin, const char* end) {
+      int value = 0;
+      for (; begin != end; ++begin) {
+         value = value * 10 + (*begin - '0');
+      }
+      return value;
+   }
+
+   /**
+    * Check the characters matched for a parameter the same way the
+    * regex would have.
+    */
+   static inline bool valid_capture(segment::kind_t kind, const char* begin, const char* end) {
+      const size_t len = end - begin;
+      switch (kind) {
+      case segment::style:
+         return len > 0;
+      case segment::z:
+         return len == 1 || (len == 2 && (begin[0] == '1' || begin[0] == '2'));
+      case segment::x:
+      case segment::y:
+         return len > 0 && len <= 7;
+      case segment::format:
+         return format_for(begin, end) != fmtNone;
+      default:
+         return true;
+      }
+   }
+
+   /**
+    * Try to compile the template into segments for the fast path.
+    * Returns false if the template needs the full regex.
+    */
+   bool compile_segments(const std::string& path_template) {
+      std::set<std::string> seen;
+      std::string text;
+      std::string::size_type pos = 0;
+
+      while (pos < path_template.size()) {
+         const char c = path_template[pos];
+         if (c == '{') {
+            const std::string::size_type close = path_template.find('}', pos);
+            if (close == std::string::npos) {
+               return false;
+            }
+            std::string name = boost::algorithm::trim_copy(path_template.substr(pos + 1, close - pos - 1));
+            if (name.empty()) {
+               return false;
+            }
+            for (std::string::iterator itr = name.begin(); itr != name.end(); ++itr) {
+               if (!is_alnum(*itr) && *itr != '_') {
+                  return false;
+               }
+               *itr = ::tolower(*itr);
+            }
+            // the regex can't handle repeated names either, but let it
+            // be the one to complain about it.
+            if (!seen.insert(name).second) {
+               return false;
+            }
+
+            if (!text.empty()) {
+               segments.push_back(segment(segment::literal, text));
+               text.clear();
+            }
+
+            if (name == "style") {
+               segments.push_back(segment(segment::style, name));
+            } else if (name == "z") {
+               segments.push_back(segment(segment::z, name));
+            } else if (name == "x") {
+               segments.push_back(segment(segment::x, name));
+            } else if (name == "y") {
+               segments.push_back(segment(segment::y, name));
+            } else if (name == "format") {
+               segments.push_back(segment(segment::format, name));
+            } else {
+               segments.push_back(segment(segment::additional, name));
+            }
+            pos = close + 1;
+
+         } else if (c == '}' || c == '[' || c == ']' || c == '\\') {
+            // these would be interpreted by the regex, so leave it to
+            // do whatever it does with them.
+            return false;
+
+         } else {
+            text += c;
+            ++pos;
+         }
+      }
+      if (!text.empty()) {
+         segments.push_back(segment(segment::literal, text));
+      }
+
+      // without these the regex path would throw from lexical_cast,
+      // so don't pretend to know better.
+      if (!seen.count("style") || !seen.count("z") || !seen.count("x") || !seen.count("y")) {
+         return false;
+      }
+
+      // each parameter must end unambiguously. none of the parameters
+      // can contain a '/', so being last is fine as the only thing that
+      // can follow is the optional command suffix.
+      for (size_t i = 0; i + 1 < segments.size(); ++i) {
+         if (segments[i].kind != segment::literal) {
+            const segment& next = segments[i + 1];
+            if (next.kind != segment::literal || in_class(segments[i].kind, next.text[0])) {
+               return false;
+            }
+         }
+      }
+
+      captures.resize(segments.size());
+      return true;
+   }
+
 public:
 
    /**
@@ -141,6 +339,19 @@ public:
 
       // compile and remember final regex
       path_regex = boost::xpressive::sregex::compile(path_regex_string);
+
+      use_fast_path = compile_segments(path_template);
+      if (!use_fast_path) {
+         segments.clear();
+         LOG_DEBUG(boost::format("Template '%1%' can't be matched without backtracking, using regex.") % path_template);
+      }
+   }
+
+   /**
+    * Whether this template is matched by the fast path.
+    */
+   bool fast_path() const {
+      return use_fast_path;
    }
 
    inline char hex2num(char c) {
@@ -187,6 +398,89 @@ public:
    */
    template <class Results>
    bool operator()(Results& results, const std::string& path) {
+      if (use_fast_path) {
+         return match_fast(results, path);
+      }
+      return match_regex(results, path);
+   }
+
+   /**
+    * Match the URL path using the compiled segments. Must only be called
+    * if fast_path() is true.
+    */
+   template <class Results>
+   bool match_fast(Results& results, const std::string& path) {
+      const char* p = path.data();
+      const char* const end = p + path.size();
+
+      for (size_t i = 0; i < segments.size(); ++i) {
+         const segment& seg = segments[i];
+         if (seg.kind == segment::literal) {
+            const size_t len = seg.text.size();
+            if (size_t(end - p) < len || std::memcmp(p, seg.text.data(), len) != 0) {
+               return false;
+            }
+            p += len;
+         } else {
+            const char* const start = p;
+            while (p != end && in_class(seg.kind, *p)) {
+               ++p;
+            }
+            if (!valid_capture(seg.kind, start, p)) {
+               return false;
+            }
+            captures[i] = std::make_pair(start, p);
+         }
+      }
+
+      // whatever's left has to be the optional command suffix.
+      protoCmd command;
+      if (p == end) {
+         command = cmdRender;
+      } else if (equals(p, end, "/status")) {
+         command = cmdStatus;
+      } else if (equals(p, end, "/dirty")) {
+         command = cmdDirty;
+      } else {
+         return false;
+      }
+
+      for (size_t i = 0; i < segments.size(); ++i) {
+         const std::pair<const char*, const char*>& cap = captures[i];
+         switch (segments[i].kind) {
+         case segment::style:
+            results.style.assign(cap.first, cap.second);
+            break;
+         case segment::z:
+            results.z = to_int(cap.first, cap.second);
+            break;
+         case segment::x:
+            results.x = to_int(cap.first, cap.second);
+            break;
+         case segment::y:
+            results.y = to_int(cap.first, cap.second);
+            break;
+         case segment::format:
+            results.format = format_for(cap.first, cap.second);
+            break;
+         case segment::additional:
+            results.parameters[segments[i].text] = url_decode(std::string(cap.first, cap.second));
+            break;
+         default:
+            break;
+         }
+      }
+      results.status = command;
+
+      return true;
+   }
+
+   /**
+    * Match the URL path using the regex built from the template. This
+    * works for any template.
+    */
+   template <class Results>
+   bool match_regex(Results& results, const std::string& path) {
       boost::xpressive::smatch match_results;
 
       if (!boost::xpressive::regex_match(path, match_results, path_regex)) {
@@ -207,6 +501,8 @@ public:
          results.format = fmtJSON;
       } else if (format == "gif") {
          results.format = fmtGIF;
+      } else if (format == "webp") {
+         results.format = fmtWEBP;
       }
 
       const std::string command = match_results["COMMAND"].str();
@@ -34,6 +34,7 @@
 #include <cstring> // for memcpy
 #include <ctime> // for std::time_t
 #include "tile_utils.hpp"
+#include "tile_trace.hpp"
 #include "proto/tile.pb.h"
 #include "storage/meta_tile.hpp" // for METATILE size
 #include "logging/logger.hpp"
@@ -52,7 +53,8 @@ enum protoCmd {
    cmdNotDone, 
    cmdRenderPrio, // render with higher priority
    cmdRenderBulk, // render with lower priority, and don't expect a response.
-   cmdStatus      // request the status of a tile
+   cmdStatus,     // request the status of a tile
+   cmdMetatile    // read a whole metatile from storage, e.g: for a batch of tiles
 };
 
 class tile_protocol
@@ -62,9 +64,9 @@ public:
    typedef std::map<std::string, std::string> parameters_t;
 
    tile_protocol()
-      : status(cmdRenderPrio), x(0), y(0), z(0), id(0), style(""), parameters(), format(fmtPNG), last_modified(0), request_last_modified(0), priority(-1) {}
+      : status(cmdRenderPrio), x(0), y(0), z(0), id(0), style(""), parameters(), format(fmtPNG), last_modified(0), request_last_modified(0), digest(0), request_digest(0), priority(-1), accept_gzip(false), request_etag_gzip(false), data_gzipped(false), dropped(false) {}
    tile_protocol(protoCmd status_,int x_,int y_, int z_, int64_t id_, const std::string & style_, protoFmt format_, std::time_t last_mod_=0, std::time_t req_last_mod_=0, uint32_t priority_=-1)
-      : status(status_), x(x_), y(y_), z(z_), id(id_), style(style_), parameters(), format(format_), last_modified(last_mod_), request_last_modified(req_last_mod_), priority(priority_=-1) {}
+      : status(status_), x(x_), y(y_), z(z_), id(id_), style(style_), parameters(), format(format_), last_modified(last_mod_), request_last_modified(req_last_mod_), digest(0), request_digest(0), priority(priority_=-1), accept_gzip(false), request_etag_gzip(false), data_gzipped(false), dropped(false) {}
    tile_protocol(tile_protocol const& other)
       : status(other.status), 
         x(other.x), y(other.y), 
@@ -74,7 +76,14 @@ public:
         format(other.format),
         last_modified(other.last_modified),
         request_last_modified(other.request_last_modified),
+        digest(other.digest),
+        request_digest(other.request_digest),
         priority(other.priority),
+        accept_gzip(other.accept_gzip),
+        request_etag_gzip(other.request_etag_gzip),
+        data_gzipped(other.data_gzipped),
+        dropped(other.dropped),
+        trace(other.trace),
         data_(other.data_)
       {}
 
@@ -89,7 +98,14 @@ public:
       format = other.format;
       last_modified = other.last_modified;
       request_last_modified = other.request_last_modified;
+      digest = other.digest;
+      request_digest = other.request_digest;
       priority = other.priority;
+      accept_gzip = other.accept_gzip;
+      request_etag_gzip = other.request_etag_gzip;
+      data_gzipped = other.data_gzipped;
+      dropped = other.dropped;
+      trace = other.trace;
       data_ = other.data_;
       return *this;
    }
@@ -102,6 +118,27 @@ public:
       {
          data_ = data;
       }
+   // takes the contents of data, leaving it with the old data, so that
+   // a tile can be handed over without copying it.
+   void swap_data(std::string &data)
+      {
+         data_.swap(data);
+      }
+
+   // Whether the client's copy of the tile, if it has one, is the same
+   // as or at least as new as the tile itself, so that a 304 can be sent.
+   // As in HTTP, an entity tag takes precedence over a date.
+   bool not_modified() const {
+      if (request_digest != 0) {
+         return digest == request_digest;
+      }
+      return (request_last_modified != 0) && (last_modified <= request_last_modified);
+   }
+
+   // Whether the client sent anything which might get it a 304.
+   bool conditional() const {
+      return (request_last_modified != 0) || (request_digest != 0);
+   }
 
    // Return priority for this tile. If it was not set explicitly it is
    // derived from the status.
@@ -127,7 +164,24 @@ public:
    protoFmt format;
    std::time_t last_modified;
    std::time_t request_last_modified;
+   uint64_t digest;
+   uint64_t request_digest;
    int32_t priority;
+   // whether the client accepts gzip encoded responses, which lets 
+   // JSON tiles stored compressed be sent as they are.
+   bool accept_gzip;
+   // whether the client's If-None-Match tag was for the gzip encoded 
+   // body, so that a 304 can give the same tag back.
+   bool request_etag_gzip;
+   // whether data() is gzip compressed, as flagged in the header of the
+   // metatile it was cut from.
+   bool data_gzipped;
+   // set when the storage worker gave up on the request without looking
+   // in the storage, e.g: because it was overloaded. this only has a 
+   // meaning within the handler, so isn't serialised.
+   bool dropped;
+   // timestamps of the stages this request has been through.
+   tile_trace trace;
 
 private:
    std::string data_;
@@ -145,6 +199,7 @@ inline std::ostream& operator<< (std::ostream& out, tile_protocol const& t)
    else if (t.status == cmdRenderPrio) { out << "cmdRenderPrio"; }
    else if (t.status == cmdRenderBulk) { out << "cmdRenderBulk"; }
    else if (t.status == cmdStatus) { out << "cmdStatus"; }
+   else if (t.status == cmdMetatile) { out << "cmdMetatile"; }
    else { out << "[[unrecognised_command]]"; }
 
    { // output the format in a nice, human-readable way.
@@ -160,6 +215,12 @@ inline std::ostream& operator<< (std::ostream& out, tile_protocol const& t)
 
    if (t.last_modified > 0) { out << " last_modified=" << t.last_modified; }
    if (t.request_last_modified > 0) { out << " request_last_modified=" << t.request_last_modified; }
+   if (t.digest != 0) { out << " digest=" << std::hex << t.digest << std::dec; }
+   if (t.request_digest != 0) { out << " request_digest=" << std::hex << t.request_digest << std::dec; }
+   if (t.accept_gzip) { out << " accept_gzip"; }
+   if (t.request_etag_gzip) { out << " request_etag_gzip"; }
+   if (t.data_gzipped) { out << " data_gzipped"; }
+   if (t.dropped) { out << " dropped"; }
 
    out << " id=" << t.id << " style=" << t.style;
    if (!t.parameters.empty()) {
@@ -214,6 +275,23 @@ inline bool serialise(const tile_protocol &tile, std::string &buf) {
    t.set_priority(tile.get_priority());
    if (tile.last_modified != 0) { t.set_last_modified(tile.last_modified); }
    if (tile.request_last_modified != 0) { t.set_request_last_modified(tile.request_last_modified); }
+   if (tile.digest != 0) { t.set_digest(tile.digest); }
+   if (tile.request_digest != 0) { t.set_request_digest(tile.request_digest); }
+   if (tile.accept_gzip) { t.set_accept_gzip(true); }
+   if (tile.request_etag_gzip) { t.set_request_etag_gzip(true); }
+   if (tile.data_gzipped) { t.set_image_gzipped(true); }
+
+   if (!tile.trace.empty()) {
+      proto::trace *tr = t.mutable_timing();
+      tr->set_received(tile.trace.at(traceReceived));
+      tr->set_parsed(tile.trace.at(traceParsed));
+      tr->set_storage_enqueue(tile.trace.at(traceStorageEnqueue));
+      tr->set_storage_dequeue(tile.trace.at(traceStorageDequeue));
+      tr->set_storage_done(tile.trace.at(traceStorageDone));
+      tr->set_queue_send(tile.trace.at(traceQueueSend));
+      tr->set_broker_reply(tile.trace.at(traceBrokerReply));
+      tr->set_http_send(tile.trace.at(traceHttpSend));
+   }
 
    BOOST_FOREACH(tile_protocol::parameters_t::value_type p, tile.parameters) {
       if (p.second != "") {
@@ -240,8 +318,26 @@ inline bool unserialise(const std::string &buf, tile_protocol &tile) {
       tile.format = static_cast<rendermq::protoFmt>(t.format());
       tile.last_modified = t.has_last_modified() ? t.last_modified() : 0;
       tile.request_last_modified = t.has_request_last_modified() ? t.request_last_modified() : 0;
+      tile.digest = t.has_digest() ? t.digest() : 0;
+      tile.request_digest = t.has_request_digest() ? t.request_digest() : 0;
+      tile.accept_gzip = t.has_accept_gzip() && t.accept_gzip();
+      tile.request_etag_gzip = t.has_request_etag_gzip() && t.request_etag_gzip();
+      tile.data_gzipped = t.has_image_gzipped() && t.image_gzipped();
       tile.priority = t.has_priority() ? t.priority() : -1;
 
+      tile.trace.clear();
+      if (t.has_timing()) {
+         const proto::trace &tr = t.timing();
+         tile.trace.set(traceReceived, tr.received());
+         tile.trace.set(traceParsed, tr.parsed());
+         tile.trace.set(traceStorageEnqueue, tr.storage_enqueue());
+         tile.trace.set(traceStorageDequeue, tr.storage_dequeue());
+         tile.trace.set(traceStorageDone, tr.storage_done());
+         tile.trace.set(traceQueueSend, tr.queue_send());
+         tile.trace.set(traceBrokerReply, tr.broker_reply());
+         tile.trace.set(traceHttpSend, tr.http_send());
+      }
+
       for (int i=0; i < t.parameters_size(); ++i) {
          const proto::parameter& p = t.parameters(i);
          tile.parameters.insert(std::make_pair<std::string, std::string>(p.key(), p.value()));
@@ -0,0 +1,99 @@
+/*------------------------------------------------------------------------------
+ *
+ *  This file is part of rendermq  
+ *
+ *  Author: matt.amos@mapquest.com
+ *
+ *  Copyright 2010-1 Mapquest, Inc.  All Rights reserved.
+ *
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *-----------------------------------------------------------------------------*/
+
+#ifndef TILE_TRACE_HPP
+#define TILE_TRACE_HPP
+
+#include <stdint.h>
+#include <cstring> // for memset
+#include <ctime>   // for clock_gettime
+
+namespace rendermq
+{
+
+/* the points in a request's lifetime at which the handler (and its
+ * storage worker) take a timestamp. the order matters: the latency
+ * of a stage is measured from the most recent earlier stage which
+ * was stamped, so stages which a request skips (e.g: a tile found
+ * in storage never goes to the queue) fold into the next one.
+ */
+enum traceStage {
+   traceReceived = 0,    // request read from mongrel
+   traceParsed,          // request & URL parsed, style rules applied
+   traceStorageEnqueue,  // storage worker received the request
+   traceStorageDequeue,  // storage worker handed it to an i/o thread
+   traceStorageDone,     // i/o thread finished with storage
+   traceQueueSend,       // handler sent the job to the render queue
+   traceBrokerReply,     // handler received the rendered tile
+   traceHttpSend,        // handler sent the HTTP reply to mongrel
+   traceNumStages
+};
+
+/* monotonic timestamps, in microseconds, for each stage of the
+ * handling of a request. a zero timestamp means the stage wasn't
+ * reached (or nobody was tracing it).
+ *
+ * note that these are only comparable with other timestamps taken
+ * on the same machine, which is fine as long as it's the handler
+ * and its storage worker threads which stamp them.
+ */
+class tile_trace
+{
+public:
+   tile_trace() { clear(); }
+
+   void clear() { std::memset(m_stamps, 0, sizeof(m_stamps)); }
+
+   // stamp the given stage with the current time.
+   void mark(traceStage stage) { m_stamps[stage] = now(); }
+
+   uint64_t at(traceStage stage) const { return m_stamps[stage]; }
+   void set(traceStage stage, uint64_t t) { m_stamps[stage] = t; }
+
+   // true if no stage has been stamped.
+   bool empty() const 
+   {
+      for (int i = 0; i < traceNumStages; ++i)
+      {
+         if (m_stamps[i] != 0) { return false; }
+      }
+      return true;
+   }
+
+   // current monotonic time in microseconds.
+   static uint64_t now() 
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+   }
+
+private:
+   uint64_t m_stamps[traceNumStages];
+};
+
+} // namespace rendermq
+
+#endif // TILE_TRACE_HPP
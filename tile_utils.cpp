@@ -35,12 +35,14 @@ const std::string mime_json("application/json;charset=UTF-8");
 const std::string mime_png("image/png");
 const std::string mime_jpg("image/jpeg");
 const std::string mime_gif("image/gif");
+const std::string mime_webp("image/webp");
 
 const std::string file_none("none");
 const std::string file_json("json");
 const std::string file_png("png");
 const std::string file_jpg("jpeg");
 const std::string file_gif("gif");
+const std::string file_webp("webp");
 const std::string file_all("all");
 
 const std::string &mime_type_for(const rendermq::protoFmt& fmt) {
@@ -48,6 +50,7 @@ const std::string &mime_type_for(const rendermq::protoFmt& fmt) {
    case rendermq::fmtPNG:  return mime_png;
    case rendermq::fmtJPEG: return mime_jpg;
    case rendermq::fmtGIF: return mime_gif;
+   case rendermq::fmtWEBP: return mime_webp;
    case rendermq::fmtJSON: return mime_json;
    default:
       throw std::runtime_error("Ambiguous format in mime_type_for()");
@@ -60,6 +63,7 @@ const std::string &file_type_for(const rendermq::protoFmt& fmt) {
    case rendermq::fmtPNG:  return file_png;
    case rendermq::fmtJPEG: return file_jpg;
    case rendermq::fmtGIF:  return file_gif;
+   case rendermq::fmtWEBP: return file_webp;
    case rendermq::fmtJSON: return file_json;
    case rendermq::fmtAll:  return file_all;
    default:
@@ -74,6 +78,7 @@ const std::vector<protoFmt> get_formats_vec(const rendermq::protoFmt& formatMask
    if(formatMask & rendermq::fmtPNG) formats.push_back(rendermq::fmtPNG);
    if(formatMask & rendermq::fmtJPEG) formats.push_back(rendermq::fmtJPEG);
    if(formatMask & rendermq::fmtGIF) formats.push_back(rendermq::fmtGIF);
+   if(formatMask & rendermq::fmtWEBP) formats.push_back(rendermq::fmtWEBP);
    if(formatMask & rendermq::fmtJSON) formats.push_back(rendermq::fmtJSON);
    return formats;
 }
@@ -88,6 +93,8 @@ const protoFmt get_format_for(const std::string& fileType)
       return rendermq::fmtJPEG;
    else if(fileType == file_gif)
       return rendermq::fmtGIF;
+   else if(fileType == file_webp)
+      return rendermq::fmtWEBP;
    else
       return rendermq::fmtNone;
 }
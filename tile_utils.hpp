@@ -40,7 +40,8 @@ enum protoFmt {
   fmtJPEG = 2,
   fmtJSON = 4, 
   fmtGIF  = 8,
-  fmtAll = 15
+  fmtWEBP = 16,
+  fmtAll = 31
   // NOTE: because it's used as a bit-mask, all enum values need
   // to be powers of two.
 };